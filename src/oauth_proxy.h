@@ -1,27 +1,269 @@
+#ifndef _OAUTH_PROXY_H_INCLUDED_
+#define _OAUTH_PROXY_H_INCLUDED_
+
+/* Exported constants */
+#define OAUTH_PROXY_AES_KEY_SIZE_BYTES 32
+#define OAUTH_PROXY_HMAC_KEY_SIZE_BYTES 32
+#define OAUTH_PROXY_MAX_KEY_IDS 256
+#define OAUTH_PROXY_CACHE_HITS 0
+#define OAUTH_PROXY_CACHE_MISSES 1
+#define OAUTH_PROXY_CACHE_EVICTIONS 2
+#define OAUTH_PROXY_DECRYPTION_ERROR_SIZE 128
+#define OAUTH_PROXY_MAX_COOKIE_CHUNKS 16
+#define OAUTH_PROXY_BEARER_PREFIX "Bearer "
+
+/* Metric counters, where each rejection reason has its own counter */
+#define OAUTH_PROXY_METRIC_REQUESTS 0
+#define OAUTH_PROXY_METRIC_PREFLIGHTS 1
+#define OAUTH_PROXY_METRIC_DECRYPT_FAILURES 2
+#define OAUTH_PROXY_METRIC_ORIGIN_MISSING 3
+#define OAUTH_PROXY_METRIC_ORIGIN_UNTRUSTED 4
+#define OAUTH_PROXY_METRIC_CSRF_COOKIE_MISSING 5
+#define OAUTH_PROXY_METRIC_CSRF_HEADER_MISSING 6
+#define OAUTH_PROXY_METRIC_CSRF_MISMATCH 7
+#define OAUTH_PROXY_METRIC_COOKIE_MISSING 8
+#define OAUTH_PROXY_METRIC_DECRYPTION_FAILED 9
+#define OAUTH_PROXY_METRIC_SERVER_ERROR 10
+#define OAUTH_PROXY_METRIC_INTROSPECTION_FAILED 11
+#define OAUTH_PROXY_METRIC_CLIENT_THROTTLED 12
+#define OAUTH_PROXY_METRIC_COUNTERS 13
+
+/* Metric histograms */
+#define OAUTH_PROXY_METRIC_COOKIE_SIZE 0
+#define OAUTH_PROXY_METRIC_DECRYPT_TIME 1
+#define OAUTH_PROXY_METRIC_MEMORY_SIZE 2
+
+/* Categories of request pool memory allocated by the module, which are counted per request */
+#define OAUTH_PROXY_MEMORY_CIPHERTEXT 0
+#define OAUTH_PROXY_MEMORY_PLAINTEXT 1
+#define OAUTH_PROXY_MEMORY_HEADERS 2
+#define OAUTH_PROXY_MEMORY_STATE 3
+#define OAUTH_PROXY_MEMORY_CATEGORIES 4
+
+/* Precomputed per worker cipher state, whose details are private to the cipher backend source file */
+typedef struct oauth_proxy_cipher_s oauth_proxy_cipher_t;
+
+/* Precomputed per worker CSRF MAC state, whose details are private to the CSRF source file */
+typedef struct oauth_proxy_csrf_mac_s oauth_proxy_csrf_mac_t;
+
+/* Per process access to the shared metrics zone, whose details are private to the metrics source file */
+typedef struct oauth_proxy_metrics_s oauth_proxy_metrics_t;
+
+/* Keys and origins that workers reload from a file, whose details are private to the dynamic source file */
+typedef struct oauth_proxy_dynamic_s oauth_proxy_dynamic_t;
+
 /* Exported types */
+
+/* A decryption key, whose identifier is carried in version 2 cookies so that the key is selected without trial decryption */
 typedef struct
+{
+    ngx_str_t encryption_key;
+    ngx_uint_t id;
+    u_char encryption_key_bytes[OAUTH_PROXY_AES_KEY_SIZE_BYTES];
+    oauth_proxy_cipher_t *cipher;
+} oauth_proxy_encryption_key_t;
+
+typedef struct oauth_proxy_configuration_s oauth_proxy_configuration_t;
+
+/* The access phase work for an enabled location, where the variant is chosen for the location's flags when configuration is merged */
+typedef ngx_int_t (*oauth_proxy_handler_pt)(ngx_http_request_t *request, oauth_proxy_configuration_t *config);
+
+struct oauth_proxy_configuration_s
 {
     ngx_flag_t enabled;
+    oauth_proxy_handler_pt handler;
     ngx_str_t cookie_name_prefix;
-    ngx_str_t encryption_key;
+    ngx_array_t *encryption_keys;
     ngx_array_t *trusted_web_origins;
+    ngx_array_t *trusted_origin_schemes;
     ngx_flag_t cors_enabled;
     ngx_flag_t allow_tokens;
     ngx_str_t cors_allow_methods;
     ngx_str_t cors_allow_headers;
     ngx_str_t cors_expose_headers;
     ngx_int_t cors_max_age;
-} oauth_proxy_configuration_t;
+    ngx_array_t *cors_response_headers;
+    ngx_array_t *cors_preflight_headers;
+    ngx_array_t *cors_error_headers;
+    ngx_shm_zone_t *cache_zone;
+    time_t cache_ttl;
+    ngx_shm_zone_t *negative_cache_zone;
+    time_t negative_cache_ttl;
+    ngx_shm_zone_t *throttle_zone;
+    ngx_uint_t throttle_threshold;
+    ngx_msec_t throttle_window;
+    oauth_proxy_encryption_key_t **encryption_keys_by_id;
+    uint64_t encryption_key_id;
+    ngx_str_t csrf_header_name;
+    ngx_uint_t csrf_header_hash;
+    ngx_str_t at_cookie_name;
+    ngx_str_t csrf_cookie_name;
+    ngx_str_t csrf_hmac_key;
+    u_char csrf_hmac_key_bytes[OAUTH_PROXY_HMAC_KEY_SIZE_BYTES];
+    oauth_proxy_csrf_mac_t *csrf_mac;
+    ngx_str_t location_name;
+    oauth_proxy_metrics_t *metrics;
+    ngx_uint_t metrics_index;
+    ngx_flag_t record_result;
+    ngx_flag_t record_timings;
+#if (NGX_THREADS)
+    ngx_thread_pool_t *thread_pool;
+#endif
+    size_t thread_pool_threshold;
+    size_t max_decompressed_size;
+    ngx_str_t phantom_token_uri;
+    ngx_shm_zone_t *phantom_token_zone;
+    ngx_str_t dynamic_config_file;
+    ngx_msec_t dynamic_config_interval;
+    oauth_proxy_dynamic_t *dynamic;
+};
+
+typedef struct
+{
+    ngx_array_t *locations;
+    ngx_uint_t authorization_hash;
+    ngx_uint_t origin_hash;
+    ngx_uint_t request_headers_hash;
+    ngx_flag_t status_enabled;
+    oauth_proxy_metrics_t *metrics;
+} oauth_proxy_main_configuration_t;
+
+/* The request headers the module uses, which are found in a single pass over the incoming headers */
+typedef struct
+{
+    ngx_str_t *authorization;
+    ngx_str_t *origin;
+    ngx_str_t *csrf;
+    ngx_str_t *access_control_request_headers;
+    ngx_flag_t origin_trusted;
+} oauth_proxy_request_headers_t;
+
+/* The module's cookies, which are found in a single pass over the cookie headers, where a missing cookie has no data */
+typedef struct
+{
+    ngx_str_t at;
+    ngx_str_t csrf;
+    ngx_str_t at_chunks[OAUTH_PROXY_MAX_COOKIE_CHUNKS];
+    ngx_uint_t at_chunk_count;
+} oauth_proxy_request_cookies_t;
+
+/* A cookie decryption posted to a thread pool, whose result is read on the event loop when the access phase resumes */
+typedef struct
+{
+    ngx_http_request_t *request;
+    const oauth_proxy_configuration_t *config;
+    ngx_str_t ciphertext;
+    const ngx_str_t *prefix;
+    u_char *buffer;
+    ngx_str_t plaintext;
+    ngx_int_t result;
+    ngx_flag_t compressed;
+    uint64_t decrypt_time;
+    ngx_flag_t completed;
+    ngx_uint_t key_generation;
+    oauth_proxy_request_headers_t headers;
+    u_char error[OAUTH_PROXY_DECRYPTION_ERROR_SIZE];
+} oauth_proxy_decryption_job_t;
+
+/* The swap of an opaque token for a JWT in phantom token mode, which may wait for an introspection subrequest */
+typedef struct
+{
+    const oauth_proxy_configuration_t *config;
+    ngx_str_t token;
+    ngx_str_t authorization;
+    ngx_http_request_t *subrequest;
+    ngx_int_t result;
+    ngx_flag_t done;
+    oauth_proxy_request_headers_t headers;
+} oauth_proxy_phantom_request_t;
+
+/* Per request state for log variables, metrics and waits, where the result is a metric counter, times are in nanoseconds and memory is in bytes */
+typedef struct
+{
+    ngx_uint_t result;
+    size_t cookie_bytes;
+    size_t memory[OAUTH_PROXY_MEMORY_CATEGORIES];
+    uint64_t origin_time;
+    uint64_t csrf_time;
+    uint64_t decrypt_time;
+    uint64_t headers_time;
+    oauth_proxy_decryption_job_t *decryption;
+    oauth_proxy_phantom_request_t *phantom;
+} oauth_proxy_request_context_t;
+
+/* Exported module */
+extern ngx_module_t ngx_curity_http_oauth_proxy_module;
 
 /* Exported functions */
 oauth_proxy_configuration_t* oauth_proxy_module_get_location_configuration(ngx_http_request_t *request);
 ngx_int_t oauth_proxy_configuration_initialize_location(ngx_conf_t *main_config, oauth_proxy_configuration_t *child_config);
+ngx_int_t oauth_proxy_configuration_compile_credentials(ngx_conf_t *main_config, oauth_proxy_configuration_t *config);
+char *oauth_proxy_configuration_set_encryption_key(ngx_conf_t *main_config, ngx_command_t *command, void *conf);
 ngx_int_t oauth_proxy_handler_main(ngx_http_request_t *request);
-ngx_int_t oauth_proxy_decryption_decrypt_cookie(ngx_http_request_t *request, ngx_str_t *plain_text, const ngx_str_t* ciphertext, const ngx_str_t* encryption_key_hex);
+oauth_proxy_handler_pt oauth_proxy_handler_select(const oauth_proxy_configuration_t *config);
+ngx_int_t oauth_proxy_handler_get_result_variable(ngx_http_request_t *request, ngx_http_variable_value_t *value, uintptr_t data);
+ngx_int_t oauth_proxy_handler_get_cookie_bytes_variable(ngx_http_request_t *request, ngx_http_variable_value_t *value, uintptr_t data);
+ngx_int_t oauth_proxy_handler_get_timing_variable(ngx_http_request_t *request, ngx_http_variable_value_t *value, uintptr_t data);
+ngx_int_t oauth_proxy_handler_get_memory_variable(ngx_http_request_t *request, ngx_http_variable_value_t *value, uintptr_t data);
+ngx_int_t oauth_proxy_decryption_get_key_id(uint64_t *key_id, const ngx_array_t *encryption_keys);
+ngx_int_t oauth_proxy_decryption_decrypt_cookie(ngx_http_request_t *request, ngx_str_t *plain_text, const ngx_str_t* ciphertext, const oauth_proxy_configuration_t *config, const ngx_str_t *prefix);
+ngx_int_t oauth_proxy_decryption_decrypt_chunks(ngx_http_request_t *request, ngx_str_t *plaintext, const ngx_str_t *chunks, ngx_uint_t chunk_count, const oauth_proxy_configuration_t *config, const ngx_str_t *prefix);
+ngx_int_t oauth_proxy_decryption_decrypt_buffer(u_char *buffer, ngx_str_t *plaintext, const ngx_str_t *ciphertext, const oauth_proxy_configuration_t *config, const ngx_str_t *prefix, ngx_flag_t shared_context, ngx_flag_t *compressed, u_char *error);
+ngx_int_t oauth_proxy_cipher_initialize(ngx_cycle_t *cycle, oauth_proxy_encryption_key_t *key);
+void oauth_proxy_cipher_free(oauth_proxy_encryption_key_t *key);
+u_char *oauth_proxy_cipher_get_library(u_char *buf, u_char *last);
+ngx_int_t oauth_proxy_cipher_decrypt(const oauth_proxy_encryption_key_t *key, ngx_flag_t shared_context, const u_char *iv, u_char *data, size_t len, const u_char *tag);
+ngx_int_t oauth_proxy_cipher_begin(const oauth_proxy_encryption_key_t *key, const u_char *iv);
+ngx_int_t oauth_proxy_cipher_update(const oauth_proxy_encryption_key_t *key, u_char *out, const u_char *in, size_t len);
+ngx_int_t oauth_proxy_cipher_finish(const oauth_proxy_encryption_key_t *key, u_char *plaintext, size_t len, const u_char *tag);
+void oauth_proxy_cpu_log_features(ngx_cycle_t *cycle);
+ngx_int_t oauth_proxy_compression_inflate(ngx_http_request_t *request, ngx_str_t *plaintext, const ngx_str_t *compressed, const oauth_proxy_configuration_t *config, const ngx_str_t *prefix);
+void oauth_proxy_compression_free(void);
+ngx_int_t oauth_proxy_csrf_initialize_mac(ngx_cycle_t *cycle, oauth_proxy_configuration_t *config);
+void oauth_proxy_csrf_free_mac(oauth_proxy_configuration_t *config);
+ngx_int_t oauth_proxy_csrf_verify_mac(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, const ngx_str_t *cookie, const ngx_str_t *header_value);
+char *oauth_proxy_threads_configure(ngx_conf_t *main_config, ngx_command_t *command, void *conf);
+#if (NGX_THREADS)
+oauth_proxy_decryption_job_t *oauth_proxy_threads_post_decryption(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, const ngx_str_t *ciphertext, const ngx_str_t *prefix);
+#endif
+char *oauth_proxy_dynamic_configure(ngx_conf_t *main_config, ngx_command_t *command, void *conf);
+void oauth_proxy_dynamic_merge(oauth_proxy_configuration_t *child_config, const oauth_proxy_configuration_t *parent_config);
+ngx_int_t oauth_proxy_dynamic_initialize(ngx_conf_t *main_config, oauth_proxy_configuration_t *config);
+void oauth_proxy_dynamic_init_process(ngx_cycle_t *cycle, oauth_proxy_configuration_t *config);
+void oauth_proxy_dynamic_exit_process(oauth_proxy_configuration_t *config);
+ngx_uint_t oauth_proxy_dynamic_acquire(const oauth_proxy_configuration_t *config);
+void oauth_proxy_dynamic_release(const oauth_proxy_configuration_t *config, ngx_uint_t generation);
+char *oauth_proxy_phantom_configure(ngx_conf_t *main_config, ngx_command_t *command, void *conf);
+ngx_int_t oauth_proxy_phantom_resolve(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, oauth_proxy_phantom_request_t *phantom);
+char *oauth_proxy_cache_configure(ngx_conf_t *main_config, ngx_command_t *command, void *conf);
+ngx_int_t oauth_proxy_cache_lookup(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, const ngx_str_t *ciphertext, ngx_str_t *plaintext);
+void oauth_proxy_cache_store(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, const ngx_str_t *ciphertext, const ngx_str_t *plaintext);
+char *oauth_proxy_negative_cache_configure(ngx_conf_t *main_config, ngx_command_t *command, void *conf);
+ngx_flag_t oauth_proxy_negative_cache_contains(const oauth_proxy_configuration_t *config, const ngx_str_t *ciphertext);
+void oauth_proxy_negative_cache_store(const oauth_proxy_configuration_t *config, const ngx_str_t *ciphertext);
+char *oauth_proxy_throttle_configure(ngx_conf_t *main_config, ngx_command_t *command, void *conf);
+ngx_flag_t oauth_proxy_throttle_is_throttled(ngx_http_request_t *request, const oauth_proxy_configuration_t *config);
+void oauth_proxy_throttle_record_failure(ngx_http_request_t *request, const oauth_proxy_configuration_t *config);
+ngx_int_t oauth_proxy_cache_get_counter_variable(ngx_http_request_t *request, ngx_http_variable_value_t *value, uintptr_t data);
+char *oauth_proxy_metrics_configure_status(ngx_conf_t *main_config, ngx_command_t *command, void *conf);
+ngx_int_t oauth_proxy_metrics_initialize(ngx_conf_t *main_config, oauth_proxy_main_configuration_t *module_main_config);
+void oauth_proxy_metrics_init_process(oauth_proxy_main_configuration_t *module_main_config);
+void oauth_proxy_metrics_increment(const oauth_proxy_configuration_t *config, ngx_uint_t counter);
+void oauth_proxy_metrics_observe(const oauth_proxy_configuration_t *config, ngx_uint_t histogram, uint64_t value);
+void oauth_proxy_metrics_observe_memory(const oauth_proxy_configuration_t *config, const size_t *memory);
+const char *oauth_proxy_metrics_get_counter_name(ngx_uint_t counter);
+ngx_int_t oauth_proxy_origins_initialize(ngx_conf_t *main_config, oauth_proxy_configuration_t *config);
+ngx_flag_t oauth_proxy_origins_is_trusted(const oauth_proxy_configuration_t *config, const ngx_str_t *web_origin);
 int oauth_proxy_encoding_bytes_from_hex(u_char *bytes, const u_char *hex, size_t hex_len);
-int oauth_proxy_encoding_base64_url_decode(u_char *bufplain, const u_char *bufcoded);
+void oauth_proxy_encoding_initialize(void);
+ngx_int_t oauth_proxy_encoding_base64_url_decode(u_char *bufplain, size_t *decoded_len, const u_char *bufcoded, size_t coded_len);
 void oauth_proxy_utils_get_csrf_header_name(u_char *csrf_header_name, const oauth_proxy_configuration_t *config);
-ngx_str_t *oauth_proxy_utils_get_header_in(ngx_http_request_t *request, u_char *name, size_t len);
-ngx_int_t oauth_proxy_utils_get_cookie(ngx_http_request_t *request, ngx_str_t* cookie_value, const ngx_str_t* cookie_name_prefix, const u_char *cookie_suffix);
-ngx_int_t oauth_proxy_utils_add_header_out(ngx_http_request_t *request, const char *name, ngx_str_t *value);
-ngx_int_t oauth_proxy_utils_add_integer_header_out(ngx_http_request_t *request, const char *name, ngx_int_t value);
+void oauth_proxy_utils_read_headers_in(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, oauth_proxy_request_headers_t *headers);
+void oauth_proxy_utils_read_cookies(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, oauth_proxy_request_cookies_t *cookies);
+ngx_int_t oauth_proxy_utils_add_header_out(ngx_http_request_t *request, const ngx_str_t *name, const ngx_str_t *value);
+ngx_int_t oauth_proxy_utils_add_headers_out(ngx_http_request_t *request, const ngx_array_t *headers);
+void oauth_proxy_utils_count_memory(ngx_http_request_t *request, ngx_uint_t category, size_t size);
+uint64_t oauth_proxy_utils_get_time(void);
+ngx_shm_zone_t *oauth_proxy_utils_add_zone(ngx_conf_t *main_config, const ngx_str_t *value, ngx_shm_zone_init_pt init_zone, size_t data_size);
+
+#endif /* _OAUTH_PROXY_H_INCLUDED_ */
@@ -0,0 +1,450 @@
+/*
+ *  Copyright 2022 Curity AB
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_string.h>
+#include "oauth_proxy.h"
+
+/* The number of old entries that may be evicted to make space for a new entry */
+#define MAX_EVICTIONS_PER_STORE 8
+
+/*
+ * Shared state, which lives in the zone so that it survives a reload
+ */
+typedef struct
+{
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t queue;
+    ngx_atomic_t hits;
+    ngx_atomic_t misses;
+    ngx_atomic_t evictions;
+} oauth_proxy_cache_shctx_t;
+
+/*
+ * Per process state for a zone
+ */
+typedef struct
+{
+    oauth_proxy_cache_shctx_t *sh;
+    ngx_slab_pool_t *shpool;
+} oauth_proxy_cache_t;
+
+/*
+ * Each entry holds the exact ciphertext, followed by the decrypted header value, so that hash collisions cannot return the wrong token
+ */
+typedef struct
+{
+    ngx_rbtree_node_t node;
+    ngx_queue_t queue;
+    uint64_t key_id;
+    time_t expires;
+    size_t ciphertext_len;
+    size_t plaintext_len;
+    u_char data[1];
+} oauth_proxy_cache_node_t;
+
+/* Forward declarations */
+static ngx_int_t init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static void rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_int_t compare_node(oauth_proxy_cache_node_t *entry, uint64_t key_id, const ngx_str_t *ciphertext);
+static oauth_proxy_cache_node_t *find_node(oauth_proxy_cache_t *cache, uint32_t hash, uint64_t key_id, const ngx_str_t *ciphertext);
+static void delete_node(oauth_proxy_cache_t *cache, oauth_proxy_cache_node_t *entry);
+
+/*
+ * Parse the oauth_proxy_cache directive, in the form zone=name:size [ttl=time]
+ */
+char *oauth_proxy_cache_configure(ngx_conf_t *main_config, ngx_command_t *command, void *conf)
+{
+    oauth_proxy_configuration_t *config = conf;
+    ngx_str_t *value = NULL;
+    ngx_str_t *zone_value = NULL;
+    ngx_str_t ttl_str;
+    time_t ttl = NGX_CONF_UNSET;
+    ngx_uint_t i = 0;
+
+    if (config->cache_zone != NGX_CONF_UNSET_PTR)
+    {
+        return "is duplicate";
+    }
+
+    value = main_config->args->elts;
+
+    for (i = 1; i < main_config->args->nelts; i++)
+    {
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0)
+        {
+            zone_value = &value[i];
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ttl=", 4) == 0)
+        {
+            ttl_str.data = value[i].data + 4;
+            ttl_str.len = value[i].len - 4;
+
+            ttl = ngx_parse_time(&ttl_str, 1);
+            if (ttl == (time_t)NGX_ERROR || ttl == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The oauth_proxy_cache ttl is invalid: \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The oauth_proxy_cache directive has an invalid parameter: \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (zone_value == NULL)
+    {
+        ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The oauth_proxy_cache directive requires a zone parameter");
+        return NGX_CONF_ERROR;
+    }
+
+    config->cache_zone = oauth_proxy_utils_add_zone(main_config, zone_value, init_zone, sizeof(oauth_proxy_cache_t));
+    if (config->cache_zone == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    config->cache_ttl = ttl;
+    return NGX_CONF_OK;
+}
+
+/*
+ * Return a copy of the plaintext for a previously decrypted cookie, or NGX_DECLINED when it must be decrypted
+ */
+ngx_int_t oauth_proxy_cache_lookup(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, const ngx_str_t *ciphertext, ngx_str_t *plaintext)
+{
+    oauth_proxy_cache_t *cache = NULL;
+    oauth_proxy_cache_node_t *entry = NULL;
+    uint32_t hash = 0;
+    u_char *plaintext_bytes = NULL;
+    ngx_int_t ret_code = NGX_DECLINED;
+
+    if (config->cache_zone == NULL)
+    {
+        return NGX_DECLINED;
+    }
+
+    cache = config->cache_zone->data;
+    hash = ngx_murmur_hash2(ciphertext->data, ciphertext->len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    entry = find_node(cache, hash, config->encryption_key_id, ciphertext);
+    if (entry != NULL && entry->expires < ngx_time())
+    {
+        delete_node(cache, entry);
+        entry = NULL;
+    }
+
+    if (entry != NULL)
+    {
+        /* The entry could be evicted once the lock is released, so take a copy */
+        plaintext_bytes = ngx_pnalloc(request->pool, entry->plaintext_len + 1);
+        if (plaintext_bytes == NULL)
+        {
+            ret_code = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        else
+        {
+            ngx_memcpy(plaintext_bytes, entry->data + entry->ciphertext_len, entry->plaintext_len);
+            plaintext_bytes[entry->plaintext_len] = 0;
+            plaintext->data = plaintext_bytes;
+            plaintext->len = entry->plaintext_len;
+            oauth_proxy_utils_count_memory(request, OAUTH_PROXY_MEMORY_PLAINTEXT, entry->plaintext_len + 1);
+
+            ngx_queue_remove(&entry->queue);
+            ngx_queue_insert_head(&cache->sh->queue, &entry->queue);
+            cache->sh->hits++;
+            ret_code = NGX_OK;
+        }
+    }
+    else
+    {
+        cache->sh->misses++;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (ret_code == NGX_HTTP_INTERNAL_SERVER_ERROR)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "Problem encountered allocating memory for a cached access token");
+    }
+
+    return ret_code;
+}
+
+/*
+ * Store a successfully decrypted cookie, evicting the least recently used entries when the zone is full
+ */
+void oauth_proxy_cache_store(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, const ngx_str_t *ciphertext, const ngx_str_t *plaintext)
+{
+    oauth_proxy_cache_t *cache = NULL;
+    oauth_proxy_cache_node_t *entry = NULL;
+    ngx_queue_t *last = NULL;
+    uint32_t hash = 0;
+    size_t size = 0;
+    ngx_uint_t i = 0;
+
+    if (config->cache_zone == NULL)
+    {
+        return;
+    }
+
+    cache = config->cache_zone->data;
+    hash = ngx_murmur_hash2(ciphertext->data, ciphertext->len);
+    size = offsetof(oauth_proxy_cache_node_t, data) + ciphertext->len + plaintext->len;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    /* Another worker may have stored the same cookie concurrently */
+    if (find_node(cache, hash, config->encryption_key_id, ciphertext) != NULL)
+    {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return;
+    }
+
+    entry = ngx_slab_alloc_locked(cache->shpool, size);
+    for (i = 0; entry == NULL && i < MAX_EVICTIONS_PER_STORE && !ngx_queue_empty(&cache->sh->queue); i++)
+    {
+        last = ngx_queue_last(&cache->sh->queue);
+        delete_node(cache, ngx_queue_data(last, oauth_proxy_cache_node_t, queue));
+        cache->sh->evictions++;
+
+        entry = ngx_slab_alloc_locked(cache->shpool, size);
+    }
+
+    if (entry != NULL)
+    {
+        entry->node.key = hash;
+        entry->key_id = config->encryption_key_id;
+        entry->expires = ngx_time() + config->cache_ttl;
+        entry->ciphertext_len = ciphertext->len;
+        entry->plaintext_len = plaintext->len;
+        ngx_memcpy(entry->data, ciphertext->data, ciphertext->len);
+        ngx_memcpy(entry->data + ciphertext->len, plaintext->data, plaintext->len);
+
+        ngx_rbtree_insert(&cache->sh->rbtree, &entry->node);
+        ngx_queue_insert_head(&cache->sh->queue, &entry->queue);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (entry == NULL)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "The oauth_proxy_cache zone \"%V\" is too small to store an access token", &config->cache_zone->shm.name);
+    }
+}
+
+/*
+ * A variable getter so that cache effectiveness can be read from logs or a status location
+ */
+ngx_int_t oauth_proxy_cache_get_counter_variable(ngx_http_request_t *request, ngx_http_variable_value_t *value, uintptr_t data)
+{
+    oauth_proxy_configuration_t *config = oauth_proxy_module_get_location_configuration(request);
+    oauth_proxy_cache_t *cache = NULL;
+    ngx_atomic_uint_t counter = 0;
+    u_char *buffer = NULL;
+
+    if (config->cache_zone == NULL)
+    {
+        value->not_found = 1;
+        return NGX_OK;
+    }
+
+    cache = config->cache_zone->data;
+    switch (data)
+    {
+        case OAUTH_PROXY_CACHE_HITS:
+            counter = cache->sh->hits;
+            break;
+
+        case OAUTH_PROXY_CACHE_MISSES:
+            counter = cache->sh->misses;
+            break;
+
+        default:
+            counter = cache->sh->evictions;
+            break;
+    }
+
+    buffer = ngx_pnalloc(request->pool, NGX_ATOMIC_T_LEN);
+    if (buffer == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    value->len = ngx_sprintf(buffer, "%uA", counter) - buffer;
+    value->data = buffer;
+    value->valid = 1;
+    value->no_cacheable = 1;
+    value->not_found = 0;
+    return NGX_OK;
+}
+
+/*
+ * Set up the zone, or reuse existing entries when NGINX is reloaded
+ */
+static ngx_int_t init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    oauth_proxy_cache_t *old_cache = data;
+    oauth_proxy_cache_t *cache = shm_zone->data;
+    size_t len = 0;
+
+    if (old_cache != NULL)
+    {
+        cache->sh = old_cache->sh;
+        cache->shpool = old_cache->shpool;
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+    if (shm_zone->shm.exists)
+    {
+        cache->sh = cache->shpool->data;
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_calloc(cache->shpool, sizeof(oauth_proxy_cache_shctx_t));
+    if (cache->sh == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel, rbtree_insert_value);
+    ngx_queue_init(&cache->sh->queue);
+
+    len = sizeof(" in oauth_proxy_cache zone \"\"") + shm_zone->shm.name.len;
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in oauth_proxy_cache zone \"%V\"%Z", &shm_zone->shm.name);
+    cache->shpool->log_nomem = 0;
+    return NGX_OK;
+}
+
+/*
+ * Order entries by hash and then by their exact contents
+ */
+static void rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t **p = NULL;
+    oauth_proxy_cache_node_t *entry = NULL;
+    oauth_proxy_cache_node_t *temp_entry = NULL;
+    ngx_str_t ciphertext;
+
+    entry = (oauth_proxy_cache_node_t *)node;
+    ciphertext.data = entry->data;
+    ciphertext.len = entry->ciphertext_len;
+
+    for ( ;; )
+    {
+        if (node->key < temp->key)
+        {
+            p = &temp->left;
+        }
+        else if (node->key > temp->key)
+        {
+            p = &temp->right;
+        }
+        else
+        {
+            temp_entry = (oauth_proxy_cache_node_t *)temp;
+            p = compare_node(temp_entry, entry->key_id, &ciphertext) < 0 ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel)
+        {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+/*
+ * Compare the wanted key and ciphertext with an entry, returning a negative value when they sort before the entry
+ */
+static ngx_int_t compare_node(oauth_proxy_cache_node_t *entry, uint64_t key_id, const ngx_str_t *ciphertext)
+{
+    if (key_id != entry->key_id)
+    {
+        return key_id < entry->key_id ? -1 : 1;
+    }
+
+    return ngx_memn2cmp(ciphertext->data, entry->data, ciphertext->len, entry->ciphertext_len);
+}
+
+/*
+ * Find an entry, which must be called while holding the zone lock
+ */
+static oauth_proxy_cache_node_t *find_node(oauth_proxy_cache_t *cache, uint32_t hash, uint64_t key_id, const ngx_str_t *ciphertext)
+{
+    ngx_rbtree_node_t *node = cache->sh->rbtree.root;
+    ngx_rbtree_node_t *sentinel = cache->sh->rbtree.sentinel;
+    ngx_int_t rc = 0;
+
+    while (node != sentinel)
+    {
+        if (hash < node->key)
+        {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key)
+        {
+            node = node->right;
+            continue;
+        }
+
+        rc = compare_node((oauth_proxy_cache_node_t *)node, key_id, ciphertext);
+        if (rc == 0)
+        {
+            return (oauth_proxy_cache_node_t *)node;
+        }
+
+        node = rc < 0 ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+/*
+ * Remove an entry, which must be called while holding the zone lock
+ */
+static void delete_node(oauth_proxy_cache_t *cache, oauth_proxy_cache_node_t *entry)
+{
+    ngx_queue_remove(&entry->queue);
+    ngx_rbtree_delete(&cache->sh->rbtree, &entry->node);
+    ngx_slab_free_locked(cache->shpool, entry);
+}
@@ -0,0 +1,144 @@
+/*
+ *  Copyright 2022 Curity AB
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_string.h>
+#include <sodium.h>
+#include "oauth_proxy.h"
+
+/*
+ * The AES-256-GCM backend for libsodium, which only implements AES-GCM on x86-64 CPUs with AES-NI and PCLMULQDQ
+ * libsodium has no streaming interface for AES-GCM, so blocks of a chunked cookie are gathered into the plaintext
+ * buffer, and decrypted in place once the tag is known, which needs no more memory than the OpenSSL backend
+ */
+
+/*
+ * The expanded key and GHASH powers are computed once per worker and are only read by requests, so threads can share them
+ * The state must be 16 byte aligned, so the structure is allocated with that alignment
+ */
+struct oauth_proxy_cipher_s
+{
+    crypto_aead_aes256gcm_state state;
+    u_char iv[crypto_aead_aes256gcm_NPUBBYTES];
+};
+
+/*
+ * Called from the init process hook, to check that the CPU is supported and to precompute the state for a key
+ */
+ngx_int_t oauth_proxy_cipher_initialize(ngx_cycle_t *cycle, oauth_proxy_encryption_key_t *key)
+{
+    oauth_proxy_cipher_t *cipher = NULL;
+
+    /* Nested locations share their parent's keys, so a key can be reached more than once */
+    if (key->cipher != NULL)
+    {
+        return NGX_OK;
+    }
+
+    if (sodium_init() < 0)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0, "Unable to initialize libsodium");
+        return NGX_ERROR;
+    }
+
+    if (crypto_aead_aes256gcm_is_available() == 0)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0, "The libsodium AES-256-GCM cipher requires a CPU with AES-NI and PCLMULQDQ, so use OAUTH_PROXY_CRYPTO=openssl on this CPU");
+        return NGX_ERROR;
+    }
+
+    cipher = ngx_pmemalign(cycle->pool, sizeof(oauth_proxy_cipher_t), 16);
+    if (cipher == NULL)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0, "Problem encountered allocating memory for the decryption cipher");
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(cipher, sizeof(oauth_proxy_cipher_t));
+    if (crypto_aead_aes256gcm_beforenm(&cipher->state, key->encryption_key_bytes) != 0)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0, "Unable to initialize the decryption context");
+        sodium_memzero(cipher, sizeof(oauth_proxy_cipher_t));
+        return NGX_ERROR;
+    }
+
+    key->cipher = cipher;
+    return NGX_OK;
+}
+
+/*
+ * Called from the exit process hook, to wipe the expanded key before the pool's memory is released
+ * Keys shared with nested locations are only wiped the first time
+ */
+void oauth_proxy_cipher_free(oauth_proxy_encryption_key_t *key)
+{
+    if (key->cipher == NULL)
+    {
+        return;
+    }
+
+    sodium_memzero(key->cipher, sizeof(oauth_proxy_cipher_t));
+    key->cipher = NULL;
+}
+
+u_char *oauth_proxy_cipher_get_library(u_char *buf, u_char *last)
+{
+    return ngx_slprintf(buf, last, "libsodium %s", sodium_version_string());
+}
+
+/*
+ * Decrypt and authenticate a whole ciphertext in place, returning NGX_DECLINED when the tag does not match
+ * The precomputed state is read only, so the event loop and threads use it in the same way
+ */
+ngx_int_t oauth_proxy_cipher_decrypt(const oauth_proxy_encryption_key_t *key, ngx_flag_t shared_context, const u_char *iv, u_char *data, size_t len, const u_char *tag)
+{
+    if (crypto_aead_aes256gcm_decrypt_detached_afternm(data, NULL, data, len, tag, NULL, 0, iv, &key->cipher->state) != 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * Start gathering a ciphertext that arrives in blocks, on the event loop, where the worker's IV buffer can be used
+ */
+ngx_int_t oauth_proxy_cipher_begin(const oauth_proxy_encryption_key_t *key, const u_char *iv)
+{
+    ngx_memcpy(key->cipher->iv, iv, crypto_aead_aes256gcm_NPUBBYTES);
+    return NGX_OK;
+}
+
+/*
+ * Blocks are copied to where their plaintext belongs, and are decrypted there when the stream finishes
+ */
+ngx_int_t oauth_proxy_cipher_update(const oauth_proxy_encryption_key_t *key, u_char *out, const u_char *in, size_t len)
+{
+    ngx_memmove(out, in, len);
+    return NGX_OK;
+}
+
+ngx_int_t oauth_proxy_cipher_finish(const oauth_proxy_encryption_key_t *key, u_char *plaintext, size_t len, const u_char *tag)
+{
+    if (crypto_aead_aes256gcm_decrypt_detached_afternm(plaintext, NULL, plaintext, len, tag, NULL, 0, key->cipher->iv, &key->cipher->state) != 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
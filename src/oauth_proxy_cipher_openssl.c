@@ -0,0 +1,212 @@
+/*
+ *  Copyright 2022 Curity AB
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_string.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include "oauth_proxy.h"
+
+/*
+ * The AES-256-GCM backend for OpenSSL and the libraries that provide its EVP interface, which are AWS-LC and BoringSSL
+ * When one of those libraries is chosen when NGINX is configured, the build fails if the headers come from a different library
+ */
+#if (OAUTH_PROXY_AWSLC) && !defined(OPENSSL_IS_AWSLC)
+#error "OAUTH_PROXY_CRYPTO=aws-lc was configured, but the OpenSSL headers found are not from AWS-LC"
+#endif
+
+#if (OAUTH_PROXY_BORINGSSL) && (!defined(OPENSSL_IS_BORINGSSL) || defined(OPENSSL_IS_AWSLC))
+#error "OAUTH_PROXY_CRYPTO=boringssl was configured, but the OpenSSL headers found are not from BoringSSL"
+#endif
+
+#define GCM_TAG_SIZE 16
+
+/*
+ * The cipher is resolved and keyed once per worker, so that requests only need to supply the IV
+ */
+struct oauth_proxy_cipher_s
+{
+    EVP_CIPHER *cipher;
+    EVP_CIPHER_CTX *ctx;
+};
+
+/*
+ * Called from the init process hook, to fetch the cipher and run the AES key schedule for a key
+ */
+ngx_int_t oauth_proxy_cipher_initialize(ngx_cycle_t *cycle, oauth_proxy_encryption_key_t *key)
+{
+    oauth_proxy_cipher_t *cipher = NULL;
+    int evp_result = 0;
+
+    /* Nested locations share their parent's keys, so a key can be reached more than once */
+    if (key->cipher != NULL)
+    {
+        return NGX_OK;
+    }
+
+    cipher = ngx_pcalloc(cycle->pool, sizeof(oauth_proxy_cipher_t));
+    if (cipher == NULL)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0, "Problem encountered allocating memory for the decryption cipher");
+        return NGX_ERROR;
+    }
+
+    key->cipher = cipher;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    /* Fetch explicitly once, rather than paying for an implicit provider lookup on every request */
+    cipher->cipher = EVP_CIPHER_fetch(NULL, "AES-256-GCM", NULL);
+#else
+    cipher->cipher = (EVP_CIPHER *)EVP_aes_256_gcm();
+#endif
+    if (cipher->cipher == NULL)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0, "Unable to load the AES-256-GCM decryption cipher");
+        return NGX_ERROR;
+    }
+
+    cipher->ctx = EVP_CIPHER_CTX_new();
+    if (cipher->ctx == NULL)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0, "Unable to create the decryption cipher");
+        oauth_proxy_cipher_free(key);
+        return NGX_ERROR;
+    }
+
+    /* Set the key without an IV, so that each request only needs to initialize the IV */
+    evp_result = EVP_DecryptInit_ex(cipher->ctx, cipher->cipher, NULL, key->encryption_key_bytes, NULL);
+    if (evp_result == 0)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0, "Unable to initialize the decryption context, error number: %d", evp_result);
+        oauth_proxy_cipher_free(key);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * Called from the exit process hook to release OpenSSL resources, where shared keys are only released the first time
+ */
+void oauth_proxy_cipher_free(oauth_proxy_encryption_key_t *key)
+{
+    oauth_proxy_cipher_t *cipher = key->cipher;
+
+    if (cipher == NULL)
+    {
+        return;
+    }
+
+    if (cipher->ctx != NULL)
+    {
+        EVP_CIPHER_CTX_free(cipher->ctx);
+        cipher->ctx = NULL;
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    if (cipher->cipher != NULL)
+    {
+        EVP_CIPHER_free(cipher->cipher);
+    }
+#endif
+
+    cipher->cipher = NULL;
+    key->cipher = NULL;
+}
+
+/*
+ * Describe the library that decrypts cookies, which for AWS-LC includes its own version after the OpenSSL version it emulates
+ */
+u_char *oauth_proxy_cipher_get_library(u_char *buf, u_char *last)
+{
+    return ngx_slprintf(buf, last, "%s", OpenSSL_version(OPENSSL_VERSION));
+}
+
+/*
+ * Decrypt and authenticate a whole ciphertext in place, returning NGX_DECLINED when the tag does not match
+ * The shared context is only used on the event loop, so other threads key a context of their own for the call
+ */
+ngx_int_t oauth_proxy_cipher_decrypt(const oauth_proxy_encryption_key_t *key, ngx_flag_t shared_context, const u_char *iv, u_char *data, size_t len, const u_char *tag)
+{
+    EVP_CIPHER_CTX *ctx = key->cipher->ctx;
+    EVP_CIPHER_CTX *owned_ctx = NULL;
+    ngx_int_t ret_code = NGX_OK;
+    int out_len = 0;
+
+    if (!shared_context)
+    {
+        owned_ctx = EVP_CIPHER_CTX_new();
+        if (owned_ctx == NULL || EVP_DecryptInit_ex(owned_ctx, key->cipher->cipher, NULL, key->encryption_key_bytes, NULL) == 0)
+        {
+            EVP_CIPHER_CTX_free(owned_ctx);
+            return NGX_ERROR;
+        }
+
+        ctx = owned_ctx;
+    }
+
+    /* The key schedule is already in place, so this reads precisely 12 bytes of IV, and the tag is exactly 16 bytes */
+    if (EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, iv) == 0 ||
+        EVP_DecryptUpdate(ctx, data, &out_len, data, (int)len) == 0 ||
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, GCM_TAG_SIZE, (void *)tag) == 0 ||
+        EVP_DecryptFinal_ex(ctx, data + out_len, &out_len) <= 0)
+    {
+        ret_code = NGX_DECLINED;
+    }
+
+    if (owned_ctx != NULL)
+    {
+        EVP_CIPHER_CTX_free(owned_ctx);
+    }
+
+    return ret_code;
+}
+
+/*
+ * Start decrypting a ciphertext that arrives in blocks, using the worker's shared context on the event loop
+ */
+ngx_int_t oauth_proxy_cipher_begin(const oauth_proxy_encryption_key_t *key, const u_char *iv)
+{
+    return EVP_DecryptInit_ex(key->cipher->ctx, NULL, NULL, NULL, iv) == 0 ? NGX_DECLINED : NGX_OK;
+}
+
+/*
+ * GCM decrypts as a stream, so each block of ciphertext produces the same number of plaintext bytes
+ */
+ngx_int_t oauth_proxy_cipher_update(const oauth_proxy_encryption_key_t *key, u_char *out, const u_char *in, size_t len)
+{
+    int out_len = 0;
+
+    return EVP_DecryptUpdate(key->cipher->ctx, out, &out_len, in, (int)len) == 0 ? NGX_DECLINED : NGX_OK;
+}
+
+/*
+ * Check the tag once all blocks have been decrypted, where the plaintext has already been written by each update
+ */
+ngx_int_t oauth_proxy_cipher_finish(const oauth_proxy_encryption_key_t *key, u_char *plaintext, size_t len, const u_char *tag)
+{
+    int out_len = 0;
+
+    if (EVP_CIPHER_CTX_ctrl(key->cipher->ctx, EVP_CTRL_GCM_SET_TAG, GCM_TAG_SIZE, (void *)tag) == 0 ||
+        EVP_DecryptFinal_ex(key->cipher->ctx, plaintext + len, &out_len) <= 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
@@ -0,0 +1,139 @@
+/*
+ *  Copyright 2022 Curity AB
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_string.h>
+#include <zlib.h>
+#include "oauth_proxy.h"
+
+/* Compressed plaintext starts with the decompressed size as a 4 byte big endian number, followed by raw DEFLATE data */
+#define DECOMPRESSED_SIZE_SIZE 4
+
+/* Forward declarations */
+static ngx_int_t get_inflater(ngx_http_request_t *request);
+
+/*
+ * The inflate state is created on first use and reset for each cookie, so that requests do not allocate zlib memory
+ * It is only used on the event loop, so one per worker is enough
+ */
+static z_stream inflater;
+static ngx_flag_t inflater_initialized = 0;
+
+/*
+ * Decompress a decrypted cookie into memory from the request pool, after the optional prefix
+ * The size is known before decompressing, so the output is allocated exactly once and cannot grow past the configured maximum
+ */
+ngx_int_t oauth_proxy_compression_inflate(ngx_http_request_t *request, ngx_str_t *plaintext, const ngx_str_t *compressed, const oauth_proxy_configuration_t *config, const ngx_str_t *prefix)
+{
+    u_char *output = NULL;
+    size_t prefix_len = prefix != NULL ? prefix->len : 0;
+    size_t decompressed_size = 0;
+    int zlib_result = 0;
+
+    if (compressed->len <= DECOMPRESSED_SIZE_SIZE)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "The received cookie has an invalid compressed format");
+        return NGX_HTTP_UNAUTHORIZED;
+    }
+
+    decompressed_size = ((size_t)compressed->data[0] << 24) | ((size_t)compressed->data[1] << 16) | ((size_t)compressed->data[2] << 8) | (size_t)compressed->data[3];
+    if (decompressed_size == 0 || decompressed_size > config->max_decompressed_size)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "The received cookie has an invalid decompressed size: %uz", decompressed_size);
+        return NGX_HTTP_UNAUTHORIZED;
+    }
+
+    if (get_inflater(request) != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    output = ngx_pnalloc(request->pool, prefix_len + decompressed_size + 1);
+    if (output == NULL)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "Problem encountered allocating memory for decompressed bytes");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    oauth_proxy_utils_count_memory(request, OAUTH_PROXY_MEMORY_PLAINTEXT, prefix_len + decompressed_size + 1);
+
+    /* When all input and output is supplied to a single call with Z_FINISH, zlib does not need its 32KB window */
+    inflater.next_in = compressed->data + DECOMPRESSED_SIZE_SIZE;
+    inflater.avail_in = (uInt)(compressed->len - DECOMPRESSED_SIZE_SIZE);
+    inflater.next_out = output + prefix_len;
+    inflater.avail_out = (uInt)decompressed_size;
+
+    /* The data must end exactly at the stated size, so that a cookie cannot expand beyond the memory allocated for it */
+    zlib_result = inflate(&inflater, Z_FINISH);
+    if (zlib_result != Z_STREAM_END || inflater.avail_out != 0 || inflater.avail_in != 0)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "Problem encountered decompressing data, error number: %d", zlib_result);
+        return NGX_HTTP_UNAUTHORIZED;
+    }
+
+    if (prefix_len > 0)
+    {
+        ngx_memcpy(output, prefix->data, prefix_len);
+    }
+
+    output[prefix_len + decompressed_size] = 0;
+    plaintext->data = output;
+    plaintext->len = prefix_len + decompressed_size;
+    return NGX_OK;
+}
+
+/*
+ * Called from the exit process hook to release zlib memory
+ */
+void oauth_proxy_compression_free(void)
+{
+    if (inflater_initialized)
+    {
+        inflateEnd(&inflater);
+        inflater_initialized = 0;
+    }
+}
+
+/*
+ * Create the inflate state on first use, or reset it for the next cookie
+ */
+static ngx_int_t get_inflater(ngx_http_request_t *request)
+{
+    int zlib_result = 0;
+
+    if (inflater_initialized)
+    {
+        zlib_result = inflateReset(&inflater);
+    }
+    else
+    {
+        ngx_memzero(&inflater, sizeof(z_stream));
+
+        /* Negative window bits select raw DEFLATE data, without the zlib header and checksum, which GCM makes redundant */
+        zlib_result = inflateInit2(&inflater, -MAX_WBITS);
+        inflater_initialized = zlib_result == Z_OK;
+    }
+
+    if (zlib_result != Z_OK)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "Unable to initialize the decompressor, error number: %d", zlib_result);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
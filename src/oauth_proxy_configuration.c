@@ -7,6 +7,14 @@
 /* Forward declarations */
 static ngx_int_t apply_configuration_defaults(ngx_conf_t *main_config, oauth_proxy_configuration_t *config);
 static ngx_int_t validate_configuration(ngx_conf_t *main_config, const oauth_proxy_configuration_t *module_location_config);
+static ngx_int_t decode_encryption_key(ngx_conf_t *main_config, oauth_proxy_configuration_t *config);
+static ngx_int_t decode_csrf_hmac_key(ngx_conf_t *main_config, oauth_proxy_configuration_t *config);
+static ngx_int_t initialize_csrf_header_name(ngx_conf_t *main_config, oauth_proxy_configuration_t *config);
+static ngx_int_t initialize_cookie_names(ngx_conf_t *main_config, oauth_proxy_configuration_t *config);
+static ngx_int_t create_cookie_name(ngx_conf_t *main_config, ngx_str_t *cookie_name, const ngx_str_t *prefix, const char *suffix);
+static ngx_int_t initialize_cors_headers(ngx_conf_t *main_config, oauth_proxy_configuration_t *config);
+static ngx_array_t *create_headers(ngx_conf_t *main_config, oauth_proxy_configuration_t *config, ngx_flag_t preflight);
+static ngx_int_t add_header(ngx_array_t *headers, const char *name, const ngx_str_t *value);
 
 /*
  * Default and validate the configuration for a location when NGINX starts up
@@ -18,7 +26,32 @@ ngx_int_t oauth_proxy_configuration_initialize_location(ngx_conf_t *main_config,
         return NGX_ERROR;
     }
 
-    if (validate_configuration(main_config, child_config) != NGX_OK)
+    if (oauth_proxy_dynamic_initialize(main_config, child_config) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (oauth_proxy_configuration_compile_credentials(main_config, child_config) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (decode_csrf_hmac_key(main_config, child_config) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (initialize_csrf_header_name(main_config, child_config) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (initialize_cookie_names(main_config, child_config) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (initialize_cors_headers(main_config, child_config) != NGX_OK)
     {
         return NGX_ERROR;
     }
@@ -26,6 +59,82 @@ ngx_int_t oauth_proxy_configuration_initialize_location(ngx_conf_t *main_config,
     return NGX_OK;
 }
 
+/*
+ * Validate and compile the keys and trusted origins, which also runs in workers when a dynamic configuration file changes
+ * Memory is allocated from the pools of the supplied configuration context, and errors are logged to its log
+ */
+ngx_int_t oauth_proxy_configuration_compile_credentials(ngx_conf_t *main_config, oauth_proxy_configuration_t *config)
+{
+    if (validate_configuration(main_config, config) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (decode_encryption_key(main_config, config) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (oauth_proxy_origins_initialize(main_config, config) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * Read an oauth_proxy_encryption_key directive, which can be repeated during key rotation
+ * The first key decrypts version 1 cookies, and version 2 cookies select a key by its id, which defaults to 0
+ */
+char *oauth_proxy_configuration_set_encryption_key(ngx_conf_t *main_config, ngx_command_t *command, void *conf)
+{
+    oauth_proxy_configuration_t *config = conf;
+    oauth_proxy_encryption_key_t *key = NULL;
+    ngx_str_t *value = NULL;
+    ngx_int_t id = 0;
+    ngx_uint_t i = 0;
+
+    if (config->encryption_keys == NGX_CONF_UNSET_PTR)
+    {
+        config->encryption_keys = ngx_array_create(main_config->pool, 2, sizeof(oauth_proxy_encryption_key_t));
+        if (config->encryption_keys == NULL)
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    value = main_config->args->elts;
+    for (i = 2; i < main_config->args->nelts; i++)
+    {
+        if (ngx_strncmp(value[i].data, "id=", 3) == 0)
+        {
+            id = ngx_atoi(value[i].data + 3, value[i].len - 3);
+            if (id == NGX_ERROR || id >= OAUTH_PROXY_MAX_KEY_IDS)
+            {
+                ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The encryption_key id must be between 0 and 255: \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The oauth_proxy_encryption_key directive has an invalid parameter: \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    key = ngx_array_push(config->encryption_keys);
+    if (key == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(key, sizeof(oauth_proxy_encryption_key_t));
+    key->encryption_key = value[1];
+    key->id = (ngx_uint_t)id;
+    return NGX_CONF_OK;
+}
+
 /*
  * Set default options that are not provided in the nginx.conf file
  */
@@ -56,6 +165,8 @@ static ngx_int_t apply_configuration_defaults(ngx_conf_t *main_config, oauth_pro
  */
 static ngx_int_t validate_configuration(ngx_conf_t *main_config, const oauth_proxy_configuration_t *module_location_config)
 {
+    oauth_proxy_encryption_key_t *keys = NULL;
+    ngx_uint_t i = 0;
     size_t max_cookie_name_size = 64;
 
     if (module_location_config != NULL && module_location_config->enabled)
@@ -72,15 +183,31 @@ static ngx_int_t validate_configuration(ngx_conf_t *main_config, const oauth_pro
             return NGX_ERROR;
         }
 
-        if (module_location_config->encryption_key.len == 0)
+        if (module_location_config->encryption_keys == NULL || module_location_config->encryption_keys->nelts == 0)
         {
             ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The encryption_key configuration directive was not provided");
             return NGX_ERROR;
         }
 
-        if (module_location_config->encryption_key.len != 64)
+        keys = module_location_config->encryption_keys->elts;
+        for (i = 0; i < module_location_config->encryption_keys->nelts; i++)
+        {
+            if (keys[i].encryption_key.len == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The encryption_key configuration directive was not provided");
+                return NGX_ERROR;
+            }
+
+            if (keys[i].encryption_key.len != 64)
+            {
+                ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The encryption_key configuration directive must contain 64 hex characters");
+                return NGX_ERROR;
+            }
+        }
+
+        if (module_location_config->csrf_hmac_key.len > 0 && module_location_config->csrf_hmac_key.len != 64)
         {
-            ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The encryption_key configuration directive must contain 64 hex characters");
+            ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The csrf_hmac_key configuration directive must contain 64 hex characters");
             return NGX_ERROR;
         }
 
@@ -92,4 +219,259 @@ static ngx_int_t validate_configuration(ngx_conf_t *main_config, const oauth_pro
     }
 
     return NGX_OK;
-}
\ No newline at end of file
+}
+
+/*
+ * Decode the hex keys once at startup, rather than on every decryption, and index them by their cookie key identifier
+ */
+static ngx_int_t decode_encryption_key(ngx_conf_t *main_config, oauth_proxy_configuration_t *config)
+{
+    oauth_proxy_encryption_key_t *keys = NULL;
+    ngx_uint_t i = 0;
+
+    if (config->enabled)
+    {
+        config->encryption_keys_by_id = ngx_pcalloc(main_config->pool, OAUTH_PROXY_MAX_KEY_IDS * sizeof(oauth_proxy_encryption_key_t *));
+        if (config->encryption_keys_by_id == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        keys = config->encryption_keys->elts;
+        for (i = 0; i < config->encryption_keys->nelts; i++)
+        {
+            if (oauth_proxy_encoding_bytes_from_hex(keys[i].encryption_key_bytes, keys[i].encryption_key.data, keys[i].encryption_key.len) != 0)
+            {
+                ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The encryption_key configuration directive is not valid hex");
+                return NGX_ERROR;
+            }
+
+            if (config->encryption_keys_by_id[keys[i].id] != NULL)
+            {
+                ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The encryption_key id %ui is used by more than one key", keys[i].id);
+                return NGX_ERROR;
+            }
+
+            config->encryption_keys_by_id[keys[i].id] = &keys[i];
+        }
+
+        if (oauth_proxy_decryption_get_key_id(&config->encryption_key_id, config->encryption_keys) != NGX_OK)
+        {
+            ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "Unable to calculate an identifier for the encryption_key");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * Decode the optional CSRF MAC key at startup, after which CSRF cookies are verified as MACs rather than decrypted
+ */
+static ngx_int_t decode_csrf_hmac_key(ngx_conf_t *main_config, oauth_proxy_configuration_t *config)
+{
+    if (config->enabled && config->csrf_hmac_key.len > 0)
+    {
+        if (oauth_proxy_encoding_bytes_from_hex(config->csrf_hmac_key_bytes, config->csrf_hmac_key.data, config->csrf_hmac_key.len) != 0)
+        {
+            ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The csrf_hmac_key configuration directive is not valid hex");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * Build the lowercase CSRF header name and its hash once, so that requests can find the header without string building
+ */
+static ngx_int_t initialize_csrf_header_name(ngx_conf_t *main_config, oauth_proxy_configuration_t *config)
+{
+    u_char *csrf_header_name = NULL;
+
+    if (config->enabled)
+    {
+        /* The validated prefix has a maximum length of 64 characters, which leaves room for the x- and -csrf parts */
+        csrf_header_name = ngx_pnalloc(main_config->pool, config->cookie_name_prefix.len + 8);
+        if (csrf_header_name == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        oauth_proxy_utils_get_csrf_header_name(csrf_header_name, config);
+        config->csrf_header_name.data = csrf_header_name;
+        config->csrf_header_name.len = ngx_strlen(csrf_header_name);
+        config->csrf_header_hash = ngx_hash_strlow(csrf_header_name, csrf_header_name, config->csrf_header_name.len);
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * Build the full cookie names once, so that requests can match each cookie in the cookie headers without string building
+ */
+static ngx_int_t initialize_cookie_names(ngx_conf_t *main_config, oauth_proxy_configuration_t *config)
+{
+    if (config->enabled)
+    {
+        if (create_cookie_name(main_config, &config->at_cookie_name, &config->cookie_name_prefix, "-at") != NGX_OK ||
+            create_cookie_name(main_config, &config->csrf_cookie_name, &config->cookie_name_prefix, "-csrf") != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t create_cookie_name(ngx_conf_t *main_config, ngx_str_t *cookie_name, const ngx_str_t *prefix, const char *suffix)
+{
+    size_t suffix_len = ngx_strlen(suffix);
+
+    cookie_name->data = ngx_pnalloc(main_config->pool, prefix->len + suffix_len);
+    if (cookie_name->data == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    cookie_name->len = ngx_cpymem(ngx_cpymem(cookie_name->data, prefix->data, prefix->len), suffix, suffix_len) - cookie_name->data;
+    return NGX_OK;
+}
+
+/*
+ * Render the static CORS response headers once, so that requests only need to add the echoed origin and request headers
+ */
+static ngx_int_t initialize_cors_headers(ngx_conf_t *main_config, oauth_proxy_configuration_t *config)
+{
+    ngx_str_t allow_credentials = ngx_string("true");
+
+    if (!config->enabled)
+    {
+        return NGX_OK;
+    }
+
+    /* Error responses always need this header so that the SPA can read them, even when CORS is disabled */
+    config->cors_error_headers = ngx_array_create(main_config->pool, 1, sizeof(ngx_table_elt_t));
+    if (config->cors_error_headers == NULL ||
+        add_header(config->cors_error_headers, "access-control-allow-credentials", &allow_credentials) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (config->cors_enabled)
+    {
+        config->cors_response_headers = create_headers(main_config, config, 0);
+        if (config->cors_response_headers == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        config->cors_preflight_headers = create_headers(main_config, config, 1);
+        if (config->cors_preflight_headers == NULL)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * Create the static headers for either pre-flight responses or main API responses
+ */
+static ngx_array_t *create_headers(ngx_conf_t *main_config, oauth_proxy_configuration_t *config, ngx_flag_t preflight)
+{
+    ngx_str_t allow_credentials = ngx_string("true");
+    ngx_str_t vary = ngx_string("origin");
+    ngx_str_t max_age;
+    ngx_array_t *headers = NULL;
+
+    headers = ngx_array_create(main_config->pool, 6, sizeof(ngx_table_elt_t));
+    if (headers == NULL)
+    {
+        return NULL;
+    }
+
+    if (add_header(headers, "access-control-allow-credentials", &allow_credentials) != NGX_OK)
+    {
+        return NULL;
+    }
+
+    /* Write headers only needed in responses to pre-flight requests */
+    if (preflight)
+    {
+        if (config->cors_allow_methods.len > 0)
+        {
+            if (add_header(headers, "access-control-allow-methods", &config->cors_allow_methods) != NGX_OK)
+            {
+                return NULL;
+            }
+        }
+
+        /* If no headers are set explicitly then the handler returns any headers the browser requests at runtime
+           This ensures that the API gateway does not need reconfiguration whenever a new header is sent */
+        if (config->cors_allow_headers.len > 0)
+        {
+            if (add_header(headers, "access-control-allow-headers", &config->cors_allow_headers) != NGX_OK)
+            {
+                return NULL;
+            }
+        }
+        else
+        {
+            ngx_str_set(&vary, "origin,access-control-request-headers");
+        }
+
+        if (config->cors_max_age > 0)
+        {
+            max_age.data = ngx_pnalloc(main_config->pool, NGX_INT_T_LEN);
+            if (max_age.data == NULL)
+            {
+                return NULL;
+            }
+
+            max_age.len = ngx_sprintf(max_age.data, "%i", config->cors_max_age) - max_age.data;
+            if (add_header(headers, "access-control-max-age", &max_age) != NGX_OK)
+            {
+                return NULL;
+            }
+        }
+    }
+
+    /* These headers are needed in both pre-flight requests and the main request */
+    if (config->cors_expose_headers.len > 0)
+    {
+        if (add_header(headers, "access-control-expose-headers", &config->cors_expose_headers) != NGX_OK)
+        {
+            return NULL;
+        }
+    }
+
+    if (add_header(headers, "vary", &vary) != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return headers;
+}
+
+/*
+ * Add a header element whose name and value live as long as the configuration
+ */
+static ngx_int_t add_header(ngx_array_t *headers, const char *name, const ngx_str_t *value)
+{
+    ngx_table_elt_t *header = NULL;
+
+    header = ngx_array_push(headers);
+    if (header == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(header, sizeof(ngx_table_elt_t));
+    header->key.data = (u_char *)name;
+    header->key.len = ngx_strlen(name);
+    header->value = *value;
+    header->hash = 1;
+    return NGX_OK;
+}
@@ -0,0 +1,200 @@
+/*
+ *  Copyright 2022 Curity AB
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_string.h>
+#include "oauth_proxy.h"
+
+#if (( __i386__ || __amd64__ ) && ( __GNUC__ || __INTEL_COMPILER ))
+#define OAUTH_PROXY_CPU_X86 1
+#include <cpuid.h>
+#elif (__aarch64__ && NGX_LINUX)
+#define OAUTH_PROXY_CPU_ARM64 1
+#include <sys/auxv.h>
+#endif
+
+/* The features that decide which AES-GCM code path a crypto library takes, with the registers and bits that report them */
+#define X86_ECX1_PCLMULQDQ (1 << 1)
+#define X86_ECX1_AES (1 << 25)
+#define X86_ECX1_OSXSAVE (1 << 27)
+#define X86_ECX1_AVX (1 << 28)
+#define X86_EBX7_AVX2 (1 << 5)
+#define X86_EBX7_AVX512F (1 << 16)
+#define X86_ECX7_VAES (1 << 9)
+#define X86_ECX7_VPCLMULQDQ (1 << 10)
+
+/* The operating system must also save the YMM registers for AVX, and the ZMM and mask registers for AVX-512 */
+#define X86_XCR0_AVX 0x06
+#define X86_XCR0_AVX512 0xe6
+
+#define FEATURES_SIZE 128
+#define LIBRARY_SIZE 128
+
+/* Forward declarations */
+static u_char *get_features(u_char *buf, u_char *last, ngx_flag_t *aes);
+static u_char *add_feature(u_char *buf, u_char *p, u_char *last, const char *name);
+#if (OAUTH_PROXY_CPU_X86)
+static uint32_t get_xcr0(void);
+#endif
+
+/*
+ * Called from the init process hook, so that each worker reports the crypto library and the CPU features it can use
+ * This shows whether a build and host have hardware AES, and whether wide vector AES-GCM code paths are available
+ */
+void oauth_proxy_cpu_log_features(ngx_cycle_t *cycle)
+{
+    u_char library[LIBRARY_SIZE];
+    u_char features[FEATURES_SIZE];
+    u_char *library_last = NULL;
+    u_char *features_last = NULL;
+    ngx_flag_t aes = 0;
+
+    library_last = oauth_proxy_cipher_get_library(library, library + LIBRARY_SIZE);
+    features_last = get_features(features, features + FEATURES_SIZE, &aes);
+
+    if (!aes)
+    {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0, "AES-256-GCM decryption uses %*s without hardware AES support, with CPU features: %*s",
+                      (size_t)(library_last - library), library, (size_t)(features_last - features), features);
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "AES-256-GCM decryption uses %*s with CPU features: %*s",
+                  (size_t)(library_last - library), library, (size_t)(features_last - features), features);
+}
+
+/*
+ * Write the names of the AES-GCM related features that the CPU and operating system support, separated by spaces
+ */
+static u_char *get_features(u_char *buf, u_char *last, ngx_flag_t *aes)
+{
+    u_char *p = buf;
+
+#if (OAUTH_PROXY_CPU_X86)
+    uint32_t eax = 0;
+    uint32_t ebx = 0;
+    uint32_t edx = 0;
+    uint32_t ecx1 = 0;
+    uint32_t ebx7 = 0;
+    uint32_t ecx7 = 0;
+    uint32_t xcr0 = 0;
+    uint32_t max_leaf = 0;
+
+    max_leaf = __get_cpuid_max(0, NULL);
+    if (max_leaf >= 1)
+    {
+        __cpuid(1, eax, ebx, ecx1, edx);
+    }
+
+    if (max_leaf >= 7)
+    {
+        __cpuid_count(7, 0, eax, ebx7, ecx7, edx);
+    }
+
+    if (ecx1 & X86_ECX1_OSXSAVE)
+    {
+        xcr0 = get_xcr0();
+    }
+
+    *aes = (ecx1 & X86_ECX1_AES) != 0;
+    if (ecx1 & X86_ECX1_AES)
+    {
+        p = add_feature(buf, p, last, "aes");
+    }
+
+    if (ecx1 & X86_ECX1_PCLMULQDQ)
+    {
+        p = add_feature(buf, p, last, "pclmulqdq");
+    }
+
+    if ((xcr0 & X86_XCR0_AVX) == X86_XCR0_AVX)
+    {
+        if (ecx1 & X86_ECX1_AVX)
+        {
+            p = add_feature(buf, p, last, "avx");
+        }
+
+        if (ebx7 & X86_EBX7_AVX2)
+        {
+            p = add_feature(buf, p, last, "avx2");
+        }
+
+        if (ecx7 & X86_ECX7_VAES)
+        {
+            p = add_feature(buf, p, last, "vaes");
+        }
+
+        if (ecx7 & X86_ECX7_VPCLMULQDQ)
+        {
+            p = add_feature(buf, p, last, "vpclmulqdq");
+        }
+    }
+
+    if ((xcr0 & X86_XCR0_AVX512) == X86_XCR0_AVX512 && (ebx7 & X86_EBX7_AVX512F))
+    {
+        p = add_feature(buf, p, last, "avx512f");
+    }
+
+#elif (OAUTH_PROXY_CPU_ARM64)
+    unsigned long hwcap = getauxval(AT_HWCAP);
+
+    *aes = (hwcap & HWCAP_AES) != 0;
+    if (hwcap & HWCAP_AES)
+    {
+        p = add_feature(buf, p, last, "aes");
+    }
+
+    if (hwcap & HWCAP_PMULL)
+    {
+        p = add_feature(buf, p, last, "pmull");
+    }
+
+#else
+    /* Other platforms are not inspected, and the library's own detection still applies */
+    *aes = 1;
+    return ngx_slprintf(p, last, "unknown");
+#endif
+
+    if (p == buf)
+    {
+        return ngx_slprintf(p, last, "none");
+    }
+
+    return p;
+}
+
+static u_char *add_feature(u_char *buf, u_char *p, u_char *last, const char *name)
+{
+    return ngx_slprintf(p, last, p == buf ? "%s" : " %s", name);
+}
+
+#if (OAUTH_PROXY_CPU_X86)
+
+/*
+ * Read the extended control register that reports which register states the operating system saves
+ */
+static uint32_t get_xcr0(void)
+{
+    uint32_t eax = 0;
+    uint32_t edx = 0;
+
+    __asm__ volatile ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+    return eax;
+}
+
+#endif
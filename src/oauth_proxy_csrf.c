@@ -0,0 +1,215 @@
+/*
+ *  Copyright 2022 Curity AB
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_string.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include "oauth_proxy.h"
+
+/* HMAC-SHA256 constants from RFC 2104, where keys shorter than the block size are padded with zeros */
+#define SHA256_BLOCK_SIZE 64
+#define SHA256_DIGEST_SIZE 32
+#define HMAC_INNER_PAD 0x36
+#define HMAC_OUTER_PAD 0x5c
+
+/* The cookie is the unpadded base64url encoding of the 32 byte MAC, though padding is tolerated */
+#define MAX_COOKIE_SIZE 44
+
+/* Forward declarations */
+static ngx_int_t absorb_pad(EVP_MD_CTX *ctx, const EVP_MD *md, const u_char *key_bytes, u_char pad);
+static ngx_int_t compute_mac(const oauth_proxy_csrf_mac_t *mac, u_char *digest, const ngx_str_t *value);
+
+/*
+ * The inner and outer hash states have already absorbed the padded key, so that each request only hashes its token
+ */
+struct oauth_proxy_csrf_mac_s
+{
+    EVP_MD *md;
+    EVP_MD_CTX *inner;
+    EVP_MD_CTX *outer;
+    EVP_MD_CTX *ctx;
+};
+
+/*
+ * Called from the init process hook, to prepare the keyed hash states for a location's CSRF MAC key
+ */
+ngx_int_t oauth_proxy_csrf_initialize_mac(ngx_cycle_t *cycle, oauth_proxy_configuration_t *config)
+{
+    oauth_proxy_csrf_mac_t *mac = NULL;
+
+    mac = ngx_pcalloc(cycle->pool, sizeof(oauth_proxy_csrf_mac_t));
+    if (mac == NULL)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0, "Problem encountered allocating memory for the CSRF MAC");
+        return NGX_ERROR;
+    }
+
+    config->csrf_mac = mac;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    mac->md = EVP_MD_fetch(NULL, "SHA256", NULL);
+#else
+    mac->md = (EVP_MD *)EVP_sha256();
+#endif
+    if (mac->md == NULL)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0, "Unable to load the SHA-256 digest for the CSRF MAC");
+        oauth_proxy_csrf_free_mac(config);
+        return NGX_ERROR;
+    }
+
+    mac->inner = EVP_MD_CTX_new();
+    mac->outer = EVP_MD_CTX_new();
+    mac->ctx = EVP_MD_CTX_new();
+    if (mac->inner == NULL || mac->outer == NULL || mac->ctx == NULL)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0, "Unable to create the CSRF MAC digest contexts");
+        oauth_proxy_csrf_free_mac(config);
+        return NGX_ERROR;
+    }
+
+    if (absorb_pad(mac->inner, mac->md, config->csrf_hmac_key_bytes, HMAC_INNER_PAD) != NGX_OK ||
+        absorb_pad(mac->outer, mac->md, config->csrf_hmac_key_bytes, HMAC_OUTER_PAD) != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0, "Unable to initialize the CSRF MAC digest contexts");
+        oauth_proxy_csrf_free_mac(config);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * Called from the exit process hook to release OpenSSL resources
+ */
+void oauth_proxy_csrf_free_mac(oauth_proxy_configuration_t *config)
+{
+    oauth_proxy_csrf_mac_t *mac = config->csrf_mac;
+
+    if (mac == NULL)
+    {
+        return;
+    }
+
+    if (mac->inner != NULL)
+    {
+        EVP_MD_CTX_free(mac->inner);
+    }
+
+    if (mac->outer != NULL)
+    {
+        EVP_MD_CTX_free(mac->outer);
+    }
+
+    if (mac->ctx != NULL)
+    {
+        EVP_MD_CTX_free(mac->ctx);
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    if (mac->md != NULL)
+    {
+        EVP_MD_free(mac->md);
+    }
+#endif
+
+    config->csrf_mac = NULL;
+}
+
+/*
+ * Check that the CSRF cookie holds the HMAC-SHA256 of the CSRF request header, using a constant time comparison
+ * NGX_DECLINED is returned for a well formed cookie whose MAC does not match the header
+ */
+ngx_int_t oauth_proxy_csrf_verify_mac(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, const ngx_str_t *cookie, const ngx_str_t *header_value)
+{
+    u_char cookie_bytes[ngx_base64_decoded_length(MAX_COOKIE_SIZE)];
+    u_char digest[SHA256_DIGEST_SIZE];
+    size_t decoded_size = 0;
+
+    if (config->csrf_mac == NULL)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "The CSRF MAC has not been initialized");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (cookie->len > MAX_COOKIE_SIZE ||
+        oauth_proxy_encoding_base64_url_decode(cookie_bytes, &decoded_size, cookie->data, cookie->len) != NGX_OK ||
+        decoded_size != SHA256_DIGEST_SIZE)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "The received CSRF cookie is not a valid MAC");
+        return NGX_HTTP_UNAUTHORIZED;
+    }
+
+    if (compute_mac(config->csrf_mac, digest, header_value) != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "Problem encountered calculating the CSRF MAC");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    return CRYPTO_memcmp(digest, cookie_bytes, SHA256_DIGEST_SIZE) == 0 ? NGX_OK : NGX_DECLINED;
+}
+
+/*
+ * Start a hash with the key XORed with an HMAC pad, which fills exactly one SHA-256 block
+ */
+static ngx_int_t absorb_pad(EVP_MD_CTX *ctx, const EVP_MD *md, const u_char *key_bytes, u_char pad)
+{
+    u_char block[SHA256_BLOCK_SIZE];
+    ngx_int_t ret_code = NGX_OK;
+    ngx_uint_t i = 0;
+
+    ngx_memset(block, pad, SHA256_BLOCK_SIZE);
+    for (i = 0; i < OAUTH_PROXY_HMAC_KEY_SIZE_BYTES; i++)
+    {
+        block[i] ^= key_bytes[i];
+    }
+
+    if (EVP_DigestInit_ex(ctx, md, NULL) == 0 || EVP_DigestUpdate(ctx, block, SHA256_BLOCK_SIZE) == 0)
+    {
+        ret_code = NGX_ERROR;
+    }
+
+    OPENSSL_cleanse(block, SHA256_BLOCK_SIZE);
+    return ret_code;
+}
+
+/*
+ * Compute HMAC-SHA256 from copies of the prepared states, which avoids hashing the key on every request
+ */
+static ngx_int_t compute_mac(const oauth_proxy_csrf_mac_t *mac, u_char *digest, const ngx_str_t *value)
+{
+    u_char inner_digest[SHA256_DIGEST_SIZE];
+    unsigned int digest_len = 0;
+
+    if (EVP_MD_CTX_copy_ex(mac->ctx, mac->inner) == 0 ||
+        EVP_DigestUpdate(mac->ctx, value->data, value->len) == 0 ||
+        EVP_DigestFinal_ex(mac->ctx, inner_digest, &digest_len) == 0)
+    {
+        return NGX_ERROR;
+    }
+
+    if (EVP_MD_CTX_copy_ex(mac->ctx, mac->outer) == 0 ||
+        EVP_DigestUpdate(mac->ctx, inner_digest, SHA256_DIGEST_SIZE) == 0 ||
+        EVP_DigestFinal_ex(mac->ctx, digest, &digest_len) == 0)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
@@ -23,161 +23,479 @@
 
 /* For encryption related constants to be used in array sizes, use #defines as valid C */
 #define VERSION_SIZE 1
+#define KEY_ID_SIZE 1
 #define GCM_IV_SIZE 12
 #define GCM_TAG_SIZE 16
-#define AES_KEY_SIZE_BYTES 32
-#define CURRENT_VERSION 1
+#define ORIGINAL_VERSION 1
+#define KEY_ID_VERSION 2
+#define COMPRESSED_VERSION 3
+
+/* Chunked cookies are decoded this many characters at a time, which must be a multiple of 4 */
+#define STREAM_BLOCK_SIZE 1024
+
+/* Forward declarations */
+static ngx_int_t select_key(const u_char *header, const oauth_proxy_configuration_t *config, oauth_proxy_encryption_key_t **key, size_t *header_size, u_char *error);
+static size_t read_chunks(u_char *encoded, const ngx_str_t *chunks, ngx_uint_t chunk_count, ngx_uint_t *chunk_index, size_t *chunk_offset, size_t max_len);
+static void set_error(u_char *error, const char *fmt, ...);
 
 /*
- * Performs AES256-GCM authenticated decryption of secure cookies, using the hex encryption key from configuration
- * https://wiki.openssl.org/index.php/EVP_Authenticated_Encryption_and_Decryption
+ * Derive a non secret identifier for a set of keys, so that shared state can be partitioned by key without storing keys
  */
-ngx_int_t oauth_proxy_decryption_decrypt_cookie(ngx_http_request_t *request, ngx_str_t *plaintext, const ngx_str_t *ciphertext, const ngx_str_t *encryption_key_hex)
+ngx_int_t oauth_proxy_decryption_get_key_id(uint64_t *key_id, const ngx_array_t *encryption_keys)
 {
-    EVP_CIPHER_CTX *ctx = NULL;
-    u_char encryption_key_bytes[AES_KEY_SIZE_BYTES];
-    u_char *ciphertext_bytes = NULL;
-    u_char *plaintext_bytes = NULL;
-    u_char iv_bytes[GCM_IV_SIZE];
-    u_char tag_bytes[GCM_TAG_SIZE];
-    int decoded_size = 0;
-    int ciphertext_byte_size = 0;
-    int plaintext_len  = 0;
-    int offset = 0;
-    int len = 0;
+    oauth_proxy_encryption_key_t *keys = NULL;
+    EVP_MD_CTX *ctx = NULL;
+    u_char digest[EVP_MAX_MD_SIZE];
+    u_char id = 0;
+    unsigned int digest_len = 0;
+    ngx_uint_t i = 0;
     int evp_result = 0;
-    ngx_int_t ret_code = NGX_OK;
 
-    ctx = EVP_CIPHER_CTX_new();
+    ctx = EVP_MD_CTX_new();
     if (ctx == NULL)
     {
-        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "Unable to create the decryption cipher");
-        ret_code = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        return NGX_ERROR;
+    }
+
+    /* Key identifiers are included, since they change which cookies a location can decrypt */
+    evp_result = EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    keys = encryption_keys->elts;
+    for (i = 0; evp_result != 0 && i < encryption_keys->nelts; i++)
+    {
+        id = (u_char)keys[i].id;
+        evp_result = EVP_DigestUpdate(ctx, &id, sizeof(id)) &&
+                     EVP_DigestUpdate(ctx, keys[i].encryption_key_bytes, OAUTH_PROXY_AES_KEY_SIZE_BYTES);
     }
 
+    if (evp_result != 0)
+    {
+        evp_result = EVP_DigestFinal_ex(ctx, digest, &digest_len);
+    }
+
+    EVP_MD_CTX_free(ctx);
+    if (evp_result == 0)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(key_id, digest, sizeof(uint64_t));
+    return NGX_OK;
+}
+
+/*
+ * Decrypt a cookie on the event loop into memory from the request pool, logging any failure
+ * Compressed cookies are decompressed once they have been authenticated, into a second allocation of the exact size
+ */
+ngx_int_t oauth_proxy_decryption_decrypt_cookie(ngx_http_request_t *request, ngx_str_t *plaintext, const ngx_str_t *ciphertext, const oauth_proxy_configuration_t *config, const ngx_str_t *prefix)
+{
+    u_char *buffer = NULL;
+    u_char error[OAUTH_PROXY_DECRYPTION_ERROR_SIZE];
+    ngx_str_t decrypted;
+    ngx_flag_t compressed = 0;
+    ngx_int_t ret_code = NGX_OK;
+
+    /* The cookie ciphertext size could represent a large JWT, so allocate memory dynamically
+       Every byte is written by the decoder before it is read, so the memory does not need to be zeroed */
+    buffer = ngx_pnalloc(request->pool, ngx_base64_decoded_length(ciphertext->len));
+    if (buffer == NULL)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "Problem encountered allocating memory for ciphertext bytes");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    oauth_proxy_utils_count_memory(request, OAUTH_PROXY_MEMORY_CIPHERTEXT, ngx_base64_decoded_length(ciphertext->len));
+    ret_code = oauth_proxy_decryption_decrypt_buffer(buffer, &decrypted, ciphertext, config, prefix, 1, &compressed, error);
+    if (ret_code != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "%s", error);
+        return ret_code;
+    }
+
+    if (compressed)
+    {
+        return oauth_proxy_compression_inflate(request, plaintext, &decrypted, config, prefix);
+    }
+
+    *plaintext = decrypted;
+    return NGX_OK;
+}
+
+/*
+ * Performs AES256-GCM authenticated decryption of secure cookies, using the precomputed cipher for the cookie's key
+ * The cipher comes from the backend chosen when NGINX is configured, in oauth_proxy_cipher_openssl.c or oauth_proxy_cipher_libsodium.c
+ *
+ * Version 1 cookies are version | IV | ciphertext | tag and use the first configured key
+ * Version 2 cookies are version | key id | IV | ciphertext | tag, and the key id selects the key directly
+ * Version 3 cookies have the same layout as version 2, but their plaintext is compressed, as described in oauth_proxy_compression.c
+ *
+ * A single buffer is used: the cookie is decoded into it, then decrypted in place, and an optional prefix such as
+ * 'Bearer ' is written over the header bytes, so that the result can be used as a header value without copying
+ *
+ * This does not allocate from a pool or log, so that it can also run in a thread pool, where the worker's shared cipher
+ * context cannot be used and the backend uses a context of its own instead. Failures are described in the error buffer
+ *
+ * Compressed plaintext is returned without the prefix and with the compressed flag set, for the caller to decompress
+ */
+ngx_int_t oauth_proxy_decryption_decrypt_buffer(u_char *buffer, ngx_str_t *plaintext, const ngx_str_t *ciphertext, const oauth_proxy_configuration_t *config, const ngx_str_t *prefix, ngx_flag_t shared_context, ngx_flag_t *compressed, u_char *error)
+{
+    oauth_proxy_encryption_key_t *key = NULL;
+    u_char *ciphertext_bytes = buffer;
+    u_char *plaintext_bytes = NULL;
+    size_t decoded_size = 0;
+    size_t header_size = VERSION_SIZE + GCM_IV_SIZE;
+    int ciphertext_byte_size = 0;
+    int plaintext_len  = 0;
+    ngx_int_t cipher_result = NGX_OK;
+    ngx_int_t ret_code = NGX_OK;
+
+    /* Reject cookies that are too small to hold the version, IV and tag before doing any other work */
     if (ret_code == NGX_OK)
     {
-        ret_code = oauth_proxy_encoding_bytes_from_hex(encryption_key_bytes, encryption_key_hex->data, encryption_key_hex->len);
-        if (ret_code != 0)
+        if (ngx_base64_decoded_length(ciphertext->len) <= VERSION_SIZE + GCM_IV_SIZE + GCM_TAG_SIZE)
         {
-            ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "The configured encryption key is not valid hex");
+            set_error(error, "Invalid data length after decoding from base64");
             ret_code = NGX_HTTP_UNAUTHORIZED;
         }
     }
 
-    /* The cookie ciphertext size could represent a large JWT, so allocate memory dynamically
-       In base64url the plaintext is always smaller than the ciphertext, but here we just ensure sufficient size */
     if (ret_code == NGX_OK)
     {
-        ciphertext_bytes = ngx_pcalloc(request->pool, ciphertext->len + 1);
-        if (ciphertext_bytes == NULL)
+        if (prefix != NULL && prefix->len > VERSION_SIZE + GCM_IV_SIZE)
         {
-            ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "Problem encountered allocating memory for ciphertext bytes");
+            set_error(error, "The decrypted value prefix is too long");
             ret_code = NGX_HTTP_INTERNAL_SERVER_ERROR;
         }
     }
 
-    /* Decode and get the exact encrypted byte sizes */
+    /* Decode the exact cookie length, since cookie values are not null terminated, then get the exact encrypted byte sizes */
     if (ret_code == NGX_OK)
     {
-        decoded_size = oauth_proxy_encoding_base64_url_decode(ciphertext_bytes, ciphertext->data);
-        ciphertext_byte_size = decoded_size - (VERSION_SIZE + GCM_IV_SIZE + GCM_TAG_SIZE);
-        if (ciphertext_byte_size <= 0)
+        if (oauth_proxy_encoding_base64_url_decode(ciphertext_bytes, &decoded_size, ciphertext->data, ciphertext->len) != NGX_OK)
         {
-            ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "Invalid data length after decoding from base64");
+            set_error(error, "The received cookie is not valid base64url");
             ret_code = NGX_HTTP_UNAUTHORIZED;
         }
-        else
-        {
-            if (ciphertext_bytes[0] != CURRENT_VERSION)
-            {
-                ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "The received cookie has an invalid format");
-                ret_code = NGX_HTTP_UNAUTHORIZED;
-            }
-        }
     }
 
     if (ret_code == NGX_OK)
     {
-        plaintext_bytes = ngx_pcalloc(request->pool, ciphertext_byte_size + 1);
-        if (plaintext_bytes == NULL)
-        {
-            ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "Problem encountered allocating memory for plaintext bytes");
-            ret_code = NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
+        ret_code = select_key(ciphertext_bytes, config, &key, &header_size, error);
     }
 
     if (ret_code == NGX_OK)
     {
-        offset = VERSION_SIZE;
-        memcpy(iv_bytes, ciphertext_bytes + offset, GCM_IV_SIZE);
-
-        offset = decoded_size - GCM_TAG_SIZE;
-        memcpy(tag_bytes, ciphertext_bytes + offset, GCM_TAG_SIZE);
+        ciphertext_byte_size = (int)decoded_size - (int)(header_size + GCM_TAG_SIZE);
+        if (ciphertext_byte_size <= 0)
+        {
+            set_error(error, "Invalid data length after decoding from base64");
+            ret_code = NGX_HTTP_UNAUTHORIZED;
+        }
     }
 
     if (ret_code == NGX_OK)
     {
-        /* With this algorithm, this method will read precisely 32 bytes from the 4th parameter and 12 bytes from the 5th */
-        evp_result = EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, encryption_key_bytes, iv_bytes);
-        if (evp_result == 0)
+        if (key->cipher == NULL)
         {
-            ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "Unable to initialize the decryption context, error number: %d", evp_result);
-            ret_code = NGX_HTTP_UNAUTHORIZED;
+            set_error(error, "The decryption cipher has not been initialized");
+            ret_code = NGX_HTTP_INTERNAL_SERVER_ERROR;
         }
     }
 
     if (ret_code == NGX_OK)
     {
-        offset = VERSION_SIZE + GCM_IV_SIZE;
-        evp_result = EVP_DecryptUpdate(ctx, plaintext_bytes, &len, ciphertext_bytes + offset, ciphertext_byte_size);
-        if (evp_result == 0)
+        /* GCM supports exactly overlapping input and output, so the plaintext replaces the ciphertext, between the IV and the tag */
+        plaintext_bytes = ciphertext_bytes + header_size;
+        cipher_result = oauth_proxy_cipher_decrypt(key, shared_context, plaintext_bytes - GCM_IV_SIZE, plaintext_bytes, ciphertext_byte_size, plaintext_bytes + ciphertext_byte_size);
+        if (cipher_result == NGX_ERROR)
+        {
+            set_error(error, "Unable to create the decryption cipher");
+            ret_code = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        else if (cipher_result != NGX_OK)
         {
-            ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "Problem encountered processing ciphertext, error number: %d", evp_result);
+            set_error(error, "Problem encountered decrypting data");
             ret_code = NGX_HTTP_UNAUTHORIZED;
         }
         else
         {
-            plaintext_len = len;
+            /* The terminator overwrites the first byte of the tag, which has already been checked */
+            plaintext_len = ciphertext_byte_size;
+            plaintext_bytes[plaintext_len] = 0;
         }
     }
 
     if (ret_code == NGX_OK)
     {
-        /* With this algorithm, this method will read precisely 16 bytes from the 4th parameter */
-        evp_result = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, GCM_TAG_SIZE, tag_bytes);
-        if (evp_result == 0)
+        *compressed = ciphertext_bytes[0] == COMPRESSED_VERSION;
+        if (prefix != NULL && !*compressed)
         {
-            ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "Problem encountered setting the message authentication code, error number: %d", evp_result);
+            plaintext_bytes -= prefix->len;
+            plaintext_len += prefix->len;
+            ngx_memcpy(plaintext_bytes, prefix->data, prefix->len);
+        }
+
+        plaintext->data = plaintext_bytes;
+        plaintext->len  = plaintext_len;
+    }
+
+    return ret_code;
+}
+
+/*
+ * Decrypt an access token that the token handler split across numbered cookies, whose values join to form one cookie
+ * Each block of characters is decoded into stack memory and passed straight to the cipher, so the joined ciphertext is
+ * never built, and the only allocation is the plaintext with its prefix, which is about one token's worth of memory
+ * Compressed tokens are decompressed after the tag has been verified, so that only authenticated data is inflated
+ */
+ngx_int_t oauth_proxy_decryption_decrypt_chunks(ngx_http_request_t *request, ngx_str_t *plaintext, const ngx_str_t *chunks, ngx_uint_t chunk_count, const oauth_proxy_configuration_t *config, const ngx_str_t *prefix)
+{
+    oauth_proxy_encryption_key_t *key = NULL;
+    u_char encoded[STREAM_BLOCK_SIZE];
+    u_char decoded[ngx_base64_decoded_length(STREAM_BLOCK_SIZE)];
+    u_char tag_bytes[GCM_TAG_SIZE];
+    u_char error[OAUTH_PROXY_DECRYPTION_ERROR_SIZE];
+    u_char *plaintext_bytes = NULL;
+    const ngx_str_t *last_chunk = NULL;
+    size_t prefix_len = prefix != NULL ? prefix->len : 0;
+    size_t padding = 0;
+    size_t coded_len = 0;
+    size_t decoded_size = 0;
+    size_t header_size = 0;
+    size_t ciphertext_end = 0;
+    size_t position = 0;
+    size_t encoded_len = 0;
+    size_t block_len = 0;
+    size_t block_offset = 0;
+    size_t take = 0;
+    size_t chunk_len = 0;
+    size_t expected_len = 0;
+    size_t chunk_offset = 0;
+    ngx_uint_t chunk_index = 0;
+    ngx_str_t decrypted;
+    ngx_flag_t compressed = 0;
+    size_t plaintext_len = 0;
+    ngx_int_t ret_code = NGX_OK;
+
+    /* Only the last chunk can end with padding, and the decoded size is known before any decoding */
+    last_chunk = &chunks[chunk_count - 1];
+    while (padding < last_chunk->len && last_chunk->data[last_chunk->len - 1 - padding] == '=')
+    {
+        padding++;
+    }
+
+    /* Padding anywhere else would be stripped from the end of a block, which would then decode short of the decoded size */
+    for (chunk_index = 0; chunk_index < chunk_count; chunk_index++)
+    {
+        chunk_len = chunks[chunk_index].len - (chunk_index == chunk_count - 1 ? padding : 0);
+        if (ngx_strlchr(chunks[chunk_index].data, chunks[chunk_index].data + chunk_len, '=') != NULL)
+        {
+            set_error(error, "The received cookie is not valid base64url");
             ret_code = NGX_HTTP_UNAUTHORIZED;
         }
+
+        coded_len += chunk_len;
     }
 
-    if (ret_code == NGX_OK)
+    chunk_index = 0;
+    decoded_size = (coded_len / 4) * 3 + (coded_len % 4 > 1 ? coded_len % 4 - 1 : 0);
+    if (ret_code == NGX_OK && (coded_len % 4 == 1 || decoded_size <= VERSION_SIZE + GCM_IV_SIZE + GCM_TAG_SIZE))
+    {
+        set_error(error, "Invalid data length after decoding from base64");
+        ret_code = NGX_HTTP_UNAUTHORIZED;
+    }
+
+    while (ret_code == NGX_OK && position < decoded_size)
     {
-        evp_result = EVP_DecryptFinal_ex(ctx, plaintext_bytes + plaintext_len, &len);
-        if (evp_result <= 0)
+        /* Blocks are whole groups of 4 characters except for the last, so each block decodes independently */
+        block_len = read_chunks(encoded, chunks, chunk_count, &chunk_index, &chunk_offset, ngx_min(coded_len - encoded_len, STREAM_BLOCK_SIZE));
+        encoded_len += block_len;
+        expected_len = encoded_len < coded_len ? (block_len / 4) * 3 : decoded_size - position;
+        if (oauth_proxy_encoding_base64_url_decode(decoded, &block_len, encoded, block_len) != NGX_OK)
         {
-            ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "Problem encountered decrypting data, error number: %d", evp_result);
+            set_error(error, "The received cookie is not valid base64url");
             ret_code = NGX_HTTP_UNAUTHORIZED;
+            break;
         }
-        else
+
+        /* Each block must move the position forward by its full size, so that a malformed cookie cannot stall the loop */
+        if (block_len == 0 || block_len != expected_len)
         {
-            plaintext_len += len;
-            plaintext_bytes[plaintext_len] = 0;
+            set_error(error, "Invalid data length after decoding from base64");
+            ret_code = NGX_HTTP_UNAUTHORIZED;
+            break;
+        }
+
+        block_offset = 0;
+        if (position == 0)
+        {
+            /* The first block always holds the whole header, since it holds 768 bytes or the whole cookie */
+            ret_code = select_key(decoded, config, &key, &header_size, error);
+            if (ret_code != NGX_OK)
+            {
+                break;
+            }
+
+            if (decoded_size <= header_size + GCM_TAG_SIZE)
+            {
+                set_error(error, "Invalid data length after decoding from base64");
+                ret_code = NGX_HTTP_UNAUTHORIZED;
+                break;
+            }
+
+            if (key->cipher == NULL)
+            {
+                set_error(error, "The decryption cipher has not been initialized");
+                ret_code = NGX_HTTP_INTERNAL_SERVER_ERROR;
+                break;
+            }
+
+            ciphertext_end = decoded_size - GCM_TAG_SIZE;
+            plaintext_bytes = ngx_pnalloc(request->pool, prefix_len + ciphertext_end - header_size + 1);
+            if (plaintext_bytes == NULL)
+            {
+                set_error(error, "Problem encountered allocating memory for plaintext bytes");
+                ret_code = NGX_HTTP_INTERNAL_SERVER_ERROR;
+                break;
+            }
+
+            oauth_proxy_utils_count_memory(request, OAUTH_PROXY_MEMORY_PLAINTEXT, prefix_len + ciphertext_end - header_size + 1);
+
+            if (oauth_proxy_cipher_begin(key, decoded + header_size - GCM_IV_SIZE) != NGX_OK)
+            {
+                set_error(error, "Unable to initialize the decryption context");
+                ret_code = NGX_HTTP_UNAUTHORIZED;
+                break;
+            }
+
+            compressed = decoded[0] == COMPRESSED_VERSION;
+            block_offset = header_size;
+        }
+
+        /* Bytes before the tag are ciphertext, which GCM decrypts as a stream into the plaintext */
+        if (position + block_offset < ciphertext_end)
+        {
+            take = ngx_min(block_len - block_offset, ciphertext_end - position - block_offset);
+            if (oauth_proxy_cipher_update(key, plaintext_bytes + prefix_len + plaintext_len, decoded + block_offset, take) != NGX_OK)
+            {
+                set_error(error, "Problem encountered processing ciphertext");
+                ret_code = NGX_HTTP_UNAUTHORIZED;
+                break;
+            }
+
+            plaintext_len += take;
+            block_offset += take;
         }
+
+        /* The tag can be split across two blocks */
+        if (block_offset < block_len)
+        {
+            ngx_memcpy(tag_bytes + position + block_offset - ciphertext_end, decoded + block_offset, block_len - block_offset);
+        }
+
+        position += block_len;
     }
 
     if (ret_code == NGX_OK)
     {
-        plaintext->data = plaintext_bytes;
-        plaintext->len  = plaintext_len;
+        if (oauth_proxy_cipher_finish(key, plaintext_bytes + prefix_len, plaintext_len, tag_bytes) != NGX_OK)
+        {
+            set_error(error, "Problem encountered decrypting data");
+            ret_code = NGX_HTTP_UNAUTHORIZED;
+        }
     }
 
-    if (ctx != NULL)
+    if (ret_code != NGX_OK)
     {
-        EVP_CIPHER_CTX_free(ctx);
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "%s", error);
+        return ret_code;
     }
 
-    return ret_code;
+    if (compressed)
+    {
+        decrypted.data = plaintext_bytes + prefix_len;
+        decrypted.len = plaintext_len;
+        return oauth_proxy_compression_inflate(request, plaintext, &decrypted, config, prefix);
+    }
+
+    plaintext_bytes[prefix_len + plaintext_len] = 0;
+    if (prefix_len > 0)
+    {
+        ngx_memcpy(plaintext_bytes, prefix->data, prefix_len);
+    }
+
+    plaintext->data = plaintext_bytes;
+    plaintext->len = prefix_len + plaintext_len;
+    return NGX_OK;
+}
+
+/*
+ * Select the key from the version and key id bytes, which is a table lookup rather than a trial decryption
+ */
+static ngx_int_t select_key(const u_char *header, const oauth_proxy_configuration_t *config, oauth_proxy_encryption_key_t **key, size_t *header_size, u_char *error)
+{
+    oauth_proxy_encryption_key_t *keys = NULL;
+
+    if (header[0] == ORIGINAL_VERSION)
+    {
+        keys = config->encryption_keys->elts;
+        *key = &keys[0];
+        *header_size = VERSION_SIZE + GCM_IV_SIZE;
+        return NGX_OK;
+    }
+
+    if (header[0] == KEY_ID_VERSION || header[0] == COMPRESSED_VERSION)
+    {
+        *key = config->encryption_keys_by_id[header[VERSION_SIZE]];
+        if (*key == NULL)
+        {
+            set_error(error, "The received cookie uses an unknown key id: %d", header[VERSION_SIZE]);
+            return NGX_HTTP_UNAUTHORIZED;
+        }
+
+        *header_size = VERSION_SIZE + KEY_ID_SIZE + GCM_IV_SIZE;
+        return NGX_OK;
+    }
+
+    set_error(error, "The received cookie has an invalid format");
+    return NGX_HTTP_UNAUTHORIZED;
+}
+
+/*
+ * Copy up to max_len characters from the chunks into a block, continuing from where the previous block ended
+ */
+static size_t read_chunks(u_char *encoded, const ngx_str_t *chunks, ngx_uint_t chunk_count, ngx_uint_t *chunk_index, size_t *chunk_offset, size_t max_len)
+{
+    size_t copied = 0;
+    size_t take = 0;
+
+    while (copied < max_len && *chunk_index < chunk_count)
+    {
+        take = ngx_min(max_len - copied, chunks[*chunk_index].len - *chunk_offset);
+        ngx_memcpy(encoded + copied, chunks[*chunk_index].data + *chunk_offset, take);
+        copied += take;
+        *chunk_offset += take;
+
+        if (*chunk_offset == chunks[*chunk_index].len)
+        {
+            (*chunk_index)++;
+            *chunk_offset = 0;
+        }
+    }
+
+    return copied;
+}
+
+/*
+ * Describe a failure for the caller to log, using the NGINX formatter, which does not allocate and is safe in threads
+ */
+static void set_error(u_char *error, const char *fmt, ...)
+{
+    u_char *last = NULL;
+    va_list args;
+
+    va_start(args, fmt);
+    last = ngx_vslprintf(error, error + OAUTH_PROXY_DECRYPTION_ERROR_SIZE - 1, fmt, args);
+    va_end(args);
+
+    *last = 0;
 }
@@ -0,0 +1,725 @@
+/*
+ *  Copyright 2022 Curity AB
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_string.h>
+#include "oauth_proxy.h"
+
+/* Workers check the file this often by default, in milliseconds */
+#define DEFAULT_INTERVAL 5000
+
+/* The file only holds keys and origins, so a larger file is most likely the wrong file */
+#define MAX_FILE_SIZE 1048576
+
+/* Each entry has a name, a value and an optional key identifier */
+#define MAX_ENTRY_WORDS 3
+
+/*
+ * A replaced set of keys and origins, which is freed once no thread pool decryption can still be using its keys
+ * The set loaded at startup has no pool, since it lives in configuration memory, so only its ciphers are freed
+ * The jobs count is for decryptions posted while the set was current, which are the only ones that can read the set
+ */
+typedef struct oauth_proxy_dynamic_retired_s
+{
+    ngx_pool_t *pool;
+    ngx_array_t *encryption_keys;
+    ngx_uint_t generation;
+    ngx_uint_t jobs;
+    struct oauth_proxy_dynamic_retired_s *next;
+} oauth_proxy_dynamic_retired_t;
+
+/*
+ * The entries from nginx.conf, which are combined with the file's entries on every load, and the per worker reload state
+ */
+struct oauth_proxy_dynamic_s
+{
+    oauth_proxy_configuration_t *config;
+    ngx_array_t *static_keys;
+    ngx_array_t *static_origins;
+    ngx_file_uniq_t uniq;
+    time_t mtime;
+    off_t size;
+    ngx_flag_t stat_failed;
+    ngx_pool_t *pool;
+    ngx_uint_t generation;
+    ngx_uint_t jobs;
+    oauth_proxy_dynamic_retired_t *retired;
+    ngx_event_t event;
+};
+
+/* Forward declarations */
+static void check_file(ngx_event_t *event);
+static void reload(oauth_proxy_dynamic_t *dynamic, ngx_log_t *log);
+static ngx_int_t load_file(ngx_conf_t *main_config, oauth_proxy_dynamic_t *dynamic, oauth_proxy_configuration_t *config);
+static ngx_int_t read_file(ngx_conf_t *main_config, const ngx_str_t *file_name, ngx_str_t *contents);
+static ngx_int_t parse_entries(ngx_conf_t *main_config, const ngx_str_t *contents, ngx_array_t *keys, ngx_array_t *origins);
+static ngx_uint_t split_words(u_char *start, u_char *end, ngx_str_t *words);
+static ngx_int_t add_key(ngx_conf_t *main_config, ngx_array_t *keys, const ngx_str_t *value, const ngx_str_t *id_str);
+static ngx_int_t copy_entries(ngx_array_t *target, const ngx_array_t *source);
+static ngx_int_t initialize_ciphers(ngx_array_t *keys, ngx_pool_t *pool, ngx_log_t *log);
+static void free_ciphers(ngx_array_t *keys);
+static ngx_flag_t record_file_info(oauth_proxy_dynamic_t *dynamic, ngx_file_info_t *file_info);
+static void release_retired(oauth_proxy_dynamic_t *dynamic, ngx_flag_t exiting);
+
+/*
+ * Parse the oauth_proxy_dynamic_config directive, which names a file of keys and origins and how often workers check it
+ */
+char *oauth_proxy_dynamic_configure(ngx_conf_t *main_config, ngx_command_t *command, void *conf)
+{
+    oauth_proxy_configuration_t *config = conf;
+    ngx_str_t *value = NULL;
+    ngx_str_t interval_str;
+    ngx_int_t interval = DEFAULT_INTERVAL;
+    ngx_uint_t i = 0;
+
+    if (config->dynamic_config_file.data != NULL)
+    {
+        return "is duplicate";
+    }
+
+    value = main_config->args->elts;
+    for (i = 2; i < main_config->args->nelts; i++)
+    {
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0)
+        {
+            interval_str.data = value[i].data + 9;
+            interval_str.len = value[i].len - 9;
+
+            interval = ngx_parse_time(&interval_str, 0);
+            if (interval == NGX_ERROR || interval == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The oauth_proxy_dynamic_config interval is invalid: \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The oauth_proxy_dynamic_config directive has an invalid parameter: \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    /* Relative paths are relative to the directory of nginx.conf, as for other NGINX files */
+    config->dynamic_config_file = value[1];
+    if (ngx_conf_full_name(main_config->cycle, &config->dynamic_config_file, 1) != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    config->dynamic_config_interval = (ngx_msec_t)interval;
+    return NGX_CONF_OK;
+}
+
+/*
+ * A parent's keys and origins include its file's entries, which a child loads for itself, so the child only inherits those from nginx.conf
+ */
+void oauth_proxy_dynamic_merge(oauth_proxy_configuration_t *child_config, const oauth_proxy_configuration_t *parent_config)
+{
+    if (parent_config->dynamic == NULL)
+    {
+        return;
+    }
+
+    if (child_config->encryption_keys == NGX_CONF_UNSET_PTR)
+    {
+        child_config->encryption_keys = parent_config->dynamic->static_keys;
+    }
+
+    if (child_config->trusted_web_origins == NGX_CONF_UNSET_PTR)
+    {
+        child_config->trusted_web_origins = parent_config->dynamic->static_origins;
+    }
+}
+
+/*
+ * Load the file when NGINX starts up, before the location's keys and origins are validated and compiled
+ * A file that cannot be loaded prevents startup, in the same way as an invalid directive
+ */
+ngx_int_t oauth_proxy_dynamic_initialize(ngx_conf_t *main_config, oauth_proxy_configuration_t *config)
+{
+    oauth_proxy_dynamic_t *dynamic = NULL;
+    ngx_file_info_t file_info;
+
+    if (!config->enabled || config->dynamic_config_file.len == 0)
+    {
+        return NGX_OK;
+    }
+
+    dynamic = ngx_pcalloc(main_config->pool, sizeof(oauth_proxy_dynamic_t));
+    if (dynamic == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    dynamic->config = config;
+    dynamic->static_keys = config->encryption_keys;
+    dynamic->static_origins = config->trusted_web_origins;
+
+    if (ngx_file_info(config->dynamic_config_file.data, &file_info) == NGX_FILE_ERROR)
+    {
+        ngx_conf_log_error(NGX_LOG_WARN, main_config, ngx_errno, "The oauth_proxy_dynamic_config file could not be found: \"%V\"", &config->dynamic_config_file);
+        return NGX_ERROR;
+    }
+
+    record_file_info(dynamic, &file_info);
+    if (load_file(main_config, dynamic, config) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    config->dynamic = dynamic;
+    return NGX_OK;
+}
+
+/*
+ * Start checking the file in each worker, whose timer does not keep a worker alive during a graceful shutdown
+ */
+void oauth_proxy_dynamic_init_process(ngx_cycle_t *cycle, oauth_proxy_configuration_t *config)
+{
+    oauth_proxy_dynamic_t *dynamic = config->dynamic;
+
+    if (dynamic == NULL || (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE))
+    {
+        return;
+    }
+
+    dynamic->event.handler = check_file;
+    dynamic->event.data = dynamic;
+    dynamic->event.log = cycle->log;
+    dynamic->event.cancelable = 1;
+    ngx_add_timer(&dynamic->event, config->dynamic_config_interval);
+}
+
+/*
+ * Called from the exit process hook, after the ciphers of the current keys have been freed
+ */
+void oauth_proxy_dynamic_exit_process(oauth_proxy_configuration_t *config)
+{
+    oauth_proxy_dynamic_t *dynamic = config->dynamic;
+
+    if (dynamic == NULL)
+    {
+        return;
+    }
+
+    release_retired(dynamic, 1);
+    if (dynamic->pool != NULL)
+    {
+        ngx_destroy_pool(dynamic->pool);
+        dynamic->pool = NULL;
+    }
+}
+
+/*
+ * Count a thread pool decryption against the current set, and return the set's generation, which is passed back when the job completes
+ */
+ngx_uint_t oauth_proxy_dynamic_acquire(const oauth_proxy_configuration_t *config)
+{
+    oauth_proxy_dynamic_t *dynamic = config->dynamic;
+
+    if (dynamic == NULL)
+    {
+        return 0;
+    }
+
+    dynamic->jobs++;
+    return dynamic->generation;
+}
+
+/*
+ * Called on the event loop when a thread pool decryption completes, for the set that was current when it was posted
+ */
+void oauth_proxy_dynamic_release(const oauth_proxy_configuration_t *config, ngx_uint_t generation)
+{
+    oauth_proxy_dynamic_t *dynamic = config->dynamic;
+    oauth_proxy_dynamic_retired_t *retired = NULL;
+
+    if (dynamic == NULL)
+    {
+        return;
+    }
+
+    if (generation == dynamic->generation)
+    {
+        dynamic->jobs--;
+        return;
+    }
+
+    for (retired = dynamic->retired; retired != NULL; retired = retired->next)
+    {
+        if (retired->generation == generation)
+        {
+            retired->jobs--;
+            return;
+        }
+    }
+}
+
+/*
+ * Runs on the event loop, and reloads the file when its identity, size or modification time has changed
+ */
+static void check_file(ngx_event_t *event)
+{
+    oauth_proxy_dynamic_t *dynamic = event->data;
+    ngx_file_info_t file_info;
+
+    if (ngx_exiting || ngx_quit || ngx_terminate)
+    {
+        return;
+    }
+
+    if (ngx_file_info(dynamic->config->dynamic_config_file.data, &file_info) == NGX_FILE_ERROR)
+    {
+        /* The file can be missing briefly while it is replaced, so this is only logged once until it returns */
+        if (!dynamic->stat_failed)
+        {
+            ngx_log_error(NGX_LOG_WARN, event->log, ngx_errno, "The oauth_proxy_dynamic_config file could not be found: \"%V\"", &dynamic->config->dynamic_config_file);
+            dynamic->stat_failed = 1;
+        }
+    }
+    else
+    {
+        dynamic->stat_failed = 0;
+        if (record_file_info(dynamic, &file_info))
+        {
+            reload(dynamic, event->log);
+        }
+    }
+
+    release_retired(dynamic, 0);
+    ngx_add_timer(event, dynamic->config->dynamic_config_interval);
+}
+
+/*
+ * Build and compile the new set in memory of its own, then publish it with plain pointer stores, so that requests never take a lock
+ * Requests run on this event loop, so none can see a partly published set, and the previous set is retired rather than freed
+ */
+static void reload(oauth_proxy_dynamic_t *dynamic, ngx_log_t *log)
+{
+    oauth_proxy_configuration_t *config = dynamic->config;
+    oauth_proxy_configuration_t next;
+    oauth_proxy_dynamic_retired_t *retired = NULL;
+    ngx_conf_t main_config;
+    ngx_pool_t *pool = NULL;
+    ngx_pool_t *temp_pool = NULL;
+    ngx_int_t ret_code = NGX_ERROR;
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+    temp_pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+    retired = ngx_alloc(sizeof(oauth_proxy_dynamic_retired_t), log);
+
+    if (pool != NULL && temp_pool != NULL && retired != NULL)
+    {
+        /* Configuration errors are logged as warnings to the error log, since there is no file and line to report */
+        ngx_memzero(&main_config, sizeof(ngx_conf_t));
+        main_config.pool = pool;
+        main_config.temp_pool = temp_pool;
+        main_config.cycle = (ngx_cycle_t *)ngx_cycle;
+        main_config.log = log;
+
+        next = *config;
+        ret_code = load_file(&main_config, dynamic, &next);
+        if (ret_code == NGX_OK)
+        {
+            ret_code = oauth_proxy_configuration_compile_credentials(&main_config, &next);
+        }
+
+        if (ret_code == NGX_OK)
+        {
+            ret_code = initialize_ciphers(next.encryption_keys, pool, log);
+        }
+    }
+
+    if (temp_pool != NULL)
+    {
+        ngx_destroy_pool(temp_pool);
+    }
+
+    if (ret_code != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_WARN, log, 0, "The oauth_proxy_dynamic_config file was not loaded, so the previous keys and origins remain in use: \"%V\"", &config->dynamic_config_file);
+        if (pool != NULL)
+        {
+            ngx_destroy_pool(pool);
+        }
+
+        if (retired != NULL)
+        {
+            ngx_free(retired);
+        }
+
+        return;
+    }
+
+    retired->pool = dynamic->pool;
+    retired->encryption_keys = config->encryption_keys;
+    retired->generation = dynamic->generation;
+    retired->jobs = dynamic->jobs;
+    retired->next = dynamic->retired;
+    dynamic->retired = retired;
+    dynamic->generation++;
+    dynamic->jobs = 0;
+
+    /* Thread pool decryptions read the keys without the event loop, so the new set must be complete before it is visible */
+    ngx_memory_barrier();
+
+    config->encryption_keys = next.encryption_keys;
+    config->encryption_keys_by_id = next.encryption_keys_by_id;
+    config->encryption_key_id = next.encryption_key_id;
+    config->trusted_web_origins = next.trusted_web_origins;
+    config->trusted_origin_schemes = next.trusted_origin_schemes;
+    dynamic->pool = pool;
+
+    ngx_log_error(NGX_LOG_NOTICE, log, 0, "The oauth_proxy_dynamic_config file was loaded with %ui keys and %ui trusted origins: \"%V\"",
+        config->encryption_keys->nelts, config->trusted_web_origins->nelts, &config->dynamic_config_file);
+}
+
+/*
+ * Combine the entries from nginx.conf with those from the file, into new arrays that are set on the configuration
+ */
+static ngx_int_t load_file(ngx_conf_t *main_config, oauth_proxy_dynamic_t *dynamic, oauth_proxy_configuration_t *config)
+{
+    ngx_array_t *keys = NULL;
+    ngx_array_t *origins = NULL;
+    ngx_str_t contents;
+
+    keys = ngx_array_create(main_config->pool, 4, sizeof(oauth_proxy_encryption_key_t));
+    origins = ngx_array_create(main_config->pool, 4, sizeof(ngx_str_t));
+    if (keys == NULL || origins == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    if (copy_entries(keys, dynamic->static_keys) != NGX_OK || copy_entries(origins, dynamic->static_origins) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (read_file(main_config, &config->dynamic_config_file, &contents) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (parse_entries(main_config, &contents, keys, origins) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    config->encryption_keys = keys;
+    config->trusted_web_origins = origins;
+    return NGX_OK;
+}
+
+/*
+ * Read the whole file into memory from the pool, since key and origin strings refer to it for as long as they are in use
+ */
+static ngx_int_t read_file(ngx_conf_t *main_config, const ngx_str_t *file_name, ngx_str_t *contents)
+{
+    ngx_file_info_t file_info;
+    ngx_fd_t fd = NGX_INVALID_FILE;
+    ssize_t bytes_read = 0;
+    size_t size = 0;
+    ngx_int_t ret_code = NGX_ERROR;
+
+    fd = ngx_open_file(file_name->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE)
+    {
+        ngx_conf_log_error(NGX_LOG_WARN, main_config, ngx_errno, "The oauth_proxy_dynamic_config file could not be opened: \"%V\"", file_name);
+        return NGX_ERROR;
+    }
+
+    if (ngx_fd_info(fd, &file_info) == NGX_FILE_ERROR)
+    {
+        ngx_conf_log_error(NGX_LOG_WARN, main_config, ngx_errno, "The oauth_proxy_dynamic_config file could not be read: \"%V\"", file_name);
+    }
+    else if (ngx_file_size(&file_info) > MAX_FILE_SIZE)
+    {
+        ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The oauth_proxy_dynamic_config file is larger than %d bytes: \"%V\"", MAX_FILE_SIZE, file_name);
+    }
+    else
+    {
+        contents->len = (size_t)ngx_file_size(&file_info);
+        contents->data = ngx_pnalloc(main_config->pool, contents->len + 1);
+        ret_code = contents->data != NULL ? NGX_OK : NGX_ERROR;
+
+        while (ret_code == NGX_OK && size < contents->len)
+        {
+            bytes_read = ngx_read_fd(fd, contents->data + size, contents->len - size);
+            if (bytes_read <= 0)
+            {
+                ngx_conf_log_error(NGX_LOG_WARN, main_config, bytes_read < 0 ? ngx_errno : 0, "The oauth_proxy_dynamic_config file could not be read: \"%V\"", file_name);
+                ret_code = NGX_ERROR;
+                break;
+            }
+
+            size += (size_t)bytes_read;
+        }
+    }
+
+    ngx_close_file(fd);
+    return ret_code;
+}
+
+/*
+ * Read one entry per line, as either "encryption_key <hex> [id=<n>]" or "trusted_web_origin <origin>"
+ * Blank lines and lines that start with # are ignored, and values are validated when the location is compiled
+ */
+static ngx_int_t parse_entries(ngx_conf_t *main_config, const ngx_str_t *contents, ngx_array_t *keys, ngx_array_t *origins)
+{
+    ngx_str_t words[MAX_ENTRY_WORDS];
+    ngx_str_t *origin = NULL;
+    u_char *p = contents->data;
+    u_char *last = contents->data + contents->len;
+    u_char *line_end = NULL;
+    ngx_uint_t count = 0;
+    ngx_uint_t line = 0;
+
+    while (p < last)
+    {
+        line++;
+        line_end = ngx_strlchr(p, last, '\n');
+        if (line_end == NULL)
+        {
+            line_end = last;
+        }
+
+        count = split_words(p, line_end, words);
+        p = line_end + 1;
+
+        if (count == 0 || words[0].data[0] == '#')
+        {
+            continue;
+        }
+
+        if (count <= MAX_ENTRY_WORDS && count >= 2 && words[0].len == 14 && ngx_strncmp(words[0].data, "encryption_key", 14) == 0)
+        {
+            if (add_key(main_config, keys, &words[1], count == 3 ? &words[2] : NULL) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            continue;
+        }
+
+        if (count == 2 && words[0].len == 18 && ngx_strncmp(words[0].data, "trusted_web_origin", 18) == 0)
+        {
+            origin = ngx_array_push(origins);
+            if (origin == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+            *origin = words[1];
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The oauth_proxy_dynamic_config file has an invalid entry on line %ui", line);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * Find the words of a line, which are separated by spaces or tabs, and return how many there are even when there are too many to store
+ */
+static ngx_uint_t split_words(u_char *start, u_char *end, ngx_str_t *words)
+{
+    u_char *p = start;
+    u_char *word_start = NULL;
+    ngx_uint_t count = 0;
+
+    while (p < end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == CR))
+        {
+            p++;
+        }
+
+        if (p == end)
+        {
+            break;
+        }
+
+        word_start = p;
+        while (p < end && *p != ' ' && *p != '\t' && *p != CR)
+        {
+            p++;
+        }
+
+        if (count < MAX_ENTRY_WORDS)
+        {
+            words[count].data = word_start;
+            words[count].len = p - word_start;
+        }
+
+        count++;
+    }
+
+    return count;
+}
+
+/*
+ * Add a key in the same way as the oauth_proxy_encryption_key directive, where the id defaults to 0
+ */
+static ngx_int_t add_key(ngx_conf_t *main_config, ngx_array_t *keys, const ngx_str_t *value, const ngx_str_t *id_str)
+{
+    oauth_proxy_encryption_key_t *key = NULL;
+    ngx_int_t id = 0;
+
+    if (id_str != NULL)
+    {
+        if (id_str->len <= 3 || ngx_strncmp(id_str->data, "id=", 3) != 0)
+        {
+            ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The oauth_proxy_dynamic_config file has an invalid encryption_key parameter: \"%V\"", id_str);
+            return NGX_ERROR;
+        }
+
+        id = ngx_atoi(id_str->data + 3, id_str->len - 3);
+        if (id == NGX_ERROR || id >= OAUTH_PROXY_MAX_KEY_IDS)
+        {
+            ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The encryption_key id must be between 0 and 255: \"%V\"", id_str);
+            return NGX_ERROR;
+        }
+    }
+
+    key = ngx_array_push(keys);
+    if (key == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(key, sizeof(oauth_proxy_encryption_key_t));
+    key->encryption_key = *value;
+    key->id = (ngx_uint_t)id;
+    return NGX_OK;
+}
+
+/*
+ * Copy the entries from nginx.conf, whose key bytes and ciphers are filled in again for the new set
+ */
+static ngx_int_t copy_entries(ngx_array_t *target, const ngx_array_t *source)
+{
+    void *elements = NULL;
+
+    if (source == NULL || source->nelts == 0)
+    {
+        return NGX_OK;
+    }
+
+    elements = ngx_array_push_n(target, source->nelts);
+    if (elements == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(elements, source->elts, source->nelts * source->size);
+    return NGX_OK;
+}
+
+/*
+ * Prepare the ciphers for a new set of keys, which are allocated from the set's own pool
+ */
+static ngx_int_t initialize_ciphers(ngx_array_t *keys, ngx_pool_t *pool, ngx_log_t *log)
+{
+    oauth_proxy_encryption_key_t *key_list = keys->elts;
+    ngx_cycle_t cycle;
+    ngx_uint_t i = 0;
+
+    /* Cipher initialization only uses the cycle's pool and log */
+    ngx_memzero(&cycle, sizeof(ngx_cycle_t));
+    cycle.pool = pool;
+    cycle.log = log;
+
+    for (i = 0; i < keys->nelts; i++)
+    {
+        key_list[i].cipher = NULL;
+    }
+
+    for (i = 0; i < keys->nelts; i++)
+    {
+        if (oauth_proxy_cipher_initialize(&cycle, &key_list[i]) != NGX_OK)
+        {
+            free_ciphers(keys);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+static void free_ciphers(ngx_array_t *keys)
+{
+    oauth_proxy_encryption_key_t *key_list = keys->elts;
+    ngx_uint_t i = 0;
+
+    for (i = 0; i < keys->nelts; i++)
+    {
+        oauth_proxy_cipher_free(&key_list[i]);
+    }
+}
+
+/*
+ * Remember the file's identity, size and modification time, and report whether any have changed
+ * A file replaced by a rename always has a new identity, even when it has the same size and modification time
+ */
+static ngx_flag_t record_file_info(oauth_proxy_dynamic_t *dynamic, ngx_file_info_t *file_info)
+{
+    ngx_flag_t changed = 0;
+
+    changed = dynamic->uniq != ngx_file_uniq(file_info) ||
+              dynamic->mtime != ngx_file_mtime(file_info) ||
+              dynamic->size != ngx_file_size(file_info);
+
+    dynamic->uniq = ngx_file_uniq(file_info);
+    dynamic->mtime = ngx_file_mtime(file_info);
+    dynamic->size = ngx_file_size(file_info);
+    return changed;
+}
+
+/*
+ * A thread reads a location's keys when it runs, so a job may use any set published after it was posted, but never an older one
+ * Sets are listed from newest to oldest, and those older than the oldest set with running jobs are freed
+ */
+static void release_retired(oauth_proxy_dynamic_t *dynamic, ngx_flag_t exiting)
+{
+    oauth_proxy_dynamic_retired_t **unused = &dynamic->retired;
+    oauth_proxy_dynamic_retired_t *retired = NULL;
+
+    for (retired = dynamic->retired; retired != NULL && !exiting; retired = retired->next)
+    {
+        if (retired->jobs > 0)
+        {
+            unused = &retired->next;
+        }
+    }
+
+    while (*unused != NULL)
+    {
+        retired = *unused;
+        *unused = retired->next;
+
+        free_ciphers(retired->encryption_keys);
+        if (retired->pool != NULL)
+        {
+            ngx_destroy_pool(retired->pool);
+        }
+
+        ngx_free(retired);
+    }
+}
@@ -67,53 +67,266 @@ static const u_char pr2six[256] =
     64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64
 };
 
+/* Forward declarations */
+static size_t decode_blocks_scalar(u_char *bufplain, const u_char *bufcoded, size_t coded_len, ngx_flag_t *invalid);
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define OAUTH_PROXY_SIMD_BASE64 1
+#include <immintrin.h>
+static size_t decode_blocks_sse41(u_char *bufplain, const u_char *bufcoded, size_t coded_len, ngx_flag_t *invalid);
+static size_t decode_blocks_avx2(u_char *bufplain, const u_char *bufcoded, size_t coded_len, ngx_flag_t *invalid);
+#endif
+
+/* The block decoder for the current CPU, which processes whole 4 character groups and returns the input consumed */
+typedef size_t (*decode_blocks_pt)(u_char *bufplain, const u_char *bufcoded, size_t coded_len, ngx_flag_t *invalid);
+static decode_blocks_pt decode_blocks = decode_blocks_scalar;
+
+/*
+ * Select the fastest block decoder that the CPU supports, which is called once per worker
+ */
+void oauth_proxy_encoding_initialize(void)
+{
+#ifdef OAUTH_PROXY_SIMD_BASE64
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+        decode_blocks = decode_blocks_avx2;
+    }
+    else if (__builtin_cpu_supports("sse4.1"))
+    {
+        decode_blocks = decode_blocks_sse41;
+    }
+#endif
+}
+
 /*
- * Decode bytes from base64url
+ * Decode bytes from base64url, reading exactly coded_len characters and failing for any character outside the alphabet
+ * The output buffer must have space for ngx_base64_decoded_length(coded_len) bytes
  */
-int oauth_proxy_encoding_base64_url_decode(u_char *bufplain, const u_char *bufcoded)
+ngx_int_t oauth_proxy_encoding_base64_url_decode(u_char *bufplain, size_t *decoded_len, const u_char *bufcoded, size_t coded_len)
 {
-    int nbytesdecoded = 0;
     const u_char *bufin = NULL;
     u_char *bufout = NULL;
-    int nprbytes = 0;
+    size_t consumed = 0;
+    ngx_flag_t invalid = 0;
+    u_char a = 0, b = 0, c = 0;
 
-    bufin = bufcoded;
-    while (pr2six[*(bufin++)] <= 63)
-        ;
-    
-    nprbytes = (bufin - bufcoded) - 1;
-    nbytesdecoded = (((int)nprbytes + 3) / 4) * 3;
+    /* Tolerate padding, though base64url encoders usually omit it */
+    while (coded_len > 0 && bufcoded[coded_len - 1] == '=')
+    {
+        coded_len--;
+    }
 
-    bufout = bufplain;
-    bufin = bufcoded;
+    if (coded_len % 4 == 1)
+    {
+        return NGX_ERROR;
+    }
 
-    while (nprbytes > 4)
+    consumed = decode_blocks(bufplain, bufcoded, coded_len, &invalid);
+    if (invalid)
     {
-        *(bufout++) = (u_char) (pr2six[*bufin] << 2 | pr2six[bufin[1]] >> 4);
-        *(bufout++) = (u_char) (pr2six[bufin[1]] << 4 | pr2six[bufin[2]] >> 2);
-        *(bufout++) = (u_char) (pr2six[bufin[2]] << 6 | pr2six[bufin[3]]);
-        bufin += 4;
-        nprbytes -= 4;
+        return NGX_ERROR;
     }
 
-    if (nprbytes > 1)
+    /* The scalar decoder finishes any groups that the vectorized decoders left, along with the final partial group */
+    consumed += decode_blocks_scalar(bufplain + (consumed / 4) * 3, bufcoded + consumed, coded_len - consumed, &invalid);
+    if (invalid)
     {
-	    *(bufout++) = (u_char) (pr2six[*bufin] << 2 | pr2six[bufin[1]] >> 4);
+        return NGX_ERROR;
     }
-    if (nprbytes > 2)
+
+    bufin = bufcoded + consumed;
+    bufout = bufplain + (consumed / 4) * 3;
+
+    if (coded_len - consumed > 1)
     {
-	    *(bufout++) = (u_char) (pr2six[bufin[1]] << 4 | pr2six[bufin[2]] >> 2);
+        a = pr2six[bufin[0]];
+        b = pr2six[bufin[1]];
+        if ((a | b) > 63)
+        {
+            return NGX_ERROR;
+        }
+
+        *(bufout++) = (u_char) (a << 2 | b >> 4);
+
+        if (coded_len - consumed > 2)
+        {
+            c = pr2six[bufin[2]];
+            if (c > 63)
+            {
+                return NGX_ERROR;
+            }
+
+            *(bufout++) = (u_char) (b << 4 | c >> 2);
+        }
     }
-    if (nprbytes > 3)
+
+    *decoded_len = bufout - bufplain;
+    return NGX_OK;
+}
+
+/*
+ * Decode whole groups of 4 characters with the lookup table, flagging characters outside the alphabet
+ */
+static size_t decode_blocks_scalar(u_char *bufplain, const u_char *bufcoded, size_t coded_len, ngx_flag_t *invalid)
+{
+    const u_char *bufin = bufcoded;
+    const u_char *end = bufcoded + (coded_len / 4) * 4;
+    u_char *bufout = bufplain;
+    u_char a = 0, b = 0, c = 0, d = 0;
+
+    while (bufin < end)
     {
-	    *(bufout++) = (u_char) (pr2six[bufin[2]] << 6 | pr2six[bufin[3]]);
+        a = pr2six[bufin[0]];
+        b = pr2six[bufin[1]];
+        c = pr2six[bufin[2]];
+        d = pr2six[bufin[3]];
+
+        /* Valid values are 0 to 63, so any invalid character sets the 64 bit */
+        if ((a | b | c | d) > 63)
+        {
+            *invalid = 1;
+            break;
+        }
+
+        *(bufout++) = (u_char) (a << 2 | b >> 4);
+        *(bufout++) = (u_char) (b << 4 | c >> 2);
+        *(bufout++) = (u_char) (c << 6 | d);
+        bufin += 4;
     }
 
-    nbytesdecoded -= (4 - nprbytes) & 3;
-    bufplain[nbytesdecoded] = '\0';
-    return nbytesdecoded;
+    return bufin - bufcoded;
 }
 
+#ifdef OAUTH_PROXY_SIMD_BASE64
+
+/*
+ * Translate 16 base64url characters to their 6 bit values, returning a mask with a bit set for each valid character
+ * Signed comparisons are used, so bytes above 127 are never in range and are rejected
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i translate_sse41(__m128i input, int *valid_mask)
+{
+    const __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(input, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(input, _mm_set1_epi8('Z' + 1)));
+    const __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(input, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(input, _mm_set1_epi8('z' + 1)));
+    const __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(input, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(input, _mm_set1_epi8('9' + 1)));
+    const __m128i dash = _mm_cmpeq_epi8(input, _mm_set1_epi8('-'));
+    const __m128i underscore = _mm_cmpeq_epi8(input, _mm_set1_epi8('_'));
+    __m128i offset;
+
+    *valid_mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, _mm_or_si128(dash, underscore))));
+
+    offset = _mm_and_si128(upper, _mm_set1_epi8(-65));
+    offset = _mm_or_si128(offset, _mm_and_si128(lower, _mm_set1_epi8(-71)));
+    offset = _mm_or_si128(offset, _mm_and_si128(digit, _mm_set1_epi8(4)));
+    offset = _mm_or_si128(offset, _mm_and_si128(dash, _mm_set1_epi8(62 - '-')));
+    offset = _mm_or_si128(offset, _mm_and_si128(underscore, _mm_set1_epi8(63 - '_')));
+    return _mm_add_epi8(input, offset);
+}
+
+/*
+ * Pack each group of four 6 bit values into 3 bytes, leaving 12 bytes at the start of the register
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i pack_sse41(__m128i values)
+{
+    const __m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    const __m128i groups = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+    return _mm_shuffle_epi8(groups, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+/*
+ * Decode 16 characters at a time, while enough input remains that each 16 byte store stays inside the decoded output
+ */
+__attribute__((target("sse4.1")))
+static size_t decode_blocks_sse41(u_char *bufplain, const u_char *bufcoded, size_t coded_len, ngx_flag_t *invalid)
+{
+    size_t consumed = 0;
+    u_char *bufout = bufplain;
+    __m128i values;
+    int valid_mask = 0;
+
+    while (coded_len - consumed >= 24)
+    {
+        values = translate_sse41(_mm_loadu_si128((const __m128i *)(bufcoded + consumed)), &valid_mask);
+        if (valid_mask != 0xFFFF)
+        {
+            *invalid = 1;
+            break;
+        }
+
+        _mm_storeu_si128((__m128i *)bufout, pack_sse41(values));
+        bufout += 12;
+        consumed += 16;
+    }
+
+    return consumed;
+}
+
+/*
+ * The AVX2 equivalent of translate_sse41 for 32 characters
+ */
+__attribute__((target("avx2")))
+static inline __m256i translate_avx2(__m256i input, unsigned int *valid_mask)
+{
+    const __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(input, _mm256_set1_epi8('A' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), input));
+    const __m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(input, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), input));
+    const __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(input, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), input));
+    const __m256i dash = _mm256_cmpeq_epi8(input, _mm256_set1_epi8('-'));
+    const __m256i underscore = _mm256_cmpeq_epi8(input, _mm256_set1_epi8('_'));
+    __m256i offset;
+
+    *valid_mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(upper, lower), _mm256_or_si256(digit, _mm256_or_si256(dash, underscore))));
+
+    offset = _mm256_and_si256(upper, _mm256_set1_epi8(-65));
+    offset = _mm256_or_si256(offset, _mm256_and_si256(lower, _mm256_set1_epi8(-71)));
+    offset = _mm256_or_si256(offset, _mm256_and_si256(digit, _mm256_set1_epi8(4)));
+    offset = _mm256_or_si256(offset, _mm256_and_si256(dash, _mm256_set1_epi8(62 - '-')));
+    offset = _mm256_or_si256(offset, _mm256_and_si256(underscore, _mm256_set1_epi8(63 - '_')));
+    return _mm256_add_epi8(input, offset);
+}
+
+/*
+ * Decode 32 characters at a time, then let the SSE4.1 decoder continue with any remaining whole blocks
+ */
+__attribute__((target("avx2")))
+static size_t decode_blocks_avx2(u_char *bufplain, const u_char *bufcoded, size_t coded_len, ngx_flag_t *invalid)
+{
+    size_t consumed = 0;
+    u_char *bufout = bufplain;
+    __m256i values;
+    __m256i pairs;
+    __m256i groups;
+    unsigned int valid_mask = 0;
+
+    while (coded_len - consumed >= 48)
+    {
+        values = translate_avx2(_mm256_loadu_si256((const __m256i *)(bufcoded + consumed)), &valid_mask);
+        if (valid_mask != 0xFFFFFFFF)
+        {
+            *invalid = 1;
+            return consumed;
+        }
+
+        /* Pack each 128 bit lane to 12 bytes, then move the two lanes together to form 24 contiguous bytes */
+        pairs = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+        groups = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+        groups = _mm256_shuffle_epi8(groups, _mm256_setr_epi8(
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        groups = _mm256_permutevar8x32_epi32(groups, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+
+        _mm256_storeu_si256((__m256i *)bufout, groups);
+        bufout += 24;
+        consumed += 32;
+    }
+
+    return consumed + decode_blocks_sse41(bufout, bufcoded + consumed, coded_len - consumed, invalid);
+}
+
+#endif
+
 /*
  * Convert each pair of hex characters to a byte value
  */
@@ -21,41 +21,173 @@
 #include <stdlib.h>
 #include "oauth_proxy.h"
 
+/* Error responses are rendered at build time, and the body memory is read only */
+static ngx_str_t unauthorized_error_body = ngx_string("{\"code\":\"unauthorized\",\"message\":\"Access denied due to missing or invalid credentials\"}");
+static ngx_str_t server_error_body = ngx_string("{\"code\":\"server_error\",\"message\":\"Problem encountered processing the request\"}");
+static ngx_str_t error_content_type = ngx_string("application/json");
+
 /* Forward declarations of implementation functions */
+static ngx_int_t handle_cors_request(ngx_http_request_t *request, oauth_proxy_configuration_t *config);
+static ngx_int_t handle_cors_or_token_request(ngx_http_request_t *request, oauth_proxy_configuration_t *config);
+static ngx_int_t handle_same_site_request(ngx_http_request_t *request, oauth_proxy_configuration_t *config);
+static ngx_int_t handle_same_site_or_token_request(ngx_http_request_t *request, oauth_proxy_configuration_t *config);
+static ngx_inline ngx_int_t handle_request(ngx_http_request_t *request, oauth_proxy_configuration_t *module_location_config, ngx_flag_t cors_enabled, ngx_flag_t allow_tokens);
 static ngx_flag_t is_data_changing_command(ngx_http_request_t *request);
-static ngx_str_t *get_header(ngx_http_request_t *request, const char *name);
-static ngx_int_t verify_web_origin(const oauth_proxy_configuration_t *config, const ngx_str_t *web_origin);
-static ngx_int_t apply_csrf_checks(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, const ngx_str_t *web_origin);
-static ngx_int_t add_authorization_header(ngx_http_request_t *request, const ngx_str_t* token_value);
-static ngx_int_t write_options_response(ngx_http_request_t *request, oauth_proxy_configuration_t *module_location_config);
-static ngx_int_t write_error_response(ngx_http_request_t *request, ngx_int_t status, oauth_proxy_configuration_t *config);
-static ngx_int_t add_cors_response_headers(ngx_http_request_t *request, oauth_proxy_configuration_t *config, u_char is_error);
+static ngx_int_t apply_csrf_checks(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, const oauth_proxy_request_headers_t *headers, const oauth_proxy_request_cookies_t *cookies, ngx_uint_t *reason);
+static ngx_int_t decrypt_cookie(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, ngx_str_t *plaintext, const ngx_str_t *ciphertext, const ngx_str_t *prefix, uint64_t *elapsed);
+static ngx_int_t decrypt_chunked_cookie(ngx_http_request_t *request, oauth_proxy_configuration_t *config, const oauth_proxy_request_headers_t *headers, const oauth_proxy_request_cookies_t *cookies, oauth_proxy_request_context_t *context, const ngx_str_t *prefix);
+static void record_decryption(const oauth_proxy_configuration_t *config, ngx_int_t ret_code, uint64_t decrypt_time, uint64_t *elapsed);
+static void reject_cookie(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, ngx_int_t ret_code, const ngx_str_t *ciphertext, ngx_uint_t *reason);
+static void reject_uncached_cookie(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, ngx_int_t ret_code, ngx_uint_t *reason);
+#if (NGX_THREADS)
+static ngx_int_t post_decryption(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, oauth_proxy_request_context_t **context, const oauth_proxy_request_headers_t *headers, const ngx_str_t *ciphertext, const ngx_str_t *prefix);
+static ngx_int_t resume_decryption(ngx_http_request_t *request, oauth_proxy_configuration_t *config, oauth_proxy_request_context_t *context);
+#endif
+static ngx_int_t forward_request(ngx_http_request_t *request, oauth_proxy_configuration_t *config, const oauth_proxy_request_headers_t *headers, oauth_proxy_request_context_t *context, const ngx_str_t *authorization_value);
+static ngx_int_t resolve_phantom_token(ngx_http_request_t *request, oauth_proxy_configuration_t *config, const oauth_proxy_request_headers_t *headers, oauth_proxy_request_context_t *context, const ngx_str_t *authorization_value);
+static ngx_int_t resume_phantom_token(ngx_http_request_t *request, oauth_proxy_configuration_t *config, oauth_proxy_request_context_t *context);
+static oauth_proxy_request_context_t *create_context(ngx_http_request_t *request);
+static uint64_t start_timing(const oauth_proxy_configuration_t *config);
+static void end_timing(const oauth_proxy_configuration_t *config, uint64_t start, uint64_t *elapsed);
+static ngx_int_t set_variable_value(ngx_http_variable_value_t *value, u_char *data, size_t len);
+static ngx_int_t add_authorization_header(ngx_http_request_t *request, const ngx_str_t* authorization_value);
+static ngx_int_t write_options_response(ngx_http_request_t *request, oauth_proxy_configuration_t *module_location_config, const oauth_proxy_request_headers_t *headers);
+static ngx_int_t write_error_response(ngx_http_request_t *request, ngx_int_t status, ngx_uint_t reason, oauth_proxy_configuration_t *config, const oauth_proxy_request_headers_t *headers, oauth_proxy_request_context_t *context);
+static ngx_int_t add_cors_response_headers(ngx_http_request_t *request, oauth_proxy_configuration_t *config, const oauth_proxy_request_headers_t *headers, u_char is_error);
 
 /*
- * The main exported handler method, called for each incoming API request
+ * The main exported handler method, called for each incoming API request, which runs the location's handler variant
  */
 ngx_int_t oauth_proxy_handler_main(ngx_http_request_t *request)
 {
-    oauth_proxy_configuration_t *module_location_config = NULL;
-    ngx_str_t *authorization_header = NULL;
-    ngx_str_t *web_origin = NULL;
-    ngx_str_t at_cookie_encrypted_hex;
-    ngx_str_t access_token;
+    oauth_proxy_configuration_t *module_location_config = oauth_proxy_module_get_location_configuration(request);
+    oauth_proxy_request_context_t *context = NULL;
     ngx_int_t ret_code = NGX_OK;
 
     /* Return immediately for locations where the module is not used */
-    module_location_config = oauth_proxy_module_get_location_configuration(request);
-    if (!module_location_config->enabled)
+    if (module_location_config->handler == NULL)
     {
         return NGX_DECLINED;
     }
 
+    ret_code = module_location_config->handler(request, module_location_config);
+
+    /* The module's memory is observed once its access phase work is complete, rather than each time the handler waits */
+    if (ret_code != NGX_AGAIN && module_location_config->metrics != NULL)
+    {
+        context = ngx_http_get_module_ctx(request, ngx_curity_http_oauth_proxy_module);
+        if (context != NULL)
+        {
+            oauth_proxy_metrics_observe_memory(module_location_config, context->memory);
+        }
+    }
+
+    return ret_code;
+}
+
+/*
+ * Choose a handler when configuration is merged, so that requests do not test the CORS and token flags
+ */
+oauth_proxy_handler_pt oauth_proxy_handler_select(const oauth_proxy_configuration_t *config)
+{
+    if (!config->enabled)
+    {
+        return NULL;
+    }
+
+    if (config->cors_enabled)
+    {
+        return config->allow_tokens ? handle_cors_or_token_request : handle_cors_request;
+    }
+
+    return config->allow_tokens ? handle_same_site_or_token_request : handle_same_site_request;
+}
+
+/*
+ * The variants pass constant flags, so that the compiler removes the branches that do not apply to the location
+ */
+static ngx_int_t handle_cors_request(ngx_http_request_t *request, oauth_proxy_configuration_t *config)
+{
+    return handle_request(request, config, 1, 0);
+}
+
+static ngx_int_t handle_cors_or_token_request(ngx_http_request_t *request, oauth_proxy_configuration_t *config)
+{
+    return handle_request(request, config, 1, 1);
+}
+
+static ngx_int_t handle_same_site_request(ngx_http_request_t *request, oauth_proxy_configuration_t *config)
+{
+    return handle_request(request, config, 0, 0);
+}
+
+static ngx_int_t handle_same_site_or_token_request(ngx_http_request_t *request, oauth_proxy_configuration_t *config)
+{
+    return handle_request(request, config, 0, 1);
+}
+
+/*
+ * Apply the module's checks to an API request and forward its access token
+ */
+static ngx_inline ngx_int_t handle_request(ngx_http_request_t *request, oauth_proxy_configuration_t *module_location_config, ngx_flag_t cors_enabled, ngx_flag_t allow_tokens)
+{
+    oauth_proxy_request_context_t *context = NULL;
+    oauth_proxy_request_headers_t headers;
+    oauth_proxy_request_cookies_t cookies;
+    ngx_str_t at_cookie_encrypted_hex;
+    ngx_str_t authorization_value;
+    static ngx_str_t bearer_prefix = ngx_string(OAUTH_PROXY_BEARER_PREFIX);
+    ngx_uint_t reason = OAUTH_PROXY_METRIC_SERVER_ERROR;
+    ngx_flag_t data_changing = 0;
+    uint64_t start = 0;
+    ngx_int_t ret_code = NGX_OK;
+
+    /* The handler runs again when a decryption posted to a thread pool or an introspection completes, and continues from that point */
+    context = ngx_http_get_module_ctx(request, ngx_curity_http_oauth_proxy_module);
+    if (context != NULL && context->phantom != NULL)
+    {
+        return resume_phantom_token(request, module_location_config, context);
+    }
+
+#if (NGX_THREADS)
+    if (context != NULL && context->decryption != NULL)
+    {
+        return resume_decryption(request, module_location_config, context);
+    }
+#endif
+
+    oauth_proxy_metrics_increment(module_location_config, OAUTH_PROXY_METRIC_REQUESTS);
+
+    /* Request state is only kept when a log format or other directive uses the module's request variables, or metrics are served */
+    if (module_location_config->record_result)
+    {
+        context = create_context(request);
+        if (context == NULL)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    /* Find all request headers the module uses in a single pass */
+    oauth_proxy_utils_read_headers_in(request, module_location_config, &headers);
+
+    /* Match the origin against the trusted origin hashes once, and reuse the verdict for CORS and error responses */
+    start = start_timing(module_location_config);
+    headers.origin_trusted = oauth_proxy_origins_is_trusted(module_location_config, headers.origin);
+    end_timing(module_location_config, start, context ? &context->origin_time : NULL);
+
     if (request->method == NGX_HTTP_OPTIONS)
     {
-        if (module_location_config->cors_enabled)
+        if (cors_enabled)
         {
             /* When CORS is enabled, avoid needing to handling pre-flight OPTIONS requests in the API */
-            return write_options_response(request, module_location_config);
+            oauth_proxy_metrics_increment(module_location_config, OAUTH_PROXY_METRIC_PREFLIGHTS);
+            if (context != NULL)
+            {
+                context->result = OAUTH_PROXY_METRIC_PREFLIGHTS;
+            }
+
+            return write_options_response(request, module_location_config, &headers);
         }
 
         /* If CORS is disabled, return immediately and the request will be routed to the target API */
@@ -63,75 +195,117 @@ ngx_int_t oauth_proxy_handler_main(ngx_http_request_t *request)
     }
 
     /* Pass the request through if it has an Authorization header, eg from a mobile client that uses the same route as an SPA */
-    if (module_location_config->allow_tokens)
+    if (allow_tokens)
     {
-        authorization_header = get_header(request, "authorization");
-        if (authorization_header != NULL)
+        if (headers.authorization != NULL)
         {
             return NGX_OK;
         }
     }
 
     /* Verify the web origin, which is sent by all modern browsers */
-    if (module_location_config->cors_enabled || is_data_changing_command(request))
+    data_changing = is_data_changing_command(request);
+    if (cors_enabled || data_changing)
     {   
-        web_origin = get_header(request, "origin");
-        if (web_origin == NULL)
+        if (headers.origin == NULL)
         {
             ret_code = NGX_HTTP_UNAUTHORIZED;
             ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "The request did not have an origin header");
-            return write_error_response(request, ret_code, module_location_config);
+            return write_error_response(request, ret_code, OAUTH_PROXY_METRIC_ORIGIN_MISSING, module_location_config, &headers, context);
         }
     
-        ret_code = verify_web_origin(module_location_config, web_origin);
-        if (ret_code != NGX_OK)
+        if (!headers.origin_trusted)
         {
             ret_code = NGX_HTTP_UNAUTHORIZED;
             ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "The request was from an untrusted web origin");
-            return write_error_response(request, ret_code, module_location_config);
+            return write_error_response(request, ret_code, OAUTH_PROXY_METRIC_ORIGIN_UNTRUSTED, module_location_config, &headers, context);
         }
     }
 
+    /* Clients that keep sending cookies that fail decryption are rejected before any cookie is decoded or decrypted */
+    if (oauth_proxy_throttle_is_throttled(request, module_location_config))
+    {
+        ret_code = NGX_HTTP_UNAUTHORIZED;
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "The client has exceeded the oauth_proxy_throttle decryption failure threshold");
+        return write_error_response(request, ret_code, OAUTH_PROXY_METRIC_CLIENT_THROTTLED, module_location_config, &headers, context);
+    }
+
+    /* Find the access token, CSRF and chunked cookies in a single pass over the cookie headers */
+    oauth_proxy_utils_read_cookies(request, module_location_config, &cookies);
+
     /* For data changing commands, apply double submit cookie checks in line with OWASP best practices */
-    if (is_data_changing_command(request))
+    if (data_changing)
     {
-        ret_code = apply_csrf_checks(request, module_location_config, web_origin);
+        start = start_timing(module_location_config);
+        ret_code = apply_csrf_checks(request, module_location_config, &headers, &cookies, &reason);
+        end_timing(module_location_config, start, context ? &context->csrf_time : NULL);
         if (ret_code != NGX_OK)
         {
-            return write_error_response(request, ret_code, module_location_config);
+            return write_error_response(request, ret_code, reason, module_location_config, &headers, context);
         }
     }
 
-    /* This returns 0 when there is a single cookie header (HTTP 1.1) or > 0 when there are multiple cookie headers (HTTP 2.0) */
-    ret_code = oauth_proxy_utils_get_cookie(request, &at_cookie_encrypted_hex, &module_location_config->cookie_name_prefix, (u_char *)"-at");
-    if (ret_code == NGX_DECLINED)
+    at_cookie_encrypted_hex = cookies.at;
+    if (at_cookie_encrypted_hex.data == NULL)
     {
+        /* Large tokens can instead be split across numbered cookies, which are decrypted as a stream without joining them */
+        ret_code = decrypt_chunked_cookie(request, module_location_config, &headers, &cookies, context, &bearer_prefix);
+        if (ret_code != NGX_DECLINED)
+        {
+            return ret_code;
+        }
+
         ret_code = NGX_HTTP_UNAUTHORIZED;
         ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "No AT cookie was found in the incoming request");
-        return write_error_response(request, ret_code, module_location_config);
+        return write_error_response(request, ret_code, OAUTH_PROXY_METRIC_COOKIE_MISSING, module_location_config, &headers, context);
     }
 
-    /* Try to decrypt the cookie to get the access token */
-    ret_code = oauth_proxy_decryption_decrypt_cookie(request, &access_token, &at_cookie_encrypted_hex, &module_location_config->encryption_key);
-    if (ret_code != NGX_OK)
+    oauth_proxy_metrics_observe(module_location_config, OAUTH_PROXY_METRIC_COOKIE_SIZE, at_cookie_encrypted_hex.len);
+    if (context != NULL)
     {
-        return write_error_response(request, ret_code, module_location_config);
+        context->cookie_bytes = at_cookie_encrypted_hex.len;
     }
 
-    /* Update the authorization header in the headers in, to forward to the API via proxy_pass */
-    ret_code = add_authorization_header(request, &access_token);
-    if (ret_code != NGX_OK)
+    /* When a cache is configured, cookies that were recently decrypted are served without decoding or decryption */
+    ret_code = oauth_proxy_cache_lookup(request, module_location_config, &at_cookie_encrypted_hex, &authorization_value);
+    if (ret_code == NGX_DECLINED)
     {
-        return write_error_response(request, ret_code, module_location_config);
+        /* Cookies that recently failed decryption, such as those from before a key rotation, are rejected again without any cryptography */
+        if (oauth_proxy_negative_cache_contains(module_location_config, &at_cookie_encrypted_hex))
+        {
+            ret_code = NGX_HTTP_UNAUTHORIZED;
+            ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "The AT cookie recently failed decryption and was rejected without decrypting it again");
+            return write_error_response(request, ret_code, OAUTH_PROXY_METRIC_DECRYPTION_FAILED, module_location_config, &headers, context);
+        }
+
+#if (NGX_THREADS)
+        /* Large cookies can be decrypted in a thread pool, so that they do not delay other connections on this worker */
+        if (module_location_config->thread_pool != NULL && at_cookie_encrypted_hex.len > module_location_config->thread_pool_threshold)
+        {
+            ret_code = post_decryption(request, module_location_config, &context, &headers, &at_cookie_encrypted_hex, &bearer_prefix);
+            if (ret_code != NGX_DECLINED)
+            {
+                return ret_code;
+            }
+        }
+#endif
+
+        /* Try to decrypt the cookie to get the access token, which is written directly after the bearer prefix */
+        ret_code = decrypt_cookie(request, module_location_config, &authorization_value, &at_cookie_encrypted_hex, &bearer_prefix, context ? &context->decrypt_time : NULL);
+        if (ret_code != NGX_OK)
+        {
+            reject_cookie(request, module_location_config, ret_code, &at_cookie_encrypted_hex, &reason);
+            return write_error_response(request, ret_code, reason, module_location_config, &headers, context);
+        }
+
+        oauth_proxy_cache_store(request, module_location_config, &at_cookie_encrypted_hex, &authorization_value);
     }
-    
-    /* Finally update CORS headers, which must be done for both the pre-flight request and also the main API request */
-    if (module_location_config->cors_enabled)
+    else if (ret_code != NGX_OK)
     {
-        add_cors_response_headers(request, module_location_config, 0);
+        return write_error_response(request, ret_code, OAUTH_PROXY_METRIC_SERVER_ERROR, module_location_config, &headers, context);
     }
 
-    return NGX_OK;
+    return forward_request(request, module_location_config, &headers, context, &authorization_value);
 }
 
 /*
@@ -146,112 +320,418 @@ static ngx_flag_t is_data_changing_command(ngx_http_request_t *request)
 }
 
 /*
- * Return the authorization header if it exists
+ * For data changing commands we make extra CSRF checks in line with OWASP best practices
+ */
+static ngx_int_t apply_csrf_checks(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, const oauth_proxy_request_headers_t *headers, const oauth_proxy_request_cookies_t *cookies, ngx_uint_t *reason)
+{
+    const ngx_str_t *csrf_cookie_encrypted_hex = &cookies->csrf;
+    ngx_str_t *csrf_header_value = NULL;
+    ngx_str_t csrf_token;
+    ngx_int_t ret_code = NGX_OK;
+
+    if (csrf_cookie_encrypted_hex->data == NULL)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "No CSRF cookie was found in the incoming request");
+        *reason = OAUTH_PROXY_METRIC_CSRF_COOKIE_MISSING;
+        return NGX_HTTP_UNAUTHORIZED;
+    }
+
+    csrf_header_value = headers->csrf;
+    if (csrf_header_value == NULL)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "A data changing request did not have a CSRF header");
+        *reason = OAUTH_PROXY_METRIC_CSRF_HEADER_MISSING;
+        return NGX_HTTP_UNAUTHORIZED;
+    }
+
+    /* When a MAC key is configured, the cookie holds a MAC of the CSRF token, which is verified without a decryption */
+    if (config->csrf_hmac_key.len > 0)
+    {
+        ret_code = oauth_proxy_csrf_verify_mac(request, config, csrf_cookie_encrypted_hex, csrf_header_value);
+        if (ret_code == NGX_DECLINED)
+        {
+            ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "The CSRF request header did not match the MAC in the CSRF cookie");
+            *reason = OAUTH_PROXY_METRIC_CSRF_MISMATCH;
+            return NGX_HTTP_UNAUTHORIZED;
+        }
+
+        if (ret_code != NGX_OK)
+        {
+            reject_uncached_cookie(request, config, ret_code, reason);
+            return ret_code;
+        }
+
+        return NGX_OK;
+    }
+
+    ret_code = decrypt_cookie(request, config, &csrf_token, csrf_cookie_encrypted_hex, NULL, NULL);
+    if (ret_code != NGX_OK)
+    {
+        reject_uncached_cookie(request, config, ret_code, reason);
+        return ret_code;
+    }
+
+    if (csrf_token.len != csrf_header_value->len || ngx_memcmp(csrf_token.data, csrf_header_value->data, csrf_token.len) != 0)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "The CSRF request header did not match the value in the encrypted CSRF cookie");
+        *reason = OAUTH_PROXY_METRIC_CSRF_MISMATCH;
+        return NGX_HTTP_UNAUTHORIZED;
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * Decrypt a cookie, and record its timing and any failure when metrics or timing variables are used
  */
-static ngx_str_t *get_header(ngx_http_request_t *request, const char *name)
+static ngx_int_t decrypt_cookie(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, ngx_str_t *plaintext, const ngx_str_t *ciphertext, const ngx_str_t *prefix, uint64_t *elapsed)
 {
-    return oauth_proxy_utils_get_header_in(request, (u_char *)name, ngx_strlen(name));
+    uint64_t start = 0;
+    uint64_t decrypt_time = 0;
+    ngx_int_t ret_code = NGX_OK;
+
+    /* Avoid reading the clock when nothing uses the timing */
+    if (config->metrics == NULL && !config->record_timings)
+    {
+        return oauth_proxy_decryption_decrypt_cookie(request, plaintext, ciphertext, config, prefix);
+    }
+
+    start = oauth_proxy_utils_get_time();
+    ret_code = oauth_proxy_decryption_decrypt_cookie(request, plaintext, ciphertext, config, prefix);
+    decrypt_time = oauth_proxy_utils_get_time() - start;
+
+    record_decryption(config, ret_code, decrypt_time, elapsed);
+    return ret_code;
 }
 
 /*
- * Ensure that incoming requests have the origin header that all modern browsers send
+ * Decrypt an access token split across numbered cookies and forward it, or return NGX_DECLINED when there are none
+ * Chunked cookies bypass the cache and thread pool, which work with a single contiguous cookie value
  */
-static ngx_int_t verify_web_origin(const oauth_proxy_configuration_t *config, const ngx_str_t *web_origin)
+static ngx_int_t decrypt_chunked_cookie(ngx_http_request_t *request, oauth_proxy_configuration_t *config, const oauth_proxy_request_headers_t *headers, const oauth_proxy_request_cookies_t *cookies, oauth_proxy_request_context_t *context, const ngx_str_t *prefix)
 {
-    ngx_str_t *trusted_web_origins = NULL;
-    ngx_str_t trusted_web_origin;
+    const ngx_str_t *chunks = cookies->at_chunks;
+    ngx_uint_t chunk_count = cookies->at_chunk_count;
+    ngx_str_t authorization_value;
+    ngx_uint_t reason = OAUTH_PROXY_METRIC_SERVER_ERROR;
+    ngx_flag_t timed = config->metrics != NULL || config->record_timings;
+    size_t cookie_bytes = 0;
+    uint64_t start = 0;
     ngx_uint_t i = 0;
+    ngx_int_t ret_code = NGX_OK;
+
+    if (chunk_count == 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    for (i = 0; i < chunk_count; i++)
+    {
+        cookie_bytes += chunks[i].len;
+    }
+
+    oauth_proxy_metrics_observe(config, OAUTH_PROXY_METRIC_COOKIE_SIZE, cookie_bytes);
+    if (context != NULL)
+    {
+        context->cookie_bytes = cookie_bytes;
+    }
+
+    start = timed ? oauth_proxy_utils_get_time() : 0;
+    ret_code = oauth_proxy_decryption_decrypt_chunks(request, &authorization_value, chunks, chunk_count, config, prefix);
+    record_decryption(config, ret_code, timed ? oauth_proxy_utils_get_time() - start : 0, context ? &context->decrypt_time : NULL);
+    if (ret_code != NGX_OK)
+    {
+        reject_uncached_cookie(request, config, ret_code, &reason);
+        return write_error_response(request, ret_code, reason, config, headers, context);
+    }
+
+    return forward_request(request, config, headers, context, &authorization_value);
+}
+
+/*
+ * Record the decryption time and any failure, for decryptions on the event loop or in a thread pool
+ */
+static void record_decryption(const oauth_proxy_configuration_t *config, ngx_int_t ret_code, uint64_t decrypt_time, uint64_t *elapsed)
+{
+    if (config->metrics == NULL && !config->record_timings)
+    {
+        return;
+    }
+
+    if (elapsed != NULL)
+    {
+        *elapsed = decrypt_time;
+    }
+
+    oauth_proxy_metrics_observe(config, OAUTH_PROXY_METRIC_DECRYPT_TIME, decrypt_time);
+    if (ret_code != NGX_OK)
+    {
+        oauth_proxy_metrics_increment(config, OAUTH_PROXY_METRIC_DECRYPT_FAILURES);
+    }
+}
 
-    trusted_web_origins = config->trusted_web_origins->elts;
-    for (i = 0; i < config->trusted_web_origins->nelts; i++)
+/*
+ * Choose the rejection reason for an access token cookie that could not be decrypted, and remember cookies that fail authentication
+ * Server errors are not remembered or counted towards the client's throttle, since the same cookie may succeed once memory is available
+ */
+static void reject_cookie(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, ngx_int_t ret_code, const ngx_str_t *ciphertext, ngx_uint_t *reason)
+{
+    if (ret_code != NGX_HTTP_UNAUTHORIZED)
+    {
+        *reason = OAUTH_PROXY_METRIC_SERVER_ERROR;
+        return;
+    }
+
+    oauth_proxy_negative_cache_store(config, ciphertext);
+    oauth_proxy_throttle_record_failure(request, config);
+    *reason = OAUTH_PROXY_METRIC_DECRYPTION_FAILED;
+}
+
+/*
+ * Choose the rejection reason for a CSRF or chunked cookie that could not be decrypted, which counts towards the client's throttle
+ * These cookies are not remembered, since the negative cache holds whole access token cookies
+ */
+static void reject_uncached_cookie(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, ngx_int_t ret_code, ngx_uint_t *reason)
+{
+    if (ret_code != NGX_HTTP_UNAUTHORIZED)
     {
-        trusted_web_origin = trusted_web_origins[i];
+        *reason = OAUTH_PROXY_METRIC_SERVER_ERROR;
+        return;
+    }
 
-        if (web_origin->len == trusted_web_origin.len && 
-            ngx_strncasecmp(web_origin->data, trusted_web_origin.data, web_origin->len) == 0)
+    oauth_proxy_throttle_record_failure(request, config);
+    *reason = OAUTH_PROXY_METRIC_DECRYPTION_FAILED;
+}
+
+#if (NGX_THREADS)
+
+/*
+ * Post the access token cookie's decryption to the thread pool, and return NGX_AGAIN so that the access phase waits for it
+ * NGX_DECLINED is returned when the task could not be posted, and the cookie is then decrypted on the event loop
+ */
+static ngx_int_t post_decryption(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, oauth_proxy_request_context_t **context, const oauth_proxy_request_headers_t *headers, const ngx_str_t *ciphertext, const ngx_str_t *prefix)
+{
+    oauth_proxy_decryption_job_t *job = NULL;
+
+    /* The context holds the job while the task runs, so it is needed even when no request variables are used */
+    if (*context == NULL)
+    {
+        *context = create_context(request);
+        if (*context == NULL)
         {
-            return NGX_OK;
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
         }
     }
 
-    return NGX_ERROR;
+    job = oauth_proxy_threads_post_decryption(request, config, ciphertext, prefix);
+    if (job == NULL)
+    {
+        return NGX_DECLINED;
+    }
+
+    /* The header values refer to request memory, so they are kept for CORS and error responses when the handler resumes */
+    job->headers = *headers;
+    (*context)->decryption = job;
+    return NGX_AGAIN;
 }
 
 /*
- * For data changing commands we make extra CSRF checks in line with OWASP best practices
+ * Finish a request whose cookie was decrypted in the thread pool, in the same way as for a decryption on the event loop
  */
-static ngx_int_t apply_csrf_checks(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, const ngx_str_t *web_origin)
+static ngx_int_t resume_decryption(ngx_http_request_t *request, oauth_proxy_configuration_t *config, oauth_proxy_request_context_t *context)
 {
-    ngx_str_t csrf_cookie_encrypted_hex;
-    u_char csrf_header_name[128];
-    ngx_str_t *csrf_header_value = NULL;
-    ngx_str_t csrf_token;
+    oauth_proxy_decryption_job_t *job = context->decryption;
+    ngx_str_t compressed;
+    ngx_uint_t reason = OAUTH_PROXY_METRIC_SERVER_ERROR;
     ngx_int_t ret_code = NGX_OK;
 
-    /* This returns 0 when there is a single cookie header or > 0 when there are multiple cookie headers */
-    ret_code = oauth_proxy_utils_get_cookie(request, &csrf_cookie_encrypted_hex, &config->cookie_name_prefix, (u_char *)"-csrf");
-    if (ret_code == NGX_DECLINED)
+    /* Other events can run the request's phases while the task is still in the thread pool */
+    if (!job->completed)
     {
-        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "No CSRF cookie was found in the incoming request");
-        return NGX_HTTP_UNAUTHORIZED;
+        return NGX_AGAIN;
     }
 
-    oauth_proxy_utils_get_csrf_header_name(csrf_header_name, config);
-    csrf_header_value = oauth_proxy_utils_get_header_in(request, csrf_header_name, ngx_strlen(csrf_header_name));
-    if (csrf_header_value == NULL)
+    record_decryption(config, job->result, job->decrypt_time, &context->decrypt_time);
+    if (job->result != NGX_OK)
     {
-        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "A data changing request did not have a CSRF header");
-        return NGX_HTTP_UNAUTHORIZED;
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "%s", job->error);
+        reject_cookie(request, config, job->result, &job->ciphertext, &reason);
+        return write_error_response(request, job->result, reason, config, &job->headers, context);
+    }
+
+    /* Decompression allocates from the request pool, so it runs on the event loop once the cookie has been authenticated */
+    if (job->compressed)
+    {
+        compressed = job->plaintext;
+        ret_code = oauth_proxy_compression_inflate(request, &job->plaintext, &compressed, config, job->prefix);
+        if (ret_code != NGX_OK)
+        {
+            oauth_proxy_metrics_increment(config, OAUTH_PROXY_METRIC_DECRYPT_FAILURES);
+            reject_cookie(request, config, ret_code, &job->ciphertext, &reason);
+            return write_error_response(request, ret_code, reason, config, &job->headers, context);
+        }
+    }
+
+    oauth_proxy_cache_store(request, config, &job->ciphertext, &job->plaintext);
+    return forward_request(request, config, &job->headers, context, &job->plaintext);
+}
+
+#endif
+
+/*
+ * Forward the access token to the API in the authorization header, then add any CORS response headers
+ */
+static ngx_int_t forward_request(ngx_http_request_t *request, oauth_proxy_configuration_t *config, const oauth_proxy_request_headers_t *headers, oauth_proxy_request_context_t *context, const ngx_str_t *authorization_value)
+{
+    uint64_t start = 0;
+    ngx_int_t ret_code = NGX_OK;
+
+    /* In phantom token mode the cookie holds an opaque token, which is swapped for a JWT before it is forwarded */
+    if (config->phantom_token_zone != NULL && (context == NULL || context->phantom == NULL))
+    {
+        return resolve_phantom_token(request, config, headers, context, authorization_value);
     }
 
-    ret_code = oauth_proxy_decryption_decrypt_cookie(request, &csrf_token, &csrf_cookie_encrypted_hex, &config->encryption_key);
+    /* Update the authorization header in the headers in, to forward to the API via proxy_pass */
+    start = start_timing(config);
+    ret_code = add_authorization_header(request, authorization_value);
     if (ret_code != NGX_OK)
     {
-        return ret_code;
+        return write_error_response(request, ret_code, OAUTH_PROXY_METRIC_SERVER_ERROR, config, headers, context);
     }
 
-    if (ngx_strcmp(csrf_token.data, csrf_header_value->data) != 0)
+    /* Finally update CORS headers, which must be done for both the pre-flight request and also the main API request */
+    if (config->cors_enabled)
     {
-        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "The CSRF request header did not match the value in the encrypted CSRF cookie");
-        return NGX_HTTP_UNAUTHORIZED;
+        add_cors_response_headers(request, config, headers, 0);
     }
 
+    end_timing(config, start, context ? &context->headers_time : NULL);
     return NGX_OK;
 }
 
 /*
- * Set the authorization header and deal with string manipulation
+ * Start swapping the opaque token for a JWT, keeping the state in the request context while the access phase waits
  */
-static ngx_int_t add_authorization_header(ngx_http_request_t *request, const ngx_str_t* token_value)
+static ngx_int_t resolve_phantom_token(ngx_http_request_t *request, oauth_proxy_configuration_t *config, const oauth_proxy_request_headers_t *headers, oauth_proxy_request_context_t *context, const ngx_str_t *authorization_value)
 {
-    ngx_table_elt_t *authorization_header = NULL;
-    u_char *header_value = NULL;
-    size_t header_value_len = 0;
+    oauth_proxy_phantom_request_t *phantom = NULL;
+    size_t prefix_len = sizeof(OAUTH_PROXY_BEARER_PREFIX) - 1;
 
-    authorization_header = ngx_list_push(&request->headers_in.headers);
-    if (authorization_header == NULL)
+    if (authorization_value->len <= prefix_len)
     {
-        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "OAuth proxy failed to allocate memory for the authorization header");
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "The received cookie did not contain an opaque access token");
+        return write_error_response(request, NGX_HTTP_UNAUTHORIZED, OAUTH_PROXY_METRIC_DECRYPTION_FAILED, config, headers, context);
+    }
+
+    /* The context holds the phantom state while the introspection runs, so it is needed even when no request variables are used */
+    if (context == NULL)
+    {
+        context = create_context(request);
+        if (context == NULL)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    phantom = ngx_pcalloc(request->pool, sizeof(oauth_proxy_phantom_request_t));
+    if (phantom == NULL)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "OAuth proxy failed to allocate memory for the phantom token");
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    /* The header size is unknown and could represent a large JWT, so allocate memory dynamically */
-    header_value_len = ngx_strlen("Bearer ") + token_value->len;
-    header_value = ngx_pcalloc(request->pool, header_value_len + 1);
-    if (header_value == NULL)
+    oauth_proxy_utils_count_memory(request, OAUTH_PROXY_MEMORY_STATE, sizeof(oauth_proxy_phantom_request_t));
+
+    /* The header values refer to request memory, so they are kept for CORS and error responses when the handler resumes */
+    phantom->token.data = authorization_value->data + prefix_len;
+    phantom->token.len = authorization_value->len - prefix_len;
+    phantom->headers = *headers;
+    context->phantom = phantom;
+
+    return resume_phantom_token(request, config, context);
+}
+
+/*
+ * Forward the JWT once it is known, or return NGX_AGAIN while an introspection is in progress
+ */
+static ngx_int_t resume_phantom_token(ngx_http_request_t *request, oauth_proxy_configuration_t *config, oauth_proxy_request_context_t *context)
+{
+    oauth_proxy_phantom_request_t *phantom = context->phantom;
+    ngx_uint_t reason = OAUTH_PROXY_METRIC_SERVER_ERROR;
+    ngx_int_t ret_code = NGX_OK;
+
+    ret_code = oauth_proxy_phantom_resolve(request, config, phantom);
+    if (ret_code == NGX_AGAIN)
+    {
+        return NGX_AGAIN;
+    }
+
+    if (ret_code != NGX_OK)
+    {
+        reason = ret_code == NGX_HTTP_INTERNAL_SERVER_ERROR ? OAUTH_PROXY_METRIC_SERVER_ERROR : OAUTH_PROXY_METRIC_INTROSPECTION_FAILED;
+        return write_error_response(request, ret_code, reason, config, &phantom->headers, context);
+    }
+
+    return forward_request(request, config, &phantom->headers, context, &phantom->authorization);
+}
+
+/*
+ * Create the request context, which is allocated when request variables are used or when the access phase must wait
+ */
+static oauth_proxy_request_context_t *create_context(ngx_http_request_t *request)
+{
+    oauth_proxy_request_context_t *context = NULL;
+
+    context = ngx_pcalloc(request->pool, sizeof(oauth_proxy_request_context_t));
+    if (context == NULL)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "OAuth proxy failed to allocate memory for the request context");
+        return NULL;
+    }
+
+    context->result = OAUTH_PROXY_METRIC_REQUESTS;
+    context->memory[OAUTH_PROXY_MEMORY_STATE] = sizeof(oauth_proxy_request_context_t);
+    ngx_http_set_ctx(request, context, ngx_curity_http_oauth_proxy_module);
+    return context;
+}
+
+/*
+ * Stage timings are only taken when a timing variable is used, so that the clock is not read otherwise
+ */
+static uint64_t start_timing(const oauth_proxy_configuration_t *config)
+{
+    return config->record_timings ? oauth_proxy_utils_get_time() : 0;
+}
+
+static void end_timing(const oauth_proxy_configuration_t *config, uint64_t start, uint64_t *elapsed)
+{
+    if (config->record_timings && elapsed != NULL)
+    {
+        *elapsed = oauth_proxy_utils_get_time() - start;
+    }
+}
+
+/*
+ * Set the authorization header from a value that already contains the bearer prefix, so that no copy is needed
+ */
+static ngx_int_t add_authorization_header(ngx_http_request_t *request, const ngx_str_t* authorization_value)
+{
+    ngx_table_elt_t *authorization_header = NULL;
+
+    authorization_header = ngx_list_push(&request->headers_in.headers);
+    if (authorization_header == NULL)
     {
-        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "OAuth proxy failed to allocate memory for the authorization header value");
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "OAuth proxy failed to allocate memory for the authorization header");
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
     ngx_str_set(&authorization_header->key, "authorization");
-    ngx_snprintf(header_value, header_value_len, "Bearer %V", token_value);
-    header_value[header_value_len] = 0;
-
-    authorization_header->value.data = header_value;
-    authorization_header->value.len  = header_value_len;
+    authorization_header->value.data = authorization_value->data;
+    authorization_header->value.len  = authorization_value->len;
     authorization_header->hash = 1;
     request->headers_in.authorization = authorization_header;
+    oauth_proxy_utils_count_memory(request, OAUTH_PROXY_MEMORY_HEADERS, sizeof(ngx_table_elt_t));
 
     return NGX_OK;
 }
@@ -259,175 +739,241 @@ static ngx_int_t add_authorization_header(ngx_http_request_t *request, const ngx
 /*
  * Write an empty CORS response
  */
-static ngx_int_t write_options_response(ngx_http_request_t *request, oauth_proxy_configuration_t *module_location_config)
+static ngx_int_t write_options_response(ngx_http_request_t *request, oauth_proxy_configuration_t *module_location_config, const oauth_proxy_request_headers_t *headers)
 {
-    add_cors_response_headers(request, module_location_config, 0);
+    add_cors_response_headers(request, module_location_config, headers, 0);
     return NGX_HTTP_NO_CONTENT;
 }
 
 /*
- * Add the error response and write CORS headers so that Javascript can read it
+ * Count the rejection reason, then add the error response and write CORS headers so that Javascript can read it
  * http://nginx.org/en/docs/dev/development_guide.html#http_response_body
  */
-static ngx_int_t write_error_response(ngx_http_request_t *request, ngx_int_t status, oauth_proxy_configuration_t *module_location_config)
+static ngx_int_t write_error_response(ngx_http_request_t *request, ngx_int_t status, ngx_uint_t reason, oauth_proxy_configuration_t *module_location_config, const oauth_proxy_request_headers_t *headers, oauth_proxy_request_context_t *context)
 {
     ngx_int_t rc;
-    ngx_str_t code;
-    ngx_str_t message;
-    u_char json_error_data[256];
+    ngx_str_t *error_body = NULL;
     ngx_chain_t output;
     ngx_buf_t *body = NULL;
-    const char *error_format = NULL;
-    size_t error_len = 0;
 
-    add_cors_response_headers(request, module_location_config, 1);
+    oauth_proxy_metrics_increment(module_location_config, reason);
+    if (context != NULL)
+    {
+        context->result = reason;
+    }
+
+    add_cors_response_headers(request, module_location_config, headers, 1);
     if (request->method == NGX_HTTP_HEAD)
     {
         return status;
     }
 
+    /* Only the buffer header is allocated, since output filters update its positions while the static body is sent */
     body = ngx_calloc_buf(request->pool);
     if (body == NULL)
     {
         ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "OAuth proxy failed to allocate memory for error body");
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
-    else
-    {
-        if (status == NGX_HTTP_INTERNAL_SERVER_ERROR)
-        {
-            ngx_str_set(&code, "server_error");
-            ngx_str_set(&message, "Problem encountered processing the request");
-        }
-        else
-        {
-            ngx_str_set(&code, "unauthorized");
-            ngx_str_set(&message, "Access denied due to missing or invalid credentials");
-        }
 
-        /* The string length calculation replaces the two '%V' markers with their actual values */
-        error_format = "{\"code\":\"%V\",\"message\":\"%V\"}";
-        error_len = ngx_strlen(error_format) + code.len + message.len - 4;
-        ngx_snprintf(json_error_data, sizeof(json_error_data) - 1, error_format, &code, &message);
-        json_error_data[error_len] = 0;
-
-        request->headers_out.status = status;
-        request->headers_out.content_length_n = error_len;
-        ngx_str_set(&request->headers_out.content_type, "application/json");
-
-        rc = ngx_http_send_header(request);
-        if (rc == NGX_ERROR || rc > NGX_OK || request->header_only) {
-            return rc;
-        }
+    error_body = status >= NGX_HTTP_INTERNAL_SERVER_ERROR ? &server_error_body : &unauthorized_error_body;
 
-        body->pos = json_error_data;
-        body->last = json_error_data + error_len;
-        body->memory = 1;
-        body->last_buf = 1;
-        body->last_in_chain = 1;
-        output.buf = body;
-        output.next = NULL;
+    request->headers_out.status = status;
+    request->headers_out.content_length_n = error_body->len;
+    request->headers_out.content_type_len = error_content_type.len;
+    request->headers_out.content_type = error_content_type;
 
-        /* Return an error result, which also requires finalize_request to be called, to prevent a 'header already sent' warning in logs
-           https://forum.nginx.org/read.php?29,280514,280521#msg-280521 */
-        rc = ngx_http_output_filter(request, &output);
-        ngx_http_finalize_request(request, rc);
-        return NGX_DONE;
+    rc = ngx_http_send_header(request);
+    if (rc == NGX_ERROR || rc > NGX_OK || request->header_only) {
+        return rc;
     }
+
+    body->pos = error_body->data;
+    body->last = error_body->data + error_body->len;
+    body->memory = 1;
+    body->last_buf = 1;
+    body->last_in_chain = 1;
+    output.buf = body;
+    output.next = NULL;
+
+    /* Return an error result, which also requires finalize_request to be called, to prevent a 'header already sent' warning in logs
+       https://forum.nginx.org/read.php?29,280514,280521#msg-280521 */
+    rc = ngx_http_output_filter(request, &output);
+    ngx_http_finalize_request(request, rc);
+    return NGX_DONE;
 }
 
 
 /*
  * When there is a valid web origin, add CORS headers so that Javascript can read the response
+ * The static headers were rendered per location at startup, so only the echoed values are built here
  */
-static ngx_int_t add_cors_response_headers(ngx_http_request_t *request, oauth_proxy_configuration_t *config, u_char is_error)
+static ngx_int_t add_cors_response_headers(ngx_http_request_t *request, oauth_proxy_configuration_t *config, const oauth_proxy_request_headers_t *headers, u_char is_error)
 {
-    ngx_str_t *web_origin = NULL;
-    ngx_str_t *allow_headers = NULL;
-    ngx_str_t allow_credentials_str;
-    ngx_str_t vary_str;
-    const char *literal_request_headers = "access-control-request-headers";
+    static ngx_str_t allow_origin_name = ngx_string("access-control-allow-origin");
+    static ngx_str_t allow_headers_name = ngx_string("access-control-allow-headers");
+    ngx_array_t *static_headers = NULL;
 
-    web_origin = get_header(request, "origin");
-    if (web_origin != NULL && verify_web_origin(config, web_origin) == NGX_OK)
+    /* These are always needed in order for the SPA to be able to read error responses from the module */
+    if (!headers->origin_trusted || (!config->cors_enabled && is_error == 0))
     {
-        /* These are always needed in order for the SPA to be able to read error responses from the module */
-        if (config->cors_enabled || is_error != 0)
-        {
-            if (oauth_proxy_utils_add_header_out(request,  "access-control-allow-origin", web_origin) != NGX_OK)
-            {
-                ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "OAuth proxy failed to add CORS allow_origin response header");
-                return NGX_HTTP_INTERNAL_SERVER_ERROR;
-            }
+        return NGX_OK;
+    }
+
+    if (oauth_proxy_utils_add_header_out(request, &allow_origin_name, headers->origin) != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "OAuth proxy failed to add CORS allow_origin response header");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-            ngx_str_set(&allow_credentials_str, "true");
-            if (oauth_proxy_utils_add_header_out(request,  "access-control-allow-credentials", &allow_credentials_str) != NGX_OK)
+    if (!config->cors_enabled)
+    {
+        static_headers = config->cors_error_headers;
+    }
+    else if (request->method == NGX_HTTP_OPTIONS)
+    {
+        /* If no headers are set explicitly then return any headers the browser requests at runtime */
+        if (config->cors_allow_headers.len == 0 && headers->access_control_request_headers != NULL)
+        {
+            if (oauth_proxy_utils_add_header_out(request, &allow_headers_name, headers->access_control_request_headers) != NGX_OK)
             {
-                ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "OAuth proxy failed to add CORS allow_credentials response header");
+                ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "OAuth proxy failed to add CORS allow_headers response header");
                 return NGX_HTTP_INTERNAL_SERVER_ERROR;
             }
         }
 
-        if (config->cors_enabled)
-        {
-            /* Write headers only needed in responses to pre-flight requests */
-            ngx_str_set(&vary_str, "origin");
-            if (request->method == NGX_HTTP_OPTIONS)
-            {
-                if (config->cors_allow_methods.len > 0)
-                {
-                    if (oauth_proxy_utils_add_header_out(request,  "access-control-allow-methods", &config->cors_allow_methods) != NGX_OK)
-                    {
-                        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "OAuth proxy failed to add CORS allow_methods response header");
-                        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-                    }
-                }
-
-                /* If no headers are set explicitly then return any headers the browser requests at runtime
-                   This ensures that the API gateway does not need reconfiguration whenever a new header is sent */
-                allow_headers = &config->cors_allow_headers;
-                if (allow_headers->len == 0)
-                {
-                    allow_headers = oauth_proxy_utils_get_header_in(request, (u_char *)literal_request_headers, ngx_strlen(literal_request_headers));
-                    ngx_str_set(&vary_str, "origin,access-control-request-headers");
-                }
-
-                if (allow_headers != NULL)
-                {
-                    if (oauth_proxy_utils_add_header_out(request,  "access-control-allow-headers", allow_headers) != NGX_OK)
-                    {
-                        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "OAuth proxy failed to add CORS allow_headers response header");
-                        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-                    }
-                }
-
-                if (config->cors_max_age > 0)
-                {
-                    if (oauth_proxy_utils_add_integer_header_out(request,  "access-control-max-age", config->cors_max_age) != NGX_OK)
-                    {
-                        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "OAuth proxy failed to add CORS max_age header");
-                        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-                    }
-                }
-            }
+        static_headers = config->cors_preflight_headers;
+    }
+    else
+    {
+        static_headers = config->cors_response_headers;
+    }
 
-            /* These headers are needed in both pre-flight requests and the main request */
-            if (config->cors_expose_headers.len > 0)
-            {
-                if (oauth_proxy_utils_add_header_out(request,  "access-control-expose-headers", &config->cors_expose_headers) != NGX_OK)
-                {
-                    ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "OAuth proxy failed to add CORS expose_headers response header");
-                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
-                }
-            }
+    if (oauth_proxy_utils_add_headers_out(request, static_headers) != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "OAuth proxy failed to add CORS response headers");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-            if (oauth_proxy_utils_add_header_out(request,  "vary", &vary_str) != NGX_OK)
-            {
-                ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "OAuth proxy failed to add CORS vary response header");
-                return NGX_HTTP_INTERNAL_SERVER_ERROR;
-            }
+    return NGX_OK;
+}
+
+/*
+ * Return the outcome of the module's checks, which is ok, preflight or the rejection reason
+ */
+ngx_int_t oauth_proxy_handler_get_result_variable(ngx_http_request_t *request, ngx_http_variable_value_t *value, uintptr_t data)
+{
+    oauth_proxy_request_context_t *context = ngx_http_get_module_ctx(request, ngx_curity_http_oauth_proxy_module);
+    const char *result = NULL;
+
+    if (context == NULL)
+    {
+        value->not_found = 1;
+        return NGX_OK;
+    }
+
+    /* The names are static, so the value refers to them without copying */
+    result = oauth_proxy_metrics_get_counter_name(context->result);
+    value->len = ngx_strlen(result);
+    value->data = (u_char *)result;
+    value->valid = 1;
+    value->no_cacheable = 0;
+    value->not_found = 0;
+    return NGX_OK;
+}
+
+/*
+ * Return the encoded size of the access token cookie
+ */
+ngx_int_t oauth_proxy_handler_get_cookie_bytes_variable(ngx_http_request_t *request, ngx_http_variable_value_t *value, uintptr_t data)
+{
+    oauth_proxy_request_context_t *context = ngx_http_get_module_ctx(request, ngx_curity_http_oauth_proxy_module);
+    u_char *buffer = NULL;
+
+    if (context == NULL || context->cookie_bytes == 0)
+    {
+        value->not_found = 1;
+        return NGX_OK;
+    }
+
+    buffer = ngx_pnalloc(request->pool, NGX_SIZE_T_LEN);
+    if (buffer == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    return set_variable_value(value, buffer, ngx_sprintf(buffer, "%uz", context->cookie_bytes) - buffer);
+}
+
+/*
+ * Return a stage timing in microseconds with nanosecond precision, where the data is the offset of the time in the context
+ */
+ngx_int_t oauth_proxy_handler_get_timing_variable(ngx_http_request_t *request, ngx_http_variable_value_t *value, uintptr_t data)
+{
+    oauth_proxy_request_context_t *context = ngx_http_get_module_ctx(request, ngx_curity_http_oauth_proxy_module);
+    uint64_t elapsed = 0;
+    u_char *buffer = NULL;
+
+    if (context != NULL)
+    {
+        elapsed = *(uint64_t *)((u_char *)context + data);
+    }
+
+    /* Stages that did not run, such as decryption after a cache hit, are logged as a dash */
+    if (elapsed == 0)
+    {
+        value->not_found = 1;
+        return NGX_OK;
+    }
+
+    buffer = ngx_pnalloc(request->pool, NGX_INT64_LEN + 4);
+    if (buffer == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    return set_variable_value(value, buffer, ngx_sprintf(buffer, "%uL.%03uL", elapsed / 1000, elapsed % 1000) - buffer);
+}
+
+/*
+ * Return the request pool memory that the module allocated in one category, or in all categories when the data is the category count
+ */
+ngx_int_t oauth_proxy_handler_get_memory_variable(ngx_http_request_t *request, ngx_http_variable_value_t *value, uintptr_t data)
+{
+    oauth_proxy_request_context_t *context = ngx_http_get_module_ctx(request, ngx_curity_http_oauth_proxy_module);
+    size_t memory = 0;
+    u_char *buffer = NULL;
+    ngx_uint_t i = 0;
+
+    if (context == NULL)
+    {
+        value->not_found = 1;
+        return NGX_OK;
+    }
+
+    for (i = 0; i < OAUTH_PROXY_MEMORY_CATEGORIES; i++)
+    {
+        if (data == OAUTH_PROXY_MEMORY_CATEGORIES || data == i)
+        {
+            memory += context->memory[i];
         }
     }
 
+    buffer = ngx_pnalloc(request->pool, NGX_SIZE_T_LEN);
+    if (buffer == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    return set_variable_value(value, buffer, ngx_sprintf(buffer, "%uz", memory) - buffer);
+}
+
+static ngx_int_t set_variable_value(ngx_http_variable_value_t *value, u_char *data, size_t len)
+{
+    value->len = len;
+    value->data = data;
+    value->valid = 1;
+    value->no_cacheable = 0;
+    value->not_found = 0;
     return NGX_OK;
 }
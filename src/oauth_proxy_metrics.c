@@ -0,0 +1,605 @@
+/*
+ *  Copyright 2022 Curity AB
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_string.h>
+#include "oauth_proxy.h"
+
+/* Histogram counters follow the plain counters, with a bucket per bound, an overflow bucket and a running sum */
+#define COOKIE_SIZE_BOUNDS 7
+#define DECRYPT_TIME_BOUNDS 8
+#define MEMORY_SIZE_BOUNDS 8
+#define COOKIE_SIZE_OFFSET OAUTH_PROXY_METRIC_COUNTERS
+#define DECRYPT_TIME_OFFSET (COOKIE_SIZE_OFFSET + COOKIE_SIZE_BOUNDS + 2)
+#define MEMORY_SIZE_OFFSET (DECRYPT_TIME_OFFSET + DECRYPT_TIME_BOUNDS + 2)
+
+/* The bytes of each memory category are summed after the histograms */
+#define MEMORY_CATEGORY_OFFSET (MEMORY_SIZE_OFFSET + MEMORY_SIZE_BOUNDS + 2)
+#define LOCATION_COUNTERS (MEMORY_CATEGORY_OFFSET + OAUTH_PROXY_MEMORY_CATEGORIES)
+
+/* Each location renders its counters, its rejection reasons, its memory categories, and the buckets, sum and count of each histogram */
+#define LOCATION_LINES (OAUTH_PROXY_METRIC_COUNTERS + OAUTH_PROXY_MEMORY_CATEGORIES + COOKIE_SIZE_BOUNDS + DECRYPT_TIME_BOUNDS + MEMORY_SIZE_BOUNDS + 9)
+#define MAX_LINE_SIZE 128
+#define MAX_HEADER_SIZE 2048
+
+/*
+ * Counters live in the shared zone as one slot per worker, and each slot is padded to a cache line
+ * Workers only write to their own slot, so the hot path has no contention, and the status handler adds the slots together
+ */
+struct oauth_proxy_metrics_s
+{
+    ngx_shm_zone_t *zone;
+    ngx_array_t *locations;
+    ngx_str_t *labels;
+    ngx_uint_t slots;
+    ngx_uint_t slot_size;
+    ngx_atomic_t *counters;
+    ngx_atomic_t *worker_counters;
+};
+
+/* Describes how a histogram is stored and rendered */
+typedef struct
+{
+    const char *name;
+    const char *help;
+    ngx_uint_t offset;
+    ngx_uint_t bound_count;
+    const uint64_t *bounds;
+    const char **bound_labels;
+    ngx_flag_t nanoseconds;
+} oauth_proxy_histogram_t;
+
+/* Cookie sizes are the encoded length, where JWT access tokens are usually a few kilobytes */
+static const uint64_t cookie_size_bounds[COOKIE_SIZE_BOUNDS] = {256, 512, 1024, 2048, 4096, 8192, 16384};
+static const char *cookie_size_labels[COOKIE_SIZE_BOUNDS] = {"256", "512", "1024", "2048", "4096", "8192", "16384"};
+
+/* Decryption times are measured in nanoseconds and rendered in seconds, as Prometheus expects */
+static const uint64_t decrypt_time_bounds[DECRYPT_TIME_BOUNDS] = {2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000};
+static const char *decrypt_time_labels[DECRYPT_TIME_BOUNDS] = {"0.0000025", "0.000005", "0.00001", "0.000025", "0.00005", "0.0001", "0.00025", "0.001"};
+
+/* The module's request pool memory per request, where NGINX allocates request pools in blocks of request_pool_size, which defaults to 4k */
+static const uint64_t memory_size_bounds[MEMORY_SIZE_BOUNDS] = {256, 512, 1024, 2048, 4096, 8192, 16384, 32768};
+static const char *memory_size_labels[MEMORY_SIZE_BOUNDS] = {"256", "512", "1024", "2048", "4096", "8192", "16384", "32768"};
+
+static oauth_proxy_histogram_t histograms[] =
+{
+    {
+        "oauth_proxy_cookie_size_bytes",
+        "Size of received access token cookies",
+        COOKIE_SIZE_OFFSET,
+        COOKIE_SIZE_BOUNDS,
+        cookie_size_bounds,
+        cookie_size_labels,
+        0
+    },
+    {
+        "oauth_proxy_decrypt_duration_seconds",
+        "Time taken to decrypt cookies",
+        DECRYPT_TIME_OFFSET,
+        DECRYPT_TIME_BOUNDS,
+        decrypt_time_bounds,
+        decrypt_time_labels,
+        1
+    },
+    {
+        "oauth_proxy_request_memory_bytes",
+        "Request pool memory allocated by the OAuth proxy for each request",
+        MEMORY_SIZE_OFFSET,
+        MEMORY_SIZE_BOUNDS,
+        memory_size_bounds,
+        memory_size_labels,
+        0
+    }
+};
+
+/* Counter names, used as rejection reason labels and $oauth_proxy_result values, where a counted request means it was allowed */
+static const char *counter_names[OAUTH_PROXY_METRIC_COUNTERS] =
+{
+    "ok",
+    "preflight",
+    "decrypt_failure",
+    "origin_missing",
+    "origin_untrusted",
+    "csrf_cookie_missing",
+    "csrf_header_missing",
+    "csrf_mismatch",
+    "cookie_missing",
+    "decryption_failed",
+    "server_error",
+    "introspection_failed",
+    "client_throttled"
+};
+
+/* Memory category names, used as labels */
+static const char *memory_category_names[OAUTH_PROXY_MEMORY_CATEGORIES] =
+{
+    "ciphertext",
+    "plaintext",
+    "headers",
+    "state"
+};
+
+static ngx_str_t metrics_zone_name = ngx_string("oauth_proxy_metrics");
+static ngx_str_t metrics_content_type = ngx_string("text/plain; version=0.0.4");
+
+/* Forward declarations */
+static ngx_int_t init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static ngx_flag_t is_same_layout(const oauth_proxy_metrics_t *metrics, const oauth_proxy_metrics_t *old_metrics);
+static ngx_int_t escape_label(ngx_conf_t *main_config, ngx_str_t *label, const ngx_str_t *location_name);
+static ngx_int_t status_handler(ngx_http_request_t *request);
+static u_char *write_metrics(const oauth_proxy_metrics_t *metrics, u_char *p, u_char *last);
+static u_char *write_histogram(const oauth_proxy_metrics_t *metrics, const oauth_proxy_histogram_t *histogram, u_char *p, u_char *last);
+static ngx_atomic_uint_t get_total(const oauth_proxy_metrics_t *metrics, ngx_uint_t location, ngx_uint_t counter);
+
+/*
+ * Parse the oauth_proxy_status directive, which serves metrics for all locations from the location where it is used
+ */
+char *oauth_proxy_metrics_configure_status(ngx_conf_t *main_config, ngx_command_t *command, void *conf)
+{
+    oauth_proxy_configuration_t *config = conf;
+    oauth_proxy_main_configuration_t *module_main_config = NULL;
+    ngx_http_core_loc_conf_t *core_config = NULL;
+
+    module_main_config = ngx_http_conf_get_module_main_conf(main_config, ngx_curity_http_oauth_proxy_module);
+    module_main_config->status_enabled = 1;
+
+    core_config = ngx_http_conf_get_module_loc_conf(main_config, ngx_http_core_module);
+    core_config->handler = status_handler;
+
+    /* Scrapers do not send cookies, so the status location does not inherit cookie checks unless configured explicitly */
+    if (config->enabled == NGX_CONF_UNSET)
+    {
+        config->enabled = 0;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * Called after all locations are merged, to size the zone for the enabled locations and the number of workers
+ */
+ngx_int_t oauth_proxy_metrics_initialize(ngx_conf_t *main_config, oauth_proxy_main_configuration_t *module_main_config)
+{
+    oauth_proxy_metrics_t *metrics = NULL;
+    oauth_proxy_configuration_t **locations = NULL;
+    ngx_core_conf_t *core_config = NULL;
+    size_t size = 0;
+    ngx_uint_t i = 0;
+
+    if (!module_main_config->status_enabled)
+    {
+        return NGX_OK;
+    }
+
+    metrics = ngx_pcalloc(main_config->pool, sizeof(oauth_proxy_metrics_t));
+    if (metrics == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    metrics->locations = module_main_config->locations;
+    metrics->labels = ngx_pcalloc(main_config->pool, sizeof(ngx_str_t) * ngx_max(metrics->locations->nelts, 1));
+    if (metrics->labels == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    /* The worker_processes directive is usually set before the http block, and any extra workers share slots */
+    core_config = (ngx_core_conf_t *)ngx_get_conf(main_config->cycle->conf_ctx, ngx_core_module);
+    metrics->slots = core_config->worker_processes > 0 ? (ngx_uint_t)core_config->worker_processes : (ngx_uint_t)ngx_ncpu;
+    metrics->slots = ngx_max(metrics->slots, 1);
+    metrics->slot_size = ngx_align(metrics->locations->nelts * LOCATION_COUNTERS, ngx_cacheline_size / sizeof(ngx_atomic_t));
+    metrics->slot_size = ngx_max(metrics->slot_size, 1);
+
+    locations = metrics->locations->elts;
+    for (i = 0; i < metrics->locations->nelts; i++)
+    {
+        if (escape_label(main_config, &metrics->labels[i], &locations[i]->location_name) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        locations[i]->metrics = metrics;
+        locations[i]->metrics_index = i;
+    }
+
+    /* Leave room for the slab pool's own pages in addition to the counters */
+    size = metrics->slots * metrics->slot_size * sizeof(ngx_atomic_t) + 8 * ngx_pagesize;
+    /* The zone is tagged with its init function, so that NGINX rejects a cache or throttle zone declared with the same name */
+    metrics->zone = ngx_shared_memory_add(main_config, &metrics_zone_name, size, (void *)init_zone);
+    if (metrics->zone == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    metrics->zone->init = init_zone;
+    metrics->zone->data = metrics;
+    module_main_config->metrics = metrics;
+    return NGX_OK;
+}
+
+/*
+ * Select the worker's slot once, so that each increment is a single uncontended atomic add
+ */
+void oauth_proxy_metrics_init_process(oauth_proxy_main_configuration_t *module_main_config)
+{
+    oauth_proxy_metrics_t *metrics = module_main_config->metrics;
+
+    if (metrics == NULL)
+    {
+        return;
+    }
+
+    metrics->worker_counters = metrics->counters + (ngx_worker % metrics->slots) * metrics->slot_size;
+}
+
+/*
+ * Increment a counter for the location
+ */
+void oauth_proxy_metrics_increment(const oauth_proxy_configuration_t *config, ngx_uint_t counter)
+{
+    if (config->metrics == NULL || config->metrics->worker_counters == NULL)
+    {
+        return;
+    }
+
+    ngx_atomic_fetch_add(&config->metrics->worker_counters[config->metrics_index * LOCATION_COUNTERS + counter], 1);
+}
+
+/*
+ * Record a value in one of the location's histograms, in bytes or nanoseconds
+ */
+void oauth_proxy_metrics_observe(const oauth_proxy_configuration_t *config, ngx_uint_t histogram, uint64_t value)
+{
+    const oauth_proxy_histogram_t *definition = &histograms[histogram];
+    ngx_atomic_t *counters = NULL;
+    ngx_uint_t bucket = 0;
+
+    if (config->metrics == NULL || config->metrics->worker_counters == NULL)
+    {
+        return;
+    }
+
+    while (bucket < definition->bound_count && value > definition->bounds[bucket])
+    {
+        bucket++;
+    }
+
+    counters = config->metrics->worker_counters + config->metrics_index * LOCATION_COUNTERS + definition->offset;
+    ngx_atomic_fetch_add(&counters[bucket], 1);
+    ngx_atomic_fetch_add(&counters[definition->bound_count + 1], (ngx_atomic_int_t)value);
+}
+
+/*
+ * Record a request's memory in the location's histogram, and add each category to its total
+ */
+void oauth_proxy_metrics_observe_memory(const oauth_proxy_configuration_t *config, const size_t *memory)
+{
+    ngx_atomic_t *counters = NULL;
+    uint64_t total = 0;
+    ngx_uint_t i = 0;
+
+    if (config->metrics == NULL || config->metrics->worker_counters == NULL)
+    {
+        return;
+    }
+
+    counters = config->metrics->worker_counters + config->metrics_index * LOCATION_COUNTERS + MEMORY_CATEGORY_OFFSET;
+    for (i = 0; i < OAUTH_PROXY_MEMORY_CATEGORIES; i++)
+    {
+        if (memory[i] > 0)
+        {
+            ngx_atomic_fetch_add(&counters[i], (ngx_atomic_int_t)memory[i]);
+            total += memory[i];
+        }
+    }
+
+    oauth_proxy_metrics_observe(config, OAUTH_PROXY_METRIC_MEMORY_SIZE, total);
+}
+
+/*
+ * Return the name of a counter, which is also the name of a request result
+ */
+const char *oauth_proxy_metrics_get_counter_name(ngx_uint_t counter)
+{
+    return counter_names[counter];
+}
+
+/*
+ * Allocate the counters, or keep the existing counters on a reload when the locations and workers are unchanged
+ */
+static ngx_int_t init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    oauth_proxy_metrics_t *old_metrics = data;
+    oauth_proxy_metrics_t *metrics = shm_zone->data;
+    ngx_slab_pool_t *shpool = NULL;
+    size_t size = metrics->slots * metrics->slot_size * sizeof(ngx_atomic_t);
+
+    /* A reused zone has the same size and so the same number of counters, but they may belong to other locations */
+    if (old_metrics != NULL)
+    {
+        metrics->counters = old_metrics->counters;
+        if (!is_same_layout(metrics, old_metrics))
+        {
+            ngx_memzero((void *)metrics->counters, size);
+        }
+
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+    if (shm_zone->shm.exists)
+    {
+        metrics->counters = shpool->data;
+        return NGX_OK;
+    }
+
+    metrics->counters = ngx_slab_calloc(shpool, size);
+    if (metrics->counters == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    shpool->data = (void *)metrics->counters;
+    return NGX_OK;
+}
+
+/*
+ * Counters are only kept across a reload when every slot and location still has the same meaning
+ */
+static ngx_flag_t is_same_layout(const oauth_proxy_metrics_t *metrics, const oauth_proxy_metrics_t *old_metrics)
+{
+    ngx_uint_t i = 0;
+
+    if (metrics->slots != old_metrics->slots || metrics->locations->nelts != old_metrics->locations->nelts)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < metrics->locations->nelts; i++)
+    {
+        if (metrics->labels[i].len != old_metrics->labels[i].len ||
+            ngx_memcmp(metrics->labels[i].data, old_metrics->labels[i].data, metrics->labels[i].len) != 0)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Location names can be regular expressions, so escape the characters that are special in label values
+ */
+static ngx_int_t escape_label(ngx_conf_t *main_config, ngx_str_t *label, const ngx_str_t *location_name)
+{
+    u_char *p = NULL;
+    ngx_uint_t i = 0;
+
+    label->data = ngx_pnalloc(main_config->pool, location_name->len * 2 + 1);
+    if (label->data == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    p = label->data;
+    for (i = 0; i < location_name->len; i++)
+    {
+        switch (location_name->data[i])
+        {
+            case '\\':
+            case '"':
+                *p++ = '\\';
+                *p++ = location_name->data[i];
+                break;
+
+            case '\n':
+                *p++ = '\\';
+                *p++ = 'n';
+                break;
+
+            default:
+                *p++ = location_name->data[i];
+                break;
+        }
+    }
+
+    label->len = p - label->data;
+    return NGX_OK;
+}
+
+/*
+ * Serve all locations' metrics in the Prometheus text format
+ */
+static ngx_int_t status_handler(ngx_http_request_t *request)
+{
+    oauth_proxy_main_configuration_t *module_main_config = NULL;
+    oauth_proxy_metrics_t *metrics = NULL;
+    ngx_buf_t *body = NULL;
+    ngx_chain_t output;
+    ngx_uint_t i = 0;
+    size_t size = MAX_HEADER_SIZE;
+    ngx_int_t rc = NGX_OK;
+
+    if (!(request->method & (NGX_HTTP_GET | NGX_HTTP_HEAD)))
+    {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(request);
+    if (rc != NGX_OK)
+    {
+        return rc;
+    }
+
+    module_main_config = ngx_http_get_module_main_conf(request, ngx_curity_http_oauth_proxy_module);
+    metrics = module_main_config->metrics;
+    if (metrics == NULL || metrics->counters == NULL)
+    {
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    for (i = 0; i < metrics->locations->nelts; i++)
+    {
+        size += LOCATION_LINES * (MAX_LINE_SIZE + metrics->labels[i].len);
+    }
+
+    body = ngx_create_temp_buf(request->pool, size);
+    if (body == NULL)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "OAuth proxy failed to allocate memory for the status response");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    body->last = write_metrics(metrics, body->pos, body->end);
+    body->last_buf = (request == request->main) ? 1 : 0;
+    body->last_in_chain = 1;
+
+    request->headers_out.status = NGX_HTTP_OK;
+    request->headers_out.content_length_n = body->last - body->pos;
+    request->headers_out.content_type_len = metrics_content_type.len;
+    request->headers_out.content_type = metrics_content_type;
+
+    rc = ngx_http_send_header(request);
+    if (rc == NGX_ERROR || rc > NGX_OK || request->header_only)
+    {
+        return rc;
+    }
+
+    output.buf = body;
+    output.next = NULL;
+    return ngx_http_output_filter(request, &output);
+}
+
+/*
+ * Write each metric family once, with a line per location
+ */
+static u_char *write_metrics(const oauth_proxy_metrics_t *metrics, u_char *p, u_char *last)
+{
+    ngx_uint_t i = 0;
+    ngx_uint_t j = 0;
+
+    p = ngx_slprintf(p, last, "# HELP oauth_proxy_requests_total Requests handled by the OAuth proxy\n"
+                              "# TYPE oauth_proxy_requests_total counter\n");
+    for (i = 0; i < metrics->locations->nelts; i++)
+    {
+        p = ngx_slprintf(p, last, "oauth_proxy_requests_total{location=\"%V\"} %uA\n",
+                         &metrics->labels[i], get_total(metrics, i, OAUTH_PROXY_METRIC_REQUESTS));
+    }
+
+    p = ngx_slprintf(p, last, "# HELP oauth_proxy_preflights_total CORS preflight requests answered by the OAuth proxy\n"
+                              "# TYPE oauth_proxy_preflights_total counter\n");
+    for (i = 0; i < metrics->locations->nelts; i++)
+    {
+        p = ngx_slprintf(p, last, "oauth_proxy_preflights_total{location=\"%V\"} %uA\n",
+                         &metrics->labels[i], get_total(metrics, i, OAUTH_PROXY_METRIC_PREFLIGHTS));
+    }
+
+    p = ngx_slprintf(p, last, "# HELP oauth_proxy_rejections_total Requests rejected by the OAuth proxy\n"
+                              "# TYPE oauth_proxy_rejections_total counter\n");
+    for (i = 0; i < metrics->locations->nelts; i++)
+    {
+        for (j = OAUTH_PROXY_METRIC_ORIGIN_MISSING; j < OAUTH_PROXY_METRIC_COUNTERS; j++)
+        {
+            p = ngx_slprintf(p, last, "oauth_proxy_rejections_total{location=\"%V\",reason=\"%s\"} %uA\n",
+                             &metrics->labels[i], counter_names[j], get_total(metrics, i, j));
+        }
+    }
+
+    p = ngx_slprintf(p, last, "# HELP oauth_proxy_decrypt_failures_total Cookies that could not be decrypted\n"
+                              "# TYPE oauth_proxy_decrypt_failures_total counter\n");
+    for (i = 0; i < metrics->locations->nelts; i++)
+    {
+        p = ngx_slprintf(p, last, "oauth_proxy_decrypt_failures_total{location=\"%V\"} %uA\n",
+                         &metrics->labels[i], get_total(metrics, i, OAUTH_PROXY_METRIC_DECRYPT_FAILURES));
+    }
+
+    p = ngx_slprintf(p, last, "# HELP oauth_proxy_memory_bytes_total Request pool memory allocated by the OAuth proxy\n"
+                              "# TYPE oauth_proxy_memory_bytes_total counter\n");
+    for (i = 0; i < metrics->locations->nelts; i++)
+    {
+        for (j = 0; j < OAUTH_PROXY_MEMORY_CATEGORIES; j++)
+        {
+            p = ngx_slprintf(p, last, "oauth_proxy_memory_bytes_total{location=\"%V\",category=\"%s\"} %uA\n",
+                             &metrics->labels[i], memory_category_names[j], get_total(metrics, i, MEMORY_CATEGORY_OFFSET + j));
+        }
+    }
+
+    for (j = 0; j < sizeof(histograms) / sizeof(histograms[0]); j++)
+    {
+        p = write_histogram(metrics, &histograms[j], p, last);
+    }
+
+    return p;
+}
+
+/*
+ * Buckets are stored individually, and Prometheus expects each bucket to include the buckets below it
+ */
+static u_char *write_histogram(const oauth_proxy_metrics_t *metrics, const oauth_proxy_histogram_t *histogram, u_char *p, u_char *last)
+{
+    ngx_atomic_uint_t count = 0;
+    ngx_atomic_uint_t sum = 0;
+    ngx_uint_t i = 0;
+    ngx_uint_t j = 0;
+
+    p = ngx_slprintf(p, last, "# HELP %s %s\n# TYPE %s histogram\n", histogram->name, histogram->help, histogram->name);
+    for (i = 0; i < metrics->locations->nelts; i++)
+    {
+        count = 0;
+        for (j = 0; j < histogram->bound_count; j++)
+        {
+            count += get_total(metrics, i, histogram->offset + j);
+            p = ngx_slprintf(p, last, "%s_bucket{location=\"%V\",le=\"%s\"} %uA\n",
+                             histogram->name, &metrics->labels[i], histogram->bound_labels[j], count);
+        }
+
+        count += get_total(metrics, i, histogram->offset + histogram->bound_count);
+        p = ngx_slprintf(p, last, "%s_bucket{location=\"%V\",le=\"+Inf\"} %uA\n", histogram->name, &metrics->labels[i], count);
+
+        sum = get_total(metrics, i, histogram->offset + histogram->bound_count + 1);
+        if (histogram->nanoseconds)
+        {
+            p = ngx_slprintf(p, last, "%s_sum{location=\"%V\"} %uA.%09uA\n", histogram->name, &metrics->labels[i], sum / 1000000000, sum % 1000000000);
+        }
+        else
+        {
+            p = ngx_slprintf(p, last, "%s_sum{location=\"%V\"} %uA\n", histogram->name, &metrics->labels[i], sum);
+        }
+
+        p = ngx_slprintf(p, last, "%s_count{location=\"%V\"} %uA\n", histogram->name, &metrics->labels[i], count);
+    }
+
+    return p;
+}
+
+/*
+ * Add a location's counter across all worker slots
+ */
+static ngx_atomic_uint_t get_total(const oauth_proxy_metrics_t *metrics, ngx_uint_t location, ngx_uint_t counter)
+{
+    ngx_atomic_uint_t total = 0;
+    ngx_uint_t i = 0;
+
+    for (i = 0; i < metrics->slots; i++)
+    {
+        total += metrics->counters[i * metrics->slot_size + location * LOCATION_COUNTERS + counter];
+    }
+
+    return total;
+}
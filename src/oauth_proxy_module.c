@@ -21,9 +21,14 @@
 #include "oauth_proxy.h"
 
 /* Forward declarations */
+static ngx_int_t add_variables(ngx_conf_t *config);
+static void *create_main_configuration(ngx_conf_t *config);
 static void *create_location_configuration(ngx_conf_t *config);
 static char *merge_location_configuration(ngx_conf_t *main_config, void *parent, void *child);
 static ngx_int_t post_configuration(ngx_conf_t *config);
+static void find_used_variables(ngx_conf_t *config, oauth_proxy_main_configuration_t *module_main_config);
+static ngx_int_t init_process(ngx_cycle_t *cycle);
+static void exit_process(ngx_cycle_t *cycle);
 
 /* Configuration directives */
 static ngx_command_t oauth_proxy_module_directives[] =
@@ -46,10 +51,10 @@ static ngx_command_t oauth_proxy_module_directives[] =
     },
     {
         ngx_string("oauth_proxy_encryption_key"),
-        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
-        ngx_conf_set_str_slot,
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+        oauth_proxy_configuration_set_encryption_key,
         NGX_HTTP_LOC_CONF_OFFSET,
-        offsetof(oauth_proxy_configuration_t, encryption_key),
+        offsetof(oauth_proxy_configuration_t, encryption_keys),
         NULL
     },
     {
@@ -108,16 +113,206 @@ static ngx_command_t oauth_proxy_module_directives[] =
         offsetof(oauth_proxy_configuration_t, cors_max_age),
         NULL
     },
+    {
+        ngx_string("oauth_proxy_csrf_hmac_key"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_str_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(oauth_proxy_configuration_t, csrf_hmac_key),
+        NULL
+    },
+    {
+        ngx_string("oauth_proxy_phantom_token"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE2,
+        oauth_proxy_phantom_configure,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("oauth_proxy_dynamic_config"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+        oauth_proxy_dynamic_configure,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("oauth_proxy_cache"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+        oauth_proxy_cache_configure,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("oauth_proxy_negative_cache"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+        oauth_proxy_negative_cache_configure,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("oauth_proxy_throttle"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+        oauth_proxy_throttle_configure,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("oauth_proxy_thread_pool"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+        oauth_proxy_threads_configure,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("oauth_proxy_max_decompressed_size"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_size_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(oauth_proxy_configuration_t, max_decompressed_size),
+        NULL
+    },
+    {
+        ngx_string("oauth_proxy_status"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+        oauth_proxy_metrics_configure_status,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
     ngx_null_command /* command termination */
 };
 
+/* Variables */
+static ngx_http_variable_t oauth_proxy_module_variables[] =
+{
+    {
+        ngx_string("oauth_proxy_cache_hits"),
+        NULL,
+        oauth_proxy_cache_get_counter_variable,
+        OAUTH_PROXY_CACHE_HITS,
+        NGX_HTTP_VAR_NOCACHEABLE,
+        0
+    },
+    {
+        ngx_string("oauth_proxy_cache_misses"),
+        NULL,
+        oauth_proxy_cache_get_counter_variable,
+        OAUTH_PROXY_CACHE_MISSES,
+        NGX_HTTP_VAR_NOCACHEABLE,
+        0
+    },
+    {
+        ngx_string("oauth_proxy_cache_evictions"),
+        NULL,
+        oauth_proxy_cache_get_counter_variable,
+        OAUTH_PROXY_CACHE_EVICTIONS,
+        NGX_HTTP_VAR_NOCACHEABLE,
+        0
+    },
+    {
+        ngx_string("oauth_proxy_result"),
+        NULL,
+        oauth_proxy_handler_get_result_variable,
+        0,
+        0,
+        0
+    },
+    {
+        ngx_string("oauth_proxy_cookie_bytes"),
+        NULL,
+        oauth_proxy_handler_get_cookie_bytes_variable,
+        0,
+        0,
+        0
+    },
+    {
+        ngx_string("oauth_proxy_origin_time"),
+        NULL,
+        oauth_proxy_handler_get_timing_variable,
+        offsetof(oauth_proxy_request_context_t, origin_time),
+        0,
+        0
+    },
+    {
+        ngx_string("oauth_proxy_csrf_time"),
+        NULL,
+        oauth_proxy_handler_get_timing_variable,
+        offsetof(oauth_proxy_request_context_t, csrf_time),
+        0,
+        0
+    },
+    {
+        ngx_string("oauth_proxy_decrypt_time"),
+        NULL,
+        oauth_proxy_handler_get_timing_variable,
+        offsetof(oauth_proxy_request_context_t, decrypt_time),
+        0,
+        0
+    },
+    {
+        ngx_string("oauth_proxy_headers_time"),
+        NULL,
+        oauth_proxy_handler_get_timing_variable,
+        offsetof(oauth_proxy_request_context_t, headers_time),
+        0,
+        0
+    },
+    {
+        ngx_string("oauth_proxy_memory_bytes"),
+        NULL,
+        oauth_proxy_handler_get_memory_variable,
+        OAUTH_PROXY_MEMORY_CATEGORIES,
+        0,
+        0
+    },
+    {
+        ngx_string("oauth_proxy_memory_ciphertext_bytes"),
+        NULL,
+        oauth_proxy_handler_get_memory_variable,
+        OAUTH_PROXY_MEMORY_CIPHERTEXT,
+        0,
+        0
+    },
+    {
+        ngx_string("oauth_proxy_memory_plaintext_bytes"),
+        NULL,
+        oauth_proxy_handler_get_memory_variable,
+        OAUTH_PROXY_MEMORY_PLAINTEXT,
+        0,
+        0
+    },
+    {
+        ngx_string("oauth_proxy_memory_header_bytes"),
+        NULL,
+        oauth_proxy_handler_get_memory_variable,
+        OAUTH_PROXY_MEMORY_HEADERS,
+        0,
+        0
+    },
+    {
+        ngx_string("oauth_proxy_memory_state_bytes"),
+        NULL,
+        oauth_proxy_handler_get_memory_variable,
+        OAUTH_PROXY_MEMORY_STATE,
+        0,
+        0
+    },
+    ngx_http_null_variable /* variable termination */
+};
+
 /* NGINX integration */
 static ngx_http_module_t oauth_proxy_module_context =
 {
-    NULL, /* pre-configuration */
+    add_variables,
     post_configuration,
 
-    NULL, /* create main configuration */
+    create_main_configuration,
     NULL, /* init main configuration */
 
     NULL, /* create server configuration */
@@ -136,10 +331,10 @@ ngx_module_t ngx_curity_http_oauth_proxy_module =
     NGX_HTTP_MODULE, /* module type */
     NULL, /* init master */
     NULL, /* init module */
-    NULL, /* init process */
+    init_process,
     NULL, /* init thread */
     NULL, /* exit thread */
-    NULL, /* exit process */
+    exit_process,
     NULL, /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -152,6 +347,31 @@ oauth_proxy_configuration_t* oauth_proxy_module_get_location_configuration(ngx_h
     return ngx_http_get_module_loc_conf(request, ngx_curity_http_oauth_proxy_module);
 }
 
+/*
+ * Called when NGINX starts up, to hold state that spans all locations
+ */
+static void *create_main_configuration(ngx_conf_t *main_config)
+{
+    oauth_proxy_main_configuration_t *module_main_config = ngx_pcalloc(main_config->pool, sizeof(oauth_proxy_main_configuration_t));
+    if (module_main_config == NULL)
+    {
+        return NULL;
+    }
+
+    module_main_config->locations = ngx_array_create(main_config->pool, 4, sizeof(oauth_proxy_configuration_t *));
+    if (module_main_config->locations == NULL)
+    {
+        return NULL;
+    }
+
+    /* These match the hashes NGINX calculates for lowercase header names, so that headers can be found cheaply */
+    module_main_config->authorization_hash = ngx_hash_key((u_char *)"authorization", ngx_strlen("authorization"));
+    module_main_config->origin_hash = ngx_hash_key((u_char *)"origin", ngx_strlen("origin"));
+    module_main_config->request_headers_hash = ngx_hash_key((u_char *)"access-control-request-headers", ngx_strlen("access-control-request-headers"));
+
+    return module_main_config;
+}
+
 /*
  * Called when NGINX starts up and finds a location that uses the plumodulegin
  */
@@ -164,10 +384,25 @@ static void *create_location_configuration(ngx_conf_t *main_config)
     }
 
     location_config->enabled               = NGX_CONF_UNSET_UINT;
+    location_config->encryption_keys       = NGX_CONF_UNSET_PTR;
     location_config->trusted_web_origins   = NGX_CONF_UNSET_PTR;
     location_config->cors_enabled          = NGX_CONF_UNSET_UINT;
     location_config->allow_tokens          = NGX_CONF_UNSET_UINT;
     location_config->cors_max_age          = NGX_CONF_UNSET_UINT;
+    location_config->cache_zone            = NGX_CONF_UNSET_PTR;
+    location_config->cache_ttl             = NGX_CONF_UNSET;
+    location_config->negative_cache_zone   = NGX_CONF_UNSET_PTR;
+    location_config->negative_cache_ttl    = NGX_CONF_UNSET;
+    location_config->throttle_zone         = NGX_CONF_UNSET_PTR;
+    location_config->throttle_threshold    = NGX_CONF_UNSET_UINT;
+    location_config->throttle_window       = NGX_CONF_UNSET_MSEC;
+#if (NGX_THREADS)
+    location_config->thread_pool           = NGX_CONF_UNSET_PTR;
+#endif
+    location_config->thread_pool_threshold = NGX_CONF_UNSET_SIZE;
+    location_config->max_decompressed_size = NGX_CONF_UNSET_SIZE;
+    location_config->phantom_token_zone    = NGX_CONF_UNSET_PTR;
+    location_config->dynamic_config_interval = NGX_CONF_UNSET_MSEC;
     return location_config;
 }
 
@@ -177,34 +412,115 @@ static void *create_location_configuration(ngx_conf_t *main_config)
 static char *merge_location_configuration(ngx_conf_t *main_config, void *parent, void *child)
 {
     oauth_proxy_configuration_t *parent_config = parent, *child_config = child;
+    oauth_proxy_main_configuration_t *module_main_config = NULL;
+    oauth_proxy_configuration_t **location = NULL;
+    ngx_http_core_loc_conf_t *core_config = NULL;
+
+    /* This must come first, so that a parent's keys and origins from its dynamic configuration file are not inherited */
+    oauth_proxy_dynamic_merge(child_config, parent_config);
 
     ngx_conf_merge_off_value(child_config->enabled,                parent_config->enabled,                0);
     ngx_conf_merge_str_value(child_config->cookie_name_prefix,     parent_config->cookie_name_prefix,     "");
-    ngx_conf_merge_str_value(child_config->encryption_key,         parent_config->encryption_key,         "");
+    ngx_conf_merge_ptr_value(child_config->encryption_keys,        parent_config->encryption_keys,        NULL);
     ngx_conf_merge_ptr_value(child_config->trusted_web_origins,    parent_config->trusted_web_origins,    NULL);
     ngx_conf_merge_off_value(child_config->cors_enabled,           parent_config->cors_enabled,           0);
     ngx_conf_merge_off_value(child_config->allow_tokens,           parent_config->allow_tokens,           0);
     ngx_conf_merge_str_value(child_config->cors_allow_methods,     parent_config->cors_allow_methods,     "");
     ngx_conf_merge_str_value(child_config->cors_allow_headers,     parent_config->cors_allow_headers,     "");
     ngx_conf_merge_str_value(child_config->cors_expose_headers,    parent_config->cors_expose_headers,    "");
+    ngx_conf_merge_str_value(child_config->csrf_hmac_key,          parent_config->csrf_hmac_key,          "");
     ngx_conf_merge_off_value(child_config->cors_max_age,           parent_config->cors_max_age,           0);
+    ngx_conf_merge_ptr_value(child_config->cache_zone,             parent_config->cache_zone,             NULL);
+    ngx_conf_merge_sec_value(child_config->cache_ttl,              parent_config->cache_ttl,              60);
+    ngx_conf_merge_ptr_value(child_config->negative_cache_zone,    parent_config->negative_cache_zone,    NULL);
+    ngx_conf_merge_sec_value(child_config->negative_cache_ttl,     parent_config->negative_cache_ttl,     60);
+    ngx_conf_merge_ptr_value(child_config->throttle_zone,          parent_config->throttle_zone,          NULL);
+    ngx_conf_merge_uint_value(child_config->throttle_threshold,    parent_config->throttle_threshold,     10);
+    ngx_conf_merge_msec_value(child_config->throttle_window,       parent_config->throttle_window,        60000);
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(child_config->thread_pool,            parent_config->thread_pool,            NULL);
+#endif
+    ngx_conf_merge_size_value(child_config->thread_pool_threshold, parent_config->thread_pool_threshold,  0);
+    ngx_conf_merge_size_value(child_config->max_decompressed_size, parent_config->max_decompressed_size,  16384);
+    ngx_conf_merge_ptr_value(child_config->phantom_token_zone,     parent_config->phantom_token_zone,     NULL);
+    ngx_conf_merge_str_value(child_config->phantom_token_uri,      parent_config->phantom_token_uri,      "");
+    ngx_conf_merge_str_value(child_config->dynamic_config_file,    parent_config->dynamic_config_file,    "");
+    ngx_conf_merge_msec_value(child_config->dynamic_config_interval, parent_config->dynamic_config_interval, 5000);
     
     if (oauth_proxy_configuration_initialize_location(main_config, child_config) != NGX_OK)
     {
         return NGX_CONF_ERROR;
     }
+
+    /* Disabled locations have no handler, so that the access phase only checks a pointer for them */
+    child_config->handler = oauth_proxy_handler_select(child_config);
+
+    /* Remember enabled locations so that each worker can prepare their decryption state, and metrics can be labelled */
+    if (child_config->enabled)
+    {
+        core_config = ngx_http_conf_get_module_loc_conf(main_config, ngx_http_core_module);
+        child_config->location_name = core_config->name;
+
+        module_main_config = ngx_http_conf_get_module_main_conf(main_config, ngx_curity_http_oauth_proxy_module);
+        location = ngx_array_push(module_main_config->locations);
+        if (location == NULL)
+        {
+            return NGX_CONF_ERROR;
+        }
+
+        *location = child_config;
+    }
     
     return NGX_CONF_OK;
 }
 
+/*
+ * Register variables before configuration is processed, so that log formats can refer to them
+ */
+static ngx_int_t add_variables(ngx_conf_t *config)
+{
+    ngx_http_variable_t *variable = NULL;
+    ngx_http_variable_t *definition = NULL;
+
+    for (definition = oauth_proxy_module_variables; definition->name.len > 0; definition++)
+    {
+        variable = ngx_http_add_variable(config, &definition->name, definition->flags);
+        if (variable == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        variable->get_handler = definition->get_handler;
+        variable->data = definition->data;
+    }
+
+    return NGX_OK;
+}
+
 /*
  * Set up the handler after configuration has been processed
  */
 static ngx_int_t post_configuration(ngx_conf_t *config)
 {
     ngx_http_core_main_conf_t *main_config = ngx_http_conf_get_module_main_conf(config, ngx_http_core_module);
-    ngx_http_handler_pt *h = ngx_array_push(&main_config->phases[NGX_HTTP_ACCESS_PHASE].handlers);
+    oauth_proxy_main_configuration_t *module_main_config = ngx_http_conf_get_module_main_conf(config, ngx_curity_http_oauth_proxy_module);
+    ngx_http_handler_pt *h = NULL;
+
+    /* All locations have been merged at this point, so the metrics zone can be sized */
+    if (oauth_proxy_metrics_initialize(config, module_main_config) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
 
+    find_used_variables(config, module_main_config);
+
+    /* When no location enables the module, the access phase handler is not registered and requests do no module work */
+    if (module_main_config->locations->nelts == 0)
+    {
+        return NGX_OK;
+    }
+
+    h = ngx_array_push(&main_config->phases[NGX_HTTP_ACCESS_PHASE].handlers);
     if (h == NULL)
     {
         return NGX_ERROR;
@@ -213,3 +529,136 @@ static ngx_int_t post_configuration(ngx_conf_t *config)
     *h = oauth_proxy_handler_main;
     return NGX_OK;
 }
+
+/*
+ * Directives that refer to variables, such as log_format, have indexed them by now
+ * Request state is kept when one of the module's request variables is used or metrics are served, and stage timings only for timing variables
+ */
+static void find_used_variables(ngx_conf_t *config, oauth_proxy_main_configuration_t *module_main_config)
+{
+    ngx_http_core_main_conf_t *main_config = ngx_http_conf_get_module_main_conf(config, ngx_http_core_module);
+    oauth_proxy_configuration_t **locations = NULL;
+    ngx_http_variable_t *variables = NULL;
+    ngx_http_variable_t *definition = NULL;
+    ngx_flag_t record_result = 0;
+    ngx_flag_t record_timings = 0;
+    ngx_uint_t i = 0;
+
+    variables = main_config->variables.elts;
+    for (i = 0; i < main_config->variables.nelts; i++)
+    {
+        for (definition = oauth_proxy_module_variables; definition->name.len > 0; definition++)
+        {
+            if (variables[i].name.len != definition->name.len ||
+                ngx_strncmp(variables[i].name.data, definition->name.data, definition->name.len) != 0)
+            {
+                continue;
+            }
+
+            if (definition->get_handler == oauth_proxy_handler_get_timing_variable)
+            {
+                record_timings = 1;
+            }
+
+            if (definition->get_handler == oauth_proxy_handler_get_timing_variable ||
+                definition->get_handler == oauth_proxy_handler_get_result_variable ||
+                definition->get_handler == oauth_proxy_handler_get_cookie_bytes_variable ||
+                definition->get_handler == oauth_proxy_handler_get_memory_variable)
+            {
+                record_result = 1;
+            }
+        }
+    }
+
+    locations = module_main_config->locations->elts;
+    for (i = 0; i < module_main_config->locations->nelts; i++)
+    {
+        /* Served metrics include each request's memory, which is counted in the request state */
+        locations[i]->record_result = record_result || locations[i]->metrics != NULL;
+        locations[i]->record_timings = record_timings;
+    }
+}
+
+/*
+ * Prepare decryption state once per worker, since cipher contexts must not be shared across processes
+ */
+static ngx_int_t init_process(ngx_cycle_t *cycle)
+{
+    oauth_proxy_main_configuration_t *module_main_config = NULL;
+    oauth_proxy_configuration_t **locations = NULL;
+    oauth_proxy_encryption_key_t *keys = NULL;
+    ngx_uint_t i = 0;
+    ngx_uint_t j = 0;
+
+    oauth_proxy_encoding_initialize();
+
+    module_main_config = ngx_http_cycle_get_module_main_conf(cycle, ngx_curity_http_oauth_proxy_module);
+    if (module_main_config == NULL)
+    {
+        return NGX_OK;
+    }
+
+    oauth_proxy_metrics_init_process(module_main_config);
+    if (module_main_config->locations->nelts > 0)
+    {
+        oauth_proxy_cpu_log_features(cycle);
+    }
+
+    locations = module_main_config->locations->elts;
+    for (i = 0; i < module_main_config->locations->nelts; i++)
+    {
+        keys = locations[i]->encryption_keys->elts;
+        for (j = 0; j < locations[i]->encryption_keys->nelts; j++)
+        {
+            if (oauth_proxy_cipher_initialize(cycle, &keys[j]) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+
+        if (locations[i]->csrf_hmac_key.len > 0)
+        {
+            if (oauth_proxy_csrf_initialize_mac(cycle, locations[i]) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+
+        oauth_proxy_dynamic_init_process(cycle, locations[i]);
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * Release decryption state when a worker exits
+ */
+static void exit_process(ngx_cycle_t *cycle)
+{
+    oauth_proxy_main_configuration_t *module_main_config = NULL;
+    oauth_proxy_configuration_t **locations = NULL;
+    oauth_proxy_encryption_key_t *keys = NULL;
+    ngx_uint_t i = 0;
+    ngx_uint_t j = 0;
+
+    module_main_config = ngx_http_cycle_get_module_main_conf(cycle, ngx_curity_http_oauth_proxy_module);
+    if (module_main_config == NULL)
+    {
+        return;
+    }
+
+    locations = module_main_config->locations->elts;
+    for (i = 0; i < module_main_config->locations->nelts; i++)
+    {
+        keys = locations[i]->encryption_keys->elts;
+        for (j = 0; j < locations[i]->encryption_keys->nelts; j++)
+        {
+            oauth_proxy_cipher_free(&keys[j]);
+        }
+
+        oauth_proxy_csrf_free_mac(locations[i]);
+        oauth_proxy_dynamic_exit_process(locations[i]);
+    }
+
+    oauth_proxy_compression_free();
+}
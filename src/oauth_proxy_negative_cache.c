@@ -0,0 +1,266 @@
+/*
+ *  Copyright 2022 Curity AB
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_string.h>
+#include "oauth_proxy.h"
+
+/* Each bucket fills a typical cache line, so that a lookup reads a single line */
+#define SLOTS_PER_BUCKET 8
+
+/* The encoded GCM tag at the end of a cookie is pseudorandom, so hashing it gives a fingerprint without a second pass over the cookie */
+#define FINGERPRINT_TAIL_SIZE 22
+
+/*
+ * A slot holds a ciphertext fingerprint in its high 32 bits and the second at which it expires in its low 32 bits, or zero when empty
+ * Slots are read and written without a lock, since a lost or stale write only means that a cookie is decrypted again
+ */
+typedef struct
+{
+    volatile uint64_t slots[SLOTS_PER_BUCKET];
+} oauth_proxy_negative_cache_bucket_t;
+
+/*
+ * Shared state, which lives in the zone so that it survives a reload
+ */
+typedef struct
+{
+    ngx_uint_t bucket_count;
+    oauth_proxy_negative_cache_bucket_t *buckets;
+} oauth_proxy_negative_cache_shctx_t;
+
+/*
+ * Per process state for a zone
+ */
+typedef struct
+{
+    oauth_proxy_negative_cache_shctx_t *sh;
+    ngx_slab_pool_t *shpool;
+} oauth_proxy_negative_cache_t;
+
+/* Forward declarations */
+static ngx_int_t init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static oauth_proxy_negative_cache_bucket_t *find_bucket(const oauth_proxy_configuration_t *config, const ngx_str_t *ciphertext, uint32_t *fingerprint);
+
+/*
+ * Parse the oauth_proxy_negative_cache directive, in the form zone=name:size [ttl=time]
+ */
+char *oauth_proxy_negative_cache_configure(ngx_conf_t *main_config, ngx_command_t *command, void *conf)
+{
+    oauth_proxy_configuration_t *config = conf;
+    ngx_str_t *value = NULL;
+    ngx_str_t *zone_value = NULL;
+    ngx_str_t ttl_str;
+    time_t ttl = NGX_CONF_UNSET;
+    ngx_uint_t i = 0;
+
+    if (config->negative_cache_zone != NGX_CONF_UNSET_PTR)
+    {
+        return "is duplicate";
+    }
+
+    value = main_config->args->elts;
+
+    for (i = 1; i < main_config->args->nelts; i++)
+    {
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0)
+        {
+            zone_value = &value[i];
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ttl=", 4) == 0)
+        {
+            ttl_str.data = value[i].data + 4;
+            ttl_str.len = value[i].len - 4;
+
+            ttl = ngx_parse_time(&ttl_str, 1);
+            if (ttl == (time_t)NGX_ERROR || ttl == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The oauth_proxy_negative_cache ttl is invalid: \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The oauth_proxy_negative_cache directive has an invalid parameter: \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (zone_value == NULL)
+    {
+        ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The oauth_proxy_negative_cache directive requires a zone parameter");
+        return NGX_CONF_ERROR;
+    }
+
+    config->negative_cache_zone = oauth_proxy_utils_add_zone(main_config, zone_value, init_zone, sizeof(oauth_proxy_negative_cache_t));
+    if (config->negative_cache_zone == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    config->negative_cache_ttl = ttl;
+    return NGX_CONF_OK;
+}
+
+/*
+ * Return whether a cookie recently failed decryption with the location's keys, reading a single bucket without any cryptography
+ */
+ngx_flag_t oauth_proxy_negative_cache_contains(const oauth_proxy_configuration_t *config, const ngx_str_t *ciphertext)
+{
+    oauth_proxy_negative_cache_bucket_t *bucket = NULL;
+    uint32_t fingerprint = 0;
+    uint32_t now = 0;
+    uint64_t slot = 0;
+    ngx_uint_t i = 0;
+
+    if (config->negative_cache_zone == NULL)
+    {
+        return 0;
+    }
+
+    bucket = find_bucket(config, ciphertext, &fingerprint);
+    now = (uint32_t)ngx_time();
+
+    for (i = 0; i < SLOTS_PER_BUCKET; i++)
+    {
+        slot = bucket->slots[i];
+        if ((uint32_t)(slot >> 32) == fingerprint && (uint32_t)slot > now)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Remember a cookie that failed decryption, replacing the same cookie, an expired slot or else the slot that expires soonest
+ */
+void oauth_proxy_negative_cache_store(const oauth_proxy_configuration_t *config, const ngx_str_t *ciphertext)
+{
+    oauth_proxy_negative_cache_bucket_t *bucket = NULL;
+    uint32_t fingerprint = 0;
+    uint32_t now = 0;
+    uint64_t slot = 0;
+    ngx_uint_t victim = 0;
+    ngx_uint_t i = 0;
+
+    if (config->negative_cache_zone == NULL)
+    {
+        return;
+    }
+
+    bucket = find_bucket(config, ciphertext, &fingerprint);
+    now = (uint32_t)ngx_time();
+
+    for (i = 0; i < SLOTS_PER_BUCKET; i++)
+    {
+        slot = bucket->slots[i];
+        if ((uint32_t)(slot >> 32) == fingerprint || (uint32_t)slot <= now)
+        {
+            victim = i;
+            break;
+        }
+
+        if ((uint32_t)slot < (uint32_t)bucket->slots[victim])
+        {
+            victim = i;
+        }
+    }
+
+    bucket->slots[victim] = ((uint64_t)fingerprint << 32) | (uint32_t)(now + config->negative_cache_ttl);
+}
+
+/*
+ * Set up the zone's buckets, or reuse existing ones when NGINX is reloaded
+ */
+static ngx_int_t init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    oauth_proxy_negative_cache_t *old_negative_cache = data;
+    oauth_proxy_negative_cache_t *negative_cache = shm_zone->data;
+    ngx_uint_t bucket_count = 0;
+    size_t len = 0;
+
+    if (old_negative_cache != NULL)
+    {
+        negative_cache->sh = old_negative_cache->sh;
+        negative_cache->shpool = old_negative_cache->shpool;
+        return NGX_OK;
+    }
+
+    negative_cache->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+    if (shm_zone->shm.exists)
+    {
+        negative_cache->sh = negative_cache->shpool->data;
+        return NGX_OK;
+    }
+
+    negative_cache->sh = ngx_slab_calloc(negative_cache->shpool, sizeof(oauth_proxy_negative_cache_shctx_t));
+    if (negative_cache->sh == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    negative_cache->shpool->data = negative_cache->sh;
+
+    len = sizeof(" in oauth_proxy_negative_cache zone \"\"") + shm_zone->shm.name.len;
+    negative_cache->shpool->log_ctx = ngx_slab_alloc(negative_cache->shpool, len);
+    if (negative_cache->shpool->log_ctx == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(negative_cache->shpool->log_ctx, " in oauth_proxy_negative_cache zone \"%V\"%Z", &shm_zone->shm.name);
+    negative_cache->shpool->log_nomem = 0;
+
+    /* The buckets are allocated once, so start from most of the zone and use less when the slab allocator's metadata leaves less space */
+    for (bucket_count = shm_zone->shm.size * 3 / 4 / sizeof(oauth_proxy_negative_cache_bucket_t); bucket_count > 0; bucket_count /= 2)
+    {
+        negative_cache->sh->buckets = ngx_slab_calloc(negative_cache->shpool, bucket_count * sizeof(oauth_proxy_negative_cache_bucket_t));
+        if (negative_cache->sh->buckets != NULL)
+        {
+            negative_cache->sh->bucket_count = bucket_count;
+            return NGX_OK;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+/*
+ * Select the bucket for a cookie and its fingerprint within the bucket, where the key set is included so that a key change starts afresh
+ */
+static oauth_proxy_negative_cache_bucket_t *find_bucket(const oauth_proxy_configuration_t *config, const ngx_str_t *ciphertext, uint32_t *fingerprint)
+{
+    oauth_proxy_negative_cache_t *negative_cache = config->negative_cache_zone->data;
+    size_t tail_size = ngx_min(ciphertext->len, FINGERPRINT_TAIL_SIZE);
+    uint32_t hash = 0;
+
+    hash = ngx_murmur_hash2(ciphertext->data, ciphertext->len) ^ (uint32_t)(config->encryption_key_id ^ (config->encryption_key_id >> 32));
+
+    /* Zero marks an empty slot */
+    *fingerprint = ngx_murmur_hash2(ciphertext->data + ciphertext->len - tail_size, tail_size) ^ hash;
+    if (*fingerprint == 0)
+    {
+        *fingerprint = 1;
+    }
+
+    return &negative_cache->sh->buckets[hash % negative_cache->sh->bucket_count];
+}
@@ -0,0 +1,315 @@
+/*
+ *  Copyright 2022 Curity AB
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_string.h>
+#include "oauth_proxy.h"
+
+/* A DNS name has at most 253 characters, which leaves room for the scheme and port */
+#define MAX_ORIGIN_SIZE 320
+
+/* Trusted origins are grouped by scheme, and each group has an exact and wildcard hash of host names */
+typedef struct
+{
+    ngx_str_t scheme;
+    ngx_hash_combined_t hosts;
+    ngx_hash_keys_arrays_t keys;
+} oauth_proxy_origin_scheme_t;
+
+/* Forward declarations */
+static ngx_int_t split_origin(const ngx_str_t *origin, ngx_str_t *scheme, ngx_str_t *host);
+static ngx_flag_t is_valid_host(const ngx_str_t *host);
+static oauth_proxy_origin_scheme_t *get_scheme(ngx_array_t *schemes, const ngx_str_t *scheme);
+static ngx_int_t build_scheme_hash(ngx_conf_t *main_config, oauth_proxy_origin_scheme_t *scheme);
+static int ngx_libc_cdecl compare_wildcards(const void *one, const void *two);
+
+/*
+ * Compile the trusted web origins into hashes once at startup, so that requests can be checked in constant time
+ * Hosts can start with a wildcard such as *.example.com, which matches in the same way as for the server_name directive
+ */
+ngx_int_t oauth_proxy_origins_initialize(ngx_conf_t *main_config, oauth_proxy_configuration_t *config)
+{
+    oauth_proxy_origin_scheme_t *scheme_hash = NULL;
+    ngx_str_t *trusted_web_origins = NULL;
+    ngx_str_t scheme;
+    ngx_str_t host;
+    ngx_uint_t hash_type = NGX_HASH_SMALL;
+    ngx_uint_t i = 0;
+    ngx_int_t ret_code = NGX_OK;
+
+    if (!config->enabled)
+    {
+        return NGX_OK;
+    }
+
+    config->trusted_origin_schemes = ngx_array_create(main_config->pool, 2, sizeof(oauth_proxy_origin_scheme_t));
+    if (config->trusted_origin_schemes == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    /* The large type only affects the temporary hash that detects duplicates while keys are added */
+    if (config->trusted_web_origins->nelts > 100)
+    {
+        hash_type = NGX_HASH_LARGE;
+    }
+
+    trusted_web_origins = config->trusted_web_origins->elts;
+    for (i = 0; i < config->trusted_web_origins->nelts; i++)
+    {
+        if (split_origin(&trusted_web_origins[i], &scheme, &host) != NGX_OK || host.len + scheme.len + 3 > MAX_ORIGIN_SIZE)
+        {
+            ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The trusted_web_origin configuration directive contains an invalid origin: \"%V\"", &trusted_web_origins[i]);
+            return NGX_ERROR;
+        }
+
+        scheme_hash = get_scheme(config->trusted_origin_schemes, &scheme);
+        if (scheme_hash == NULL)
+        {
+            scheme_hash = ngx_array_push(config->trusted_origin_schemes);
+            if (scheme_hash == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+            ngx_memzero(scheme_hash, sizeof(oauth_proxy_origin_scheme_t));
+            scheme_hash->scheme.data = ngx_pnalloc(main_config->pool, scheme.len);
+            if (scheme_hash->scheme.data == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+            ngx_strlow(scheme_hash->scheme.data, scheme.data, scheme.len);
+            scheme_hash->scheme.len = scheme.len;
+
+            scheme_hash->keys.pool = main_config->pool;
+            scheme_hash->keys.temp_pool = main_config->temp_pool;
+            if (ngx_hash_keys_array_init(&scheme_hash->keys, hash_type) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+
+        /* NGINX hashes also accept trailing wildcards and leading dots, which would trust unrelated domains */
+        if (!is_valid_host(&host))
+        {
+            ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The trusted_web_origin configuration directive contains an invalid wildcard: \"%V\"", &trusted_web_origins[i]);
+            return NGX_ERROR;
+        }
+
+        /* The value is only used to indicate a match, and duplicate origins are harmless */
+        ret_code = ngx_hash_add_key(&scheme_hash->keys, &host, &trusted_web_origins[i], NGX_HASH_WILDCARD_KEY);
+        if (ret_code == NGX_ERROR)
+        {
+            return NGX_ERROR;
+        }
+
+        if (ret_code == NGX_DECLINED)
+        {
+            ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The trusted_web_origin configuration directive contains an invalid wildcard: \"%V\"", &trusted_web_origins[i]);
+            return NGX_ERROR;
+        }
+    }
+
+    scheme_hash = config->trusted_origin_schemes->elts;
+    for (i = 0; i < config->trusted_origin_schemes->nelts; i++)
+    {
+        if (build_scheme_hash(main_config, &scheme_hash[i]) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * Return whether the origin header matches a trusted web origin, ignoring case as for the previous comparison
+ */
+ngx_flag_t oauth_proxy_origins_is_trusted(const oauth_proxy_configuration_t *config, const ngx_str_t *web_origin)
+{
+    u_char origin_data[MAX_ORIGIN_SIZE];
+    ngx_str_t origin;
+    ngx_str_t scheme;
+    ngx_str_t host;
+    oauth_proxy_origin_scheme_t *scheme_hash = NULL;
+
+    if (web_origin == NULL || web_origin->len > MAX_ORIGIN_SIZE || config->trusted_origin_schemes == NULL)
+    {
+        return 0;
+    }
+
+    /* Browsers send lowercase origins, but copying to a small stack buffer keeps matching case insensitive */
+    ngx_strlow(origin_data, web_origin->data, web_origin->len);
+    origin.data = origin_data;
+    origin.len = web_origin->len;
+
+    if (split_origin(&origin, &scheme, &host) != NGX_OK)
+    {
+        return 0;
+    }
+
+    scheme_hash = get_scheme(config->trusted_origin_schemes, &scheme);
+    if (scheme_hash == NULL)
+    {
+        return 0;
+    }
+
+    return ngx_hash_find_combined(&scheme_hash->hosts, ngx_hash_key(host.data, host.len), host.data, host.len) != NULL;
+}
+
+/*
+ * Split an origin such as https://www.example.com:8443 into its scheme and host parts
+ */
+static ngx_int_t split_origin(const ngx_str_t *origin, ngx_str_t *scheme, ngx_str_t *host)
+{
+    u_char *separator = NULL;
+
+    separator = ngx_strlcasestrn(origin->data, origin->data + origin->len, (u_char *)"://", 3 - 1);
+    if (separator == NULL || separator == origin->data)
+    {
+        return NGX_ERROR;
+    }
+
+    scheme->data = origin->data;
+    scheme->len = separator - origin->data;
+    host->data = separator + 3;
+    host->len = origin->len - scheme->len - 3;
+
+    return host->len > 0 ? NGX_OK : NGX_ERROR;
+}
+
+/*
+ * A host is either exact, or has a single wildcard as its first label, such as *.example.com
+ */
+static ngx_flag_t is_valid_host(const ngx_str_t *host)
+{
+    u_char *start = host->data;
+
+    if (host->len > 2 && host->data[0] == '*' && host->data[1] == '.')
+    {
+        start += 2;
+    }
+
+    if (start[0] == '.' || ngx_strlchr(start, host->data + host->len, '*') != NULL)
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * There are usually only one or two schemes, so a linear search is cheapest
+ */
+static oauth_proxy_origin_scheme_t *get_scheme(ngx_array_t *schemes, const ngx_str_t *scheme)
+{
+    oauth_proxy_origin_scheme_t *scheme_hash = NULL;
+    ngx_uint_t i = 0;
+
+    scheme_hash = schemes->elts;
+    for (i = 0; i < schemes->nelts; i++)
+    {
+        if (scheme_hash[i].scheme.len == scheme->len &&
+            ngx_strncasecmp(scheme_hash[i].scheme.data, scheme->data, scheme->len) == 0)
+        {
+            return &scheme_hash[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Build the hashes for one scheme, in the same way as NGINX does for server names
+ */
+static ngx_int_t build_scheme_hash(ngx_conf_t *main_config, oauth_proxy_origin_scheme_t *scheme)
+{
+    ngx_hash_init_t hash;
+    ngx_hash_key_t *keys = NULL;
+    ngx_uint_t nelts = 0;
+    ngx_uint_t i = 0;
+    size_t bucket_size = 256;
+
+    /* Size buckets so that the longest origin always fits and large origin lists still find a hash size */
+    nelts = scheme->keys.keys.nelts + scheme->keys.dns_wc_head.nelts + scheme->keys.dns_wc_tail.nelts;
+    keys = scheme->keys.keys.elts;
+    for (i = 0; i < scheme->keys.keys.nelts; i++)
+    {
+        bucket_size = ngx_max(bucket_size, NGX_HASH_ELT_SIZE(&keys[i]) + sizeof(void *));
+    }
+
+    hash.key = ngx_hash_key_lc;
+    hash.max_size = ngx_max(1024, nelts * 4);
+    hash.bucket_size = ngx_align(bucket_size, ngx_cacheline_size);
+    hash.name = "oauth_proxy_trusted_web_origin_hash";
+    hash.pool = main_config->pool;
+
+    if (scheme->keys.keys.nelts > 0)
+    {
+        hash.hash = &scheme->hosts.hash;
+        hash.temp_pool = NULL;
+
+        if (ngx_hash_init(&hash, scheme->keys.keys.elts, scheme->keys.keys.nelts) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    if (scheme->keys.dns_wc_head.nelts > 0)
+    {
+        ngx_qsort(scheme->keys.dns_wc_head.elts, (size_t) scheme->keys.dns_wc_head.nelts, sizeof(ngx_hash_key_t), compare_wildcards);
+
+        hash.hash = NULL;
+        hash.temp_pool = main_config->temp_pool;
+
+        if (ngx_hash_wildcard_init(&hash, scheme->keys.dns_wc_head.elts, scheme->keys.dns_wc_head.nelts) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        scheme->hosts.wc_head = (ngx_hash_wildcard_t *) hash.hash;
+    }
+
+    if (scheme->keys.dns_wc_tail.nelts > 0)
+    {
+        ngx_qsort(scheme->keys.dns_wc_tail.elts, (size_t) scheme->keys.dns_wc_tail.nelts, sizeof(ngx_hash_key_t), compare_wildcards);
+
+        hash.hash = NULL;
+        hash.temp_pool = main_config->temp_pool;
+
+        if (ngx_hash_wildcard_init(&hash, scheme->keys.dns_wc_tail.elts, scheme->keys.dns_wc_tail.nelts) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        scheme->hosts.wc_tail = (ngx_hash_wildcard_t *) hash.hash;
+    }
+
+    /* The key arrays were allocated from the temporary pool and are not needed at runtime */
+    ngx_memzero(&scheme->keys, sizeof(ngx_hash_keys_arrays_t));
+    return NGX_OK;
+}
+
+static int ngx_libc_cdecl compare_wildcards(const void *one, const void *two)
+{
+    ngx_hash_key_t *first = (ngx_hash_key_t *) one;
+    ngx_hash_key_t *second = (ngx_hash_key_t *) two;
+
+    return ngx_dns_strcmp(first->key.data, second->key.data);
+}
@@ -0,0 +1,608 @@
+/*
+ *  Copyright 2022 Curity AB
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_string.h>
+#include "oauth_proxy.h"
+
+/* The number of old entries that may be evicted to make space for a new entry */
+#define MAX_EVICTIONS_PER_STORE 8
+
+/* Other requests for the same token wait for an introspection in progress for up to this many seconds, then start their own */
+#define PENDING_LIFETIME 10
+
+/* Waiting requests check the zone this often, in milliseconds */
+#define WAIT_INTERVAL 10
+
+/*
+ * Shared state, which lives in the zone so that it survives a reload
+ */
+typedef struct
+{
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t queue;
+} oauth_proxy_phantom_shctx_t;
+
+/*
+ * Per process state for a zone
+ */
+typedef struct
+{
+    oauth_proxy_phantom_shctx_t *sh;
+    ngx_slab_pool_t *shpool;
+} oauth_proxy_phantom_cache_t;
+
+/*
+ * Each entry is keyed by the opaque token, which is followed by the JWT, or no JWT while an introspection is pending
+ */
+typedef struct
+{
+    ngx_str_node_t sn;
+    ngx_queue_t queue;
+    time_t expires;
+    ngx_flag_t pending;
+    size_t jwt_len;
+    u_char data[1];
+} oauth_proxy_phantom_node_t;
+
+/* Forward declarations */
+static ngx_int_t lookup_token(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, oauth_proxy_phantom_request_t *phantom);
+static ngx_int_t start_introspection(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, oauth_proxy_phantom_request_t *phantom);
+static ngx_int_t introspection_done(ngx_http_request_t *subrequest, void *data, ngx_int_t rc);
+static ngx_int_t read_introspection_response(ngx_http_request_t *subrequest, oauth_proxy_phantom_request_t *phantom, ngx_int_t rc);
+static ngx_int_t get_response_body(ngx_http_request_t *subrequest, ngx_str_t *body);
+static time_t get_max_age(ngx_http_request_t *subrequest);
+static ngx_int_t wait_for_introspection(ngx_http_request_t *request);
+static void wait_completed(ngx_http_request_t *request);
+static void store_token(const oauth_proxy_configuration_t *config, const ngx_str_t *token, const ngx_str_t *jwt, time_t max_age, ngx_log_t *log);
+static oauth_proxy_phantom_node_t *insert_node(oauth_proxy_phantom_cache_t *cache, const ngx_str_t *token, uint32_t hash, const ngx_str_t *jwt);
+static void delete_node(oauth_proxy_phantom_cache_t *cache, oauth_proxy_phantom_node_t *entry);
+static ngx_int_t init_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+/*
+ * Parse the oauth_proxy_phantom_token directive, in the form uri zone=name:size
+ */
+char *oauth_proxy_phantom_configure(ngx_conf_t *main_config, ngx_command_t *command, void *conf)
+{
+    oauth_proxy_configuration_t *config = conf;
+    ngx_str_t *value = NULL;
+
+#if !(OAUTH_PROXY_PHANTOM_TOKEN)
+
+    /* The introspection subrequest and the wait for it to complete are not yet covered by integration test runs */
+    ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The oauth_proxy_phantom_token directive requires the module to be configured with OAUTH_PROXY_PHANTOM_TOKEN=yes");
+    return NGX_CONF_ERROR;
+
+#endif
+
+    if (config->phantom_token_zone != NGX_CONF_UNSET_PTR)
+    {
+        return "is duplicate";
+    }
+
+    value = main_config->args->elts;
+    if (value[1].len == 0 || value[1].data[0] != '/')
+    {
+        ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The oauth_proxy_phantom_token uri is invalid: \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_strncmp(value[2].data, "zone=", 5) != 0)
+    {
+        ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The oauth_proxy_phantom_token directive requires a zone parameter");
+        return NGX_CONF_ERROR;
+    }
+
+    config->phantom_token_zone = oauth_proxy_utils_add_zone(main_config, &value[2], init_zone, sizeof(oauth_proxy_phantom_cache_t));
+    if (config->phantom_token_zone == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    config->phantom_token_uri = value[1];
+    return NGX_CONF_OK;
+}
+
+/*
+ * Swap the opaque token from the cookie for a JWT, from the zone or from an introspection subrequest
+ * This is called again each time the request resumes, and returns NGX_AGAIN until the phantom's authorization value is set
+ */
+ngx_int_t oauth_proxy_phantom_resolve(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, oauth_proxy_phantom_request_t *phantom)
+{
+    ngx_str_t jwt;
+    ngx_int_t ret_code = NGX_OK;
+
+    /* This request owns an introspection, whose result is set when the subrequest completes */
+    if (phantom->subrequest != NULL)
+    {
+        return phantom->done ? phantom->result : NGX_AGAIN;
+    }
+
+    ret_code = lookup_token(request, config, phantom);
+    if (ret_code == NGX_DECLINED)
+    {
+        ret_code = start_introspection(request, config, phantom);
+        if (ret_code != NGX_AGAIN)
+        {
+            /* Release the pending entry, so that other requests for the token do not wait for an introspection that never started */
+            ngx_str_null(&jwt);
+            store_token(config, &phantom->token, &jwt, 0, request->connection->log);
+        }
+
+        return ret_code;
+    }
+
+    if (ret_code == NGX_BUSY)
+    {
+        return wait_for_introspection(request);
+    }
+
+    return ret_code;
+}
+
+/*
+ * Copy the JWT for the token from the zone, or mark the token as pending so that concurrent requests wait for this one
+ * NGX_DECLINED is returned when this request should introspect, and NGX_BUSY when another request is already doing so
+ */
+static ngx_int_t lookup_token(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, oauth_proxy_phantom_request_t *phantom)
+{
+    oauth_proxy_phantom_cache_t *cache = config->phantom_token_zone->data;
+    oauth_proxy_phantom_node_t *entry = NULL;
+    ngx_str_t jwt;
+    uint32_t hash = 0;
+    u_char *authorization = NULL;
+    ngx_int_t ret_code = NGX_DECLINED;
+
+    hash = ngx_crc32_short(phantom->token.data, phantom->token.len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    entry = (oauth_proxy_phantom_node_t *)ngx_str_rbtree_lookup(&cache->sh->rbtree, &phantom->token, hash);
+    if (entry != NULL && entry->expires < ngx_time())
+    {
+        delete_node(cache, entry);
+        entry = NULL;
+    }
+
+    if (entry != NULL && entry->pending)
+    {
+        ret_code = NGX_BUSY;
+    }
+    else if (entry != NULL)
+    {
+        /* The entry could be evicted once the lock is released, so take a copy after the bearer prefix */
+        authorization = ngx_pnalloc(request->pool, sizeof(OAUTH_PROXY_BEARER_PREFIX) - 1 + entry->jwt_len + 1);
+        if (authorization == NULL)
+        {
+            ret_code = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        else
+        {
+            phantom->authorization.data = authorization;
+            phantom->authorization.len = ngx_cpymem(ngx_cpymem(authorization, OAUTH_PROXY_BEARER_PREFIX, sizeof(OAUTH_PROXY_BEARER_PREFIX) - 1),
+                                                    entry->data + phantom->token.len, entry->jwt_len) - authorization;
+            authorization[phantom->authorization.len] = 0;
+            oauth_proxy_utils_count_memory(request, OAUTH_PROXY_MEMORY_PLAINTEXT, phantom->authorization.len + 1);
+
+            ngx_queue_remove(&entry->queue);
+            ngx_queue_insert_head(&cache->sh->queue, &entry->queue);
+            ret_code = NGX_OK;
+        }
+    }
+    else
+    {
+        /* The pending entry has no JWT, and expires if this worker stops before the introspection completes */
+        ngx_str_null(&jwt);
+        entry = insert_node(cache, &phantom->token, hash, &jwt);
+        if (entry != NULL)
+        {
+            entry->pending = 1;
+            entry->expires = ngx_time() + PENDING_LIFETIME;
+        }
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (ret_code == NGX_HTTP_INTERNAL_SERVER_ERROR)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "Problem encountered allocating memory for a cached JWT");
+    }
+
+    return ret_code;
+}
+
+/*
+ * Post the opaque token to the introspection location as a form, and read the JWT in memory when the subrequest completes
+ * The location is expected to set the accept, content-type and client credential headers with proxy_set_header
+ */
+static ngx_int_t start_introspection(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, oauth_proxy_phantom_request_t *phantom)
+{
+    ngx_http_post_subrequest_t *callback = NULL;
+    ngx_http_request_t *subrequest = NULL;
+    ngx_buf_t *body = NULL;
+    ngx_chain_t *chain = NULL;
+    size_t body_len = 0;
+
+    callback = ngx_palloc(request->pool, sizeof(ngx_http_post_subrequest_t));
+    if (callback == NULL)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "OAuth proxy failed to allocate memory for the introspection request");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    callback->handler = introspection_done;
+    callback->data = phantom;
+
+    if (ngx_http_subrequest(request, (ngx_str_t *)&config->phantom_token_uri, NULL, &subrequest, callback, NGX_HTTP_SUBREQUEST_IN_MEMORY | NGX_HTTP_SUBREQUEST_WAITED) != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "OAuth proxy failed to create the introspection request");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* The token is form encoded, since opaque tokens could contain reserved characters */
+    body_len = sizeof("token=") - 1 + phantom->token.len + 2 * ngx_escape_uri(NULL, phantom->token.data, phantom->token.len, NGX_ESCAPE_ARGS);
+    body = ngx_create_temp_buf(request->pool, body_len);
+    chain = ngx_alloc_chain_link(request->pool);
+    subrequest->request_body = ngx_pcalloc(request->pool, sizeof(ngx_http_request_body_t));
+    if (body == NULL || chain == NULL || subrequest->request_body == NULL)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "OAuth proxy failed to allocate memory for the introspection request");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* NGINX allocates the subrequest from this request's pool too, and its request structure is most of that memory */
+    oauth_proxy_utils_count_memory(request, OAUTH_PROXY_MEMORY_STATE, sizeof(ngx_http_post_subrequest_t) + sizeof(ngx_http_request_t) +
+                                   body_len + sizeof(ngx_buf_t) + sizeof(ngx_chain_t) + sizeof(ngx_http_request_body_t));
+
+    body->last = ngx_cpymem(body->last, "token=", sizeof("token=") - 1);
+    body->last = (u_char *)ngx_escape_uri(body->last, phantom->token.data, phantom->token.len, NGX_ESCAPE_ARGS);
+    body->last_buf = 1;
+    chain->buf = body;
+    chain->next = NULL;
+
+    subrequest->request_body->bufs = chain;
+    subrequest->method = NGX_HTTP_POST;
+    ngx_str_set(&subrequest->method_name, "POST");
+    subrequest->headers_in.content_length_n = body_len;
+    subrequest->headers_in.chunked = 0;
+
+    phantom->config = config;
+    phantom->subrequest = subrequest;
+    return NGX_AGAIN;
+}
+
+/*
+ * Called when the introspection subrequest is finalized, after which NGINX runs the main request's phases again
+ */
+static ngx_int_t introspection_done(ngx_http_request_t *subrequest, void *data, ngx_int_t rc)
+{
+    oauth_proxy_phantom_request_t *phantom = data;
+
+    if (!phantom->done)
+    {
+        phantom->done = 1;
+        phantom->result = read_introspection_response(subrequest, phantom, rc);
+    }
+
+    return rc;
+}
+
+/*
+ * Read the JWT from a successful response and store it, or release the pending entry so that a later request can retry
+ * A 204 response means that the token is not active, and other failures are reported as a bad gateway
+ */
+static ngx_int_t read_introspection_response(ngx_http_request_t *subrequest, oauth_proxy_phantom_request_t *phantom, ngx_int_t rc)
+{
+    ngx_http_request_t *request = subrequest->parent;
+    ngx_str_t body;
+    ngx_str_t jwt;
+    u_char *authorization = NULL;
+    ngx_int_t ret_code = NGX_OK;
+
+    ngx_str_null(&jwt);
+    if (rc == NGX_ERROR || rc >= NGX_HTTP_SPECIAL_RESPONSE)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "The introspection request failed, status: %i", rc);
+        ret_code = NGX_HTTP_BAD_GATEWAY;
+    }
+    else if (subrequest->headers_out.status == NGX_HTTP_NO_CONTENT)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "The introspection response reported that the access token is not active");
+        ret_code = NGX_HTTP_UNAUTHORIZED;
+    }
+    else if (subrequest->headers_out.status != NGX_HTTP_OK)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "The introspection request failed, status: %ui", subrequest->headers_out.status);
+        ret_code = NGX_HTTP_BAD_GATEWAY;
+    }
+    else if (get_response_body(subrequest, &body) != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "The introspection response did not contain a JWT");
+        ret_code = NGX_HTTP_BAD_GATEWAY;
+    }
+    else
+    {
+        authorization = ngx_pnalloc(request->pool, sizeof(OAUTH_PROXY_BEARER_PREFIX) - 1 + body.len + 1);
+        if (authorization == NULL)
+        {
+            ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "Problem encountered allocating memory for the JWT");
+            ret_code = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        else
+        {
+            phantom->authorization.data = authorization;
+            phantom->authorization.len = ngx_cpymem(ngx_cpymem(authorization, OAUTH_PROXY_BEARER_PREFIX, sizeof(OAUTH_PROXY_BEARER_PREFIX) - 1), body.data, body.len) - authorization;
+            authorization[phantom->authorization.len] = 0;
+            oauth_proxy_utils_count_memory(request, OAUTH_PROXY_MEMORY_PLAINTEXT, phantom->authorization.len + 1);
+
+            jwt.data = authorization + sizeof(OAUTH_PROXY_BEARER_PREFIX) - 1;
+            jwt.len = body.len;
+        }
+    }
+
+    /* Responses without a max-age are used once and not cached */
+    store_token(phantom->config, &phantom->token, &jwt, jwt.len > 0 ? get_max_age(subrequest) : 0, request->connection->log);
+    return ret_code;
+}
+
+/*
+ * The JWT is the whole response body, which an in memory subrequest holds in a single buffer
+ */
+static ngx_int_t get_response_body(ngx_http_request_t *subrequest, ngx_str_t *body)
+{
+    ngx_buf_t *buffer = NULL;
+
+    if (subrequest->out != NULL && subrequest->out->buf != NULL)
+    {
+        buffer = subrequest->out->buf;
+    }
+    else if (subrequest->upstream != NULL)
+    {
+        buffer = &subrequest->upstream->buffer;
+    }
+
+    if (buffer == NULL || buffer->pos == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    body->data = buffer->pos;
+    body->len = buffer->last - buffer->pos;
+    while (body->len > 0 && (body->data[body->len - 1] == '\n' || body->data[body->len - 1] == '\r' || body->data[body->len - 1] == ' '))
+    {
+        body->len--;
+    }
+
+    return body->len > 0 ? NGX_OK : NGX_ERROR;
+}
+
+/*
+ * Read the JWT's remaining lifetime from the cache-control max-age directive, which is 0 when there is none
+ */
+static time_t get_max_age(ngx_http_request_t *subrequest)
+{
+    ngx_list_part_t *part = &subrequest->headers_out.headers.part;
+    ngx_table_elt_t *header = part->elts;
+    u_char *directive = NULL;
+    u_char *last = NULL;
+    ngx_int_t max_age = 0;
+    ngx_uint_t i = 0;
+
+    for (i = 0; /* void */ ; i++)
+    {
+        if (i >= part->nelts)
+        {
+            if (part->next == NULL)
+            {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (header[i].hash == 0 || header[i].key.len != sizeof("cache-control") - 1 ||
+            ngx_strncasecmp(header[i].key.data, (u_char *)"cache-control", sizeof("cache-control") - 1) != 0)
+        {
+            continue;
+        }
+
+        last = header[i].value.data + header[i].value.len;
+        directive = ngx_strlcasestrn(header[i].value.data, last, (u_char *)"max-age=", sizeof("max-age=") - 2);
+        if (directive == NULL)
+        {
+            continue;
+        }
+
+        directive += sizeof("max-age=") - 1;
+        for (last = directive; last < header[i].value.data + header[i].value.len && *last >= '0' && *last <= '9'; last++)
+        {
+            /* void */
+        }
+
+        max_age = ngx_atoi(directive, last - directive);
+        return max_age > 0 ? (time_t)max_age : 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Wait for another request's introspection of the same token, by checking the zone again after a short delay
+ */
+static ngx_int_t wait_for_introspection(ngx_http_request_t *request)
+{
+    request->read_event_handler = ngx_http_test_reading;
+    request->write_event_handler = wait_completed;
+    ngx_add_timer(request->connection->write, WAIT_INTERVAL);
+    return NGX_AGAIN;
+}
+
+/*
+ * Run the request's phases again when the delay has passed, so that the access handler checks the zone
+ */
+static void wait_completed(ngx_http_request_t *request)
+{
+    ngx_event_t *event = request->connection->write;
+
+    if (!event->timedout)
+    {
+        if (ngx_handle_write_event(event, 0) != NGX_OK)
+        {
+            ngx_http_finalize_request(request, NGX_ERROR);
+        }
+
+        return;
+    }
+
+    event->timedout = 0;
+    request->read_event_handler = ngx_http_block_reading;
+    request->write_event_handler = ngx_http_core_run_phases;
+    ngx_http_core_run_phases(request);
+}
+
+/*
+ * Replace the pending entry with the JWT, or delete it when there is nothing to cache
+ */
+static void store_token(const oauth_proxy_configuration_t *config, const ngx_str_t *token, const ngx_str_t *jwt, time_t max_age, ngx_log_t *log)
+{
+    oauth_proxy_phantom_cache_t *cache = config->phantom_token_zone->data;
+    oauth_proxy_phantom_node_t *entry = NULL;
+    uint32_t hash = 0;
+
+    hash = ngx_crc32_short(token->data, token->len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    entry = (oauth_proxy_phantom_node_t *)ngx_str_rbtree_lookup(&cache->sh->rbtree, (ngx_str_t *)token, hash);
+    if (entry != NULL && entry->pending)
+    {
+        delete_node(cache, entry);
+        entry = NULL;
+    }
+
+    if (entry == NULL && max_age > 0)
+    {
+        entry = insert_node(cache, token, hash, jwt);
+        if (entry != NULL)
+        {
+            entry->expires = ngx_time() + max_age;
+        }
+        else
+        {
+            ngx_log_error(NGX_LOG_WARN, log, 0, "The oauth_proxy_phantom_token zone \"%V\" is too small to store a JWT", &config->phantom_token_zone->shm.name);
+        }
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+/*
+ * Allocate and insert an entry, evicting the least recently used entries when the zone is full
+ * This must be called while holding the zone lock
+ */
+static oauth_proxy_phantom_node_t *insert_node(oauth_proxy_phantom_cache_t *cache, const ngx_str_t *token, uint32_t hash, const ngx_str_t *jwt)
+{
+    oauth_proxy_phantom_node_t *entry = NULL;
+    ngx_queue_t *last = NULL;
+    size_t size = offsetof(oauth_proxy_phantom_node_t, data) + token->len + jwt->len;
+    ngx_uint_t i = 0;
+
+    entry = ngx_slab_alloc_locked(cache->shpool, size);
+    for (i = 0; entry == NULL && i < MAX_EVICTIONS_PER_STORE && !ngx_queue_empty(&cache->sh->queue); i++)
+    {
+        last = ngx_queue_last(&cache->sh->queue);
+        delete_node(cache, ngx_queue_data(last, oauth_proxy_phantom_node_t, queue));
+
+        entry = ngx_slab_alloc_locked(cache->shpool, size);
+    }
+
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+
+    ngx_memcpy(entry->data, token->data, token->len);
+    ngx_memcpy(entry->data + token->len, jwt->data, jwt->len);
+    entry->sn.node.key = hash;
+    entry->sn.str.data = entry->data;
+    entry->sn.str.len = token->len;
+    entry->pending = 0;
+    entry->jwt_len = jwt->len;
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &entry->sn.node);
+    ngx_queue_insert_head(&cache->sh->queue, &entry->queue);
+    return entry;
+}
+
+/*
+ * Remove an entry, which must be called while holding the zone lock
+ */
+static void delete_node(oauth_proxy_phantom_cache_t *cache, oauth_proxy_phantom_node_t *entry)
+{
+    ngx_queue_remove(&entry->queue);
+    ngx_rbtree_delete(&cache->sh->rbtree, &entry->sn.node);
+    ngx_slab_free_locked(cache->shpool, entry);
+}
+
+/*
+ * Set up the zone, or reuse existing entries when NGINX is reloaded
+ */
+static ngx_int_t init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    oauth_proxy_phantom_cache_t *old_cache = data;
+    oauth_proxy_phantom_cache_t *cache = shm_zone->data;
+    size_t len = 0;
+
+    if (old_cache != NULL)
+    {
+        cache->sh = old_cache->sh;
+        cache->shpool = old_cache->shpool;
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+    if (shm_zone->shm.exists)
+    {
+        cache->sh = cache->shpool->data;
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_calloc(cache->shpool, sizeof(oauth_proxy_phantom_shctx_t));
+    if (cache->sh == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel, ngx_str_rbtree_insert_value);
+    ngx_queue_init(&cache->sh->queue);
+
+    len = sizeof(" in oauth_proxy_phantom_token zone \"\"") + shm_zone->shm.name.len;
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in oauth_proxy_phantom_token zone \"%V\"%Z", &shm_zone->shm.name);
+    cache->shpool->log_nomem = 0;
+    return NGX_OK;
+}
@@ -0,0 +1,183 @@
+/*
+ *  Copyright 2022 Curity AB
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_string.h>
+#include "oauth_proxy.h"
+
+/* Smaller cookies decrypt in a few microseconds, which is less than the cost of handing them to another thread */
+#define DEFAULT_THRESHOLD 4096
+
+#if (NGX_THREADS)
+
+/* Forward declarations */
+static void decrypt_in_thread(void *data, ngx_log_t *log);
+static void decryption_completed(ngx_event_t *event);
+
+#endif
+
+/*
+ * Parse the oauth_proxy_thread_pool directive, which names a pool from the thread_pool directive and a cookie size threshold
+ */
+char *oauth_proxy_threads_configure(ngx_conf_t *main_config, ngx_command_t *command, void *conf)
+{
+#if (NGX_THREADS)
+    oauth_proxy_configuration_t *config = conf;
+    ngx_str_t *value = NULL;
+    ngx_str_t threshold_str;
+    ssize_t threshold = DEFAULT_THRESHOLD;
+    ngx_uint_t i = 0;
+
+    if (config->thread_pool != NGX_CONF_UNSET_PTR)
+    {
+        return "is duplicate";
+    }
+
+    value = main_config->args->elts;
+    for (i = 2; i < main_config->args->nelts; i++)
+    {
+        if (ngx_strncmp(value[i].data, "threshold=", 10) == 0)
+        {
+            threshold_str.data = value[i].data + 10;
+            threshold_str.len = value[i].len - 10;
+
+            threshold = ngx_parse_size(&threshold_str);
+            if (threshold == NGX_ERROR)
+            {
+                ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The oauth_proxy_thread_pool threshold is invalid: \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The oauth_proxy_thread_pool directive has an invalid parameter: \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    /* NGINX reports pools that are not defined by a thread_pool directive once the configuration is loaded */
+    config->thread_pool = ngx_thread_pool_add(main_config, &value[1]);
+    if (config->thread_pool == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    config->thread_pool_threshold = (size_t)threshold;
+    return NGX_CONF_OK;
+
+#else
+
+    ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The oauth_proxy_thread_pool directive requires NGINX to be built with --with-threads");
+    return NGX_CONF_ERROR;
+
+#endif
+}
+
+#if (NGX_THREADS)
+
+/*
+ * Post a cookie decryption to the location's thread pool, after allocating all of the memory it needs on the event loop
+ * The request is blocked until the task completes, and NULL is returned if the task could not be posted
+ */
+oauth_proxy_decryption_job_t *oauth_proxy_threads_post_decryption(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, const ngx_str_t *ciphertext, const ngx_str_t *prefix)
+{
+    oauth_proxy_decryption_job_t *job = NULL;
+    ngx_thread_task_t *task = NULL;
+
+    task = ngx_thread_task_alloc(request->pool, sizeof(oauth_proxy_decryption_job_t));
+    if (task == NULL)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "OAuth proxy failed to allocate memory for the decryption task");
+        return NULL;
+    }
+
+    job = task->ctx;
+    job->buffer = ngx_pnalloc(request->pool, ngx_base64_decoded_length(ciphertext->len));
+    if (job->buffer == NULL)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "Problem encountered allocating memory for ciphertext bytes");
+        return NULL;
+    }
+
+    oauth_proxy_utils_count_memory(request, OAUTH_PROXY_MEMORY_STATE, sizeof(ngx_thread_task_t) + sizeof(oauth_proxy_decryption_job_t));
+    oauth_proxy_utils_count_memory(request, OAUTH_PROXY_MEMORY_CIPHERTEXT, ngx_base64_decoded_length(ciphertext->len));
+
+    /* The cookie refers to request header memory and the prefix is static, so both remain valid while the task runs */
+    job->request = request;
+    job->config = config;
+    job->ciphertext = *ciphertext;
+    job->prefix = prefix;
+
+    task->handler = decrypt_in_thread;
+    task->event.handler = decryption_completed;
+    task->event.data = job;
+
+    /* This fails when the pool's queue is full, in which case NGINX has logged the overflow */
+    if (ngx_thread_task_post(config->thread_pool, task) != NGX_OK)
+    {
+        return NULL;
+    }
+
+    /* A thread may read the location's keys until the job completes, so the keys that are current now cannot yet be freed */
+    job->key_generation = oauth_proxy_dynamic_acquire(config);
+    request->main->blocked++;
+    request->aio = 1;
+    return job;
+}
+
+/*
+ * Runs in a pool thread, so only the job's own memory is written, and failures are left for the event loop to log
+ */
+static void decrypt_in_thread(void *data, ngx_log_t *log)
+{
+    oauth_proxy_decryption_job_t *job = data;
+    uint64_t start = 0;
+
+    if (job->config->metrics == NULL && !job->config->record_timings)
+    {
+        job->result = oauth_proxy_decryption_decrypt_buffer(job->buffer, &job->plaintext, &job->ciphertext, job->config, job->prefix, 0, &job->compressed, job->error);
+        return;
+    }
+
+    start = oauth_proxy_utils_get_time();
+    job->result = oauth_proxy_decryption_decrypt_buffer(job->buffer, &job->plaintext, &job->ciphertext, job->config, job->prefix, 0, &job->compressed, job->error);
+    job->decrypt_time = oauth_proxy_utils_get_time() - start;
+}
+
+/*
+ * Runs on the event loop when the task completes, and runs the request's phases again so that the access handler resumes
+ * If the client has gone away, the request's write handler finalizes it instead
+ */
+static void decryption_completed(ngx_event_t *event)
+{
+    oauth_proxy_decryption_job_t *job = event->data;
+    ngx_http_request_t *request = job->request;
+    ngx_connection_t *connection = request->connection;
+
+    ngx_http_set_log_request(connection->log, request);
+
+    job->completed = 1;
+    oauth_proxy_dynamic_release(job->config, job->key_generation);
+    request->main->blocked--;
+    request->aio = 0;
+
+    request->write_event_handler(request);
+    ngx_http_run_posted_requests(connection);
+}
+
+#endif
@@ -0,0 +1,343 @@
+/*
+ *  Copyright 2022 Curity AB
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_string.h>
+#include "oauth_proxy.h"
+
+/* The number of least recently failing clients that may be evicted to make space for a new client */
+#define MAX_EVICTIONS_PER_FAILURE 8
+
+/*
+ * Shared state, which lives in the zone so that it survives a reload
+ */
+typedef struct
+{
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t queue;
+} oauth_proxy_throttle_shctx_t;
+
+/*
+ * Per process state for a zone
+ */
+typedef struct
+{
+    oauth_proxy_throttle_shctx_t *sh;
+    ngx_slab_pool_t *shpool;
+} oauth_proxy_throttle_t;
+
+/*
+ * Failures are counted in fixed windows, and the previous window's count is weighted by how much of it the sliding window still covers
+ * The node's string refers to the client address, which is stored after the node
+ */
+typedef struct
+{
+    ngx_str_node_t sn;
+    ngx_queue_t queue;
+    ngx_msec_t window_start;
+    ngx_uint_t current;
+    ngx_uint_t previous;
+    u_char data[1];
+} oauth_proxy_throttle_node_t;
+
+/* Forward declarations */
+static ngx_int_t init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static oauth_proxy_throttle_node_t *find_node(oauth_proxy_throttle_t *throttle, ngx_str_t *address, uint32_t hash);
+static void slide_window(oauth_proxy_throttle_node_t *entry, ngx_msec_t window, ngx_msec_t now);
+static void delete_node(oauth_proxy_throttle_t *throttle, oauth_proxy_throttle_node_t *entry);
+
+/*
+ * Parse the oauth_proxy_throttle directive, in the form zone=name:size [threshold=number] [window=time]
+ */
+char *oauth_proxy_throttle_configure(ngx_conf_t *main_config, ngx_command_t *command, void *conf)
+{
+    oauth_proxy_configuration_t *config = conf;
+    ngx_str_t *value = NULL;
+    ngx_str_t *zone_value = NULL;
+    ngx_str_t window_str;
+    ngx_int_t threshold = NGX_CONF_UNSET;
+    ngx_msec_t window = NGX_CONF_UNSET_MSEC;
+    ngx_uint_t i = 0;
+
+    if (config->throttle_zone != NGX_CONF_UNSET_PTR)
+    {
+        return "is duplicate";
+    }
+
+    value = main_config->args->elts;
+
+    for (i = 1; i < main_config->args->nelts; i++)
+    {
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0)
+        {
+            zone_value = &value[i];
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "threshold=", 10) == 0)
+        {
+            threshold = ngx_atoi(value[i].data + 10, value[i].len - 10);
+            if (threshold == NGX_ERROR || threshold == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The oauth_proxy_throttle threshold is invalid: \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "window=", 7) == 0)
+        {
+            window_str.data = value[i].data + 7;
+            window_str.len = value[i].len - 7;
+
+            window = ngx_parse_time(&window_str, 0);
+            if (window == (ngx_msec_t)NGX_ERROR || window == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The oauth_proxy_throttle window is invalid: \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The oauth_proxy_throttle directive has an invalid parameter: \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (zone_value == NULL)
+    {
+        ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The oauth_proxy_throttle directive requires a zone parameter");
+        return NGX_CONF_ERROR;
+    }
+
+    /* Locations that name the same zone count a client's failures together */
+    config->throttle_zone = oauth_proxy_utils_add_zone(main_config, zone_value, init_zone, sizeof(oauth_proxy_throttle_t));
+    if (config->throttle_zone == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    config->throttle_threshold = threshold == NGX_CONF_UNSET ? NGX_CONF_UNSET_UINT : (ngx_uint_t)threshold;
+    config->throttle_window = window;
+    return NGX_CONF_OK;
+}
+
+/*
+ * Return whether the client has reached the failure threshold within the sliding window, so that it is rejected before any decryption
+ */
+ngx_flag_t oauth_proxy_throttle_is_throttled(ngx_http_request_t *request, const oauth_proxy_configuration_t *config)
+{
+    oauth_proxy_throttle_t *throttle = NULL;
+    oauth_proxy_throttle_node_t *entry = NULL;
+    ngx_str_t *address = NULL;
+    ngx_msec_int_t elapsed = 0;
+    ngx_msec_t window = config->throttle_window;
+    uint64_t failures = 0;
+    uint32_t hash = 0;
+
+    if (config->throttle_zone == NULL)
+    {
+        return 0;
+    }
+
+    throttle = config->throttle_zone->data;
+    address = &request->connection->addr_text;
+    hash = ngx_murmur_hash2(address->data, address->len);
+
+    ngx_shmtx_lock(&throttle->shpool->mutex);
+
+    entry = find_node(throttle, address, hash);
+    if (entry != NULL)
+    {
+        /* The counts are only read here, and the window slides when the next failure is recorded */
+        elapsed = (ngx_msec_int_t)(ngx_current_msec - entry->window_start);
+        if (elapsed < (ngx_msec_int_t)window)
+        {
+            failures = entry->current + (uint64_t)entry->previous * (window - elapsed) / window;
+        }
+        else if (elapsed < (ngx_msec_int_t)(2 * window))
+        {
+            failures = (uint64_t)entry->current * (2 * window - elapsed) / window;
+        }
+    }
+
+    ngx_shmtx_unlock(&throttle->shpool->mutex);
+
+    return failures >= config->throttle_threshold ? 1 : 0;
+}
+
+/*
+ * Count a cookie that failed decryption against the client's address, evicting the least recently failing clients when the zone is full
+ */
+void oauth_proxy_throttle_record_failure(ngx_http_request_t *request, const oauth_proxy_configuration_t *config)
+{
+    oauth_proxy_throttle_t *throttle = NULL;
+    oauth_proxy_throttle_node_t *entry = NULL;
+    ngx_queue_t *last = NULL;
+    ngx_str_t *address = NULL;
+    uint32_t hash = 0;
+    size_t size = 0;
+    ngx_uint_t i = 0;
+
+    if (config->throttle_zone == NULL)
+    {
+        return;
+    }
+
+    throttle = config->throttle_zone->data;
+    address = &request->connection->addr_text;
+    hash = ngx_murmur_hash2(address->data, address->len);
+
+    ngx_shmtx_lock(&throttle->shpool->mutex);
+
+    entry = find_node(throttle, address, hash);
+    if (entry != NULL)
+    {
+        slide_window(entry, config->throttle_window, ngx_current_msec);
+        entry->current++;
+
+        ngx_queue_remove(&entry->queue);
+        ngx_queue_insert_head(&throttle->sh->queue, &entry->queue);
+        ngx_shmtx_unlock(&throttle->shpool->mutex);
+        return;
+    }
+
+    size = offsetof(oauth_proxy_throttle_node_t, data) + address->len;
+    entry = ngx_slab_alloc_locked(throttle->shpool, size);
+    for (i = 0; entry == NULL && i < MAX_EVICTIONS_PER_FAILURE && !ngx_queue_empty(&throttle->sh->queue); i++)
+    {
+        last = ngx_queue_last(&throttle->sh->queue);
+        delete_node(throttle, ngx_queue_data(last, oauth_proxy_throttle_node_t, queue));
+
+        entry = ngx_slab_alloc_locked(throttle->shpool, size);
+    }
+
+    if (entry != NULL)
+    {
+        ngx_memcpy(entry->data, address->data, address->len);
+        entry->sn.node.key = hash;
+        entry->sn.str.data = entry->data;
+        entry->sn.str.len = address->len;
+        entry->window_start = ngx_current_msec;
+        entry->current = 1;
+        entry->previous = 0;
+
+        ngx_rbtree_insert(&throttle->sh->rbtree, &entry->sn.node);
+        ngx_queue_insert_head(&throttle->sh->queue, &entry->queue);
+    }
+
+    ngx_shmtx_unlock(&throttle->shpool->mutex);
+
+    if (entry == NULL)
+    {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "The oauth_proxy_throttle zone \"%V\" is too small to count a client's failures", &config->throttle_zone->shm.name);
+    }
+}
+
+/*
+ * Set up the zone, or reuse existing clients when NGINX is reloaded
+ */
+static ngx_int_t init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    oauth_proxy_throttle_t *old_throttle = data;
+    oauth_proxy_throttle_t *throttle = shm_zone->data;
+    size_t len = 0;
+
+    if (old_throttle != NULL)
+    {
+        throttle->sh = old_throttle->sh;
+        throttle->shpool = old_throttle->shpool;
+        return NGX_OK;
+    }
+
+    throttle->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+    if (shm_zone->shm.exists)
+    {
+        throttle->sh = throttle->shpool->data;
+        return NGX_OK;
+    }
+
+    throttle->sh = ngx_slab_calloc(throttle->shpool, sizeof(oauth_proxy_throttle_shctx_t));
+    if (throttle->sh == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    throttle->shpool->data = throttle->sh;
+    ngx_rbtree_init(&throttle->sh->rbtree, &throttle->sh->sentinel, ngx_str_rbtree_insert_value);
+    ngx_queue_init(&throttle->sh->queue);
+
+    len = sizeof(" in oauth_proxy_throttle zone \"\"") + shm_zone->shm.name.len;
+    throttle->shpool->log_ctx = ngx_slab_alloc(throttle->shpool, len);
+    if (throttle->shpool->log_ctx == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(throttle->shpool->log_ctx, " in oauth_proxy_throttle zone \"%V\"%Z", &shm_zone->shm.name);
+    throttle->shpool->log_nomem = 0;
+    return NGX_OK;
+}
+
+/*
+ * Find a client, which must be called while holding the zone lock
+ */
+static oauth_proxy_throttle_node_t *find_node(oauth_proxy_throttle_t *throttle, ngx_str_t *address, uint32_t hash)
+{
+    ngx_str_node_t *sn = ngx_str_rbtree_lookup(&throttle->sh->rbtree, address, hash);
+
+    return sn != NULL ? (oauth_proxy_throttle_node_t *)((u_char *)sn - offsetof(oauth_proxy_throttle_node_t, sn)) : NULL;
+}
+
+/*
+ * Move the fixed window forward to the one that contains the current time, keeping the count of the window before it
+ */
+static void slide_window(oauth_proxy_throttle_node_t *entry, ngx_msec_t window, ngx_msec_t now)
+{
+    ngx_msec_int_t elapsed = (ngx_msec_int_t)(now - entry->window_start);
+
+    if (elapsed < (ngx_msec_int_t)window)
+    {
+        return;
+    }
+
+    if (elapsed < (ngx_msec_int_t)(2 * window))
+    {
+        entry->previous = entry->current;
+        entry->window_start += window;
+    }
+    else
+    {
+        entry->previous = 0;
+        entry->window_start = now;
+    }
+
+    entry->current = 0;
+}
+
+/*
+ * Remove a client, which must be called while holding the zone lock
+ */
+static void delete_node(oauth_proxy_throttle_t *throttle, oauth_proxy_throttle_node_t *entry)
+{
+    ngx_queue_remove(&entry->queue);
+    ngx_rbtree_delete(&throttle->sh->rbtree, &entry->sn.node);
+    ngx_slab_free_locked(throttle->shpool, entry);
+}
@@ -2,11 +2,13 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 #include <ngx_string.h>
-#include <math.h>
+#include <time.h>
 #include "oauth_proxy.h"
 
 /* Forward declarations */
-static ngx_int_t oauth_proxy_utils_integer_to_headerstring(ngx_http_request_t *request, ngx_str_t *output, ngx_int_t input);
+static ngx_flag_t header_matches(const ngx_table_elt_t *header, ngx_uint_t hash, const ngx_str_t *name);
+static void read_cookie_header(const oauth_proxy_configuration_t *config, const ngx_str_t *header, oauth_proxy_request_cookies_t *cookies);
+static void match_cookie(const oauth_proxy_configuration_t *config, const ngx_str_t *name, const ngx_str_t *value, oauth_proxy_request_cookies_t *cookies);
 
 /*
  * Get the CSRF header name into the supplied buffer
@@ -25,15 +27,22 @@ void oauth_proxy_utils_get_csrf_header_name(u_char *csrf_header_name, const oaut
 }
 
 /*
- * Find a header that is not in the standard headers_in structure
+ * Find all headers the module uses in one pass, using the lowercase keys and hashes that NGINX calculated when parsing
  * https://www.nginx.com/resources/wiki/start/topics/examples/headers_management/
  */
-ngx_str_t *oauth_proxy_utils_get_header_in(ngx_http_request_t *request, u_char *name, size_t len)
+void oauth_proxy_utils_read_headers_in(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, oauth_proxy_request_headers_t *headers)
 {
+    static ngx_str_t authorization_name = ngx_string("authorization");
+    static ngx_str_t origin_name = ngx_string("origin");
+    static ngx_str_t request_headers_name = ngx_string("access-control-request-headers");
+    oauth_proxy_main_configuration_t *main_config = NULL;
     ngx_list_part_t *part = NULL;
     ngx_table_elt_t *h = NULL;
     ngx_uint_t i = 0;
 
+    ngx_memzero(headers, sizeof(oauth_proxy_request_headers_t));
+    main_config = ngx_http_get_module_main_conf(request, ngx_curity_http_oauth_proxy_module);
+
     /* Get the first part of the list. There is usual only one part */
     part = &request->headers_in.headers.part;
     h = part->elts;
@@ -52,61 +61,192 @@ ngx_str_t *oauth_proxy_utils_get_header_in(ngx_http_request_t *request, u_char *
             i = 0;
         }
 
-        /* Just compare the lengths and then the names case insensitively */
-        if (len != h[i].key.len || ngx_strcasecmp(name, h[i].key.data) != 0) {
-            continue;
+        /* Keep the first matched header for each name */
+        if (headers->origin == NULL && header_matches(&h[i], main_config->origin_hash, &origin_name)) {
+            headers->origin = &h[i].value;
+        }
+        else if (headers->csrf == NULL && header_matches(&h[i], config->csrf_header_hash, &config->csrf_header_name)) {
+            headers->csrf = &h[i].value;
+        }
+        else if (headers->authorization == NULL && header_matches(&h[i], main_config->authorization_hash, &authorization_name)) {
+            headers->authorization = &h[i].value;
         }
+        else if (headers->access_control_request_headers == NULL && header_matches(&h[i], main_config->request_headers_hash, &request_headers_name)) {
+            headers->access_control_request_headers = &h[i].value;
+        }
+    }
+}
 
-        /* Stop the search at the first matched header */
-        return &h[i].value;
+/*
+ * Compare the hash and length first, so that most headers are skipped without a string comparison
+ */
+static ngx_flag_t header_matches(const ngx_table_elt_t *header, ngx_uint_t hash, const ngx_str_t *name)
+{
+    if (header->hash != hash || header->key.len != name->len)
+    {
+        return 0;
+    }
+
+    /* Headers added by other modules may not have a lowercase key */
+    if (header->lowcase_key != NULL)
+    {
+        return ngx_strncmp(header->lowcase_key, name->data, name->len) == 0;
     }
 
-    return NULL;
+    return ngx_strncasecmp(header->key.data, name->data, name->len) == 0;
 }
 
 /*
- * Get a cookie and deal with string manipulation
+ * Find all of the module's cookies in one pass over the cookie headers, which HTTP/2 clients may split into many crumbs
  * Use this include technique from the below link to handle version specific differences
  * https://github.com/openresty/headers-more-nginx-module/blob/master/src/ngx_http_headers_more_headers_in.c
  */
-ngx_int_t oauth_proxy_utils_get_cookie(ngx_http_request_t *request, ngx_str_t* cookie_value, const ngx_str_t* cookie_name_prefix, const u_char *cookie_suffix)
+void oauth_proxy_utils_read_cookies(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, oauth_proxy_request_cookies_t *cookies)
 {
-    u_char cookie_name[128];
-    size_t suffix_len = 0;
-    ngx_str_t cookie_name_str;
+    ngx_uint_t i = 0;
 
 #if defined(nginx_version) && nginx_version >= 1023000
-    ngx_table_elt_t *cookie_headers = NULL;
+    ngx_table_elt_t *cookie_header = NULL;
+#else
+    ngx_table_elt_t **cookie_headers = NULL;
 #endif
 
-    suffix_len = ngx_strlen(cookie_suffix);
-    ngx_memcpy(cookie_name, cookie_name_prefix->data, cookie_name_prefix->len);
-    ngx_memcpy(cookie_name + cookie_name_prefix->len, cookie_suffix, suffix_len);
-    cookie_name[cookie_name_prefix->len + suffix_len] = 0;
-
-    cookie_name_str.data = cookie_name;
-    cookie_name_str.len = ngx_strlen(cookie_name);
+    ngx_memzero(cookies, sizeof(oauth_proxy_request_cookies_t));
 
 #if defined(nginx_version) && nginx_version >= 1023000
 
-    // The API to deal with multi header lines changed for NGINX 1.23.0
-    cookie_headers = ngx_http_parse_multi_header_lines(request, request->headers_in.cookie, &cookie_name_str, cookie_value);
-    if (cookie_headers == NULL) {
-        return NGX_DECLINED;
+    // NGINX 1.23.0 and later link cookie headers together
+    for (cookie_header = request->headers_in.cookie; cookie_header != NULL; cookie_header = cookie_header->next)
+    {
+        read_cookie_header(config, &cookie_header->value, cookies);
     }
-
-    return NGX_OK;
 #else
 
-    // Versions before 1.23.0 used this syntax and returned NGX_DECLINED if not found
-    return ngx_http_parse_multi_header_lines(&request->headers_in.cookies, &cookie_name_str, cookie_value);
+    // Versions before 1.23.0 kept cookie headers in an array
+    cookie_headers = request->headers_in.cookies.elts;
+    for (i = 0; i < request->headers_in.cookies.nelts; i++)
+    {
+        read_cookie_header(config, &cookie_headers[i]->value, cookies);
+    }
 #endif
+
+    /* The chunks end at the first missing number */
+    for (i = 0; i < OAUTH_PROXY_MAX_COOKIE_CHUNKS && cookies->at_chunks[i].data != NULL; i++)
+    {
+        /* void */
+    }
+
+    cookies->at_chunk_count = i;
+}
+
+/*
+ * Split a cookie header into name and value pairs, in the same way as ngx_http_parse_multi_header_lines
+ */
+static void read_cookie_header(const oauth_proxy_configuration_t *config, const ngx_str_t *header, oauth_proxy_request_cookies_t *cookies)
+{
+    u_char *position = header->data;
+    u_char *end = header->data + header->len;
+    ngx_str_t name;
+    ngx_str_t value;
+
+    while (position < end)
+    {
+        while (position < end && (*position == ' ' || *position == ';'))
+        {
+            position++;
+        }
+
+        name.data = position;
+        while (position < end && *position != '=' && *position != ';' && *position != ' ')
+        {
+            position++;
+        }
+
+        name.len = position - name.data;
+        while (position < end && *position == ' ')
+        {
+            position++;
+        }
+
+        /* Skip crumbs without a value */
+        if (position == end || *position != '=')
+        {
+            while (position < end && *position != ';')
+            {
+                position++;
+            }
+
+            continue;
+        }
+
+        for (position++; position < end && *position == ' '; position++)
+        {
+            /* void */
+        }
+
+        value.data = position;
+        while (position < end && *position != ';')
+        {
+            position++;
+        }
+
+        value.len = position - value.data;
+        match_cookie(config, &name, &value, cookies);
+    }
+}
+
+/*
+ * Keep the first value for each of the module's cookies, whose names all start with the access token cookie's name or the CSRF cookie's name
+ */
+static void match_cookie(const oauth_proxy_configuration_t *config, const ngx_str_t *name, const ngx_str_t *value, oauth_proxy_request_cookies_t *cookies)
+{
+    const ngx_str_t *at_name = &config->at_cookie_name;
+    size_t index_len = 0;
+    ngx_int_t index = 0;
+
+    if (name->len == config->csrf_cookie_name.len && ngx_strncasecmp(name->data, config->csrf_cookie_name.data, name->len) == 0)
+    {
+        if (cookies->csrf.data == NULL)
+        {
+            cookies->csrf = *value;
+        }
+
+        return;
+    }
+
+    if (name->len < at_name->len || ngx_strncasecmp(name->data, at_name->data, at_name->len) != 0)
+    {
+        return;
+    }
+
+    if (name->len == at_name->len)
+    {
+        if (cookies->at.data == NULL)
+        {
+            cookies->at = *value;
+        }
+
+        return;
+    }
+
+    /* Numbered chunks are named like example-at-0, with no leading zeros */
+    index_len = name->len - at_name->len - 1;
+    if (name->data[at_name->len] != '-' || index_len == 0 || (index_len > 1 && name->data[at_name->len + 1] == '0'))
+    {
+        return;
+    }
+
+    index = ngx_atoi(name->data + at_name->len + 1, index_len);
+    if (index != NGX_ERROR && index < OAUTH_PROXY_MAX_COOKIE_CHUNKS && cookies->at_chunks[index].data == NULL)
+    {
+        cookies->at_chunks[index] = *value;
+    }
 }
 
 /*
- * Add a single outgoing header
+ * Add a single outgoing header, whose name and value must remain valid for the lifetime of the request
  */
-ngx_int_t oauth_proxy_utils_add_header_out(ngx_http_request_t *request, const char *name, ngx_str_t *value)
+ngx_int_t oauth_proxy_utils_add_header_out(ngx_http_request_t *request, const ngx_str_t *name, const ngx_str_t *value)
 {
     ngx_table_elt_t *header_element = NULL;
 
@@ -116,51 +256,127 @@ ngx_int_t oauth_proxy_utils_add_header_out(ngx_http_request_t *request, const ch
         return NGX_ERROR;
     }
 
-    header_element->key.data = (u_char *)name;
-    header_element->key.len = ngx_strlen(name);
-    header_element->value.data = value->data;
-    header_element->value.len = value->len;
+    ngx_memzero(header_element, sizeof(ngx_table_elt_t));
+    header_element->key = *name;
+    header_element->value = *value;
     header_element->hash = 1;
+    oauth_proxy_utils_count_memory(request, OAUTH_PROXY_MEMORY_HEADERS, sizeof(ngx_table_elt_t));
     return NGX_OK;
 }
 
 /*
- * Deal with conversions and then add an outgoing header for an integer
+ * Add a block of outgoing headers that were rendered when the configuration was loaded
  */
-ngx_int_t oauth_proxy_utils_add_integer_header_out(ngx_http_request_t *request, const char *name, ngx_int_t value)
+ngx_int_t oauth_proxy_utils_add_headers_out(ngx_http_request_t *request, const ngx_array_t *headers)
 {
-    ngx_str_t buffer;
+    ngx_table_elt_t *header_elements = NULL;
+    ngx_table_elt_t *header_element = NULL;
+    ngx_uint_t i = 0;
 
-    if (oauth_proxy_utils_integer_to_headerstring(request, &buffer, value) != NGX_OK)
+    header_elements = headers->elts;
+    for (i = 0; i < headers->nelts; i++)
     {
-        return NGX_ERROR;
+        header_element = ngx_list_push(&request->headers_out.headers);
+        if (header_element == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        *header_element = header_elements[i];
     }
 
-    return oauth_proxy_utils_add_header_out(request, name, &buffer);
+    oauth_proxy_utils_count_memory(request, OAUTH_PROXY_MEMORY_HEADERS, headers->nelts * sizeof(ngx_table_elt_t));
+    return NGX_OK;
 }
 
 /*
- * Set a header string, which must point to permanent heap memory
+ * Count request pool memory that the module allocated, for requests whose context is kept
+ * List elements are counted at their element size, since the list only allocates a new part once in a while
  */
-static ngx_int_t oauth_proxy_utils_integer_to_headerstring(ngx_http_request_t *request, ngx_str_t *output, ngx_int_t input)
+void oauth_proxy_utils_count_memory(ngx_http_request_t *request, ngx_uint_t category, size_t size)
 {
-    u_char *buffer;
-    u_char *result = NULL;
-    size_t buffer_size = 128;
-    size_t size = 0;
+    oauth_proxy_request_context_t *context = ngx_http_get_module_ctx(request, ngx_curity_http_oauth_proxy_module);
 
-    buffer = ngx_pcalloc(request->pool, buffer_size);
-    if (buffer == NULL)
+    if (context != NULL)
     {
-        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0, "OAuth proxy failed to allocate integer to string memory");
-        return NGX_ERROR;
+        context->memory[category] += size;
     }
+}
 
-    result = ngx_snprintf(buffer, buffer_size - 1, "%d", input);
-    size = result - buffer;
-    buffer[size] = 0;
+/*
+ * The NGINX time is cached per event loop iteration in milliseconds, so a monotonic clock is read for stage timings
+ */
+uint64_t oauth_proxy_utils_get_time(void)
+{
+    struct timespec now;
 
-    output->data = buffer;
-    output->len = size;
-    return NGX_OK;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+/*
+ * Add the shared memory zone for a zone=name[:size] parameter, where the directive's other locations can name the zone without a size
+ * The feature's init function is the zone's tag, and NGINX matches zones by name and tag, so a zone of the same name used by another
+ * feature or module fails configuration rather than being returned with data of a different type
+ */
+ngx_shm_zone_t *oauth_proxy_utils_add_zone(ngx_conf_t *main_config, const ngx_str_t *value, ngx_shm_zone_init_pt init_zone, size_t data_size)
+{
+    ngx_str_t *directive = main_config->args->elts;
+    ngx_shm_zone_t *zone = NULL;
+    ngx_str_t name;
+    ngx_str_t size_str;
+    ssize_t size = 0;
+    u_char *separator = NULL;
+    void *data = NULL;
+
+    name.data = value->data + 5;
+    name.len = value->len - 5;
+
+    separator = ngx_strlchr(name.data, name.data + name.len, ':');
+    if (separator != NULL)
+    {
+        name.len = separator - name.data;
+        size_str.data = separator + 1;
+        size_str.len = value->data + value->len - size_str.data;
+
+        size = ngx_parse_size(&size_str);
+        if (size == NGX_ERROR)
+        {
+            ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The %V zone size is invalid: \"%V\"", &directive[0], value);
+            return NULL;
+        }
+
+        if (size < (ssize_t)(8 * ngx_pagesize))
+        {
+            ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The %V zone \"%V\" is too small", &directive[0], value);
+            return NULL;
+        }
+    }
+
+    if (name.len == 0)
+    {
+        ngx_conf_log_error(NGX_LOG_WARN, main_config, 0, "The %V zone name is invalid: \"%V\"", &directive[0], value);
+        return NULL;
+    }
+
+    zone = ngx_shared_memory_add(main_config, &name, size, (void *)init_zone);
+    if (zone == NULL)
+    {
+        return NULL;
+    }
+
+    /* The first location to name the zone allocates the data, which the init function reads when the zone is created */
+    if (zone->data == NULL)
+    {
+        data = ngx_pcalloc(main_config->pool, data_size);
+        if (data == NULL)
+        {
+            return NULL;
+        }
+
+        zone->init = init_zone;
+        zone->data = data;
+    }
+
+    return zone;
 }
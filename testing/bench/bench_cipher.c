@@ -0,0 +1,293 @@
+/*
+ *  Copyright 2022 Curity AB
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * A microbenchmark that compares AES-256-GCM backends, by decrypting cookies of several sizes with the backend it is built with
+ * The bench-ciphers make target builds it once per available backend, and each run starts with the library and CPU features
+ * The event loop case uses the worker's shared context, and the thread case keys a context per call, as thread pool decryption does
+ * Cookies are always encrypted with OpenSSL, which is also what the token handler's encryption is compatible with
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include "src/os/unix/ngx_alloc.c"
+#include "src/core/ngx_palloc.c"
+#include "src/core/ngx_string.c"
+
+#include "../../src/oauth_proxy_encoding.c"
+#include "../../src/oauth_proxy_decryption.c"
+
+/* The backend is chosen by the build command rather than by how NGINX was configured, so that one tree can build each of them */
+#if (BENCH_LIBSODIUM)
+#include "../../src/oauth_proxy_cipher_libsodium.c"
+#else
+#include "../../src/oauth_proxy_cipher_openssl.c"
+#endif
+#include "../../src/oauth_proxy_cpu.c"
+
+/* Each case is run for several rounds and the median is reported, so that one noisy round does not move the result */
+#define ROUNDS 7
+#define DECRYPT_ITERATIONS 20000
+
+#define DESCRIPTION_SIZE 128
+
+typedef void (*bench_run_pt)(void *data, ngx_uint_t iterations);
+
+typedef struct
+{
+    oauth_proxy_configuration_t *config;
+    ngx_str_t cookie;
+    ngx_str_t prefix;
+    u_char *buffer;
+    ngx_flag_t shared_context;
+    ngx_int_t result;
+} decrypt_case_t;
+
+/* Forward declarations */
+static ngx_int_t create_cookie(ngx_pool_t *pool, ngx_str_t *cookie, const u_char *key, size_t cookie_size);
+static void run_decrypt(void *data, ngx_uint_t iterations);
+static double measure(bench_run_pt run, void *data, ngx_uint_t iterations);
+static int compare_doubles(const void *one, const void *two);
+static double elapsed_ns(struct timespec *start, struct timespec *end);
+
+ngx_module_t ngx_curity_http_oauth_proxy_module;
+
+/*
+ * Decrypt cookies from 128 bytes to 16KB on the event loop and as a thread would, and report ns per operation and throughput
+ */
+int main(void)
+{
+    size_t cookie_sizes[] = {128, 512, 2048, 4096, 16384};
+    const char *case_names[] = {"event_loop", "thread"};
+    static u_char key_bytes[OAUTH_PROXY_AES_KEY_SIZE_BYTES];
+    oauth_proxy_encryption_key_t *keys_by_id[OAUTH_PROXY_MAX_KEY_IDS];
+    oauth_proxy_encryption_key_t key;
+    oauth_proxy_configuration_t config;
+    u_char library[DESCRIPTION_SIZE];
+    u_char features[DESCRIPTION_SIZE];
+    u_char *library_last = NULL;
+    u_char *features_last = NULL;
+    ngx_flag_t aes = 0;
+    ngx_log_t log;
+    ngx_cycle_t cycle;
+    ngx_pool_t *pool = NULL;
+    decrypt_case_t decrypt_case;
+    double ns = 0;
+    ngx_uint_t i = 0;
+    ngx_uint_t j = 0;
+
+    ngx_pagesize = getpagesize();
+    ngx_cacheline_size = NGX_CPU_CACHE_LINE;
+    oauth_proxy_encoding_initialize();
+
+    ngx_memzero(&log, sizeof(ngx_log_t));
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, &log);
+    if (pool == NULL)
+    {
+        return 1;
+    }
+
+    /* A fixed key keeps runs comparable, and the cipher is prepared in the same way as the init process hook does */
+    for (i = 0; i < OAUTH_PROXY_AES_KEY_SIZE_BYTES; i++)
+    {
+        key_bytes[i] = (u_char)i;
+    }
+
+    ngx_memzero(&key, sizeof(key));
+    ngx_memcpy(key.encryption_key_bytes, key_bytes, OAUTH_PROXY_AES_KEY_SIZE_BYTES);
+    ngx_memzero(&cycle, sizeof(cycle));
+    cycle.pool = pool;
+    cycle.log = &log;
+    if (oauth_proxy_cipher_initialize(&cycle, &key) != NGX_OK)
+    {
+        fprintf(stderr, "Unable to initialize the decryption cipher\n");
+        return 1;
+    }
+
+    ngx_memzero(keys_by_id, sizeof(keys_by_id));
+    keys_by_id[0] = &key;
+
+    ngx_memzero(&config, sizeof(config));
+    config.enabled = 1;
+    config.encryption_keys_by_id = keys_by_id;
+
+    library_last = oauth_proxy_cipher_get_library(library, library + DESCRIPTION_SIZE);
+    features_last = get_features(features, features + DESCRIPTION_SIZE, &aes);
+    printf("library: %.*s\n", (int)(library_last - library), library);
+    printf("cpu:     %.*s\n", (int)(features_last - features), features);
+    printf("%-14s %8s %12s %10s\n", "function", "size", "ns/op", "MB/s");
+
+    ngx_memzero(&decrypt_case, sizeof(decrypt_case));
+    decrypt_case.config = &config;
+    ngx_str_set(&decrypt_case.prefix, "Bearer ");
+
+    for (i = 0; i < sizeof(cookie_sizes) / sizeof(cookie_sizes[0]); i++)
+    {
+        if (create_cookie(pool, &decrypt_case.cookie, key_bytes, cookie_sizes[i]) != NGX_OK)
+        {
+            fprintf(stderr, "Unable to create a %zu byte cookie\n", cookie_sizes[i]);
+            return 1;
+        }
+
+        decrypt_case.buffer = ngx_pnalloc(pool, ngx_base64_decoded_length(decrypt_case.cookie.len));
+        if (decrypt_case.buffer == NULL)
+        {
+            return 1;
+        }
+
+        for (j = 0; j < sizeof(case_names) / sizeof(case_names[0]); j++)
+        {
+            decrypt_case.shared_context = j == 0;
+            ns = measure(run_decrypt, &decrypt_case, DECRYPT_ITERATIONS);
+            if (decrypt_case.result != NGX_OK)
+            {
+                fprintf(stderr, "Unable to decrypt a %zu byte cookie\n", cookie_sizes[i]);
+                return 1;
+            }
+
+            /* Throughput is for the decoded cookie, which is what the cipher processes */
+            printf("%-14s %8zu %12.1f %10.1f\n", case_names[j], decrypt_case.cookie.len, ns, ngx_base64_decoded_length(decrypt_case.cookie.len) * 1e3 / ns);
+        }
+    }
+
+    oauth_proxy_cipher_free(&key);
+    return 0;
+}
+
+/*
+ * Encrypt random plaintext as a version 2 cookie for key id 0, sized so that the encoded cookie is close to the requested size
+ */
+static ngx_int_t create_cookie(ngx_pool_t *pool, ngx_str_t *cookie, const u_char *key, size_t cookie_size)
+{
+    EVP_CIPHER_CTX *ctx = NULL;
+    ngx_str_t source;
+    u_char *payload = NULL;
+    size_t header_size = VERSION_SIZE + KEY_ID_SIZE + GCM_IV_SIZE;
+    size_t plaintext_size = cookie_size * 3 / 4 - header_size - GCM_TAG_SIZE;
+    size_t payload_size = header_size + plaintext_size + GCM_TAG_SIZE;
+    int len = 0;
+    int evp_result = 0;
+
+    payload = ngx_palloc(pool, payload_size);
+    cookie->data = ngx_pnalloc(pool, ngx_base64_encoded_length(payload_size));
+    if (payload == NULL || cookie->data == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    payload[0] = KEY_ID_VERSION;
+    payload[VERSION_SIZE] = 0;
+    if (RAND_bytes(payload + VERSION_SIZE + KEY_ID_SIZE, (int)(GCM_IV_SIZE + plaintext_size)) != 1)
+    {
+        return NGX_ERROR;
+    }
+
+    ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    /* The random plaintext is encrypted in place, since only its size matters to the benchmark */
+    evp_result = EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, payload + VERSION_SIZE + KEY_ID_SIZE) &&
+                 EVP_EncryptUpdate(ctx, payload + header_size, &len, payload + header_size, (int)plaintext_size) &&
+                 EVP_EncryptFinal_ex(ctx, payload + header_size + len, &len) &&
+                 EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, GCM_TAG_SIZE, payload + header_size + plaintext_size);
+    EVP_CIPHER_CTX_free(ctx);
+    if (!evp_result)
+    {
+        return NGX_ERROR;
+    }
+
+    source.data = payload;
+    source.len = payload_size;
+    ngx_encode_base64url(cookie, &source);
+    return NGX_OK;
+}
+
+static void run_decrypt(void *data, ngx_uint_t iterations)
+{
+    decrypt_case_t *decrypt_case = data;
+    u_char error[OAUTH_PROXY_DECRYPTION_ERROR_SIZE];
+    ngx_str_t plaintext;
+    ngx_flag_t compressed = 0;
+    ngx_uint_t i = 0;
+
+    for (i = 0; i < iterations; i++)
+    {
+        decrypt_case->result = oauth_proxy_decryption_decrypt_buffer(decrypt_case->buffer, &plaintext, &decrypt_case->cookie, decrypt_case->config,
+                                                                     &decrypt_case->prefix, decrypt_case->shared_context, &compressed, error);
+        __asm__ __volatile__("" : : "r"(plaintext.data) : "memory");
+    }
+}
+
+/*
+ * Run a warm up round and then timed rounds, returning the median ns per operation
+ */
+static double measure(bench_run_pt run, void *data, ngx_uint_t iterations)
+{
+    double results[ROUNDS];
+    struct timespec start, end;
+    ngx_uint_t i = 0;
+
+    run(data, iterations / 10);
+
+    for (i = 0; i < ROUNDS; i++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        run(data, iterations);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        results[i] = elapsed_ns(&start, &end) / iterations;
+    }
+
+    qsort(results, ROUNDS, sizeof(double), compare_doubles);
+    return results[ROUNDS / 2];
+}
+
+static int compare_doubles(const void *one, const void *two)
+{
+    double first = *(const double *)one;
+    double second = *(const double *)two;
+
+    return (first > second) - (first < second);
+}
+
+static double elapsed_ns(struct timespec *start, struct timespec *end)
+{
+    return (double)(end->tv_sec - start->tv_sec) * 1e9 + (double)(end->tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Cookies in this benchmark are not compressed and memory is not counted, so these module functions are not needed
+ */
+ngx_int_t oauth_proxy_compression_inflate(ngx_http_request_t *request, ngx_str_t *plaintext, const ngx_str_t *compressed, const oauth_proxy_configuration_t *config, const ngx_str_t *prefix)
+{
+    return NGX_HTTP_UNAUTHORIZED;
+}
+
+void oauth_proxy_utils_count_memory(ngx_http_request_t *request, ngx_uint_t category, size_t size)
+{
+}
+
+/*
+ * The included sources log through this function, which is not needed by the benchmark
+ */
+void ngx_cdecl ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err, const char *fmt, ...)
+{
+}
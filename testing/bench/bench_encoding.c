@@ -0,0 +1,209 @@
+/*
+ *  Copyright 2022 Curity AB
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * A microbenchmark for base64url decoding of cookie sized payloads
+ * It includes the encoding source directly, so that each block decoder can be measured in isolation
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../../src/oauth_proxy_encoding.c"
+
+#define ITERATIONS 200000
+
+/* Forward declarations */
+static int legacy_base64_url_decode(u_char *bufplain, const u_char *bufcoded);
+static size_t encode(u_char *bufcoded, const u_char *bufplain, size_t plain_len);
+static double elapsed_ns(struct timespec *start, struct timespec *end);
+
+/*
+ * Run each decoder over payloads from 100 bytes to 8KB and report ns per decode
+ */
+int main(void)
+{
+    size_t sizes[] = {100, 1024, 2048, 4096, 8192};
+    const char *names[] = {"scalar", "sse4.1", "avx2"};
+    decode_blocks_pt decoders[3];
+    ngx_uint_t decoder_count = 1;
+    u_char *plain = NULL;
+    u_char *coded = NULL;
+    u_char *output = NULL;
+    size_t coded_len = 0;
+    size_t decoded_len = 0;
+    struct timespec start, end;
+    ngx_uint_t i = 0, j = 0, k = 0;
+
+    decoders[0] = decode_blocks_scalar;
+#ifdef OAUTH_PROXY_SIMD_BASE64
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        decoders[decoder_count++] = decode_blocks_sse41;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        decoders[decoder_count++] = decode_blocks_avx2;
+    }
+#endif
+
+    printf("%-8s %-10s %12s %10s\n", "bytes", "decoder", "ns/op", "speedup");
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        double legacy_ns = 0;
+        double ns = 0;
+
+        plain = malloc(sizes[i]);
+        coded = malloc(ngx_base64_encoded_length(sizes[i]) + 1);
+        output = malloc(sizes[i] + 4);
+        for (j = 0; j < sizes[i]; j++)
+        {
+            plain[j] = (u_char)rand();
+        }
+
+        /* The legacy decoder needs a null terminator to find the end of the input */
+        coded_len = encode(coded, plain, sizes[i]);
+        coded[coded_len] = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (k = 0; k < ITERATIONS; k++)
+        {
+            legacy_base64_url_decode(output, coded);
+            __asm__ __volatile__("" : : "r"(output) : "memory");
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        legacy_ns = elapsed_ns(&start, &end) / ITERATIONS;
+        printf("%-8zu %-10s %12.1f %10s\n", sizes[i], "legacy", legacy_ns, "1.00x");
+
+        for (j = 0; j < decoder_count; j++)
+        {
+            decode_blocks = decoders[j];
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (k = 0; k < ITERATIONS; k++)
+            {
+                oauth_proxy_encoding_base64_url_decode(output, &decoded_len, coded, coded_len);
+                __asm__ __volatile__("" : : "r"(output) : "memory");
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            ns = elapsed_ns(&start, &end) / ITERATIONS;
+
+            if (decoded_len != sizes[i] || memcmp(output, plain, sizes[i]) != 0)
+            {
+                fprintf(stderr, "The %s decoder produced incorrect output for %zu bytes\n", names[j], sizes[i]);
+                return 1;
+            }
+
+            printf("%-8zu %-10s %12.1f %9.2fx\n", sizes[i], names[j], ns, legacy_ns / ns);
+        }
+
+        free(plain);
+        free(coded);
+        free(output);
+    }
+
+    return 0;
+}
+
+/*
+ * The previous decoder, which scanned for the first character outside the alphabet
+ */
+static int legacy_base64_url_decode(u_char *bufplain, const u_char *bufcoded)
+{
+    int nbytesdecoded = 0;
+    const u_char *bufin = NULL;
+    u_char *bufout = NULL;
+    int nprbytes = 0;
+
+    bufin = bufcoded;
+    while (pr2six[*(bufin++)] <= 63)
+        ;
+
+    nprbytes = (bufin - bufcoded) - 1;
+    nbytesdecoded = (((int)nprbytes + 3) / 4) * 3;
+
+    bufout = bufplain;
+    bufin = bufcoded;
+
+    while (nprbytes > 4)
+    {
+        *(bufout++) = (u_char) (pr2six[*bufin] << 2 | pr2six[bufin[1]] >> 4);
+        *(bufout++) = (u_char) (pr2six[bufin[1]] << 4 | pr2six[bufin[2]] >> 2);
+        *(bufout++) = (u_char) (pr2six[bufin[2]] << 6 | pr2six[bufin[3]]);
+        bufin += 4;
+        nprbytes -= 4;
+    }
+
+    if (nprbytes > 1)
+    {
+        *(bufout++) = (u_char) (pr2six[*bufin] << 2 | pr2six[bufin[1]] >> 4);
+    }
+    if (nprbytes > 2)
+    {
+        *(bufout++) = (u_char) (pr2six[bufin[1]] << 4 | pr2six[bufin[2]] >> 2);
+    }
+    if (nprbytes > 3)
+    {
+        *(bufout++) = (u_char) (pr2six[bufin[2]] << 6 | pr2six[bufin[3]]);
+    }
+
+    nbytesdecoded -= (4 - nprbytes) & 3;
+    bufplain[nbytesdecoded] = '\0';
+    return nbytesdecoded;
+}
+
+/*
+ * Encode test data as unpadded base64url, in the same way as encrypt.js
+ */
+static size_t encode(u_char *bufcoded, const u_char *bufplain, size_t plain_len)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    u_char *bufout = bufcoded;
+    uint32_t value = 0;
+    size_t i = 0;
+
+    for (i = 0; i + 2 < plain_len; i += 3)
+    {
+        value = (uint32_t)bufplain[i] << 16 | (uint32_t)bufplain[i + 1] << 8 | bufplain[i + 2];
+        *(bufout++) = alphabet[(value >> 18) & 63];
+        *(bufout++) = alphabet[(value >> 12) & 63];
+        *(bufout++) = alphabet[(value >> 6) & 63];
+        *(bufout++) = alphabet[value & 63];
+    }
+
+    if (plain_len - i == 1)
+    {
+        value = (uint32_t)bufplain[i] << 16;
+        *(bufout++) = alphabet[(value >> 18) & 63];
+        *(bufout++) = alphabet[(value >> 12) & 63];
+    }
+    else if (plain_len - i == 2)
+    {
+        value = (uint32_t)bufplain[i] << 16 | (uint32_t)bufplain[i + 1] << 8;
+        *(bufout++) = alphabet[(value >> 18) & 63];
+        *(bufout++) = alphabet[(value >> 12) & 63];
+        *(bufout++) = alphabet[(value >> 6) & 63];
+    }
+
+    return bufout - bufcoded;
+}
+
+static double elapsed_ns(struct timespec *start, struct timespec *end)
+{
+    return (double)(end->tv_sec - start->tv_sec) * 1e9 + (double)(end->tv_nsec - start->tv_nsec);
+}
@@ -0,0 +1,220 @@
+/*
+ *  Copyright 2022 Curity AB
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * A microbenchmark for trusted web origin matching with 1, 100 and 10,000 configured origins
+ * It includes the NGINX pool, array, string and hash sources, so that the matcher runs without a full NGINX build
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "src/os/unix/ngx_alloc.c"
+#include "src/core/ngx_palloc.c"
+#include "src/core/ngx_array.c"
+#include "src/core/ngx_string.c"
+#include "src/core/ngx_hash.c"
+#include "../../src/oauth_proxy_origins.c"
+
+#define ITERATIONS 1000000
+
+/* Forward declarations */
+static ngx_int_t create_configuration(ngx_conf_t *cf, oauth_proxy_configuration_t *config, ngx_uint_t count, ngx_flag_t wildcard);
+static ngx_flag_t legacy_is_trusted(const oauth_proxy_configuration_t *config, const ngx_str_t *web_origin);
+static double elapsed_ns(struct timespec *start, struct timespec *end);
+
+/*
+ * Compare the previous linear scan with the hashed matcher, looking up the last configured origin
+ */
+int main(void)
+{
+    ngx_uint_t counts[] = {1, 100, 10000};
+    ngx_log_t log;
+    ngx_conf_t cf;
+    oauth_proxy_configuration_t config;
+    oauth_proxy_configuration_t wildcard_config;
+    ngx_str_t *origins = NULL;
+    ngx_str_t web_origin;
+    ngx_flag_t trusted = 0;
+    struct timespec start, end;
+    double legacy_ns = 0;
+    double ns = 0;
+    ngx_uint_t i = 0, k = 0;
+
+    ngx_pagesize = getpagesize();
+    ngx_cacheline_size = NGX_CPU_CACHE_LINE;
+
+    ngx_memzero(&log, sizeof(ngx_log_t));
+    ngx_memzero(&cf, sizeof(ngx_conf_t));
+    cf.log = &log;
+    cf.pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, &log);
+    cf.temp_pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, &log);
+    if (cf.pool == NULL || cf.temp_pool == NULL)
+    {
+        return 1;
+    }
+
+    printf("%-8s %-10s %12s %10s\n", "origins", "matcher", "ns/op", "speedup");
+
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+    {
+        if (create_configuration(&cf, &config, counts[i], 0) != NGX_OK ||
+            create_configuration(&cf, &wildcard_config, counts[i], 1) != NGX_OK)
+        {
+            fprintf(stderr, "Unable to compile %lu trusted origins\n", (unsigned long) counts[i]);
+            return 1;
+        }
+
+        /* The last origin is the worst case for the linear scan */
+        origins = config.trusted_web_origins->elts;
+        web_origin = origins[counts[i] - 1];
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (k = 0; k < ITERATIONS; k++)
+        {
+            trusted = legacy_is_trusted(&config, &web_origin);
+            __asm__ __volatile__("" : : "r"(trusted) : "memory");
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        legacy_ns = elapsed_ns(&start, &end) / ITERATIONS;
+        printf("%-8lu %-10s %12.1f %10s\n", (unsigned long) counts[i], "linear", legacy_ns, "1.00x");
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (k = 0; k < ITERATIONS; k++)
+        {
+            trusted = oauth_proxy_origins_is_trusted(&config, &web_origin);
+            __asm__ __volatile__("" : : "r"(trusted) : "memory");
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ns = elapsed_ns(&start, &end) / ITERATIONS;
+        if (!trusted)
+        {
+            fprintf(stderr, "The exact hash did not match %.*s\n", (int) web_origin.len, web_origin.data);
+            return 1;
+        }
+        printf("%-8lu %-10s %12.1f %9.2fx\n", (unsigned long) counts[i], "exact", ns, legacy_ns / ns);
+
+        /* The same host names are also matched through their wildcard parents */
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (k = 0; k < ITERATIONS; k++)
+        {
+            trusted = oauth_proxy_origins_is_trusted(&wildcard_config, &web_origin);
+            __asm__ __volatile__("" : : "r"(trusted) : "memory");
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ns = elapsed_ns(&start, &end) / ITERATIONS;
+        if (!trusted)
+        {
+            fprintf(stderr, "The wildcard hash did not match %.*s\n", (int) web_origin.len, web_origin.data);
+            return 1;
+        }
+        printf("%-8lu %-10s %12.1f %9.2fx\n", (unsigned long) counts[i], "wildcard", ns, legacy_ns / ns);
+    }
+
+    return 0;
+}
+
+/*
+ * Create origins such as https://www.brand42.com, or https://*.brand42.com when wildcards are requested
+ */
+static ngx_int_t create_configuration(ngx_conf_t *cf, oauth_proxy_configuration_t *config, ngx_uint_t count, ngx_flag_t wildcard)
+{
+    ngx_str_t *origin = NULL;
+    u_char *last = NULL;
+    ngx_uint_t i = 0;
+
+    ngx_memzero(config, sizeof(oauth_proxy_configuration_t));
+    config->enabled = 1;
+    config->trusted_web_origins = ngx_array_create(cf->pool, count, sizeof(ngx_str_t));
+    if (config->trusted_web_origins == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        origin = ngx_array_push(config->trusted_web_origins);
+        if (origin == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        origin->data = ngx_pnalloc(cf->pool, 64);
+        if (origin->data == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        last = ngx_sprintf(origin->data, wildcard ? "https://*.brand%ui.com" : "https://www.brand%ui.com", i);
+        origin->len = last - origin->data;
+    }
+
+    if (oauth_proxy_origins_initialize(cf, config) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    /* Lookups use exact origins, so the wildcard configuration is given those values after compiling */
+    if (wildcard)
+    {
+        origin = config->trusted_web_origins->elts;
+        for (i = 0; i < count; i++)
+        {
+            last = ngx_sprintf(origin[i].data, "https://www.brand%ui.com", i);
+            origin[i].len = last - origin[i].data;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * The previous matcher, which compared the origin with each trusted origin in turn
+ */
+static ngx_flag_t legacy_is_trusted(const oauth_proxy_configuration_t *config, const ngx_str_t *web_origin)
+{
+    ngx_str_t *trusted_web_origins = NULL;
+    ngx_uint_t i = 0;
+
+    trusted_web_origins = config->trusted_web_origins->elts;
+    for (i = 0; i < config->trusted_web_origins->nelts; i++)
+    {
+        if (web_origin->len == trusted_web_origins[i].len &&
+            ngx_strncasecmp(web_origin->data, trusted_web_origins[i].data, web_origin->len) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static double elapsed_ns(struct timespec *start, struct timespec *end)
+{
+    return (double)(end->tv_sec - start->tv_sec) * 1e9 + (double)(end->tv_nsec - start->tv_nsec);
+}
+
+/*
+ * The included sources log through these functions, which are not needed by the benchmark
+ */
+void ngx_cdecl ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err, const char *fmt, ...)
+{
+}
+
+void ngx_cdecl ngx_conf_log_error(ngx_uint_t level, ngx_conf_t *cf, ngx_err_t err, const char *fmt, ...)
+{
+    fprintf(stderr, "%s\n", fmt);
+}
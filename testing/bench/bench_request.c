@@ -0,0 +1,862 @@
+/*
+ *  Copyright 2022 Curity AB
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * A microbenchmark for the per request work of the module: cookie decryption, CSRF checks, reading request headers and cookies
+ * JWTs are also decrypted from uncompressed and compressed cookies, to compare the cookie size with the CPU cost
+ * It includes the NGINX pool, list, string and hash sources, so that module functions run without a full NGINX build
+ * Pool allocations made by the module are counted, so that the output reports allocations per operation as well as time
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <zlib.h>
+#include "src/os/unix/ngx_alloc.c"
+#include "src/core/ngx_palloc.c"
+#include "src/core/ngx_list.c"
+#include "src/core/ngx_string.c"
+#include "src/core/ngx_hash.c"
+
+/* Module sources included below this point allocate through the counting functions */
+static void *counting_palloc(ngx_pool_t *pool, size_t size);
+static void *counting_pnalloc(ngx_pool_t *pool, size_t size);
+static void *counting_pcalloc(ngx_pool_t *pool, size_t size);
+#define ngx_palloc counting_palloc
+#define ngx_pnalloc counting_pnalloc
+#define ngx_pcalloc counting_pcalloc
+
+#include "../../src/oauth_proxy_encoding.c"
+#include "../../src/oauth_proxy_decryption.c"
+#if (OAUTH_PROXY_LIBSODIUM)
+#include "../../src/oauth_proxy_cipher_libsodium.c"
+#else
+#include "../../src/oauth_proxy_cipher_openssl.c"
+#endif
+#include "../../src/oauth_proxy_compression.c"
+#include "../../src/oauth_proxy_csrf.c"
+#include "../../src/oauth_proxy_utils.c"
+
+#undef ngx_palloc
+#undef ngx_pnalloc
+#undef ngx_pcalloc
+
+/* Each case is run for several rounds and the median is reported, so that one noisy round does not move the result */
+#define ROUNDS 7
+#define DECRYPT_ITERATIONS 20000
+#define HEADER_ITERATIONS 200000
+#define CSRF_ITERATIONS 200000
+
+/* The size of an encrypted cookie for a 64 character CSRF token */
+#define CSRF_COOKIE_SIZE 126
+
+/* The default request_pool_size, so that large cookies spill to large allocations as they do in NGINX */
+#define REQUEST_POOL_SIZE 4096
+
+/* A JWT's payload is a JSON object with this many claims, in addition to the standard ones */
+#define JWT_MIN_CLAIMS 5
+
+/* NGINX allocates request header list parts of this size */
+#define HEADER_LIST_PART_SIZE 20
+
+typedef void (*bench_run_pt)(void *data, ngx_uint_t iterations);
+
+typedef struct
+{
+    ngx_http_request_t *request;
+    oauth_proxy_configuration_t *config;
+    ngx_str_t cookie;
+    ngx_str_t prefix;
+    ngx_int_t result;
+} decrypt_case_t;
+
+typedef struct
+{
+    ngx_http_request_t *request;
+    oauth_proxy_configuration_t *config;
+    oauth_proxy_request_headers_t headers;
+} headers_case_t;
+
+typedef struct
+{
+    ngx_http_request_t *request;
+    oauth_proxy_configuration_t *config;
+    ngx_str_t cookie;
+    ngx_str_t token;
+    ngx_int_t result;
+} csrf_case_t;
+
+typedef struct
+{
+    ngx_http_request_t *request;
+    oauth_proxy_configuration_t *config;
+    oauth_proxy_request_cookies_t cookies;
+} cookies_case_t;
+
+/* Forward declarations */
+static ngx_int_t create_cookie(ngx_pool_t *pool, ngx_str_t *cookie, const u_char *key, size_t cookie_size);
+static ngx_int_t create_jwt(ngx_pool_t *pool, ngx_str_t *jwt, ngx_uint_t claim_count);
+static ngx_int_t create_compressed_cookie(ngx_pool_t *pool, ngx_str_t *cookie, const u_char *key, const ngx_str_t *token);
+static ngx_int_t encrypt_cookie(ngx_pool_t *pool, ngx_str_t *cookie, const u_char *key, u_char version, const u_char *plaintext, size_t plaintext_size);
+static ngx_int_t create_mac_cookie(ngx_pool_t *pool, ngx_str_t *cookie, const u_char *key, const ngx_str_t *token);
+static ngx_int_t create_headers(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, ngx_uint_t count);
+static ngx_int_t add_header(ngx_list_t *headers, ngx_pool_t *pool, const char *name, const char *value);
+static ngx_int_t create_cookie_headers(ngx_http_request_t *request, ngx_uint_t count);
+static void run_decrypt(void *data, ngx_uint_t iterations);
+static void run_csrf_decrypt(void *data, ngx_uint_t iterations);
+static void run_csrf_mac(void *data, ngx_uint_t iterations);
+static void run_read_headers(void *data, ngx_uint_t iterations);
+static void run_read_cookies(void *data, ngx_uint_t iterations);
+static double measure(bench_run_pt run, void *data, ngx_uint_t iterations, double *allocations, double *bytes);
+static size_t encode(u_char *bufcoded, const u_char *bufplain, size_t plain_len);
+static int compare_doubles(const void *one, const void *two);
+static double elapsed_ns(struct timespec *start, struct timespec *end);
+
+static ngx_uint_t allocation_count = 0;
+static size_t allocation_bytes = 0;
+
+ngx_module_t ngx_curity_http_oauth_proxy_module;
+
+/*
+ * Decrypt cookies from 100 bytes to 8KB, then read header lists of 5 to 100 entries and cookie crumbs, and report ns and allocations per operation
+ */
+int main(void)
+{
+    size_t cookie_sizes[] = {100, 512, 1024, 2048, 4096, 8192};
+    ngx_uint_t claim_counts[] = {JWT_MIN_CLAIMS, 20, 50, 100};
+    ngx_uint_t header_counts[] = {5, 10, 25, 50, 100};
+    ngx_uint_t crumb_counts[] = {2, 10, 25, 50};
+    static u_char key_bytes[OAUTH_PROXY_AES_KEY_SIZE_BYTES];
+    oauth_proxy_encryption_key_t *keys_by_id[OAUTH_PROXY_MAX_KEY_IDS];
+    oauth_proxy_encryption_key_t key;
+    oauth_proxy_configuration_t config;
+    oauth_proxy_main_configuration_t main_config;
+    void *main_conf[1];
+    void *request_ctx[1];
+    ngx_log_t log;
+    ngx_cycle_t cycle;
+    ngx_connection_t connection;
+    ngx_http_request_t request;
+    ngx_pool_t *pool = NULL;
+    decrypt_case_t decrypt_case;
+    ngx_str_t jwt;
+    csrf_case_t csrf_case;
+    headers_case_t headers_case;
+    cookies_case_t cookies_case;
+    u_char csrf_header_name[] = "x-example-csrf";
+    double allocations = 0;
+    double bytes = 0;
+    double ns = 0;
+    ngx_uint_t i = 0;
+
+    ngx_pagesize = getpagesize();
+    ngx_cacheline_size = NGX_CPU_CACHE_LINE;
+    oauth_proxy_encoding_initialize();
+
+    ngx_memzero(&log, sizeof(ngx_log_t));
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, &log);
+    if (pool == NULL)
+    {
+        return 1;
+    }
+
+    /* A fixed key keeps runs comparable, and the cipher is prepared in the same way as the init process hook does */
+    for (i = 0; i < OAUTH_PROXY_AES_KEY_SIZE_BYTES; i++)
+    {
+        key_bytes[i] = (u_char)i;
+    }
+
+    ngx_memzero(&key, sizeof(key));
+    ngx_memcpy(key.encryption_key_bytes, key_bytes, OAUTH_PROXY_AES_KEY_SIZE_BYTES);
+    ngx_memzero(&cycle, sizeof(cycle));
+    cycle.pool = pool;
+    cycle.log = &log;
+    if (oauth_proxy_cipher_initialize(&cycle, &key) != NGX_OK)
+    {
+        fprintf(stderr, "Unable to initialize the decryption cipher\n");
+        return 1;
+    }
+
+    ngx_memzero(keys_by_id, sizeof(keys_by_id));
+    keys_by_id[0] = &key;
+
+    ngx_memzero(&config, sizeof(config));
+    config.enabled = 1;
+    config.max_decompressed_size = 65536;
+    config.encryption_keys_by_id = keys_by_id;
+    config.csrf_header_name.data = csrf_header_name;
+    config.csrf_header_name.len = sizeof(csrf_header_name) - 1;
+    config.csrf_header_hash = ngx_hash_key(csrf_header_name, config.csrf_header_name.len);
+    ngx_str_set(&config.at_cookie_name, "example-at");
+    ngx_str_set(&config.csrf_cookie_name, "example-csrf");
+
+    ngx_memzero(&main_config, sizeof(main_config));
+    main_config.authorization_hash = ngx_hash_key((u_char *)"authorization", ngx_strlen("authorization"));
+    main_config.origin_hash = ngx_hash_key((u_char *)"origin", ngx_strlen("origin"));
+    main_config.request_headers_hash = ngx_hash_key((u_char *)"access-control-request-headers", ngx_strlen("access-control-request-headers"));
+    main_conf[0] = &main_config;
+
+    ngx_memzero(&connection, sizeof(connection));
+    connection.log = &log;
+    ngx_memzero(&request, sizeof(request));
+    request.connection = &connection;
+    request.main_conf = main_conf;
+
+    /* Requests without module state, as when no request variables or metrics are used, count no memory */
+    request_ctx[0] = NULL;
+    request.ctx = request_ctx;
+
+    request.pool = ngx_create_pool(REQUEST_POOL_SIZE, &log);
+    if (request.pool == NULL)
+    {
+        return 1;
+    }
+
+    printf("%-14s %8s %12s %10s %10s\n", "function", "size", "ns/op", "allocs/op", "bytes/op");
+
+    /* The handler decrypts with a Bearer prefix, and the request pool is reset each time as for a new request */
+    ngx_memzero(&decrypt_case, sizeof(decrypt_case));
+    decrypt_case.request = &request;
+    decrypt_case.config = &config;
+    ngx_str_set(&decrypt_case.prefix, "Bearer ");
+
+    for (i = 0; i < sizeof(cookie_sizes) / sizeof(cookie_sizes[0]); i++)
+    {
+        if (create_cookie(pool, &decrypt_case.cookie, key_bytes, cookie_sizes[i]) != NGX_OK)
+        {
+            fprintf(stderr, "Unable to create a %zu byte cookie\n", cookie_sizes[i]);
+            return 1;
+        }
+
+        ns = measure(run_decrypt, &decrypt_case, DECRYPT_ITERATIONS, &allocations, &bytes);
+        if (decrypt_case.result != NGX_OK)
+        {
+            fprintf(stderr, "Unable to decrypt a %zu byte cookie\n", cookie_sizes[i]);
+            return 1;
+        }
+
+        printf("%-14s %8zu %12.1f %10.2f %10.1f\n", "decrypt_cookie", decrypt_case.cookie.len, ns, allocations, bytes);
+    }
+
+    /* The same JWT in a version 2 cookie and a compressed version 3 cookie, where the size column is the cookie size */
+    for (i = 0; i < sizeof(claim_counts) / sizeof(claim_counts[0]); i++)
+    {
+        if (create_jwt(pool, &jwt, claim_counts[i]) != NGX_OK ||
+            encrypt_cookie(pool, &decrypt_case.cookie, key_bytes, KEY_ID_VERSION, jwt.data, jwt.len) != NGX_OK)
+        {
+            fprintf(stderr, "Unable to create a JWT cookie with %lu claims\n", (unsigned long) claim_counts[i]);
+            return 1;
+        }
+
+        ns = measure(run_decrypt, &decrypt_case, DECRYPT_ITERATIONS, &allocations, &bytes);
+        if (decrypt_case.result != NGX_OK)
+        {
+            fprintf(stderr, "Unable to decrypt a JWT cookie with %lu claims\n", (unsigned long) claim_counts[i]);
+            return 1;
+        }
+
+        printf("%-14s %8zu %12.1f %10.2f %10.1f\n", "decrypt_jwt", decrypt_case.cookie.len, ns, allocations, bytes);
+
+        if (create_compressed_cookie(pool, &decrypt_case.cookie, key_bytes, &jwt) != NGX_OK)
+        {
+            fprintf(stderr, "Unable to create a compressed JWT cookie with %lu claims\n", (unsigned long) claim_counts[i]);
+            return 1;
+        }
+
+        ns = measure(run_decrypt, &decrypt_case, DECRYPT_ITERATIONS, &allocations, &bytes);
+        if (decrypt_case.result != NGX_OK)
+        {
+            fprintf(stderr, "Unable to decrypt a compressed JWT cookie with %lu claims\n", (unsigned long) claim_counts[i]);
+            return 1;
+        }
+
+        printf("%-14s %8zu %12.1f %10.2f %10.1f\n", "decrypt_jwt_z", decrypt_case.cookie.len, ns, allocations, bytes);
+    }
+
+    /* The encrypted CSRF cookie is decrypted without a prefix, whereas the MAC cookie is checked against the header token */
+    ngx_memzero(&csrf_case, sizeof(csrf_case));
+    csrf_case.request = &request;
+    csrf_case.config = &config;
+    ngx_str_set(&csrf_case.token, "pQguFsD6hFjnyYjaeC5KyijcWS6AvkJHiUmY7dLUsuTKsLAITLiJHVqsCdQpaGYO");
+
+    if (create_cookie(pool, &csrf_case.cookie, key_bytes, CSRF_COOKIE_SIZE) != NGX_OK)
+    {
+        fprintf(stderr, "Unable to create an encrypted CSRF cookie\n");
+        return 1;
+    }
+
+    ns = measure(run_csrf_decrypt, &csrf_case, CSRF_ITERATIONS, &allocations, &bytes);
+    if (csrf_case.result != NGX_OK)
+    {
+        fprintf(stderr, "Unable to decrypt the CSRF cookie\n");
+        return 1;
+    }
+
+    printf("%-14s %8zu %12.1f %10.2f %10.1f\n", "csrf_decrypt", csrf_case.cookie.len, ns, allocations, bytes);
+
+    ngx_memcpy(config.csrf_hmac_key_bytes, key_bytes, OAUTH_PROXY_HMAC_KEY_SIZE_BYTES);
+    if (oauth_proxy_csrf_initialize_mac(&cycle, &config) != NGX_OK ||
+        create_mac_cookie(pool, &csrf_case.cookie, key_bytes, &csrf_case.token) != NGX_OK)
+    {
+        fprintf(stderr, "Unable to create a CSRF MAC cookie\n");
+        return 1;
+    }
+
+    ns = measure(run_csrf_mac, &csrf_case, CSRF_ITERATIONS, &allocations, &bytes);
+    if (csrf_case.result != NGX_OK)
+    {
+        fprintf(stderr, "Unable to verify the CSRF MAC cookie\n");
+        return 1;
+    }
+
+    printf("%-14s %8zu %12.1f %10.2f %10.1f\n", "csrf_mac", csrf_case.cookie.len, ns, allocations, bytes);
+
+    /* The headers the module looks for are placed last, which is the worst case for the scan */
+    ngx_memzero(&headers_case, sizeof(headers_case));
+    headers_case.request = &request;
+    headers_case.config = &config;
+
+    for (i = 0; i < sizeof(header_counts) / sizeof(header_counts[0]); i++)
+    {
+        if (create_headers(&request, &config, header_counts[i]) != NGX_OK)
+        {
+            fprintf(stderr, "Unable to create %lu request headers\n", (unsigned long) header_counts[i]);
+            return 1;
+        }
+
+        ns = measure(run_read_headers, &headers_case, HEADER_ITERATIONS, &allocations, &bytes);
+        if (headers_case.headers.origin == NULL || headers_case.headers.csrf == NULL || headers_case.headers.authorization == NULL)
+        {
+            fprintf(stderr, "The module headers were not found in %lu request headers\n", (unsigned long) header_counts[i]);
+            return 1;
+        }
+
+        printf("%-14s %8lu %12.1f %10.2f %10.1f\n", "read_headers", (unsigned long) header_counts[i], ns, allocations, bytes);
+    }
+
+    /* HTTP/2 clients send each cookie as a separate crumb, and the module's cookies are placed last */
+    ngx_memzero(&cookies_case, sizeof(cookies_case));
+    cookies_case.request = &request;
+    cookies_case.config = &config;
+
+    for (i = 0; i < sizeof(crumb_counts) / sizeof(crumb_counts[0]); i++)
+    {
+        if (create_cookie_headers(&request, crumb_counts[i]) != NGX_OK)
+        {
+            fprintf(stderr, "Unable to create %lu cookie crumbs\n", (unsigned long) crumb_counts[i]);
+            return 1;
+        }
+
+        ns = measure(run_read_cookies, &cookies_case, HEADER_ITERATIONS, &allocations, &bytes);
+        if (cookies_case.cookies.at.data == NULL || cookies_case.cookies.csrf.data == NULL)
+        {
+            fprintf(stderr, "The module cookies were not found in %lu cookie crumbs\n", (unsigned long) crumb_counts[i]);
+            return 1;
+        }
+
+        printf("%-14s %8lu %12.1f %10.2f %10.1f\n", "read_cookies", (unsigned long) crumb_counts[i], ns, allocations, bytes);
+    }
+
+    oauth_proxy_csrf_free_mac(&config);
+    oauth_proxy_compression_free();
+    oauth_proxy_cipher_free(&key);
+    return 0;
+}
+
+/*
+ * Encrypt random plaintext as a version 2 cookie for key id 0, sized so that the encoded cookie is close to the requested size
+ */
+static ngx_int_t create_cookie(ngx_pool_t *pool, ngx_str_t *cookie, const u_char *key, size_t cookie_size)
+{
+    u_char *plaintext = NULL;
+    size_t plaintext_size = 0;
+    ngx_uint_t i = 0;
+
+    plaintext_size = cookie_size * 3 / 4 - (VERSION_SIZE + KEY_ID_SIZE + GCM_IV_SIZE) - GCM_TAG_SIZE;
+    plaintext = ngx_palloc(pool, plaintext_size);
+    if (plaintext == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    /* Token characters are printable, as for a JWT */
+    for (i = 0; i < plaintext_size; i++)
+    {
+        plaintext[i] = (u_char)('a' + rand() % 26);
+    }
+
+    return encrypt_cookie(pool, cookie, key, KEY_ID_VERSION, plaintext, plaintext_size);
+}
+
+/*
+ * Create an RS256 JWT whose payload has typical claims, with random values where an authorization server would use them
+ * Its header, payload and signature are base64url encoded, which limits how well any JWT compresses
+ */
+static ngx_int_t create_jwt(ngx_pool_t *pool, ngx_str_t *jwt, ngx_uint_t claim_count)
+{
+    static const char *header = "{\"kid\":\"-1909572257\",\"x5t\":\"a5VBKnJcXxQKTRkd_vv8FtbOuuM\",\"alg\":\"RS256\"}";
+    u_char *payload = NULL;
+    u_char *last = NULL;
+    u_char signature[256];
+    size_t payload_size = 512 + claim_count * 64;
+    ngx_uint_t i = 0;
+
+    payload = ngx_pnalloc(pool, payload_size);
+    jwt->data = ngx_pnalloc(pool, ngx_base64_encoded_length(ngx_strlen(header)) + ngx_base64_encoded_length(payload_size) + ngx_base64_encoded_length(sizeof(signature)) + 2);
+    if (payload == NULL || jwt->data == NULL || RAND_bytes(signature, sizeof(signature)) != 1)
+    {
+        return NGX_ERROR;
+    }
+
+    last = ngx_sprintf(payload, "{\"jti\":\"%08xD-%04xD-%04xD\",\"delegationId\":\"%08xD-%04xD\",\"exp\":1733913733,\"nbf\":1733913433,"
+                                "\"scope\":\"openid profile investments\",\"iss\":\"https://login.example.com/oauth/v2/oauth-anonymous\","
+                                "\"sub\":\"%08xD%08xD\",\"aud\":\"api.example.com\",\"iat\":1733913433,\"purpose\":\"access_token\"",
+                       (uint32_t)rand(), (uint32_t)rand() & 0xffff, (uint32_t)rand() & 0xffff, (uint32_t)rand(), (uint32_t)rand() & 0xffff,
+                       (uint32_t)rand(), (uint32_t)rand());
+
+    for (i = 0; i < claim_count; i++)
+    {
+        last = ngx_sprintf(last, ",\"custom_claim_%ui\":\"value-%08xD\"", i, (uint32_t)rand());
+    }
+
+    *last++ = '}';
+
+    jwt->len = encode(jwt->data, (const u_char *)header, ngx_strlen(header));
+    jwt->data[jwt->len++] = '.';
+    jwt->len += encode(jwt->data + jwt->len, payload, last - payload);
+    jwt->data[jwt->len++] = '.';
+    jwt->len += encode(jwt->data + jwt->len, signature, sizeof(signature));
+    return NGX_OK;
+}
+
+/*
+ * Create a version 3 cookie, whose plaintext is the token's size followed by its raw DEFLATE data, as encrypt.js does
+ */
+static ngx_int_t create_compressed_cookie(ngx_pool_t *pool, ngx_str_t *cookie, const u_char *key, const ngx_str_t *token)
+{
+    z_stream deflater;
+    u_char *plaintext = NULL;
+    size_t plaintext_size = 0;
+    int zlib_result = 0;
+
+    plaintext = ngx_palloc(pool, DECOMPRESSED_SIZE_SIZE + deflateBound(NULL, token->len));
+    if (plaintext == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    plaintext[0] = (u_char)(token->len >> 24);
+    plaintext[1] = (u_char)(token->len >> 16);
+    plaintext[2] = (u_char)(token->len >> 8);
+    plaintext[3] = (u_char)token->len;
+
+    ngx_memzero(&deflater, sizeof(deflater));
+    if (deflateInit2(&deflater, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    deflater.next_in = token->data;
+    deflater.avail_in = (uInt)token->len;
+    deflater.next_out = plaintext + DECOMPRESSED_SIZE_SIZE;
+    deflater.avail_out = (uInt)deflateBound(&deflater, token->len);
+    zlib_result = deflate(&deflater, Z_FINISH);
+    plaintext_size = DECOMPRESSED_SIZE_SIZE + deflater.total_out;
+    deflateEnd(&deflater);
+    if (zlib_result != Z_STREAM_END)
+    {
+        return NGX_ERROR;
+    }
+
+    return encrypt_cookie(pool, cookie, key, COMPRESSED_VERSION, plaintext, plaintext_size);
+}
+
+/*
+ * Encrypt plaintext as a cookie for key id 0, in the given version's format
+ */
+static ngx_int_t encrypt_cookie(ngx_pool_t *pool, ngx_str_t *cookie, const u_char *key, u_char version, const u_char *plaintext, size_t plaintext_size)
+{
+    EVP_CIPHER_CTX *ctx = NULL;
+    u_char *payload = NULL;
+    size_t header_size = VERSION_SIZE + KEY_ID_SIZE + GCM_IV_SIZE;
+    int len = 0;
+    int evp_result = 0;
+
+    payload = ngx_palloc(pool, header_size + plaintext_size + GCM_TAG_SIZE);
+    cookie->data = ngx_pnalloc(pool, ngx_base64_encoded_length(header_size + plaintext_size + GCM_TAG_SIZE));
+    if (payload == NULL || cookie->data == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    payload[0] = version;
+    payload[VERSION_SIZE] = 0;
+    if (RAND_bytes(payload + VERSION_SIZE + KEY_ID_SIZE, GCM_IV_SIZE) != 1)
+    {
+        return NGX_ERROR;
+    }
+
+    ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    evp_result = EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, payload + VERSION_SIZE + KEY_ID_SIZE) &&
+                 EVP_EncryptUpdate(ctx, payload + header_size, &len, plaintext, (int)plaintext_size) &&
+                 EVP_EncryptFinal_ex(ctx, payload + header_size + len, &len) &&
+                 EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, GCM_TAG_SIZE, payload + header_size + plaintext_size);
+    EVP_CIPHER_CTX_free(ctx);
+    if (!evp_result)
+    {
+        return NGX_ERROR;
+    }
+
+    cookie->len = encode(cookie->data, payload, header_size + plaintext_size + GCM_TAG_SIZE);
+    return NGX_OK;
+}
+
+/*
+ * Create a CSRF cookie containing the HMAC-SHA256 of the token, in the format that the module verifies
+ */
+static ngx_int_t create_mac_cookie(ngx_pool_t *pool, ngx_str_t *cookie, const u_char *key, const ngx_str_t *token)
+{
+    u_char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len = 0;
+
+    if (HMAC(EVP_sha256(), key, OAUTH_PROXY_HMAC_KEY_SIZE_BYTES, token->data, token->len, digest, &digest_len) == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    cookie->data = ngx_pnalloc(pool, ngx_base64_encoded_length(digest_len));
+    if (cookie->data == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    cookie->len = encode(cookie->data, digest, digest_len);
+    return NGX_OK;
+}
+
+/*
+ * Create a header list with common browser headers, followed by the origin, CSRF and authorization headers
+ */
+static ngx_int_t create_headers(ngx_http_request_t *request, const oauth_proxy_configuration_t *config, ngx_uint_t count)
+{
+    static const char *common_names[] = {"host", "user-agent", "accept", "accept-language", "accept-encoding",
+                                         "referer", "connection", "cookie", "x-forwarded-for", "x-request-id"};
+    u_char name[32];
+    u_char *last = NULL;
+    ngx_uint_t filler_count = count - 3;
+    ngx_uint_t i = 0;
+
+    if (ngx_list_init(&request->headers_in.headers, request->pool, HEADER_LIST_PART_SIZE, sizeof(ngx_table_elt_t)) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < filler_count; i++)
+    {
+        if (i < sizeof(common_names) / sizeof(common_names[0]))
+        {
+            last = ngx_cpymem(name, common_names[i], ngx_strlen(common_names[i]));
+        }
+        else
+        {
+            last = ngx_sprintf(name, "x-custom-header-%ui", i);
+        }
+
+        *last = 0;
+        if (add_header(&request->headers_in.headers, request->pool, (const char *)name, "value") != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    if (add_header(&request->headers_in.headers, request->pool, "origin", "https://www.example.com") != NGX_OK ||
+        add_header(&request->headers_in.headers, request->pool, (const char *)config->csrf_header_name.data, "csrf") != NGX_OK ||
+        add_header(&request->headers_in.headers, request->pool, "authorization", "Bearer token") != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * Add a header with the lowercase key and hash that the NGINX header parser calculates
+ */
+static ngx_int_t add_header(ngx_list_t *headers, ngx_pool_t *pool, const char *name, const char *value)
+{
+    ngx_table_elt_t *header = NULL;
+    size_t name_len = ngx_strlen(name);
+
+    header = ngx_list_push(headers);
+    if (header == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(header, sizeof(ngx_table_elt_t));
+    header->key.data = ngx_pnalloc(pool, name_len);
+    header->lowcase_key = ngx_pnalloc(pool, name_len);
+    if (header->key.data == NULL || header->lowcase_key == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(header->key.data, name, name_len);
+    header->key.len = name_len;
+    header->hash = ngx_hash_strlow(header->lowcase_key, header->key.data, name_len);
+    header->value.data = (u_char *)value;
+    header->value.len = ngx_strlen(value);
+    return NGX_OK;
+}
+
+/*
+ * Create one cookie header per crumb, ending with the CSRF and access token cookies, linked in the same way as NGINX does
+ */
+static ngx_int_t create_cookie_headers(ngx_http_request_t *request, ngx_uint_t count)
+{
+    ngx_table_elt_t *headers = NULL;
+    u_char *value = NULL;
+    ngx_uint_t i = 0;
+
+    headers = ngx_pcalloc(request->pool, count * sizeof(ngx_table_elt_t));
+    if (headers == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        value = ngx_pnalloc(request->pool, 64);
+        if (value == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        if (i == count - 1)
+        {
+            headers[i].value.len = ngx_sprintf(value, "example-at=%s", "AcYBf995tTBVsLtQLvOuLUZXHm2c") - value;
+        }
+        else if (i == count - 2)
+        {
+            headers[i].value.len = ngx_sprintf(value, "example-csrf=%s", "AcYBf995tTBVsLtQLvOuLUZXHm2c") - value;
+        }
+        else
+        {
+            headers[i].value.len = ngx_sprintf(value, "_analytics_%ui=GA1.2.%ui", i, i) - value;
+        }
+
+        headers[i].value.data = value;
+        ngx_str_set(&headers[i].key, "cookie");
+        headers[i].hash = 1;
+    }
+
+#if defined(nginx_version) && nginx_version >= 1023000
+    for (i = 0; i < count - 1; i++)
+    {
+        headers[i].next = &headers[i + 1];
+    }
+
+    request->headers_in.cookie = &headers[0];
+#else
+    if (ngx_array_init(&request->headers_in.cookies, request->pool, count, sizeof(ngx_table_elt_t *)) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        *(ngx_table_elt_t **)ngx_array_push(&request->headers_in.cookies) = &headers[i];
+    }
+#endif
+
+    return NGX_OK;
+}
+
+static void run_decrypt(void *data, ngx_uint_t iterations)
+{
+    decrypt_case_t *decrypt_case = data;
+    ngx_str_t plaintext;
+    ngx_uint_t i = 0;
+
+    for (i = 0; i < iterations; i++)
+    {
+        ngx_reset_pool(decrypt_case->request->pool);
+        decrypt_case->result = oauth_proxy_decryption_decrypt_cookie(decrypt_case->request, &plaintext, &decrypt_case->cookie, decrypt_case->config, &decrypt_case->prefix);
+        __asm__ __volatile__("" : : "r"(plaintext.data) : "memory");
+    }
+}
+
+static void run_csrf_decrypt(void *data, ngx_uint_t iterations)
+{
+    csrf_case_t *csrf_case = data;
+    ngx_str_t plaintext;
+    ngx_uint_t i = 0;
+
+    for (i = 0; i < iterations; i++)
+    {
+        ngx_reset_pool(csrf_case->request->pool);
+        csrf_case->result = oauth_proxy_decryption_decrypt_cookie(csrf_case->request, &plaintext, &csrf_case->cookie, csrf_case->config, NULL);
+        __asm__ __volatile__("" : : "r"(plaintext.data) : "memory");
+    }
+}
+
+static void run_csrf_mac(void *data, ngx_uint_t iterations)
+{
+    csrf_case_t *csrf_case = data;
+    ngx_uint_t i = 0;
+
+    for (i = 0; i < iterations; i++)
+    {
+        ngx_reset_pool(csrf_case->request->pool);
+        csrf_case->result = oauth_proxy_csrf_verify_mac(csrf_case->request, csrf_case->config, &csrf_case->cookie, &csrf_case->token);
+        __asm__ __volatile__("" : : "r"(csrf_case->result) : "memory");
+    }
+}
+
+static void run_read_headers(void *data, ngx_uint_t iterations)
+{
+    headers_case_t *headers_case = data;
+    ngx_uint_t i = 0;
+
+    for (i = 0; i < iterations; i++)
+    {
+        oauth_proxy_utils_read_headers_in(headers_case->request, headers_case->config, &headers_case->headers);
+        __asm__ __volatile__("" : : "r"(&headers_case->headers) : "memory");
+    }
+}
+
+static void run_read_cookies(void *data, ngx_uint_t iterations)
+{
+    cookies_case_t *cookies_case = data;
+    ngx_uint_t i = 0;
+
+    for (i = 0; i < iterations; i++)
+    {
+        oauth_proxy_utils_read_cookies(cookies_case->request, cookies_case->config, &cookies_case->cookies);
+        __asm__ __volatile__("" : : "r"(&cookies_case->cookies) : "memory");
+    }
+}
+
+/*
+ * Run a warm up round and then timed rounds, returning the median ns per operation and the allocations made by the module
+ */
+static double measure(bench_run_pt run, void *data, ngx_uint_t iterations, double *allocations, double *bytes)
+{
+    double results[ROUNDS];
+    struct timespec start, end;
+    ngx_uint_t i = 0;
+
+    run(data, iterations / 10);
+
+    allocation_count = 0;
+    allocation_bytes = 0;
+    for (i = 0; i < ROUNDS; i++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        run(data, iterations);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        results[i] = elapsed_ns(&start, &end) / iterations;
+    }
+
+    *allocations = (double)allocation_count / (iterations * ROUNDS);
+    *bytes = (double)allocation_bytes / (iterations * ROUNDS);
+
+    qsort(results, ROUNDS, sizeof(double), compare_doubles);
+    return results[ROUNDS / 2];
+}
+
+/*
+ * Encode test data as unpadded base64url, in the same way as encrypt.js
+ */
+static size_t encode(u_char *bufcoded, const u_char *bufplain, size_t plain_len)
+{
+    ngx_str_t source;
+    ngx_str_t destination;
+
+    source.data = (u_char *)bufplain;
+    source.len = plain_len;
+    destination.data = bufcoded;
+    ngx_encode_base64url(&destination, &source);
+    return destination.len;
+}
+
+static int compare_doubles(const void *one, const void *two)
+{
+    double first = *(const double *)one;
+    double second = *(const double *)two;
+
+    return (first > second) - (first < second);
+}
+
+static double elapsed_ns(struct timespec *start, struct timespec *end)
+{
+    return (double)(end->tv_sec - start->tv_sec) * 1e9 + (double)(end->tv_nsec - start->tv_nsec);
+}
+
+static void *counting_palloc(ngx_pool_t *pool, size_t size)
+{
+    allocation_count++;
+    allocation_bytes += size;
+    return ngx_palloc(pool, size);
+}
+
+static void *counting_pnalloc(ngx_pool_t *pool, size_t size)
+{
+    allocation_count++;
+    allocation_bytes += size;
+    return ngx_pnalloc(pool, size);
+}
+
+static void *counting_pcalloc(ngx_pool_t *pool, size_t size)
+{
+    allocation_count++;
+    allocation_bytes += size;
+    return ngx_pcalloc(pool, size);
+}
+
+/*
+ * Cookies are read by the decryption benchmark directly, so the NGINX cookie parser is not needed
+ */
+#if defined(nginx_version) && nginx_version >= 1023000
+ngx_table_elt_t *ngx_http_parse_multi_header_lines(ngx_http_request_t *r, ngx_table_elt_t *headers, ngx_str_t *name, ngx_str_t *value)
+{
+    return NULL;
+}
+#else
+ngx_int_t ngx_http_parse_multi_header_lines(ngx_array_t *headers, ngx_str_t *name, ngx_str_t *value)
+{
+    return NGX_DECLINED;
+}
+#endif
+
+/*
+ * The included sources log through these functions, which are not needed by the benchmark
+ */
+void ngx_cdecl ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err, const char *fmt, ...)
+{
+}
+
+void ngx_cdecl ngx_conf_log_error(ngx_uint_t level, ngx_conf_t *cf, ngx_err_t err, const char *fmt, ...)
+{
+}
@@ -0,0 +1,439 @@
+/*
+ *  Copyright 2022 Curity AB
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * A microbenchmark for the CPU cost of each rejected request when a client floods the module with garbage access token cookies
+ * Without a throttle each cookie is decoded and fails the GCM tag check, whereas a throttled client is rejected after a zone lookup
+ * It includes the NGINX pool, string, hash, red-black tree, mutex and slab sources, so that the zone is used without a full NGINX build
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <zlib.h>
+#include "src/os/unix/ngx_alloc.c"
+#include "src/core/ngx_palloc.c"
+#include "src/core/ngx_list.c"
+#include "src/core/ngx_string.c"
+#include "src/core/ngx_hash.c"
+#include "src/core/ngx_parse.c"
+#include "src/core/ngx_murmurhash.c"
+#include "src/core/ngx_rbtree.c"
+#include "src/core/ngx_shmtx.c"
+#include "src/core/ngx_slab.c"
+
+#include "../../src/oauth_proxy_encoding.c"
+#include "../../src/oauth_proxy_decryption.c"
+#if (OAUTH_PROXY_LIBSODIUM)
+#include "../../src/oauth_proxy_cipher_libsodium.c"
+#else
+#include "../../src/oauth_proxy_cipher_openssl.c"
+#endif
+#include "../../src/oauth_proxy_compression.c"
+#include "../../src/oauth_proxy_utils.c"
+#include "../../src/oauth_proxy_throttle.c"
+
+/* Each case is run for several rounds and the median is reported, so that one noisy round does not move the result */
+#define ROUNDS 7
+#define DECRYPT_ITERATIONS 20000
+#define THROTTLE_ITERATIONS 1000000
+
+/* The zone size is large enough for the most clients that are benchmarked, so that no client is evicted */
+#define ZONE_SIZE (8 * 1024 * 1024)
+
+/* The default failure threshold of the oauth_proxy_throttle directive */
+#define THRESHOLD 10
+
+/* The default request_pool_size */
+#define REQUEST_POOL_SIZE 4096
+
+typedef void (*bench_run_pt)(void *data, ngx_uint_t iterations);
+
+typedef struct
+{
+    ngx_http_request_t *request;
+    oauth_proxy_configuration_t *config;
+    ngx_str_t cookie;
+    ngx_str_t prefix;
+    ngx_int_t result;
+} flood_case_t;
+
+/* Forward declarations */
+static ngx_int_t create_zone(ngx_shm_zone_t *zone, u_char *name);
+static ngx_int_t add_clients(ngx_http_request_t *request, oauth_proxy_configuration_t *config, ngx_uint_t count);
+static ngx_int_t create_garbage_cookie(ngx_pool_t *pool, ngx_str_t *cookie, size_t cookie_size);
+static void run_decrypt(void *data, ngx_uint_t iterations);
+static void run_throttled(void *data, ngx_uint_t iterations);
+static void run_record_failure(void *data, ngx_uint_t iterations);
+static double measure(bench_run_pt run, void *data, ngx_uint_t iterations);
+static int compare_doubles(const void *one, const void *two);
+static double elapsed_ns(struct timespec *start, struct timespec *end);
+
+ngx_module_t ngx_curity_http_oauth_proxy_module;
+volatile ngx_cycle_t *ngx_cycle;
+volatile ngx_msec_t ngx_current_msec;
+ngx_int_t ngx_ncpu;
+ngx_pid_t ngx_pid;
+
+/*
+ * Reject garbage cookies from 100 bytes to 8KB by decryption, then reject a throttled client with 1 to 10,000 other clients in the zone
+ */
+int main(void)
+{
+    size_t cookie_sizes[] = {100, 1024, 4096, 8192};
+    ngx_uint_t client_counts[] = {1, 100, 10000};
+    static u_char key_bytes[OAUTH_PROXY_AES_KEY_SIZE_BYTES];
+    static u_char zone_name[] = "bench";
+    oauth_proxy_encryption_key_t *keys_by_id[OAUTH_PROXY_MAX_KEY_IDS];
+    oauth_proxy_encryption_key_t key;
+    oauth_proxy_configuration_t config;
+    void *request_ctx[1];
+    ngx_log_t log;
+    ngx_cycle_t cycle;
+    ngx_connection_t connection;
+    ngx_http_request_t request;
+    ngx_shm_zone_t zone;
+    ngx_pool_t *pool = NULL;
+    flood_case_t flood_case;
+    double decrypt_ns = 0;
+    double ns = 0;
+    ngx_uint_t i = 0;
+
+    ngx_pagesize = getpagesize();
+    for (ngx_pagesize_shift = 0, i = ngx_pagesize; i >>= 1; ngx_pagesize_shift++) { /* void */ }
+    ngx_cacheline_size = NGX_CPU_CACHE_LINE;
+    ngx_ncpu = 1;
+    ngx_pid = getpid();
+    ngx_current_msec = 1000;
+    ngx_slab_sizes_init();
+    oauth_proxy_encoding_initialize();
+
+    ngx_memzero(&log, sizeof(ngx_log_t));
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, &log);
+    if (pool == NULL)
+    {
+        return 1;
+    }
+
+    /* The slab allocator logs through the cycle when the zone is full */
+    ngx_memzero(&cycle, sizeof(cycle));
+    cycle.pool = pool;
+    cycle.log = &log;
+    ngx_cycle = &cycle;
+
+    for (i = 0; i < OAUTH_PROXY_AES_KEY_SIZE_BYTES; i++)
+    {
+        key_bytes[i] = (u_char)i;
+    }
+
+    ngx_memzero(&key, sizeof(key));
+    ngx_memcpy(key.encryption_key_bytes, key_bytes, OAUTH_PROXY_AES_KEY_SIZE_BYTES);
+    if (oauth_proxy_cipher_initialize(&cycle, &key) != NGX_OK)
+    {
+        fprintf(stderr, "Unable to initialize the decryption cipher\n");
+        return 1;
+    }
+
+    ngx_memzero(keys_by_id, sizeof(keys_by_id));
+    keys_by_id[0] = &key;
+
+    ngx_memzero(&config, sizeof(config));
+    config.enabled = 1;
+    config.max_decompressed_size = 16384;
+    config.encryption_keys_by_id = keys_by_id;
+    config.throttle_threshold = THRESHOLD;
+    config.throttle_window = 60000;
+
+    ngx_memzero(&connection, sizeof(connection));
+    connection.log = &log;
+    ngx_str_set(&connection.addr_text, "192.0.2.1");
+    ngx_memzero(&request, sizeof(request));
+    request.connection = &connection;
+    request_ctx[0] = NULL;
+    request.ctx = request_ctx;
+
+    request.pool = ngx_create_pool(REQUEST_POOL_SIZE, &log);
+    if (request.pool == NULL)
+    {
+        return 1;
+    }
+
+    ngx_memzero(&flood_case, sizeof(flood_case));
+    flood_case.request = &request;
+    flood_case.config = &config;
+    ngx_str_set(&flood_case.prefix, "Bearer ");
+
+    printf("%-16s %8s %8s %12s %10s\n", "function", "size", "clients", "ns/op", "speedup");
+
+    /* Without a throttle, every garbage cookie is decoded and fails the GCM tag check */
+    for (i = 0; i < sizeof(cookie_sizes) / sizeof(cookie_sizes[0]); i++)
+    {
+        if (create_garbage_cookie(pool, &flood_case.cookie, cookie_sizes[i]) != NGX_OK)
+        {
+            fprintf(stderr, "Unable to create a %zu byte garbage cookie\n", cookie_sizes[i]);
+            return 1;
+        }
+
+        ns = measure(run_decrypt, &flood_case, DECRYPT_ITERATIONS);
+        if (flood_case.result != NGX_HTTP_UNAUTHORIZED)
+        {
+            fprintf(stderr, "A %zu byte garbage cookie was not rejected\n", cookie_sizes[i]);
+            return 1;
+        }
+
+        printf("%-16s %8zu %8s %12.1f %10s\n", "decrypt_reject", flood_case.cookie.len, "-", ns, "-");
+    }
+
+    /* The smallest cookie is the cheapest to reject by decryption, so speedups are reported against it */
+    if (create_garbage_cookie(pool, &flood_case.cookie, cookie_sizes[0]) != NGX_OK)
+    {
+        return 1;
+    }
+
+    decrypt_ns = measure(run_decrypt, &flood_case, DECRYPT_ITERATIONS);
+
+    /* Other clients make the zone's tree deeper, and the flooding client is looked up among them */
+    for (i = 0; i < sizeof(client_counts) / sizeof(client_counts[0]); i++)
+    {
+        if (create_zone(&zone, zone_name) != NGX_OK)
+        {
+            fprintf(stderr, "Unable to create the throttle zone\n");
+            return 1;
+        }
+
+        config.throttle_zone = &zone;
+        if (add_clients(&request, &config, client_counts[i]) != NGX_OK)
+        {
+            fprintf(stderr, "Unable to add %lu clients to the throttle zone\n", (unsigned long) client_counts[i]);
+            return 1;
+        }
+
+        ns = measure(run_record_failure, &flood_case, THROTTLE_ITERATIONS);
+        printf("%-16s %8s %8lu %12.1f %10s\n", "record_failure", "-", (unsigned long) client_counts[i], ns, "-");
+
+        ns = measure(run_throttled, &flood_case, THROTTLE_ITERATIONS);
+        if (flood_case.result != 1)
+        {
+            fprintf(stderr, "The flooding client was not throttled with %lu clients\n", (unsigned long) client_counts[i]);
+            return 1;
+        }
+
+        printf("%-16s %8zu %8lu %12.1f %9.1fx\n", "throttle_reject", flood_case.cookie.len, (unsigned long) client_counts[i], ns, decrypt_ns / ns);
+        free(zone.shm.addr);
+    }
+
+    oauth_proxy_compression_free();
+    oauth_proxy_cipher_free(&key);
+    return 0;
+}
+
+/*
+ * Initialize a slab pool in process memory, in the same way as NGINX does for a shared zone, then set up the throttle's state in it
+ */
+static ngx_int_t create_zone(ngx_shm_zone_t *zone, u_char *name)
+{
+    ngx_slab_pool_t *shpool = NULL;
+    u_char *addr = NULL;
+
+    if (posix_memalign((void **)&addr, ngx_pagesize, ZONE_SIZE) != 0)
+    {
+        return NGX_ERROR;
+    }
+
+    /* Shared memory is mapped zero filled, and the mutex relies on that */
+    ngx_memzero(addr, ZONE_SIZE);
+    ngx_memzero(zone, sizeof(ngx_shm_zone_t));
+    zone->shm.addr = addr;
+    zone->shm.size = ZONE_SIZE;
+    zone->shm.name.data = name;
+    zone->shm.name.len = ngx_strlen(name);
+    zone->data = calloc(1, sizeof(oauth_proxy_throttle_t));
+    if (zone->data == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    shpool = (ngx_slab_pool_t *)addr;
+    shpool->end = addr + ZONE_SIZE;
+    shpool->min_shift = 3;
+    shpool->addr = addr;
+    if (ngx_shmtx_create(&shpool->mutex, &shpool->lock, NULL) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_slab_init(shpool);
+    return init_zone(zone, NULL);
+}
+
+/*
+ * Record one failure for each of the other clients, then enough failures for the flooding client to be throttled
+ */
+static ngx_int_t add_clients(ngx_http_request_t *request, oauth_proxy_configuration_t *config, ngx_uint_t count)
+{
+    ngx_str_t flooding_address = request->connection->addr_text;
+    u_char address[NGX_SOCKADDR_STRLEN];
+    ngx_uint_t i = 0;
+
+    for (i = 1; i < count; i++)
+    {
+        request->connection->addr_text.data = address;
+        request->connection->addr_text.len = ngx_sprintf(address, "10.%ui.%ui.%ui", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff) - address;
+        oauth_proxy_throttle_record_failure(request, config);
+    }
+
+    request->connection->addr_text = flooding_address;
+    for (i = 0; i < config->throttle_threshold; i++)
+    {
+        oauth_proxy_throttle_record_failure(request, config);
+    }
+
+    return oauth_proxy_throttle_is_throttled(request, config) ? NGX_OK : NGX_ERROR;
+}
+
+/*
+ * Create a version 2 cookie for key id 0 whose IV, ciphertext and tag are random, so that it is only rejected by the GCM tag check
+ */
+static ngx_int_t create_garbage_cookie(ngx_pool_t *pool, ngx_str_t *cookie, size_t cookie_size)
+{
+    ngx_str_t payload;
+    size_t payload_size = cookie_size * 3 / 4;
+
+    payload.data = ngx_palloc(pool, payload_size);
+    cookie->data = ngx_pnalloc(pool, ngx_base64_encoded_length(payload_size));
+    if (payload.data == NULL || cookie->data == NULL || RAND_bytes(payload.data, (int)payload_size) != 1)
+    {
+        return NGX_ERROR;
+    }
+
+    payload.data[0] = KEY_ID_VERSION;
+    payload.data[VERSION_SIZE] = 0;
+    payload.len = payload_size;
+    ngx_encode_base64url(cookie, &payload);
+    return NGX_OK;
+}
+
+static void run_decrypt(void *data, ngx_uint_t iterations)
+{
+    flood_case_t *flood_case = data;
+    ngx_str_t plaintext;
+    ngx_uint_t i = 0;
+
+    for (i = 0; i < iterations; i++)
+    {
+        ngx_reset_pool(flood_case->request->pool);
+        flood_case->result = oauth_proxy_decryption_decrypt_cookie(flood_case->request, &plaintext, &flood_case->cookie, flood_case->config, &flood_case->prefix);
+        __asm__ __volatile__("" : : "r"(plaintext.data) : "memory");
+    }
+}
+
+static void run_throttled(void *data, ngx_uint_t iterations)
+{
+    flood_case_t *flood_case = data;
+    ngx_uint_t i = 0;
+
+    for (i = 0; i < iterations; i++)
+    {
+        flood_case->result = oauth_proxy_throttle_is_throttled(flood_case->request, flood_case->config);
+        __asm__ __volatile__("" : : "r"(flood_case->result) : "memory");
+    }
+}
+
+/*
+ * The cost that a throttle adds to each failure before its client reaches the threshold
+ */
+static void run_record_failure(void *data, ngx_uint_t iterations)
+{
+    flood_case_t *flood_case = data;
+    ngx_uint_t i = 0;
+
+    for (i = 0; i < iterations; i++)
+    {
+        oauth_proxy_throttle_record_failure(flood_case->request, flood_case->config);
+    }
+}
+
+/*
+ * Run a warm up round and then timed rounds, returning the median ns per operation
+ */
+static double measure(bench_run_pt run, void *data, ngx_uint_t iterations)
+{
+    double results[ROUNDS];
+    struct timespec start, end;
+    ngx_uint_t i = 0;
+
+    run(data, iterations / 10);
+
+    for (i = 0; i < ROUNDS; i++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        run(data, iterations);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        results[i] = elapsed_ns(&start, &end) / iterations;
+    }
+
+    qsort(results, ROUNDS, sizeof(double), compare_doubles);
+    return results[ROUNDS / 2];
+}
+
+static int compare_doubles(const void *one, const void *two)
+{
+    double first = *(const double *)one;
+    double second = *(const double *)two;
+
+    return (first > second) - (first < second);
+}
+
+static double elapsed_ns(struct timespec *start, struct timespec *end)
+{
+    return (double)(end->tv_sec - start->tv_sec) * 1e9 + (double)(end->tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Cookies are passed to the decryption functions directly, so the NGINX cookie parser is not needed
+ */
+#if defined(nginx_version) && nginx_version >= 1023000
+ngx_table_elt_t *ngx_http_parse_multi_header_lines(ngx_http_request_t *r, ngx_table_elt_t *headers, ngx_str_t *name, ngx_str_t *value)
+{
+    return NULL;
+}
+#else
+ngx_int_t ngx_http_parse_multi_header_lines(ngx_array_t *headers, ngx_str_t *name, ngx_str_t *value)
+{
+    return NGX_DECLINED;
+}
+#endif
+
+/*
+ * The zone is created by the benchmark rather than by the directive, which is not run
+ */
+ngx_shm_zone_t *ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name, size_t size, void *tag)
+{
+    return NULL;
+}
+
+/*
+ * The included sources log through these functions, which are not needed by the benchmark
+ */
+void ngx_cdecl ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err, const char *fmt, ...)
+{
+}
+
+void ngx_cdecl ngx_conf_log_error(ngx_uint_t level, ngx_conf_t *cf, ngx_err_t err, const char *fmt, ...)
+{
+}
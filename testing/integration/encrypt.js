@@ -2,25 +2,37 @@
 
 const fs = require('fs');
 const crypto = require('crypto');
+const zlib = require('zlib');
 const {exit} = require('process');
 const GCM_IV_SIZE = 12;
-const CURRENT_VERSION = 1;
+const CURRENT_VERSION = 2;
+const COMPRESSED_VERSION = 3;
 
 try {
 
+    // The --compress option produces a version 3 cookie, whose plaintext is compressed before encryption
     var args = process.argv.slice(2);
+    const compress = args.includes('--compress');
+    args = args.filter((arg) => arg !== '--compress');
     if (args.length < 1) {
         throw new Error('Please supply the plaintext data as a command line parameter');
     }
 
     const payloadText = args[0];
+
+    // Version 2 cookies carry the identifier of the key, which must match an id= value in the NGINX configuration
+    const keyId = args.length > 1 ? parseInt(args[1], 10) : 0;
+    if (isNaN(keyId) || keyId < 0 || keyId > 255) {
+        throw new Error('The key id must be between 0 and 255');
+    }
+
     const encryptionKeyHex = fs.readFileSync('./encryption.key', 'ascii');
     const encryptionKeyBytes = Buffer.from(encryptionKeyHex, 'hex');
     const ivBytes = crypto.randomBytes(GCM_IV_SIZE);
     const cipher = crypto.createCipheriv('aes-256-gcm', encryptionKeyBytes, ivBytes);
     
-    const versionBytes = Buffer.from(new Uint8Array([CURRENT_VERSION]));
-    const plaintextBytes = Buffer.from(payloadText);
+    const headerBytes = Buffer.from(new Uint8Array([compress ? COMPRESSED_VERSION : CURRENT_VERSION, keyId]));
+    const plaintextBytes = compress ? compressPayload(Buffer.from(payloadText)) : Buffer.from(payloadText);
     
     const encryptedBytes = cipher.update(plaintextBytes);
     const finalBytes = cipher.final()
@@ -28,7 +40,7 @@ try {
     const ciphertextBytes = Buffer.concat([encryptedBytes, finalBytes]);
     const tagBytes = cipher.getAuthTag();
 
-    const allBytes = Buffer.concat([versionBytes, ivBytes, ciphertextBytes, tagBytes]);
+    const allBytes = Buffer.concat([headerBytes, ivBytes, ciphertextBytes, tagBytes]);
     const base64urlencoded = allBytes.toString('base64')
         .replace(/=/g, "")
         .replace(/\+/g, "-")
@@ -42,3 +54,11 @@ try {
     console.log(`utils.encrypt error:  ${e.message}`);
     exit(1);
 }
+
+// The decompressed size is written first as 4 bytes big endian, so that NGINX can check it before decompressing
+function compressPayload(payloadBytes) {
+
+    const sizeBytes = Buffer.alloc(4);
+    sizeBytes.writeUInt32BE(payloadBytes.length);
+    return Buffer.concat([sizeBytes, zlib.deflateRawSync(payloadBytes, {level: zlib.constants.Z_BEST_COMPRESSION})]);
+}
@@ -0,0 +1,339 @@
+'use strict';
+
+const http = require('http');
+const http2 = require('http2');
+const os = require('os');
+const {Worker, isMainThread, parentPort, workerData} = require('worker_threads');
+const {exit} = require('process');
+
+/*
+ * Drive each traffic mix over HTTP/1.1 and HTTP/2 and report throughput and latency percentiles
+ * Cookies are supplied by load.sh, which creates them with encrypt.js
+ */
+const WEB_ORIGIN = 'https://www.example.com';
+const ACCESS_TOKEN = process.env.ACCESS_TOKEN || '';
+const CSRF_TOKEN = process.env.CSRF_TOKEN || '';
+const ACCESS_TOKEN_COOKIE = process.env.ACCESS_TOKEN_COOKIE || '';
+const CSRF_COOKIE = process.env.CSRF_COOKIE || '';
+const LARGE_ACCESS_TOKEN_COOKIE = process.env.LARGE_ACCESS_TOKEN_COOKIE || '';
+const HTTP1_PORT = parseInt(process.env.HTTP1_PORT || '8091', 10);
+const HTTP2_PORT = parseInt(process.env.HTTP2_PORT || '8092', 10);
+const WORKER_PROCESSES = parseInt(process.env.WORKER_PROCESSES || '1', 10);
+const DURATION = parseFloat(process.env.DURATION || '10');
+const WARMUP = parseFloat(process.env.WARMUP || '2');
+const CONNECTIONS = parseInt(process.env.CONNECTIONS || '64', 10);
+const CLIENT_THREADS = parseInt(process.env.CLIENT_THREADS || `${Math.max(1, Math.floor(os.cpus().length / 2))}`, 10);
+
+/*
+ * The invalid cookie has a changed ciphertext character, so that it decodes but fails authentication
+ */
+function invalidCookie(cookie) {
+    const position = Math.floor(cookie.length / 2);
+    const replacement = cookie[position] === 'A' ? 'B' : 'A';
+    return cookie.substring(0, position) + replacement + cookie.substring(position + 1);
+}
+
+/*
+ * Scenarios that reach the upstream are compared with the baseline, which makes the same upstream call without the module
+ */
+const SCENARIOS = [
+    {
+        name: 'baseline',
+        method: 'GET',
+        path: '/baseline',
+        headers: {origin: WEB_ORIGIN, cookie: `example-at=${ACCESS_TOKEN_COOKIE}`},
+        status: 200,
+        upstream: true,
+    },
+    {
+        name: 'get',
+        method: 'GET',
+        path: '/api',
+        headers: {origin: WEB_ORIGIN, cookie: `example-at=${ACCESS_TOKEN_COOKIE}`},
+        status: 200,
+        upstream: true,
+    },
+    {
+        name: 'post_csrf',
+        method: 'POST',
+        path: '/api',
+        headers: {
+            origin: WEB_ORIGIN,
+            cookie: `example-at=${ACCESS_TOKEN_COOKIE}; example-csrf=${CSRF_COOKIE}`,
+            'x-example-csrf': CSRF_TOKEN,
+            'content-length': '0',
+        },
+        status: 200,
+        upstream: true,
+    },
+    {
+        name: 'preflight',
+        method: 'OPTIONS',
+        path: '/api',
+        headers: {
+            origin: WEB_ORIGIN,
+            'access-control-request-method': 'POST',
+            'access-control-request-headers': 'x-example-csrf',
+        },
+        status: 204,
+        upstream: false,
+    },
+    {
+        name: 'bearer',
+        method: 'GET',
+        path: '/api',
+        headers: {authorization: `Bearer ${ACCESS_TOKEN}`},
+        status: 200,
+        upstream: true,
+    },
+    {
+        name: 'invalid_cookie',
+        method: 'GET',
+        path: '/api',
+        headers: {origin: WEB_ORIGIN, cookie: `example-at=${invalidCookie(ACCESS_TOKEN_COOKIE)}`},
+        status: 401,
+        upstream: false,
+    },
+    {
+        name: 'large_cookie',
+        method: 'GET',
+        path: '/api',
+        headers: {origin: WEB_ORIGIN, cookie: `example-at=${LARGE_ACCESS_TOKEN_COOKIE}`},
+        status: 200,
+        upstream: true,
+    },
+    {
+        /*
+         * Half of the connections send large cookies in the background, and only the small cookie requests are measured
+         * This shows how long large cookie decryption stalls other requests on the same worker
+         */
+        name: 'large_mixed',
+        method: 'GET',
+        path: '/api',
+        headers: {origin: WEB_ORIGIN, cookie: `example-at=${ACCESS_TOKEN_COOKIE}`},
+        backgroundHeaders: {origin: WEB_ORIGIN, cookie: `example-at=${LARGE_ACCESS_TOKEN_COOKIE}`},
+        status: 200,
+        upstream: true,
+    },
+];
+
+if (isMainThread) {
+    main().catch((e) => {
+        console.log(`load.main error: ${e.message}`);
+        exit(1);
+    });
+} else {
+    runClient(workerData).then((result) => parentPort.postMessage(result));
+}
+
+/*
+ * Run each scenario in turn, so that only one traffic mix is measured at a time
+ */
+async function main() {
+
+    const selected = process.env.SCENARIOS ? process.env.SCENARIOS.split(',') : SCENARIOS.map((s) => s.name);
+    const protocols = process.env.PROTOCOLS ? process.env.PROTOCOLS.split(',') : ['h1', 'h2'];
+
+    console.log(`${WORKER_PROCESSES} NGINX workers, ${CLIENT_THREADS} client threads, ${CONNECTIONS} connections, ${DURATION}s per scenario`);
+    console.log(
+        'scenario'.padEnd(16) +
+        'protocol'.padEnd(10) +
+        'rps'.padStart(10) +
+        'p50 ms'.padStart(10) +
+        'p99 ms'.padStart(10) +
+        'p999 ms'.padStart(10) +
+        'errors'.padStart(8) +
+        'overhead us'.padStart(13));
+
+    let failed = false;
+    for (const protocol of protocols) {
+
+        let baselineRps = 0;
+        for (const scenario of SCENARIOS.filter((s) => selected.includes(s.name))) {
+
+            const result = await runScenario(scenario, protocol);
+            if (scenario.name === 'baseline') {
+                baselineRps = result.rps;
+            }
+
+            console.log(
+                scenario.name.padEnd(16) +
+                protocol.padEnd(10) +
+                result.rps.toFixed(0).padStart(10) +
+                result.p50.toFixed(3).padStart(10) +
+                result.p99.toFixed(3).padStart(10) +
+                result.p999.toFixed(3).padStart(10) +
+                `${result.errors}`.padStart(8) +
+                getOverhead(scenario, result.rps, baselineRps).padStart(13));
+
+            if (result.errors > 0) {
+                failed = true;
+            }
+        }
+    }
+
+    exit(failed ? 1 : 0);
+}
+
+/*
+ * Split connections across client threads, then merge the latencies recorded after the warm up period
+ */
+async function runScenario(scenario, protocol) {
+
+    const port = protocol === 'h2' ? HTTP2_PORT : HTTP1_PORT;
+    const threads = Math.min(CLIENT_THREADS, CONNECTIONS);
+    const clients = [];
+
+    for (let i = 0; i < threads; i++) {
+
+        const connections = Math.floor(CONNECTIONS / threads) + (i < CONNECTIONS % threads ? 1 : 0);
+        clients.push(new Promise((resolve, reject) => {
+            const worker = new Worker(__filename, {
+                workerData: {scenario, protocol, port, connections, warmup: WARMUP, duration: DURATION},
+            });
+            worker.once('message', resolve);
+            worker.once('error', reject);
+        }));
+    }
+
+    const results = await Promise.all(clients);
+    const latencies = new Float64Array(results.reduce((total, r) => total + r.latencies.length, 0));
+    let offset = 0;
+    let errors = 0;
+    for (const result of results) {
+        latencies.set(result.latencies, offset);
+        offset += result.latencies.length;
+        errors += result.errors;
+    }
+
+    latencies.sort();
+    return {
+        rps: latencies.length / DURATION,
+        p50: getPercentile(latencies, 0.5),
+        p99: getPercentile(latencies, 0.99),
+        p999: getPercentile(latencies, 0.999),
+        errors,
+    };
+}
+
+/*
+ * The extra NGINX worker time per request compared to the baseline, which is meaningful when the workers are saturated
+ */
+function getOverhead(scenario, rps, baselineRps) {
+
+    if (!scenario.upstream || scenario.backgroundHeaders || scenario.name === 'baseline' || rps === 0 || baselineRps === 0) {
+        return '-';
+    }
+
+    return ((WORKER_PROCESSES / rps - WORKER_PROCESSES / baselineRps) * 1000000).toFixed(2);
+}
+
+function getPercentile(sorted, percentile) {
+
+    if (sorted.length === 0) {
+        return 0;
+    }
+
+    return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * percentile))];
+}
+
+/*
+ * Each connection sends one request at a time, and latencies are recorded in milliseconds once the warm up has finished
+ */
+async function runClient(options) {
+
+    const latencies = [];
+    const start = Date.now();
+    const measureFrom = start + options.warmup * 1000;
+    const measureUntil = measureFrom + options.duration * 1000;
+    let errors = 0;
+
+    const send = options.protocol === 'h2' ? createHttp2Sender(options) : createHttp1Sender(options);
+    const loops = [];
+    for (let i = 0; i < options.connections; i++) {
+
+        const background = options.scenario.backgroundHeaders && i % 2 === 1;
+        loops.push((async () => {
+            const request = send.connect(background ? options.scenario.backgroundHeaders : options.scenario.headers);
+            for (;;) {
+
+                const requestStart = process.hrtime.bigint();
+                if (Date.now() >= measureUntil) {
+                    break;
+                }
+
+                const status = await request();
+                const requestEnd = process.hrtime.bigint();
+                const now = Date.now();
+                if (!background && now >= measureFrom && now < measureUntil) {
+
+                    latencies.push(Number(requestEnd - requestStart) / 1000000);
+                    if (status !== options.scenario.status) {
+                        errors++;
+                    }
+                }
+            }
+        })());
+    }
+
+    await Promise.all(loops);
+    send.close();
+    return {latencies: Float64Array.from(latencies), errors};
+}
+
+function createHttp1Sender(options) {
+
+    const agent = new http.Agent({keepAlive: true, maxSockets: options.connections});
+    return {
+        connect: (headers) => () => new Promise((resolve) => {
+
+            const request = http.request({
+                agent,
+                host: '127.0.0.1',
+                port: options.port,
+                method: options.scenario.method,
+                path: options.scenario.path,
+                headers,
+            }, (response) => {
+                response.resume();
+                response.on('end', () => resolve(response.statusCode));
+            });
+
+            request.on('error', () => resolve(0));
+            request.end();
+        }),
+        close: () => agent.destroy(),
+    };
+}
+
+function createHttp2Sender(options) {
+
+    const sessions = [];
+    return {
+        connect: (headers) => {
+
+            const session = http2.connect(`http://127.0.0.1:${options.port}`);
+            session.on('error', () => {});
+            sessions.push(session);
+
+            return () => new Promise((resolve) => {
+
+                const stream = session.request({
+                    ':method': options.scenario.method,
+                    ':path': options.scenario.path,
+                    ...headers,
+                });
+
+                let status = 0;
+                stream.on('response', (headers) => {
+                    status = headers[':status'];
+                });
+                stream.on('error', () => resolve(0));
+                stream.on('close', () => resolve(status));
+                stream.resume();
+                stream.end();
+            });
+        },
+        close: () => sessions.forEach((session) => session.close()),
+    };
+}
@@ -0,0 +1,153 @@
+#!/bin/bash
+
+####################################################################################################
+# Load test the built NGINX with the module against a local echo upstream, over HTTP/1.1 and HTTP/2
+# Each traffic mix is reported with its throughput and latency percentiles, and compared to a
+# location with the module turned off, to show the module's overhead per worker core
+####################################################################################################
+
+WEB_ORIGIN='https://www.example.com'
+ACCESS_TOKEN='42665300-efe8-419d-be52-07b53e208f46'
+CSRF_TOKEN='njowdfew098723rhjl'
+
+#
+# Ensure that we are in the folder containing this script
+#
+cd "$(dirname "${BASH_SOURCE[0]}")"
+ENCRYPT_UTIL=$(pwd)/../integration/encrypt.js
+LOAD_UTIL=$(pwd)/load.js
+
+#
+# Control the load test via environment variables
+#
+if [ "$NGINX_BIN" == '' ]; then
+  NGINX_BIN=$(which nginx)
+fi
+if [ "$NGINX_BIN" == '' ]; then
+  >&2 echo '*** Build NGINX with the module, then set NGINX_BIN or add the nginx binary to the PATH'
+  exit 1
+fi
+if [ "$WORKER_PROCESSES" == '' ]; then
+  WORKER_PROCESSES=1
+fi
+if [ "$HTTP1_PORT" == '' ]; then
+  HTTP1_PORT=8091
+fi
+if [ "$HTTP2_PORT" == '' ]; then
+  HTTP2_PORT=8092
+fi
+if [ "$UPSTREAM_PORT" == '' ]; then
+  UPSTREAM_PORT=8093
+fi
+if [ "$LARGE_TOKEN_SIZE" == '' ]; then
+  LARGE_TOKEN_SIZE=16000
+fi
+
+#
+# NGINX runs from a temporary prefix folder, which is removed when the script exits
+#
+WORK_DIR=$(mktemp -d)
+function cleanup() {
+  if [ "$NGINX_PID" != '' ]; then
+    kill $NGINX_PID 2>/dev/null
+    wait $NGINX_PID 2>/dev/null
+  fi
+  rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+#
+# Generate a key, and cookies in the same format as the integration tests
+#
+ENCRYPTION_KEY=$(openssl rand -hex 32)
+echo -n $ENCRYPTION_KEY > "$WORK_DIR/encryption.key"
+ACCESS_TOKEN_COOKIE=$(cd "$WORK_DIR" && node "$ENCRYPT_UTIL" "$ACCESS_TOKEN")
+if [ $? -ne 0 ]; then
+  >&2 echo "*** Unable to create the access token cookie: $ACCESS_TOKEN_COOKIE"
+  exit 1
+fi
+CSRF_COOKIE=$(cd "$WORK_DIR" && node "$ENCRYPT_UTIL" "$CSRF_TOKEN")
+if [ $? -ne 0 ]; then
+  >&2 echo "*** Unable to create the CSRF cookie: $CSRF_COOKIE"
+  exit 1
+fi
+
+#
+# A large cookie, such as one containing a JWT with many claims, for the large cookie scenarios
+#
+LARGE_ACCESS_TOKEN=$(head -c $LARGE_TOKEN_SIZE /dev/urandom | base64 -w 0 | tr '+/' '-_' | head -c $LARGE_TOKEN_SIZE)
+LARGE_ACCESS_TOKEN_COOKIE=$(cd "$WORK_DIR" && node "$ENCRYPT_UTIL" "$LARGE_ACCESS_TOKEN")
+if [ $? -ne 0 ]; then
+  >&2 echo "*** Unable to create the large access token cookie: $LARGE_ACCESS_TOKEN_COOKIE"
+  exit 1
+fi
+
+#
+# Dynamic module builds are loaded from MODULE_PATH, whereas static builds need no load_module directive
+#
+LOAD_MODULE=''
+if [ "$MODULE_PATH" != '' ]; then
+  LOAD_MODULE="load_module $MODULE_PATH;"
+fi
+
+#
+# When THREAD_POOL is set, cookies larger than THREAD_POOL_THRESHOLD are decrypted in a pool with that many threads
+#
+THREAD_POOL_MAIN=''
+THREAD_POOL_LOCATION=''
+if [ "$THREAD_POOL" != '' ]; then
+  if [ "$THREAD_POOL_THRESHOLD" == '' ]; then
+    THREAD_POOL_THRESHOLD=4k
+  fi
+  THREAD_POOL_MAIN="thread_pool oauth threads=$THREAD_POOL;"
+  THREAD_POOL_LOCATION="oauth_proxy_thread_pool oauth threshold=$THREAD_POOL_THRESHOLD;"
+fi
+
+NGINX_CONF_DATA=$(cat ./nginx.conf.template)
+NGINX_CONF_DATA=$(sed "s/ENCRYPTION_KEY/$ENCRYPTION_KEY/g" <<< "$NGINX_CONF_DATA")
+NGINX_CONF_DATA=$(sed "s/WORKER_PROCESSES/$WORKER_PROCESSES/g" <<< "$NGINX_CONF_DATA")
+NGINX_CONF_DATA=$(sed "s/HTTP1_PORT/$HTTP1_PORT/g" <<< "$NGINX_CONF_DATA")
+NGINX_CONF_DATA=$(sed "s/HTTP2_PORT/$HTTP2_PORT/g" <<< "$NGINX_CONF_DATA")
+NGINX_CONF_DATA=$(sed "s/UPSTREAM_PORT/$UPSTREAM_PORT/g" <<< "$NGINX_CONF_DATA")
+NGINX_CONF_DATA=$(sed "s|LOAD_MODULE|$LOAD_MODULE|g" <<< "$NGINX_CONF_DATA")
+NGINX_CONF_DATA=$(sed "s|THREAD_POOL_MAIN|$THREAD_POOL_MAIN|g" <<< "$NGINX_CONF_DATA")
+NGINX_CONF_DATA=$(sed "s|THREAD_POOL_LOCATION|$THREAD_POOL_LOCATION|g" <<< "$NGINX_CONF_DATA")
+echo "$NGINX_CONF_DATA" > "$WORK_DIR/nginx.conf"
+
+#
+# Start NGINX and wait until it accepts requests
+#
+mkdir -p "$WORK_DIR/logs"
+"$NGINX_BIN" -p "$WORK_DIR" -c nginx.conf &
+NGINX_PID=$!
+
+for i in $(seq 1 50); do
+  HTTP_STATUS=$(curl -s -o /dev/null -w '%{http_code}' "http://127.0.0.1:$HTTP1_PORT/baseline")
+  if [ "$HTTP_STATUS" == '200' ]; then
+    break
+  fi
+  sleep 0.1
+done
+if [ "$HTTP_STATUS" != '200' ]; then
+  >&2 echo '*** NGINX did not start for the load test'
+  cat "$WORK_DIR/error.log"
+  exit 1
+fi
+
+#
+# Check that the module accepts the generated cookie before measuring anything
+#
+HTTP_STATUS=$(curl -s -o /dev/null -w '%{http_code}' "http://127.0.0.1:$HTTP1_PORT/api" \
+-H "origin: $WEB_ORIGIN" \
+-H "cookie: example-at=$ACCESS_TOKEN_COOKIE")
+if [ "$HTTP_STATUS" != '200' ]; then
+  >&2 echo "*** The module did not accept the generated cookie, status: $HTTP_STATUS"
+  cat "$WORK_DIR/error.log"
+  exit 1
+fi
+
+#
+# Run the traffic mixes, where SCENARIOS, PROTOCOLS, DURATION, WARMUP, CONNECTIONS and CLIENT_THREADS can also be set
+#
+export ACCESS_TOKEN CSRF_TOKEN ACCESS_TOKEN_COOKIE CSRF_COOKIE LARGE_ACCESS_TOKEN_COOKIE HTTP1_PORT HTTP2_PORT WORKER_PROCESSES
+node "$LOAD_UTIL"
@@ -0,0 +1,198 @@
+#!/usr/bin/perl
+
+###########################################################################
+# Runs tests to verify that decrypted access tokens are cached when enabled
+###########################################################################
+
+use strict;
+use warnings;
+use Test::Nginx::Socket 'no_plan';
+
+SKIP: {
+    our $at_opaque = "42665300-efe8-419d-be52-07b53e208f46";
+    our $at_opaque_cookie = "AcYBf995tTBVsLtQLvOuLUZXHm2c-XqP8t7SKmhBiQtzy5CAw4h_RF6rXyg6kHrvhb8x4WaLQC6h3mw6a3O3Q9A";
+    run_tests();
+}
+
+__DATA__
+
+=== TEST CACHE_1: NGINX quits when the cache zone is too small
+#####################################################################
+# The zone must be large enough to hold the slab allocator's metadata
+#####################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_cache zone=tokens:1k;
+}
+
+--- must_die
+
+--- error_log
+The oauth_proxy_cache zone "zone=tokens:1k" is too small
+
+=== TEST CACHE_2: NGINX quits when the cache has an invalid time to live
+#####################################################
+# Cache parameters are validated when NGINX starts up
+#####################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_cache zone=tokens:1m ttl=never;
+}
+
+--- must_die
+
+--- error_log
+The oauth_proxy_cache ttl is invalid: "ttl=never"
+
+=== TEST CACHE_3: Repeated requests with the same cookie are served from the cache
+################################################################################
+# The first request decrypts the cookie and later requests read the cached token
+################################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_cache zone=tokens:1m ttl=60s;
+
+    proxy_pass http://localhost:1984/target;
+}
+location /target {
+    return 200 $http_authorization;
+}
+location /stats {
+    oauth_proxy_cache zone=tokens;
+    return 200 "$oauth_proxy_cache_hits $oauth_proxy_cache_misses $oauth_proxy_cache_evictions";
+}
+
+--- request eval
+["GET /t", "GET /t", "GET /stats"]
+
+--- more_headers eval
+my $data;
+$data .= "origin: https://www.example.com\n";
+$data .= "cookie: example-at=" . $main::at_opaque_cookie . "\n";
+$data;
+
+--- error_code eval
+[200, 200, 200]
+
+--- response_body eval
+["Bearer " . $main::at_opaque, "Bearer " . $main::at_opaque, "1 1 0"]
+
+=== TEST CACHE_4: A tampered cookie is not served from the cache
+########################################################################
+# Only exact ciphertext matches are cache hits, so tampering still fails
+########################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_cache zone=tokens:1m;
+
+    proxy_pass http://localhost:1984/target;
+}
+location /target {
+    return 200 $http_authorization;
+}
+
+--- request eval
+["GET /t", "GET /t"]
+
+--- more_headers eval
+[
+    "origin: https://www.example.com\ncookie: example-at=" . $main::at_opaque_cookie . "\n",
+    "origin: https://www.example.com\ncookie: example-at=" . $main::at_opaque_cookie . "x\n"
+]
+
+--- error_code eval
+[200, 401]
+
+=== TEST CACHE_5: NGINX quits when the negative cache has an invalid time to live
+##############################################################
+# Negative cache parameters are validated when NGINX starts up
+##############################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_negative_cache zone=rejected:1m ttl=never;
+}
+
+--- must_die
+
+--- error_log
+The oauth_proxy_negative_cache ttl is invalid: "ttl=never"
+
+=== TEST CACHE_6: A cookie that failed decryption is rejected again without decryption
+#############################################################################################
+# The second request is answered from the negative cache's fingerprint of the tampered cookie
+#############################################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_negative_cache zone=rejected:1m ttl=60s;
+
+    proxy_pass http://localhost:1984/target;
+}
+location /target {
+    return 200 $http_authorization;
+}
+
+--- request eval
+["GET /t", "GET /t", "GET /t"]
+
+--- more_headers eval
+[
+    "origin: https://www.example.com\ncookie: example-at=" . $main::at_opaque_cookie . "x\n",
+    "origin: https://www.example.com\ncookie: example-at=" . $main::at_opaque_cookie . "x\n",
+    "origin: https://www.example.com\ncookie: example-at=" . $main::at_opaque_cookie . "\n"
+]
+
+--- error_code eval
+[401, 401, 200]
+
+--- error_log
+The AT cookie recently failed decryption and was rejected without decrypting it again
+
+=== TEST CACHE_7: NGINX quits when the negative cache zone has the name of a cache zone
+###################################################################################
+# Each kind of zone has its own tag, so that a fingerprint is never read as a token
+###################################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_cache zone=tokens:1m;
+    oauth_proxy_negative_cache zone=tokens:1m;
+}
+
+--- must_die
+
+--- error_log
+the shared memory zone "tokens" is already declared for a different use
@@ -264,3 +264,184 @@ GET /root/api
 
 --- error_log
 The request did not have an origin header
+
+=== TEST CONFIG_12: NGINX quits when the encryption key contains non hex characters
+###########################################################################
+# The key is decoded at startup, so invalid hex is detected before requests
+###########################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4z50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_cors_enabled on;
+}
+
+--- must_die
+
+--- error_log
+The encryption_key configuration directive is not valid hex
+
+=== TEST CONFIG_13: NGINX quits when a trusted web origin has no scheme
+###############################################################################
+# Origins are compiled into hashes at startup, so malformed values are rejected
+###############################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "www.example.com";
+    oauth_proxy_cors_enabled on;
+}
+
+--- must_die
+
+--- error_log
+The trusted_web_origin configuration directive contains an invalid origin
+
+=== TEST CONFIG_14: NGINX quits when two encryption keys use the same key id
+###############################################################################
+# Each key id must select a single key, so that rotated cookies are unambiguous
+###############################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50" id=1;
+    oauth_proxy_encryption_key "7b99279ab87533d3c238db874a842a91ee26a76027f3c03c317504963d2c9926" id=1;
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_cors_enabled on;
+}
+
+--- must_die
+
+--- error_log
+The encryption_key id 1 is used by more than one key
+
+=== TEST CONFIG_15: NGINX quits when an encryption key id does not fit in a single byte
+###################################################################
+# Key ids are stored in one byte of the cookie, so must be 0 to 255
+###################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50" id=256;
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_cors_enabled on;
+}
+
+--- must_die
+
+--- error_log
+The encryption_key id must be between 0 and 255
+
+=== TEST CONFIG_16: NGINX quits when the CSRF MAC key has an invalid length
+#################################################################################
+# The CSRF MAC key is a 256 bit key in hex, in the same format as encryption keys
+#################################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_csrf_hmac_key "6a5b4c3d2e1f0011";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+}
+
+--- must_die
+
+--- error_log
+The csrf_hmac_key configuration directive must contain 64 hex characters
+
+=== TEST CONFIG_17: Locations with the module deactivated are not affected when another location activates it
+####################################################################################
+# Each location is given a handler when NGINX starts, and deactivated ones have none
+####################################################################################
+
+--- config
+location /api {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_cors_enabled on;
+}
+location /t {
+    oauth_proxy off;
+    proxy_pass http://localhost:1984/target;
+}
+location /target {
+    return 200;
+}
+
+--- request
+GET /t
+
+--- error_code: 200
+
+=== TEST CONFIG_18: Workers log the AES-256-GCM library and CPU features when they start
+###################################################################################
+# The log shows whether the host has hardware AES for the configured crypto library
+###################################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+}
+
+--- request
+GET /t
+
+--- error_code: 401
+
+--- error_log eval
+qr/AES-256-GCM decryption uses .+ with CPU features: /
+
+=== TEST CONFIG_19: NGINX quits when a trusted web origin has a trailing wildcard
+################################################################################################
+# A trailing wildcard would trust hosts under any other domain, such as app.example.attacker.com
+################################################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://app.example.*";
+    oauth_proxy_cors_enabled on;
+}
+
+--- must_die
+
+--- error_log
+The trusted_web_origin configuration directive contains an invalid wildcard
+
+=== TEST CONFIG_20: NGINX quits when a trusted web origin host starts with a dot
+#################################################################################################
+# Only a leading *. label is supported as a wildcard, so that the meaning of each origin is clear
+#################################################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://.example.com";
+    oauth_proxy_cors_enabled on;
+}
+
+--- must_die
+
+--- error_log
+The trusted_web_origin configuration directive contains an invalid wildcard
@@ -0,0 +1,133 @@
+#!/usr/bin/perl
+
+###################################################################################
+# Runs tests to verify that keys and trusted origins are loaded from a dynamic file
+###################################################################################
+
+use strict;
+use warnings;
+use Test::Nginx::Socket 'no_plan';
+
+SKIP: {
+    our $at_opaque = "42665300-efe8-419d-be52-07b53e208f46";
+    our $at_opaque_cookie = "AcYBf995tTBVsLtQLvOuLUZXHm2c-XqP8t7SKmhBiQtzy5CAw4h_RF6rXyg6kHrvhb8x4WaLQC6h3mw6a3O3Q9A";
+    run_tests();
+}
+
+__DATA__
+
+=== TEST DYNAMIC_1: A cookie is decrypted with a key and origin from the dynamic file
+##################################################################################
+# A location can take all of its keys and trusted origins from the file at startup
+##################################################################################
+
+--- user_files
+>>> keys.conf
+# Keys and origins for the example SPA
+encryption_key 4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50
+trusted_web_origin https://www.example.com
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_dynamic_config ../html/keys.conf interval=1s;
+
+    proxy_pass http://localhost:1984/target;
+}
+location /target {
+    add_header 'authorization' $http_authorization;
+    return 200;
+}
+
+--- request
+GET /t
+
+--- more_headers eval
+my $data;
+$data .= "origin: https://www.example.com\n";
+$data .= "cookie: example-at=" . $main::at_opaque_cookie . "\n";
+$data;
+
+--- error_code: 200
+
+--- response_headers eval
+"authorization: Bearer " . $main::at_opaque;
+
+=== TEST DYNAMIC_2: Origins from the dynamic file are trusted in addition to those from nginx.conf
+##############################################################################################
+# The file's entries are added to the directives, so that nginx.conf can keep a fixed baseline
+##############################################################################################
+
+--- user_files
+>>> keys.conf
+trusted_web_origin https://app.example.com
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_dynamic_config ../html/keys.conf;
+
+    proxy_pass http://localhost:1984/target;
+}
+location /target {
+    add_header 'authorization' $http_authorization;
+    return 200;
+}
+
+--- request
+GET /t
+
+--- more_headers eval
+my $data;
+$data .= "origin: https://app.example.com\n";
+$data .= "cookie: example-at=" . $main::at_opaque_cookie . "\n";
+$data;
+
+--- error_code: 200
+
+--- response_headers eval
+"authorization: Bearer " . $main::at_opaque;
+
+=== TEST DYNAMIC_3: NGINX quits when the dynamic file has an invalid entry
+#####################################################################
+# An invalid file is reported in the same way as an invalid directive
+#####################################################################
+
+--- user_files
+>>> keys.conf
+trusted_web_origin https://www.example.com
+encryption_key
+encryption_key 4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_dynamic_config ../html/keys.conf;
+}
+
+--- must_die
+
+--- error_log
+The oauth_proxy_dynamic_config file has an invalid entry on line 2
+
+=== TEST DYNAMIC_4: NGINX quits when the dynamic file does not exist
+##############################################################
+# A missing file prevents startup rather than denying requests
+##############################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_dynamic_config ../html/missing.conf;
+}
+
+--- must_die
+
+--- error_log
+The oauth_proxy_dynamic_config file could not be found
@@ -351,4 +351,92 @@ $data;
 --- error_code: 200
 
 --- response_headers eval
-"authorization: Bearer " . $main::at_opaque;
\ No newline at end of file
+"authorization: Bearer " . $main::at_opaque;
+=== TEST HTTP_GET_12: GET from a subdomain of a wildcard trusted origin returns 200
+##########################################################################################
+# Multi-brand deployments can trust all subdomains with a leading wildcard in the host name
+##########################################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.other.com";
+    oauth_proxy_trusted_web_origin "https://*.example.com";
+    oauth_proxy_cors_enabled on;
+
+    proxy_pass http://localhost:1984/target;
+}
+location /target {
+    return 200;
+}
+
+--- request
+GET /t
+
+--- more_headers eval
+my $data;
+$data .= "origin: https://brand1.example.com\n";
+$data .= "cookie: example-at=" . $main::at_opaque_cookie . "\n";
+$data;
+
+--- error_code: 200
+
+--- response_headers
+access-control-allow-origin: https://brand1.example.com
+access-control-allow-credentials: true
+
+=== TEST HTTP_GET_13: GET from a different scheme than a wildcard trusted origin returns 401
+##########################################################################################
+# Wildcards only apply to the host name, so the scheme must still match exactly
+##########################################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://*.example.com";
+    oauth_proxy_cors_enabled on;
+}
+
+--- request
+GET /t
+
+--- more_headers eval
+my $data;
+$data .= "origin: http://brand1.example.com\n";
+$data .= "cookie: example-at=" . $main::at_opaque_cookie . "\n";
+$data;
+
+--- error_code: 401
+
+--- error_log
+The request was from an untrusted web origin
+
+=== TEST HTTP_GET_14: Repeated errors return the complete static error body
+##########################################################################################
+# Error bodies are rendered once and shared, so every response must still contain all of it
+##########################################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_cors_enabled on;
+}
+
+--- request eval
+["GET /t", "GET /t"]
+
+--- more_headers
+origin: https://www.example.com
+
+--- error_code eval
+[401, 401]
+
+--- response_body eval
+["{\"code\":\"unauthorized\",\"message\":\"Access denied due to missing or invalid credentials\"}", "{\"code\":\"unauthorized\",\"message\":\"Access denied due to missing or invalid credentials\"}"]
@@ -270,4 +270,44 @@ access-control-allow-methods: OPTIONS,HEAD,GET,POST,PUT,PATCH,DELETE
 access-control-allow-headers:
 access-control-expose-headers:
 access-control-max-age: 600
-vary: origin,access-control-request-headers
\ No newline at end of file
+vary: origin,access-control-request-headers
+=== TEST HTTP_OPTIONS_9: OPTIONS uses the CORS headers rendered for its own location
+##################################################################################
+# CORS headers are rendered per location at startup, so settings must not leak across
+##################################################################################
+
+--- config
+location /a {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_cors_enabled on;
+    oauth_proxy_cors_max_age 600;
+    oauth_proxy_cors_allow_methods "GET,POST";
+}
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_cors_enabled on;
+    oauth_proxy_cors_allow_headers "x-example-csrf";
+}
+
+--- request
+OPTIONS /t
+
+--- more_headers
+origin: https://www.example.com
+access-control-request-headers: x-other
+
+--- error_code: 204
+
+--- response_headers
+access-control-allow-origin: https://www.example.com
+access-control-allow-credentials: true
+access-control-allow-methods: OPTIONS,HEAD,GET,POST,PUT,PATCH,DELETE
+access-control-allow-headers: x-example-csrf
+access-control-max-age: 86400
+vary: origin
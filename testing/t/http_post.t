@@ -14,6 +14,7 @@ SKIP: {
     
     our $csrf_token = "pQguFsD6hFjnyYjaeC5KyijcWS6AvkJHiUmY7dLUsuTKsLAITLiJHVqsCdQpaGYO";
     our $csrf_cookie = "AfctuC2zuBeZoQHfbopmpQyOADYU6Tp9raMEA-2EhWp4I3HtoiAtoP-H2U_PIrF7O0ZQ0nwE7VmWcl3BAY6bGlv4_EGqToyh4lOqynkSlBByxixJY-kA3bIFufJl";
+    our $csrf_mac_cookie = "IRqSclkA67L4aNfeIs608TU5zWizrbjUCCaVNfz7Am8";
     
     run_tests();
 }
@@ -347,4 +348,112 @@ $data;
 --- error_code: 200
 
 --- response_headers eval
-"authorization: Bearer " . $main::at_opaque
\ No newline at end of file
+"authorization: Bearer " . $main::at_opaque
+
+=== TEST HTTP_POST_10: POST with a CSRF MAC cookie and a matching CSRF token returns 200
+###################################################################################################
+# When a MAC key is configured, the CSRF cookie holds a MAC of the token rather than its ciphertext
+###################################################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_csrf_hmac_key "6a5b4c3d2e1f00112233445566778899aabbccddeeff0123456789abcdef0123";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_cors_enabled on;
+
+    proxy_pass http://localhost:1984/target;
+}
+location /target {
+    add_header 'authorization' $http_authorization;
+    return 200;
+}
+
+--- request
+POST /t
+
+--- more_headers eval
+my $data;
+$data .= "origin: https://www.example.com\n";
+$data .= "x-example-csrf: " . $main::csrf_token . "\n";
+$data .= "cookie: example-at=" . $main::at_opaque_cookie . "; example-csrf=" . $main::csrf_mac_cookie . "\n";
+$data;
+
+--- error_code: 200
+
+--- response_headers eval
+"authorization: Bearer " . $main::at_opaque
+
+=== TEST HTTP_POST_11: POST with a CSRF MAC cookie and a different CSRF token returns 401
+##################################################
+# The MAC only matches the token it was issued for
+##################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_csrf_hmac_key "6a5b4c3d2e1f00112233445566778899aabbccddeeff0123456789abcdef0123";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_cors_enabled on;
+
+    proxy_pass http://localhost:1984/target;
+}
+location /target {
+    add_header 'authorization' $http_authorization;
+    return 200;
+}
+
+--- request
+POST /t
+
+--- more_headers eval
+my $data;
+$data .= "origin: https://www.example.com\n";
+$data .= "x-example-csrf: x" . $main::csrf_token . "\n";
+$data .= "cookie: example-at=" . $main::at_opaque_cookie . "; example-csrf=" . $main::csrf_mac_cookie . "\n";
+$data;
+
+--- error_code: 401
+
+--- error_log
+The CSRF request header did not match the MAC in the CSRF cookie
+
+=== TEST HTTP_POST_12: POST with an encrypted CSRF cookie returns 401 when a MAC key is configured
+#####################################################
+# The two CSRF cookie formats are not interchangeable
+#####################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_csrf_hmac_key "6a5b4c3d2e1f00112233445566778899aabbccddeeff0123456789abcdef0123";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_cors_enabled on;
+
+    proxy_pass http://localhost:1984/target;
+}
+location /target {
+    add_header 'authorization' $http_authorization;
+    return 200;
+}
+
+--- request
+POST /t
+
+--- more_headers eval
+my $data;
+$data .= "origin: https://www.example.com\n";
+$data .= "x-example-csrf: " . $main::csrf_token . "\n";
+$data .= "cookie: example-at=" . $main::at_opaque_cookie . "; example-csrf=" . $main::csrf_cookie . "\n";
+$data;
+
+--- error_code: 401
+
+--- error_log
+The received CSRF cookie is not a valid MAC
@@ -0,0 +1,235 @@
+#!/usr/bin/perl
+
+######################################################################################
+# Runs tests to verify that opaque tokens in cookies are swapped for JWTs when enabled
+######################################################################################
+
+use strict;
+use warnings;
+use Test::Nginx::Socket;
+
+# The phantom token mode is only built when the configure script runs with OAUTH_PROXY_PHANTOM_TOKEN=yes
+if (($ENV{OAUTH_PROXY_PHANTOM_TOKEN} // '') ne 'yes') {
+    plan(skip_all => 'the module was not configured with OAUTH_PROXY_PHANTOM_TOKEN=yes');
+}
+plan('no_plan');
+
+SKIP: {
+    our $at_opaque_cookie = "AcYBf995tTBVsLtQLvOuLUZXHm2c-XqP8t7SKmhBiQtzy5CAw4h_RF6rXyg6kHrvhb8x4WaLQC6h3mw6a3O3Q9A";
+    our $jwt = "eyJhbGciOiJub25lIn0.POST.42";
+    run_tests();
+}
+
+__DATA__
+
+=== TEST PHANTOM_1: NGINX quits when the phantom token directive has no zone
+#########################################################################
+# The zone holds JWTs and pending introspections, which all workers share
+#########################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_phantom_token /introspect tokens:1m;
+}
+
+--- must_die
+
+--- error_log
+The oauth_proxy_phantom_token directive requires a zone parameter
+
+=== TEST PHANTOM_2: The opaque token is swapped for a JWT which is forwarded to the API
+##########################################################################################
+# The introspection location receives the token as a form, and returns the JWT as the body
+##########################################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_phantom_token /introspect zone=tokens:1m;
+
+    proxy_pass http://localhost:1984/target;
+}
+location /introspect {
+    internal;
+    proxy_pass_request_headers off;
+    proxy_set_header content-type "application/x-www-form-urlencoded";
+    proxy_set_header accept "application/jwt";
+    proxy_pass http://localhost:1984/mock_introspection;
+}
+location /mock_introspection {
+    add_header cache-control "max-age=60";
+    return 200 "eyJhbGciOiJub25lIn0.$request_method.$content_length";
+}
+location /target {
+    return 200 $http_authorization;
+}
+
+--- request
+GET /t
+
+--- more_headers eval
+my $data;
+$data .= "origin: https://www.example.com\n";
+$data .= "cookie: example-at=" . $main::at_opaque_cookie . "\n";
+$data;
+
+--- error_code: 200
+
+--- response_body eval
+"Bearer " . $main::jwt
+
+=== TEST PHANTOM_3: Repeated requests with the same cookie use the cached JWT
+##################################################################################
+# The introspection endpoint only allows one request, so the second must be cached
+##################################################################################
+
+--- http_config
+limit_req_zone $server_name zone=introspection:1m rate=1r/m;
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_phantom_token /introspect zone=tokens:1m;
+
+    proxy_pass http://localhost:1984/target;
+}
+location /introspect {
+    internal;
+    proxy_pass_request_headers off;
+    proxy_set_header content-type "application/x-www-form-urlencoded";
+    proxy_set_header accept "application/jwt";
+    proxy_pass http://localhost:1984/mock_introspection;
+}
+location /mock_introspection {
+    limit_req zone=introspection nodelay;
+    add_header cache-control "max-age=60";
+    return 200 "eyJhbGciOiJub25lIn0.$request_method.$content_length";
+}
+location /target {
+    return 200 $http_authorization;
+}
+
+--- request eval
+["GET /t", "GET /t"]
+
+--- more_headers eval
+my $data;
+$data .= "origin: https://www.example.com\n";
+$data .= "cookie: example-at=" . $main::at_opaque_cookie . "\n";
+$data;
+
+--- error_code eval
+[200, 200]
+
+--- response_body eval
+["Bearer " . $main::jwt, "Bearer " . $main::jwt]
+
+=== TEST PHANTOM_4: A 401 is returned when the opaque token is not active
+########################################################################
+# The introspection endpoint returns a 204 for expired or revoked tokens
+########################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_phantom_token /introspect zone=tokens:1m;
+
+    proxy_pass http://localhost:1984/target;
+}
+location /introspect {
+    internal;
+    proxy_pass http://localhost:1984/mock_introspection;
+}
+location /mock_introspection {
+    return 204;
+}
+location /target {
+    return 200 $http_authorization;
+}
+
+--- request
+GET /t
+
+--- more_headers eval
+my $data;
+$data .= "origin: https://www.example.com\n";
+$data .= "cookie: example-at=" . $main::at_opaque_cookie . "\n";
+$data;
+
+--- error_code: 401
+
+--- error_log
+The introspection response reported that the access token is not active
+
+=== TEST PHANTOM_5: A 502 is returned when the introspection request fails
+##############################################################################
+# Failures are not cached, so that a later request introspects the token again
+##############################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_phantom_token /introspect zone=tokens:1m;
+
+    proxy_pass http://localhost:1984/target;
+}
+location /introspect {
+    internal;
+    proxy_pass http://localhost:1984/mock_introspection;
+}
+location /mock_introspection {
+    return 500;
+}
+location /target {
+    return 200 $http_authorization;
+}
+
+--- request
+GET /t
+
+--- more_headers eval
+my $data;
+$data .= "origin: https://www.example.com\n";
+$data .= "cookie: example-at=" . $main::at_opaque_cookie . "\n";
+$data;
+
+--- error_code: 502
+
+--- error_log
+The introspection request failed, status: 500
+
+=== TEST PHANTOM_6: NGINX quits when the phantom token zone has the name of a cache zone
+####################################################################################
+# Each kind of zone has its own tag, so that JWTs are never read from a foreign zone
+####################################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_cache zone=tokens:1m;
+    oauth_proxy_phantom_token /introspect zone=tokens:1m;
+}
+
+--- must_die
+
+--- error_log
+the shared memory zone "tokens" is already declared for a different use
@@ -0,0 +1,182 @@
+#!/usr/bin/perl
+
+################################################################
+# Runs tests to verify the metrics served by the status location
+################################################################
+
+use strict;
+use warnings;
+use Test::Nginx::Socket 'no_plan';
+
+SKIP: {
+    our $at_opaque_cookie = "AcYBf995tTBVsLtQLvOuLUZXHm2c-XqP8t7SKmhBiQtzy5CAw4h_RF6rXyg6kHrvhb8x4WaLQC6h3mw6a3O3Q9A";
+    run_tests();
+}
+
+__DATA__
+
+=== TEST STATUS_1: The status location serves metrics in the Prometheus text format
+#################################################################################
+# Without a status location no zone is created, and with one the format is stable
+#################################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+}
+location /status {
+    oauth_proxy_status;
+}
+
+--- request
+GET /status
+
+--- error_code: 200
+
+--- response_headers
+content-type: text/plain; version=0.0.4
+
+--- response_body_like chomp
+# TYPE oauth_proxy_requests_total counter\noauth_proxy_requests_total\{location="/t"\} 0\n
+
+=== TEST STATUS_2: Rejections are counted by reason for each location
+################################################################################
+# Each failed check increments its own counter, so that causes can be told apart
+################################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_cors_enabled on;
+}
+location /status {
+    oauth_proxy_status;
+}
+
+--- request eval
+["GET /t", "GET /status"]
+
+--- more_headers
+origin: https://www.evil.com
+
+--- error_code eval
+[401, 200]
+
+--- response_body_like eval
+[".*", "oauth_proxy_rejections_total\\{location=\"/t\",reason=\"origin_untrusted\"\\} 1\n"]
+
+=== TEST STATUS_3: Successful requests record the cookie size and decryption time
+###################################################################
+# Histograms are written with cumulative buckets, a sum and a count
+###################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+
+    proxy_pass http://localhost:1984/target;
+}
+location /target {
+    return 200;
+}
+location /status {
+    oauth_proxy_status;
+}
+
+--- request eval
+["GET /t", "GET /status"]
+
+--- more_headers eval
+"cookie: example-at=" . $main::at_opaque_cookie . "\n"
+
+--- error_code eval
+[200, 200]
+
+--- response_body_like eval
+["", "oauth_proxy_cookie_size_bytes_bucket\\{location=\"/t\",le=\"256\"\\} 1\n(.|\n)*oauth_proxy_cookie_size_bytes_sum\\{location=\"/t\"\\} 87\n(.|\n)*oauth_proxy_decrypt_duration_seconds_count\\{location=\"/t\"\\} 1\n"]
+
+=== TEST STATUS_4: The status location does not inherit cookie checks
+############################################################################################
+# Scrapers do not send cookies, so a status location within a protected path is still served
+############################################################################################
+
+--- config
+location /api {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+
+    location /api/status {
+        oauth_proxy_status;
+    }
+}
+
+--- request
+GET /api/status
+
+--- error_code: 200
+
+=== TEST STATUS_5: Request pool memory is recorded by category and as a histogram
+####################################################################################
+# The module's allocations are counted when its access phase work for a request ends
+####################################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+
+    proxy_pass http://localhost:1984/target;
+}
+location /target {
+    return 200;
+}
+location /status {
+    oauth_proxy_status;
+}
+
+--- request eval
+["GET /t", "GET /status"]
+
+--- more_headers eval
+"cookie: example-at=" . $main::at_opaque_cookie . "\n"
+
+--- error_code eval
+[200, 200]
+
+--- response_body_like eval
+["", "oauth_proxy_memory_bytes_total\\{location=\"/t\",category=\"ciphertext\"\\} 66\n(.|\n)*oauth_proxy_request_memory_bytes_count\\{location=\"/t\"\\} 1\n"]
+
+=== TEST STATUS_6: NGINX quits when another zone uses the name of the metrics zone
+####################################################################################
+# Each kind of zone has its own tag, so that one never reads another's shared memory
+####################################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_cache zone=oauth_proxy_metrics:1m;
+}
+location /status {
+    oauth_proxy_status;
+}
+
+--- must_die
+
+--- error_log
+the shared memory zone "oauth_proxy_metrics" is already declared for a different use
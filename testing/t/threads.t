@@ -0,0 +1,148 @@
+#!/usr/bin/perl
+
+##########################################################################
+# Runs tests to verify that cookies can be decrypted in NGINX thread pools
+##########################################################################
+
+use strict;
+use warnings;
+use Test::Nginx::Socket 'no_plan';
+
+SKIP: {
+    our $at_opaque = "42665300-efe8-419d-be52-07b53e208f46";
+    our $at_opaque_cookie = "AcYBf995tTBVsLtQLvOuLUZXHm2c-XqP8t7SKmhBiQtzy5CAw4h_RF6rXyg6kHrvhb8x4WaLQC6h3mw6a3O3Q9A";
+    (our $at_opaque_cookie_tampered = $at_opaque_cookie) =~ s/hBiQ/hBiR/;
+    run_tests();
+}
+
+__DATA__
+
+=== TEST THREADS_1: NGINX quits when the thread pool threshold is invalid
+###################################################################
+# The threshold is a size, in the same format as NGINX buffer sizes
+###################################################################
+
+--- main_config
+thread_pool oauth threads=2;
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_thread_pool oauth threshold=large;
+}
+
+--- must_die
+
+--- error_log
+The oauth_proxy_thread_pool threshold is invalid: "threshold=large"
+
+=== TEST THREADS_2: A cookie decrypted in the thread pool is forwarded as a bearer token
+#########################################################################################
+# A zero threshold sends every cookie to the pool, and the request resumes with the token
+#########################################################################################
+
+--- main_config
+thread_pool oauth threads=2;
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_thread_pool oauth threshold=0;
+
+    proxy_pass http://localhost:1984/target;
+}
+location /target {
+    return 200 $http_authorization;
+}
+
+--- more_headers eval
+my $data;
+$data .= "origin: https://www.example.com\n";
+$data .= "cookie: example-at=" . $main::at_opaque_cookie . "\n";
+$data;
+
+--- request
+GET /t
+
+--- error_code: 200
+
+--- response_body eval
+"Bearer " . $main::at_opaque
+
+=== TEST THREADS_3: A cookie that fails decryption in the thread pool is rejected
+##################################################################################
+# Failures are logged and returned when the request resumes, as for the event loop
+##################################################################################
+
+--- main_config
+thread_pool oauth threads=2;
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_thread_pool oauth threshold=0;
+
+    proxy_pass http://localhost:1984/target;
+}
+location /target {
+    return 200 $http_authorization;
+}
+
+--- more_headers eval
+my $data;
+$data .= "origin: https://www.example.com\n";
+$data .= "cookie: example-at=" . $main::at_opaque_cookie_tampered . "\n";
+$data;
+
+--- request
+GET /t
+
+--- error_code: 401
+
+--- error_log
+Problem encountered decrypting data
+
+=== TEST THREADS_4: Cookies below the threshold are decrypted on the event loop
+################################################################################
+# Small cookies are not worth handing to another thread, so are decrypted inline
+################################################################################
+
+--- main_config
+thread_pool oauth threads=2;
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_thread_pool oauth threshold=16k;
+
+    proxy_pass http://localhost:1984/target;
+}
+location /target {
+    return 200 $http_authorization;
+}
+
+--- more_headers eval
+my $data;
+$data .= "origin: https://www.example.com\n";
+$data .= "cookie: example-at=" . $main::at_opaque_cookie . "\n";
+$data;
+
+--- request
+GET /t
+
+--- error_code: 200
+
+--- response_body eval
+"Bearer " . $main::at_opaque
@@ -0,0 +1,157 @@
+#!/usr/bin/perl
+
+###################################################################################
+# Runs tests to verify that clients with repeated decryption failures are throttled
+###################################################################################
+
+use strict;
+use warnings;
+use Test::Nginx::Socket 'no_plan';
+
+SKIP: {
+    our $at_opaque = "42665300-efe8-419d-be52-07b53e208f46";
+    our $at_opaque_cookie = "AcYBf995tTBVsLtQLvOuLUZXHm2c-XqP8t7SKmhBiQtzy5CAw4h_RF6rXyg6kHrvhb8x4WaLQC6h3mw6a3O3Q9A";
+    run_tests();
+}
+
+__DATA__
+
+=== TEST THROTTLE_1: NGINX quits when the throttle has an invalid threshold
+########################################################
+# Throttle parameters are validated when NGINX starts up
+########################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_throttle zone=failures:1m threshold=0;
+}
+
+--- must_die
+
+--- error_log
+The oauth_proxy_throttle threshold is invalid: "threshold=0"
+
+=== TEST THROTTLE_2: A client below the threshold can still send a valid cookie
+##################################################################
+# Failures are counted, but requests are decrypted until the limit
+##################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_throttle zone=failures:1m threshold=3 window=60s;
+
+    proxy_pass http://localhost:1984/target;
+}
+location /target {
+    return 200 $http_authorization;
+}
+
+--- request eval
+["GET /t", "GET /t", "GET /t"]
+
+--- more_headers eval
+[
+    "cookie: example-at=" . $main::at_opaque_cookie . "x\n",
+    "cookie: example-at=" . $main::at_opaque_cookie . "x\n",
+    "cookie: example-at=" . $main::at_opaque_cookie . "\n"
+]
+
+--- error_code eval
+[401, 401, 200]
+
+=== TEST THROTTLE_3: A client that reaches the threshold is rejected before decryption
+####################################################################################
+# Once throttled, even a valid cookie is rejected until the failure rate falls again
+####################################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_throttle zone=failures:1m threshold=2 window=60s;
+
+    proxy_pass http://localhost:1984/target;
+}
+location /target {
+    return 200 $http_authorization;
+}
+
+--- request eval
+["GET /t", "GET /t", "GET /t"]
+
+--- more_headers eval
+[
+    "cookie: example-at=" . $main::at_opaque_cookie . "x\n",
+    "cookie: example-at=" . $main::at_opaque_cookie . "x\n",
+    "cookie: example-at=" . $main::at_opaque_cookie . "\n"
+]
+
+--- error_code eval
+[401, 401, 401]
+
+--- error_log
+The client has exceeded the oauth_proxy_throttle decryption failure threshold
+
+=== TEST THROTTLE_4: Cookies rejected by the negative cache do not count towards the threshold
+##################################################################################################################
+# Only a failed decode or decryption is counted, so a repeated stale cookie is counted once while it is remembered
+##################################################################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_negative_cache zone=rejected:1m ttl=60s;
+    oauth_proxy_throttle zone=failures:1m threshold=2 window=60s;
+
+    proxy_pass http://localhost:1984/target;
+}
+location /target {
+    return 200 $http_authorization;
+}
+
+--- request eval
+["GET /t", "GET /t", "GET /t"]
+
+--- more_headers eval
+[
+    "cookie: example-at=" . $main::at_opaque_cookie . "x\n",
+    "cookie: example-at=" . $main::at_opaque_cookie . "x\n",
+    "cookie: example-at=" . $main::at_opaque_cookie . "\n"
+]
+
+--- error_code eval
+[401, 401, 200]
+
+
+=== TEST THROTTLE_5: NGINX quits when the throttle zone has the name of a negative cache zone
+#########################################################################################
+# Each kind of zone has its own tag, so that failures are never counted in a foreign zone
+#########################################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_negative_cache zone=rejected:1m;
+    oauth_proxy_throttle zone=rejected:1m;
+}
+
+--- must_die
+
+--- error_log
+the shared memory zone "rejected" is already declared for a different use
@@ -0,0 +1,139 @@
+#!/usr/bin/perl
+
+#####################################################################
+# Runs tests to verify the request variables available to log formats
+#####################################################################
+
+use strict;
+use warnings;
+use Test::Nginx::Socket 'no_plan';
+
+SKIP: {
+    our $at_opaque_cookie = "AcYBf995tTBVsLtQLvOuLUZXHm2c-XqP8t7SKmhBiQtzy5CAw4h_RF6rXyg6kHrvhb8x4WaLQC6h3mw6a3O3Q9A";
+    run_tests();
+}
+
+__DATA__
+
+=== TEST VARIABLES_1: The result variable contains the rejection reason
+#######################################################################
+# Rejected requests can be told apart in access logs without debug logs
+#######################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+    oauth_proxy_cors_enabled on;
+
+    add_header x-result $oauth_proxy_result always;
+}
+
+--- request
+GET /t
+
+--- more_headers
+origin: https://www.evil.com
+
+--- error_code: 401
+
+--- response_headers
+x-result: origin_untrusted
+
+=== TEST VARIABLES_2: The result and cookie size are available for allowed requests
+###########################################################################
+# The cookie size is the encoded length, so that large cookies can be found
+###########################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+
+    add_header x-result $oauth_proxy_result;
+    add_header x-cookie-bytes $oauth_proxy_cookie_bytes;
+    proxy_pass http://localhost:1984/target;
+}
+location /target {
+    return 200;
+}
+
+--- request
+GET /t
+
+--- more_headers eval
+"cookie: example-at=" . $main::at_opaque_cookie . "\n"
+
+--- error_code: 200
+
+--- response_headers
+x-result: ok
+x-cookie-bytes: 87
+
+=== TEST VARIABLES_3: Stage timings are in microseconds and only set for stages that ran
+######################################################################
+# A GET request has no CSRF check, so its timing variable is not found
+######################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+
+    add_header x-times "$oauth_proxy_origin_time $oauth_proxy_csrf_time $oauth_proxy_decrypt_time $oauth_proxy_headers_time";
+    proxy_pass http://localhost:1984/target;
+}
+location /target {
+    return 200;
+}
+
+--- request
+GET /t
+
+--- more_headers eval
+"cookie: example-at=" . $main::at_opaque_cookie . "\n"
+
+--- error_code: 200
+
+--- response_headers_like
+x-times: ^\d+\.\d{3}  \d+\.\d{3} \d+\.\d{3}$
+
+=== TEST VARIABLES_4: Memory variables report the module's request pool allocations by category
+#########################################################################################
+# A single cookie is decrypted in place, so its decoded buffer is the ciphertext category
+#########################################################################################
+
+--- config
+location /t {
+    oauth_proxy on;
+    oauth_proxy_cookie_name_prefix "example";
+    oauth_proxy_encryption_key "4e4636356d65563e4c73233847503e3b21436e6f7629724950526f4b5e2e4e50";
+    oauth_proxy_trusted_web_origin "https://www.example.com";
+
+    add_header x-memory "$oauth_proxy_memory_bytes";
+    add_header x-memory-ciphertext "$oauth_proxy_memory_ciphertext_bytes";
+    add_header x-memory-plaintext "$oauth_proxy_memory_plaintext_bytes";
+    proxy_pass http://localhost:1984/target;
+}
+location /target {
+    return 200;
+}
+
+--- request
+GET /t
+
+--- more_headers eval
+"cookie: example-at=" . $main::at_opaque_cookie . "\n"
+
+--- error_code: 200
+
+--- response_headers_like
+x-memory: ^\d{3,}$
+x-memory-ciphertext: ^66$
+x-memory-plaintext: ^0$